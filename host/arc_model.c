@@ -0,0 +1,123 @@
+/* Arc-side model of the packet descriptor queues
+ *
+ * This mirrors what mod_pipe's pipe_packet_tx/pipe_packet_rx do over the
+ * expansion card bus:  byte-wide accesses to the TX/RX buffers and
+ * descriptors in the register region of podule_space, with the descriptor
+ * top byte (holding READY) written last/cleared to hand over ownership.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "podule_interface.h"
+#include "podule_regs.h"
+#include "arc_model.h"
+
+static struct {
+        arc_pump_t      pump;
+        unsigned int    tx_head;
+        unsigned int    rx_tail;
+} arc;
+
+static uint64_t         now_ms(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void    arc_init(arc_pump_t pump)
+{
+        arc.pump = pump;
+        arc.tx_head = 0;
+        arc.rx_tail = 0;
+}
+
+/* Returns 0, or -1 on timeout (as mod_pipe's "Timed out waiting for TX
+ * descriptor" error).
+ */
+int     arc_packet_tx(unsigned int cid, const uint8_t *data, unsigned int len,
+                      unsigned int timeout_ms)
+{
+        volatile uint8_t *r = podule_if_get_regs();
+
+        for (unsigned int i = 0; i < len; i++)
+                r[PR_TX_BUFFERS + i] = data[i];
+
+        uint32_t d = (0 << PR_DESCR_ADDR_SHIFT) |
+                (((len - 1) << PR_DESCR_SIZE_SHIFT) & PR_DESCR_SIZE_MASK) |
+                ((cid << PR_DESCR_CID_SHIFT) & PR_DESCR_CID_MASK) |
+                PR_DESCR_READY;
+
+        // LSB first, so READY (in the top byte) arrives last:
+        volatile uint8_t *descr = &r[PR_TX0_0 + arc.tx_head * 4];
+        descr[0] = d;
+        descr[1] = d >> 8;
+        descr[2] = d >> 16;
+        descr[3] = d >> 24;
+
+        uint64_t start = now_ms();
+        unsigned int polls = 0;
+        while (descr[3] & 0x80) {
+                arc.pump();
+                if ((++polls & 0xff) == 0 && now_ms() - start > timeout_ms)
+                        return -1;
+        }
+
+        arc.tx_head = (arc.tx_head + 1) & PR_DESCRS_MASK;
+        return 0;
+}
+
+/* Waits for a packet; returns its length (and CID), or -1 on timeout. */
+int     arc_packet_rx(uint8_t *data, unsigned int *cid, unsigned int timeout_ms)
+{
+        volatile uint8_t *r = podule_if_get_regs();
+        volatile uint8_t *descr = &r[PR_RX0_0 + arc.rx_tail * 4];
+
+        uint64_t start = now_ms();
+        unsigned int polls = 0;
+        while (!(descr[3] & 0x80)) {
+                arc.pump();
+                if ((++polls & 0xff) == 0 && now_ms() - start > timeout_ms)
+                        return -1;
+        }
+
+        uint32_t d = descr[0] | (descr[1] << 8) | (descr[2] << 16) |
+                ((uint32_t)descr[3] << 24);
+        unsigned int len = PR_DESCR_SIZE(d);
+        unsigned int addr = PR_DESCR_ADDR(d);
+
+        for (unsigned int i = 0; i < len; i++)
+                data[i] = r[PR_RX_BUFFERS + addr + i];
+        *cid = PR_DESCR_CID(d);
+
+        // Consume:
+        descr[3] = 0;
+        arc.rx_tail = (arc.rx_tail + 1) & PR_DESCRS_MASK;
+        return len;
+}
@@ -0,0 +1,151 @@
+#!/bin/sh
+# Hardware-free benchmark:  runs the server against a virtual podule on a
+# pty, doing a hostinfo ping storm, a PCPL of an N MB file and a PCPR of it
+# back to the host, then lists the directory and copies a tree of small
+# files (and a mostly empty disc image) with PCPLR, and reads and writes a
+# floppy image with DiscOps, and images a floppy to the host and back (as
+# PDISCREAD/PDISCWRITE), and saves, lists, loads and changes files through
+# the Pipe filing system, and copies the tree back out of a zip of it, and
+# PLOADs the disc image into memory.  Then restarts the server under a
+# connected podule, changes a few files in the tree, and PSYNCs it.
+#
+# The Arc side here is vpodule's workloads (workload*.c):  models of what
+# mod_pipe does, not mod_pipe itself.  So this exercises and times the server
+# and the firmware's pipe code; it isn't a test of the Arc side.
+#
+# Usage: [CTL=1] [VENDOR=1] bench.sh [MB] [pings] [extra vpodule args...]
+#
+# MIT License
+#
+# Copyright (c) 2021 Matt Evans
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+set -e
+
+MB=${1:-4}
+PINGS=${2:-1000}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+SERVER=${SERVER:-$HERE/../server/server}
+VPODULE=$HERE/vpodule
+
+TMP=$(mktemp -d)
+trap 'kill $SRV_PID 2>/dev/null; rm -rf "$TMP"' EXIT
+
+mkdir "$TMP/share" "$TMP/local"
+dd if=/dev/urandom of="$TMP/share/bench,ffd" bs=1048576 count="$MB" 2>/dev/null
+# A tree like an application suite:  mostly small files, a few levels deep
+for d in 0 1 2 3; do
+	mkdir -p "$TMP/share/tree/d$d/sub"
+	for f in $(seq 1 40); do
+		head -c $((f * 97 * (d + 1))) /dev/urandom > "$TMP/share/tree/d$d/f$f"
+		head -c $((f * 13)) /dev/urandom > "$TMP/share/tree/d$d/sub/s$f.txt"
+	done
+done
+head -c 300000 /dev/urandom > "$TMP/share/tree/d0/big"
+# A disc image:  mostly zeroes, some formatted (&E5) space, a little data
+IMG="$TMP/share/tree/d0/image"
+head -c 204800 /dev/zero > "$IMG"
+head -c 16384 /dev/zero | tr '\0' '\345' | dd of="$IMG" bs=4096 seek=8 conv=notrunc 2>/dev/null
+head -c 3000 /dev/urandom | dd of="$IMG" bs=1 seek=70000 conv=notrunc 2>/dev/null
+
+# An 800K floppy image, mostly empty
+DISC="$TMP/share/disc.adf"
+head -c 819200 /dev/zero > "$DISC"
+head -c 20000 /dev/urandom | dd of="$DISC" bs=1024 seek=10 conv=notrunc 2>/dev/null
+head -c 5000 /dev/urandom | dd of="$DISC" bs=1024 seek=300 conv=notrunc 2>/dev/null
+cp "$DISC" "$TMP/disc.orig"
+
+# The tree again, as an archive to copy out of
+(cd "$TMP/share" && zip -qr tree.zip tree)
+cp -r "$TMP/share/tree" "$TMP/tree.orig"
+
+# CTL=1 adds a control lane, as the podule's second CDC interface:
+DEV="$TMP/vpodule0"
+LANE_ARGS=""
+if [ -n "$CTL" ]; then
+	DEV="$TMP/vpodule0,$TMP/vpodule0c"
+	LANE_ARGS="-c $TMP/vpodule0c"
+fi
+
+# VENDOR=1 carries data over vpodule's stand-in for the vendor interface:
+if [ -n "$VENDOR" ]; then
+	DEV="unix:$TMP/vpodule0v"
+	[ -n "$CTL" ] && DEV="$DEV,$TMP/vpodule0c"
+	LANE_ARGS="$LANE_ARGS -u $TMP/vpodule0v"
+fi
+
+(cd "$TMP/share" && exec "$SERVER" "$DEV" > "$TMP/server.log") &
+SRV_PID=$!
+
+# Each workload models the mod_pipe command it's named after (see
+# workload.h); they drive the server and firmware, not test mod_pipe.
+"$VPODULE" -l "$TMP/vpodule0" $LANE_ARGS -o "$TMP/local" "$@" \
+	ping:"$PINGS" pcpl:bench pcpr:bench:bench2 pcpr:bench:bench3:8000:8023 \
+	pcpr:bench:bench3:8000:8024 cat: pcplr:tree disc:disc.adf \
+	image:floppy.adf fs:fsdir pcplr:tree.zip/tree:ziptree pload:tree.d0.image \
+	pbench:"$PINGS"
+
+# Restart the server under a vpodule that's agreed CRC framing with the old
+# one.  The new one starts plain, so the modelled Arc has to negotiate again.
+"$VPODULE" -l "$TMP/vpodule0" $LANE_ARGS -o "$TMP/local" "$@" \
+	ping:10 hold:"$TMP/hold" nego cat: pcpl:bench &
+VP_PID=$!
+while [ ! -e "$TMP/hold" ]; do
+	kill -0 $VP_PID
+	sleep 0.1
+done
+kill $SRV_PID
+wait $SRV_PID || true
+(cd "$TMP/share" && exec "$SERVER" "$DEV" >> "$TMP/server.log") &
+SRV_PID=$!
+rm "$TMP/hold"
+wait $VP_PID
+
+# A couple of blocks of the big file, a grown and a shrunk file, and a new
+# one.  They're stamped later, as a redeploy would be.
+printf 'changed' | dd of="$TMP/share/tree/d0/big" bs=1 seek=1000 conv=notrunc 2>/dev/null
+printf 'changed' | dd of="$TMP/share/tree/d0/big" bs=1 seek=200000 conv=notrunc 2>/dev/null
+head -c 5000 /dev/urandom >> "$TMP/share/tree/d1/f30"
+head -c 1500 "$TMP/share/tree/d2/f40" > "$TMP/share/tree/d2/f39"
+echo new > "$TMP/share/tree/d3/sub/new"
+LATER=$(( $(date +%s) + 60 ))
+touch -d "@$LATER" "$TMP/share/tree/d0/big" "$TMP/share/tree/d1/f30" \
+	"$TMP/share/tree/d2/f39"
+
+"$VPODULE" -l "$TMP/vpodule0" $LANE_ARGS -o "$TMP/local" "$@" psync:tree
+
+cmp "$TMP/share/bench,ffd" "$TMP/local/bench"
+cmp "$TMP/share/bench,ffd" "$TMP/share/bench2,ffd"
+# An untyped file, written over with another load address:
+cmp "$TMP/share/bench,ffd" "$TMP/share/bench3,8000-8024"
+[ ! -e "$TMP/share/bench3,8000-8023" ]
+diff -r "$TMP/share/tree" "$TMP/local/tree"
+# The disc workload copied the image's first half over its second:
+cmp "$TMP/disc.orig" "$TMP/local/disc.adf"
+head -c 409600 "$TMP/disc.orig" > "$TMP/disc.half"
+cat "$TMP/disc.half" "$TMP/disc.half" | cmp - "$DISC"
+cmp "$TMP/local/floppy.adf" "$TMP/share/floppy.adf"
+cmp "$TMP/local/Text" "$TMP/share/fsdir/Text,fff"
+diff -r "$TMP/tree.orig" "$TMP/local/ziptree"
+cmp "$TMP/local/image" "$TMP/share/tree/d0/image"
+echo "Data verified OK"
@@ -0,0 +1,51 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/* Host build shim for tusb.h:  the CDC/vendor calls that pipe_packet.c makes.
+ * Each host program provides its own implementation (a pty for vpodule,
+ * an in-memory link for the tests).
+ */
+
+#ifndef HOST_TUSB_H
+#define HOST_TUSB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+bool            tud_cdc_n_connected(uint8_t itf);
+uint32_t        tud_cdc_n_available(uint8_t itf);
+uint32_t        tud_cdc_n_read(uint8_t itf, void *buffer, uint32_t bufsize);
+uint32_t        tud_cdc_n_write(uint8_t itf, void const *buffer, uint32_t bufsize);
+uint32_t        tud_cdc_n_write_flush(uint8_t itf);
+
+#define CFG_TUD_VENDOR_TX_BUFSIZE       1024    // As tusb_config.h
+
+uint32_t        tud_vendor_n_available(uint8_t itf);
+uint32_t        tud_vendor_n_read(uint8_t itf, void *buffer, uint32_t bufsize);
+uint32_t        tud_vendor_n_write(uint8_t itf, void const *buffer, uint32_t bufsize);
+uint32_t        tud_vendor_n_write_flush(uint8_t itf);
+uint32_t        tud_vendor_n_write_available(uint8_t itf);
+
+#endif
@@ -0,0 +1,669 @@
+/* pipe_test:  host unit tests and microbenchmark for pipe_packet.c
+ *
+ * Builds the firmware's pipe code against an in-memory "USB" link whose
+ * reads and writes are chopped into fragments (as TinyUSB's FIFOs and 64
+ * byte packets do), with arc_model.c producing and consuming descriptors
+ * as the Arc would.
+ *
+ * The tests check framing, fragmentation, back-to-back packets and
+ * backpressure on both paths.  With -b, the RX and TX paths are timed;
+ * only time spent inside pipe_poll() (i.e. what core0 does) is counted.
+ * That's host time, of course -- it's a relative measure for comparing
+ * changes to the firmware code, not an RP2040 cycle count.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "tusb.h"
+#include "pipe_packet.h"
+#include "podule_interface.h"
+#include "podule_regs.h"
+#include "arc_model.h"
+
+#define PKT_HDR_SIZE    3
+#define LINK_BUF_SIZE   (1024 * 1024)
+
+volatile uint8_t podule_space[4096];
+
+////////////////////////////////////////////////////////////////////////////////
+// In-memory USB link
+
+static struct {
+        uint8_t         to_dev[LINK_BUF_SIZE];  // Host -> podule
+        unsigned int    to_dev_rd, to_dev_wr;
+        uint8_t         to_host[LINK_BUF_SIZE]; // Podule -> host
+        unsigned int    to_host_wr;
+        unsigned int    max_frag;
+        uint32_t        rng;
+        /* Second CDC interface (control lane), podule -> host only: */
+        bool            ctl_connected;
+        uint8_t         ctl_to_host[4096];
+        unsigned int    ctl_to_host_wr;
+        /* Vendor interface, when open: */
+        uint8_t         vnd_to_dev[4096];
+        unsigned int    vnd_to_dev_rd, vnd_to_dev_wr;
+        uint8_t         vnd_to_host[4096];
+        unsigned int    vnd_to_host_wr;
+} usb;
+
+static unsigned int frag(void)
+{
+        // xorshift32; fragments are 1..max_frag bytes
+        usb.rng ^= usb.rng << 13;
+        usb.rng ^= usb.rng >> 17;
+        usb.rng ^= usb.rng << 5;
+        return 1 + (usb.rng % usb.max_frag);
+}
+
+static void     link_reset(unsigned int max_frag, uint32_t seed)
+{
+        usb.to_dev_rd = usb.to_dev_wr = 0;
+        usb.to_host_wr = 0;
+        usb.ctl_connected = false;
+        usb.ctl_to_host_wr = 0;
+        usb.vnd_to_dev_rd = usb.vnd_to_dev_wr = 0;
+        usb.vnd_to_host_wr = 0;
+        usb.max_frag = max_frag;
+        usb.rng = seed ? seed : 1;
+}
+
+bool            tud_cdc_n_connected(uint8_t itf)
+{
+        return itf == 0 || usb.ctl_connected;
+}
+
+uint32_t        tud_cdc_n_available(uint8_t itf)
+{
+        return itf == 0 ? usb.to_dev_wr - usb.to_dev_rd : 0;
+}
+
+uint32_t        tud_cdc_n_read(uint8_t itf, void *buffer, uint32_t bufsize)
+{
+        unsigned int n = usb.to_dev_wr - usb.to_dev_rd;
+        unsigned int f = frag();
+
+        if (itf != 0)
+                return 0;
+
+        if (n > bufsize)
+                n = bufsize;
+        if (n > f)
+                n = f;
+        memcpy(buffer, &usb.to_dev[usb.to_dev_rd], n);
+        usb.to_dev_rd += n;
+        return n;
+}
+
+uint32_t        tud_cdc_n_write(uint8_t itf, void const *buffer, uint32_t bufsize)
+{
+        unsigned int n = frag();
+
+        if (n > bufsize)
+                n = bufsize;
+        if (itf != 0) {
+                if (n > sizeof(usb.ctl_to_host) - usb.ctl_to_host_wr)
+                        n = sizeof(usb.ctl_to_host) - usb.ctl_to_host_wr;
+                memcpy(&usb.ctl_to_host[usb.ctl_to_host_wr], buffer, n);
+                usb.ctl_to_host_wr += n;
+                return n;
+        }
+        if (n > LINK_BUF_SIZE - usb.to_host_wr)
+                n = LINK_BUF_SIZE - usb.to_host_wr;
+        memcpy(&usb.to_host[usb.to_host_wr], buffer, n);
+        usb.to_host_wr += n;
+        return n;
+}
+
+uint32_t        tud_cdc_n_write_flush(uint8_t itf)
+{
+        return 0;
+}
+
+uint32_t        tud_vendor_n_available(uint8_t itf)
+{
+        return usb.vnd_to_dev_wr - usb.vnd_to_dev_rd;
+}
+
+uint32_t        tud_vendor_n_read(uint8_t itf, void *buffer, uint32_t bufsize)
+{
+        unsigned int n = usb.vnd_to_dev_wr - usb.vnd_to_dev_rd;
+
+        if (n > bufsize)
+                n = bufsize;
+        memcpy(buffer, &usb.vnd_to_dev[usb.vnd_to_dev_rd], n);
+        usb.vnd_to_dev_rd += n;
+        return n;
+}
+
+uint32_t        tud_vendor_n_write(uint8_t itf, void const *buffer, uint32_t bufsize)
+{
+        unsigned int n = bufsize;
+
+        if (n > sizeof(usb.vnd_to_host) - usb.vnd_to_host_wr)
+                n = sizeof(usb.vnd_to_host) - usb.vnd_to_host_wr;
+        memcpy(&usb.vnd_to_host[usb.vnd_to_host_wr], buffer, n);
+        usb.vnd_to_host_wr += n;
+        return n;
+}
+
+uint32_t        tud_vendor_n_write_flush(uint8_t itf)
+{
+        return 0;
+}
+
+uint32_t        tud_vendor_n_write_available(uint8_t itf)
+{
+        return CFG_TUD_VENDOR_TX_BUFSIZE;       // Sent instantly
+}
+
+/* Host side sends a framed packet to the podule */
+static void     host_send(unsigned int cid, const uint8_t *data, unsigned int len)
+{
+        usb.to_dev[usb.to_dev_wr++] = cid;
+        usb.to_dev[usb.to_dev_wr++] = len & 0xff;
+        usb.to_dev[usb.to_dev_wr++] = len >> 8;
+        memcpy(&usb.to_dev[usb.to_dev_wr], data, len);
+        usb.to_dev_wr += len;
+}
+
+/* Reference CRC-16/CCITT (poly 0x1021, init 0xffff), bitwise */
+static uint16_t ref_crc16(const uint8_t *data, unsigned int len)
+{
+        uint16_t c = 0xffff;
+
+        while (len--) {
+                c ^= (uint16_t)*data++ << 8;
+                for (int b = 0; b < 8; b++)
+                        c = (c & 0x8000) ? (c << 1) ^ 0x1021 : c << 1;
+        }
+        return c;
+}
+
+/* As host_send(), but as a CRC frame; flip is XORed into payload byte 0 */
+static void     host_send_frame(unsigned int cid, const uint8_t *data,
+                                unsigned int len, uint8_t flip)
+{
+        uint8_t *f = &usb.to_dev[usb.to_dev_wr];
+        uint16_t crc;
+
+        f[0] = 0xfa;
+        f[1] = cid;
+        f[2] = len & 0xff;
+        f[3] = len >> 8;
+        f[4] = ref_crc16(f, 4) & 0xff;
+        memcpy(&f[5], data, len);
+        crc = ref_crc16(f, 5 + len);
+        f[5] ^= flip;
+        f[5 + len] = crc & 0xff;
+        f[6 + len] = crc >> 8;
+        usb.to_dev_wr += 7 + len;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Podule pump, with timing of pipe_poll()
+
+static uint64_t poll_ns;
+static uint64_t poll_cycles;
+
+static uint64_t now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void     podule_pump(void)
+{
+#ifdef HAVE_TSC
+        uint64_t c = __rdtsc();
+#endif
+        uint64_t t = now_ns();
+        pipe_poll();
+        poll_ns += now_ns() - t;
+#ifdef HAVE_TSC
+        poll_cycles += __rdtsc() - c;
+#endif
+}
+
+static void     reset_all(unsigned int max_frag, uint32_t seed)
+{
+        memset((void *)podule_space, 0, sizeof(podule_space));
+        link_reset(max_frag, seed);
+        pipe_vendor_open(false);
+        pipe_init();
+        arc_init(podule_pump);
+        poll_ns = poll_cycles = 0;
+}
+
+static void     fill_pattern(uint8_t *buf, unsigned int len, unsigned int seed)
+{
+        for (unsigned int i = 0; i < len; i++)
+                buf[i] = (uint8_t)(seed * 31 + i * 7);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Tests
+
+static int      failures = 0;
+
+#define CHECK(cond, ...) do {                                           \
+                if (!(cond)) {                                          \
+                        printf("FAIL %s:%d: ", __func__, __LINE__);     \
+                        printf(__VA_ARGS__);                            \
+                        printf("\n");                                   \
+                        failures++;                                     \
+                        return;                                         \
+                }                                                       \
+        } while (0)
+
+/* Arc sends packets of every size; check what comes out of USB. */
+static void     test_tx_sizes(unsigned int max_frag)
+{
+        uint8_t data[PR_RX_TX_BUFSZ];
+
+        reset_all(max_frag, 1234);
+
+        for (unsigned int len = 1; len <= PR_RX_TX_BUFSZ; len++) {
+                unsigned int cid = len & 0x7f;
+                fill_pattern(data, len, len);
+
+                unsigned int start = usb.to_host_wr;
+                CHECK(arc_packet_tx(cid, data, len, 1000) == 0,
+                      "TX timeout at len %u", len);
+                // Descriptor is consumed once all bytes are submitted:
+                CHECK(usb.to_host_wr - start == len + PKT_HDR_SIZE,
+                      "len %u: %u bytes on the wire", len,
+                      usb.to_host_wr - start);
+
+                uint8_t *p = &usb.to_host[start];
+                CHECK(p[0] == cid && (p[1] | (p[2] << 8)) == len,
+                      "len %u: bad header %02x %02x %02x", len,
+                      p[0], p[1], p[2]);
+                CHECK(!memcmp(&p[3], data, len), "len %u: data mismatch", len);
+        }
+}
+
+/* Host sends packets of every size, fragmented; Arc receives them. */
+static void     test_rx_sizes(unsigned int max_frag)
+{
+        uint8_t data[PR_RX_TX_BUFSZ], got[PR_RX_TX_BUFSZ];
+
+        reset_all(max_frag, 5678);
+
+        for (unsigned int len = 1; len <= PR_RX_TX_BUFSZ; len++) {
+                unsigned int cid = (len * 3) & 0x7f;
+                unsigned int rcid;
+
+                fill_pattern(data, len, len);
+                host_send(cid, data, len);
+
+                int r = arc_packet_rx(got, &rcid, 1000);
+                CHECK(r == len, "len %u: got %d", len, r);
+                CHECK(rcid == cid, "len %u: CID %u, expected %u", len, rcid, cid);
+                CHECK(!memcmp(got, data, len), "len %u: data mismatch", len);
+        }
+}
+
+/* Many packets queued back-to-back, so USB reads span packet boundaries;
+ * the Arc is slow to consume, so the podule has to hold off (backpressure).
+ */
+static void     test_rx_back_to_back(unsigned int max_frag)
+{
+        uint8_t data[PR_RX_TX_BUFSZ], got[PR_RX_TX_BUFSZ];
+        const unsigned int n = 200;
+
+        reset_all(max_frag, 42);
+
+        for (unsigned int i = 0; i < n; i++) {
+                unsigned int len = 1 + (i * 37) % PR_RX_TX_BUFSZ;
+                fill_pattern(data, len, i);
+                host_send(i & 0x7f, data, len);
+        }
+
+        for (unsigned int i = 0; i < n; i++) {
+                unsigned int len = 1 + (i * 37) % PR_RX_TX_BUFSZ;
+                unsigned int rcid;
+
+                // Let the podule spin for a while with the Arc not listening:
+                for (int j = 0; j < 10; j++)
+                        podule_pump();
+
+                fill_pattern(data, len, i);
+                int r = arc_packet_rx(got, &rcid, 1000);
+                CHECK(r == len, "pkt %u: got len %d, expected %u", i, r, len);
+                CHECK(rcid == (i & 0x7f), "pkt %u: CID %u", i, rcid);
+                CHECK(!memcmp(got, data, len), "pkt %u: data mismatch", i);
+        }
+        CHECK(usb.to_dev_rd == usb.to_dev_wr, "unconsumed input");
+}
+
+/* Only one RX buffer:  a second packet must not be delivered over the top of
+ * one the Arc hasn't consumed.
+ */
+static void     test_rx_no_overwrite(void)
+{
+        uint8_t a[16] = "first packet", b[16] = "second packet";
+        uint8_t got[PR_RX_TX_BUFSZ];
+        unsigned int rcid;
+
+        reset_all(64, 7);
+        host_send(5, a, sizeof(a));
+        host_send(6, b, sizeof(b));
+
+        for (int j = 0; j < 100; j++)
+                podule_pump();
+
+        volatile uint8_t *r = podule_if_get_regs();
+        CHECK(!memcmp((void *)&r[PR_RX_BUFFERS], a, sizeof(a)),
+              "RX buffer overwritten before consumption");
+
+        CHECK(arc_packet_rx(got, &rcid, 1000) == sizeof(a) && rcid == 5,
+              "first packet");
+        CHECK(arc_packet_rx(got, &rcid, 1000) == sizeof(b) && rcid == 6 &&
+              !memcmp(got, b, sizeof(b)), "second packet");
+}
+
+/* A TX descriptor that points off the end of the buffer is dropped (and
+ * consumed), not sent.
+ */
+static void     test_tx_bad_descriptor(void)
+{
+        volatile uint8_t *r = podule_if_get_regs();
+
+        reset_all(64, 9);
+        PR_TX_DESCR(r, 0) = PR_DESCR_READY | (1 << PR_DESCR_CID_SHIFT) |
+                ((100 - 1) << PR_DESCR_SIZE_SHIFT) | (450 << PR_DESCR_ADDR_SHIFT);
+        podule_pump();
+
+        CHECK(!PR_DESCR_IS_READY(PR_TX_DESCR(r, 0)), "descriptor not consumed");
+        CHECK(r[PR_TX_TAIL] == 1, "tail not advanced");
+        CHECK(usb.to_host_wr == 0, "bad packet was sent");
+}
+
+/* With a bulk and an interactive descriptor both ready, the interactive
+ * one goes first; the tail then moves past both.
+ */
+static void     test_tx_priority(void)
+{
+        volatile uint8_t *r = podule_if_get_regs();
+
+        reset_all(1024, 11);
+        r[PR_TX_BULK0] = 1 << 2;
+        memset((void *)&r[PR_TX_BUFFERS], 0xbb, 16);
+        memset((void *)&r[PR_TX_BUFFERS + 256], 0x11, 8);
+        PR_TX_DESCR(r, 0) = PR_DESCR_READY | (2 << PR_DESCR_CID_SHIFT) |
+                ((16 - 1) << PR_DESCR_SIZE_SHIFT) | (0 << PR_DESCR_ADDR_SHIFT);
+        PR_TX_DESCR(r, 1) = PR_DESCR_READY | (1 << PR_DESCR_CID_SHIFT) |
+                ((8 - 1) << PR_DESCR_SIZE_SHIFT) | (256 << PR_DESCR_ADDR_SHIFT);
+
+        podule_pump();
+        CHECK(!PR_DESCR_IS_READY(PR_TX_DESCR(r, 1)) &&
+              PR_DESCR_IS_READY(PR_TX_DESCR(r, 0)), "interactive not first");
+        CHECK(r[PR_TX_TAIL] == 0, "tail moved past unsent descriptor");
+
+        podule_pump();
+        CHECK(!PR_DESCR_IS_READY(PR_TX_DESCR(r, 0)), "bulk not sent");
+        CHECK(r[PR_TX_TAIL] == 0, "tail %d after both", r[PR_TX_TAIL]);
+        CHECK(usb.to_host_wr == 2 * PKT_HDR_SIZE + 8 + 16 &&
+              usb.to_host[0] == 1 && usb.to_host[PKT_HDR_SIZE] == 0x11 &&
+              usb.to_host[PKT_HDR_SIZE + 8] == 2, "wrong order on USB");
+}
+
+/* With the control lane connected, bulk and interactive packets go out on
+ * separate interfaces, at the same time.
+ */
+static void     test_tx_lanes(void)
+{
+        volatile uint8_t *r = podule_if_get_regs();
+
+        reset_all(1, 12);               // Packets take many polls to send
+        usb.ctl_connected = true;
+        r[PR_TX_BULK0] = 1 << 2;
+        memset((void *)&r[PR_TX_BUFFERS], 0xbb, 16);
+        memset((void *)&r[PR_TX_BUFFERS + 256], 0x11, 8);
+        PR_TX_DESCR(r, 0) = PR_DESCR_READY | (2 << PR_DESCR_CID_SHIFT) |
+                ((16 - 1) << PR_DESCR_SIZE_SHIFT) | (0 << PR_DESCR_ADDR_SHIFT);
+        PR_TX_DESCR(r, 1) = PR_DESCR_READY | (1 << PR_DESCR_CID_SHIFT) |
+                ((8 - 1) << PR_DESCR_SIZE_SHIFT) | (256 << PR_DESCR_ADDR_SHIFT);
+
+        podule_pump();
+        CHECK(usb.to_host_wr == 1 && usb.ctl_to_host_wr == 1,
+              "both lanes not started");
+        for (int j = 0; j < 100; j++)
+                podule_pump();
+
+        CHECK(!PR_DESCR_IS_READY(PR_TX_DESCR(r, 0)) &&
+              !PR_DESCR_IS_READY(PR_TX_DESCR(r, 1)), "not consumed");
+        CHECK(r[PR_TX_TAIL] == 0, "tail %d", r[PR_TX_TAIL]);
+        CHECK(usb.to_host_wr == PKT_HDR_SIZE + 16 && usb.to_host[0] == 2,
+              "bulk lane");
+        CHECK(usb.ctl_to_host_wr == PKT_HDR_SIZE + 8 &&
+              usb.ctl_to_host[0] == 1 && usb.ctl_to_host[PKT_HDR_SIZE] == 0x11,
+              "control lane");
+}
+
+/* Over the vendor interface, a packet that would end on a full USB packet
+ * is padded by a byte; packets from the host arrive as over CDC.
+ */
+static void     test_vendor_lane(void)
+{
+        uint8_t data[PR_RX_TX_BUFSZ], got[PR_RX_TX_BUFSZ];
+        unsigned int rcid;
+
+        reset_all(1024, 13);
+        pipe_vendor_open(true);
+        fill_pattern(data, 61, 1);
+
+        CHECK(arc_packet_tx(4, data, 61, 1000) == 0, "TX timed out");
+        CHECK(usb.vnd_to_host_wr == 64 + 1 && usb.to_host_wr == 0,
+              "TX of 61: %d bytes out", usb.vnd_to_host_wr);
+        CHECK(usb.vnd_to_host[0] == 4 && usb.vnd_to_host[1] == 61 &&
+              !memcmp(&usb.vnd_to_host[PKT_HDR_SIZE], data, 61), "TX data");
+
+        CHECK(arc_packet_tx(4, data, 10, 1000) == 0, "TX timed out");
+        CHECK(usb.vnd_to_host_wr == 65 + 13, "TX of 10");
+
+        usb.vnd_to_dev[0] = 7;
+        usb.vnd_to_dev[1] = 20;
+        usb.vnd_to_dev[2] = 0;
+        memcpy(&usb.vnd_to_dev[PKT_HDR_SIZE], data, 20);
+        usb.vnd_to_dev_wr = PKT_HDR_SIZE + 20;
+        CHECK(arc_packet_rx(got, &rcid, 1000) == 20 && rcid == 7 &&
+              !memcmp(got, data, 20), "RX");
+        pipe_vendor_open(false);
+}
+
+/* With CRC agreed, TX is framed; on RX, a damaged frame and junk are
+ * dropped (and counted) without losing the good frames around them, and a
+ * plain hostinfo packet still gets through.
+ */
+static void     test_crc_framing(unsigned int max_frag)
+{
+        volatile uint8_t *r = podule_if_get_regs();
+        uint8_t data[PR_RX_TX_BUFSZ], got[PR_RX_TX_BUFSZ];
+        static const uint8_t junk[] = { 0x12, 0xfa, 0x03, 0xfa };
+        unsigned int rcid;
+        int n;
+
+        reset_all(max_frag, 14);
+        r[PR_LINK_CAPS] = PR_CAP_CRC;
+        fill_pattern(data, 300, 2);
+
+        CHECK(arc_packet_tx(9, data, 300, 1000) == 0, "TX timed out");
+        CHECK(usb.to_host_wr == 300 + 7, "TX of %d bytes", usb.to_host_wr);
+        CHECK(usb.to_host[0] == 0xfa && usb.to_host[1] == 9 &&
+              usb.to_host[4] == (ref_crc16(usb.to_host, 4) & 0xff) &&
+              !memcmp(&usb.to_host[5], data, 300), "TX header/data");
+        CHECK((usb.to_host[305] | (usb.to_host[306] << 8)) ==
+              ref_crc16(usb.to_host, 305), "TX CRC");
+
+        host_send_frame(2, data, 100, 0);
+        host_send_frame(3, data, 200, 0x40);            // Bad CRC
+        memcpy(&usb.to_dev[usb.to_dev_wr], junk, sizeof(junk));
+        usb.to_dev_wr += sizeof(junk);
+        host_send(5, data, 10);                         // Plain, not hostinfo
+        host_send_frame(4, data, 50, 0);
+        host_send(1, data, 8);                          // Plain hostinfo
+
+        n = arc_packet_rx(got, &rcid, 1000);
+        CHECK(n == 100 && rcid == 2 && !memcmp(got, data, 100),
+              "first: %d, CID %u", n, rcid);
+        n = arc_packet_rx(got, &rcid, 1000);
+        CHECK(n == 50 && rcid == 4 && !memcmp(got, data, 50),
+              "after bad: %d, CID %u", n, rcid);
+        n = arc_packet_rx(got, &rcid, 1000);
+        CHECK(n == 8 && rcid == 1, "hostinfo: %d, CID %u", n, rcid);
+        CHECK(usb.to_dev_rd == usb.to_dev_wr, "unconsumed input");
+        CHECK(r[PR_LINK_BAD] == 1 && r[PR_LINK_RESYNC] == 1,
+              "bad %d, resync %d", r[PR_LINK_BAD], r[PR_LINK_RESYNC]);
+}
+
+/* pipe_init() advertises the firmware's capabilities for negotiation */
+static void     test_caps_regs(void)
+{
+        volatile uint8_t *r = podule_if_get_regs();
+
+        reset_all(64, 10);
+        CHECK(r[PR_FW_VERSION] == PR_FW_VERSION_CUR, "version %d",
+              r[PR_FW_VERSION]);
+        CHECK(r[PR_FW_RING] == PR_NUM_DESCRS, "ring %d", r[PR_FW_RING]);
+        CHECK(r[PR_FW_MAXPKT] * 4 == PR_RX_TX_BUFSZ, "max packet %d",
+              r[PR_FW_MAXPKT] * 4);
+        CHECK((r[PR_FW_CAPS] & ~(PR_CAP_LINK_MASK)) == 0,
+              "non-link caps 0x%x", r[PR_FW_CAPS]);
+        CHECK(r[PR_LINK_CAPS] == 0, "link caps set");
+}
+
+static void     run_tests(void)
+{
+        static const unsigned int frags[] = { 1, 3, 64, 1024 };
+
+        for (unsigned int i = 0; i < sizeof(frags) / sizeof(frags[0]); i++) {
+                test_tx_sizes(frags[i]);
+                test_rx_sizes(frags[i]);
+                test_rx_back_to_back(frags[i]);
+                test_crc_framing(frags[i]);
+        }
+        test_rx_no_overwrite();
+        test_tx_bad_descriptor();
+        test_tx_priority();
+        test_tx_lanes();
+        test_vendor_lane();
+        test_caps_regs();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Microbenchmark
+
+static void     report(const char *what, unsigned int max_frag, unsigned int len,
+                       unsigned int n)
+{
+        double secs = poll_ns / 1e9;
+        printf("%s frag %4u len %3u: %8.1f MB/s, %7.0f ns/pkt", what,
+               max_frag, len, (double)len * n / secs / 1e6,
+               (double)poll_ns / n);
+#ifdef HAVE_TSC
+        printf(", %7.0f cycles/pkt", (double)poll_cycles / n);
+#endif
+        printf(" (in pipe_poll)\n");
+}
+
+static void     bench(void)
+{
+        static const unsigned int frags[] = { 64, 1024 };
+        static const unsigned int lens[] = { 16, 256, 512 };
+        uint8_t data[PR_RX_TX_BUFSZ];
+        const unsigned int n = 20000;
+
+        for (unsigned int f = 0; f < 2; f++) {
+                for (unsigned int l = 0; l < 3; l++) {
+                        unsigned int len = lens[l];
+                        unsigned int rcid;
+
+                        reset_all(frags[f], 1);
+                        fill_pattern(data, len, 0);
+                        for (unsigned int i = 0; i < n; i++) {
+                                host_send(1, data, len);
+                                arc_packet_rx(data, &rcid, 1000);
+                                // Don't run off the end of the link buffer:
+                                if (usb.to_dev_wr > LINK_BUF_SIZE / 2 &&
+                                    usb.to_dev_rd == usb.to_dev_wr)
+                                        usb.to_dev_rd = usb.to_dev_wr = 0;
+                        }
+                        report("RX", frags[f], len, n);
+
+                        reset_all(frags[f], 1);
+                        for (unsigned int i = 0; i < n; i++) {
+                                arc_packet_tx(1, data, len, 1000);
+                                if (usb.to_host_wr > LINK_BUF_SIZE / 2)
+                                        usb.to_host_wr = 0;
+                        }
+                        report("TX", frags[f], len, n);
+                }
+        }
+}
+
+int             main(int argc, char *argv[])
+{
+        bool do_bench = false;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "bh")) != -1) {
+                switch (opt) {
+                case 'b':
+                        do_bench = true;
+                        break;
+                default:
+                        printf("Syntax: %s [-b]\n"
+                               "\t-b\tRun microbenchmark instead of tests\n",
+                               argv[0]);
+                        return 1;
+                }
+        }
+
+        if (do_bench) {
+                bench();
+                return 0;
+        }
+
+        run_tests();
+        if (failures) {
+                printf("%d test(s) FAILED\n", failures);
+                return 1;
+        }
+        printf("All tests passed\n");
+        return 0;
+}
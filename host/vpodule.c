@@ -0,0 +1,447 @@
+/* vpodule:  a virtual ArcPipePodule on a pty
+ *
+ * Runs the firmware's pipe_packet.c on the host, with the TinyUSB CDC calls
+ * redirected to a pty master (and, with -u, the vendor interface to a unix
+ * socket).  The server opens the pty slave as though it were /dev/ttyACMx.
+ * This file is that podule-space and USB shim, and main().
+ *
+ * The Arc's side is arc_model.c's descriptor queues, driven by the
+ * workloads in workload*.c.  Those are models of mod_pipe, written to send
+ * what it sends, so that the server and the firmware pipe code can be
+ * exercised and benchmarked without hardware.  They aren't tests of
+ * mod_pipe:  none of its code runs here.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "tusb.h"
+#include "pipe_packet.h"
+#include "podule_interface.h"
+#include "podule_regs.h"
+#include "arc_model.h"
+#include "workload.h"
+
+#define USB_FIFO_SIZE           1024    // As CFG_TUD_CDC_[RT]X_BUFSIZE
+
+volatile uint8_t podule_space[4096];
+
+static int      pty_fd[2] = { -1, -1 };  // Per CDC interface (lane)
+static unsigned int frag_size = USB_FIFO_SIZE;
+unsigned int    err_every = 0;
+static uint64_t err_pos[2];             // Bytes read, written on the ptys
+unsigned int    errs_injected = 0;
+
+////////////////////////////////////////////////////////////////////////////////
+// TinyUSB CDC shim, onto the pty
+
+bool            tud_cdc_n_connected(uint8_t itf)
+{
+        return itf < 2 && pty_fd[itf] >= 0;
+}
+
+uint32_t        tud_cdc_n_available(uint8_t itf)
+{
+        int n = 0;
+        if (ioctl(pty_fd[itf], FIONREAD, &n) < 0)
+                return 0;
+        return n;
+}
+
+/* -e: flip a bit in every err_every'th byte over the ptys, counting from
+ * *pos.  Only once CRC framing's agreed, as before that an error loses the
+ * link for good.
+ */
+static void     inject_errors(uint8_t *buf, unsigned int len, uint64_t pos)
+{
+        volatile uint8_t *r = podule_if_get_regs();
+
+        if (!err_every || !(r[PR_LINK_CAPS] & PR_CAP_CRC))
+                return;
+        for (unsigned int i = 0; i < len; i++) {
+                if ((pos + i + 1) % err_every == 0) {
+                        buf[i] ^= 0x10;
+                        errs_injected++;
+                }
+        }
+}
+
+uint32_t        tud_cdc_n_read(uint8_t itf, void *buffer, uint32_t bufsize)
+{
+        if (bufsize > frag_size)
+                bufsize = frag_size;
+        int r = read(pty_fd[itf], buffer, bufsize);
+        if (r <= 0)
+                return 0;
+        inject_errors(buffer, r, err_pos[0]);
+        err_pos[0] += r;
+        return r;
+}
+
+uint32_t        tud_cdc_n_write(uint8_t itf, void const *buffer, uint32_t bufsize)
+{
+        uint8_t buf[USB_FIFO_SIZE];
+
+        if (bufsize > frag_size)
+                bufsize = frag_size;
+        if (bufsize > sizeof(buf))
+                bufsize = sizeof(buf);
+        memcpy(buf, buffer, bufsize);
+        inject_errors(buf, bufsize, err_pos[1]);
+        int r = write(pty_fd[itf], buf, bufsize);
+        if (r <= 0)
+                return 0;
+        err_pos[1] += r;
+        return r;
+}
+
+uint32_t        tud_cdc_n_write_flush(uint8_t itf)
+{
+        return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// TinyUSB vendor shim, onto a unix SOCK_SEQPACKET socket:  each message is
+// one USB transfer, as the server's usbfs lane would see them.
+
+static struct {
+        int             listen_fd;
+        int             fd;
+        uint8_t         rx[2048];       // Current message, read so far
+        unsigned int    rx_rd, rx_len;
+        uint8_t         tx[CFG_TUD_VENDOR_TX_BUFSIZE];
+        unsigned int    tx_len;
+} vnd = { -1, -1 };
+
+static void     vendor_close(void)
+{
+        close(vnd.fd);
+        vnd.fd = -1;
+        vnd.rx_rd = vnd.rx_len = vnd.tx_len = 0;
+        pipe_vendor_open(false);
+}
+
+/* A connection stands in for the host's open control request */
+static void     vendor_poll(void)
+{
+        if (vnd.listen_fd < 0 || vnd.fd >= 0)
+                return;
+        vnd.fd = accept4(vnd.listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (vnd.fd >= 0)
+                pipe_vendor_open(true);
+}
+
+uint32_t        tud_vendor_n_available(uint8_t itf)
+{
+        if (vnd.rx_rd == vnd.rx_len && vnd.fd >= 0) {
+                int r = recv(vnd.fd, vnd.rx, sizeof(vnd.rx), 0);
+
+                if (r == 0 || (r < 0 && errno != EAGAIN))
+                        vendor_close();
+                vnd.rx_rd = 0;
+                vnd.rx_len = r > 0 ? r : 0;
+        }
+        return vnd.rx_len - vnd.rx_rd;
+}
+
+uint32_t        tud_vendor_n_read(uint8_t itf, void *buffer, uint32_t bufsize)
+{
+        unsigned int n = tud_vendor_n_available(itf);
+
+        if (n > bufsize)
+                n = bufsize;
+        memcpy(buffer, &vnd.rx[vnd.rx_rd], n);
+        vnd.rx_rd += n;
+        return n;
+}
+
+uint32_t        tud_vendor_n_write(uint8_t itf, void const *buffer, uint32_t bufsize)
+{
+        unsigned int n = sizeof(vnd.tx) - vnd.tx_len;
+
+        if (n > bufsize)
+                n = bufsize;
+        memcpy(&vnd.tx[vnd.tx_len], buffer, n);
+        vnd.tx_len += n;
+        return n;
+}
+
+/* As USB, a transfer only ends on a short packet */
+uint32_t        tud_vendor_n_write_flush(uint8_t itf)
+{
+        if (vnd.tx_len == 0 || vnd.tx_len % 64 == 0)
+                return 0;
+        if (send(vnd.fd, vnd.tx, vnd.tx_len, 0) < 0 && errno != EAGAIN) {
+                vendor_close();
+                return 0;
+        }
+        unsigned int n = vnd.tx_len;
+        vnd.tx_len = 0;
+        return n;
+}
+
+uint32_t        tud_vendor_n_write_available(uint8_t itf)
+{
+        return sizeof(vnd.tx) - vnd.tx_len;
+}
+
+static int      vendor_listen(const char *path)
+{
+        struct sockaddr_un sa = { .sun_family = AF_UNIX };
+
+        vnd.listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+        if (vnd.listen_fd < 0) {
+                perror("- Can't create socket");
+                return -1;
+        }
+        strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+        unlink(path);
+        if (bind(vnd.listen_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+            listen(vnd.listen_fd, 1) < 0) {
+                perror("- Can't listen");
+                return -1;
+        }
+        printf("+++ Vendor interface on %s\n", path);
+        return 0;
+}
+
+static void     podule_pump(void)
+{
+        vendor_poll();
+        pipe_poll();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static int      open_pty(const char *link)
+{
+        int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+        if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+                perror("- Can't create pty");
+                return -1;
+        }
+
+        struct termios tos;
+        tcgetattr(fd, &tos);
+        cfmakeraw(&tos);
+        tcsetattr(fd, TCSANOW, &tos);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        char *slave = ptsname(fd);
+        printf("+++ Virtual podule on %s\n", slave);
+
+        if (link) {
+                unlink(link);
+                if (symlink(slave, link) < 0) {
+                        perror("- Can't create link");
+                        return -1;
+                }
+                printf("+++ Linked as %s\n", link);
+        }
+        return fd;
+}
+
+static void     usage(char *prog)
+{
+        printf("Syntax: %s [-l link] [-c link] [-u socket] [-f frag] "
+               "[-t timeout_ms] [-o dir] [-d depth] [-i N] [-e N] [-P] [-Z] "
+               "workload...\n"
+               "\t-l\tSymlink the pty slave here (point the server at it)\n"
+               "\t-c\tAdd a control lane pty, linked here (give the server "
+               "'data,control')\n"
+               "\t-u\tServe the vendor interface on a unix socket (give the "
+               "server 'unix:socket')\n"
+               "\t-f\tMax bytes per USB read/write call (default %d)\n"
+               "\t-t\tPer-packet timeout (default %d ms)\n"
+               "\t-o\tWrite files copied by pcpl/pcplr into this directory "
+               "(and pcpr's come from it)\n"
+               "\t-d\tTagged pcpl requests in flight (default %d, "
+               "0 = untagged)\n"
+               "\t-i\tDuring pcpl, ping every N blocks\n"
+               "\t-e\tCorrupt every Nth byte over the ptys, once CRC "
+               "framing's agreed\n"
+               "\t-P\tDon't offer CRC framing (plain packets)\n"
+               "\t-Z\tDon't offer packed block responses\n"
+               "Workloads:\n"
+               "\tping:N\t\tN hostinfo round trips\n"
+               "\tpcpl:NAME\tCopy host file NAME, as *PCPL\n"
+               "\tpcpr:NAME[:HOST[:LOAD:EXEC]]\tCopy NAME to the host (as "
+               "HOST, untyped with\n\t\t\thex LOAD and EXEC), as *PCPR\n"
+               "\tcat:DIR\t\tList host directory DIR, as *PCAT\n"
+               "\tpcplr:DIR[:LOCAL]\tCopy host tree DIR, as *PCPLR\n"
+               "\tpsync:DIR[:LOCAL]\tUpdate a copy of host tree DIR, "
+               "as *PSYNC\n"
+               "\tdisc:IMAGE\tRead host disc image IMAGE with DiscOps, "
+               "then copy its first half over its second\n"
+               "\timage:IMAGE\tImage a floppy to new host image IMAGE, as "
+               "*PDISCREAD,\n\t\t\tand back, as *PDISCWRITE\n"
+               "\tfs:DIR\t\tUse host directory DIR through the Pipe filing "
+               "system\n"
+               "\tpload:NAME\tLoad host file NAME (as Pipe: names it) "
+               "into memory, as *PLOAD\n"
+               "\thold:PATH\tCreate PATH and wait for it to be removed\n"
+               "\tnego\t\tNegotiate again (e.g. after a server restart)\n"
+               "\tpbench:N\tN round trips, then N packets each way, of "
+               "each size, as *PBENCH\n",
+               prog, USB_FIFO_SIZE, timeout_ms, depth);
+}
+
+int             main(int argc, char *argv[])
+{
+        char *link = NULL;
+        char *ctl_link = NULL;
+        char *vnd_path = NULL;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "l:c:u:f:t:o:d:i:e:PZh")) != -1) {
+                switch (opt) {
+                case 'l':
+                        link = optarg;
+                        break;
+                case 'c':
+                        ctl_link = optarg;
+                        break;
+                case 'u':
+                        vnd_path = optarg;
+                        break;
+                case 'i':
+                        ping_every = strtoul(optarg, NULL, 0);
+                        break;
+                case 'e':
+                        err_every = strtoul(optarg, NULL, 0);
+                        break;
+                case 'P':
+                        offer_crc = false;
+                        break;
+                case 'Z':
+                        offer_compress = false;
+                        break;
+                case 'f':
+                        frag_size = strtoul(optarg, NULL, 0);
+                        if (frag_size == 0)
+                                frag_size = 1;
+                        break;
+                case 't':
+                        timeout_ms = strtoul(optarg, NULL, 0);
+                        break;
+                case 'o':
+                        out_dir = optarg;
+                        break;
+                case 'd':
+                        depth = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+
+        setvbuf(stdout, NULL, _IOLBF, 0);
+
+        pty_fd[0] = open_pty(link);
+        if (pty_fd[0] < 0)
+                return 1;
+        if (ctl_link) {
+                pty_fd[1] = open_pty(ctl_link);
+                if (pty_fd[1] < 0)
+                        return 1;
+        }
+        if (vnd_path && vendor_listen(vnd_path) < 0)
+                return 1;
+
+        memset((void *)podule_space, 0, sizeof(podule_space));
+        pipe_init();
+        // As mod_pipe's init:
+        podule_if_get_regs()[PR_TX_BULK0] = (1 << CID_RAWFILE) |
+                (1 << CID_BLOCK) | (1 << CID_ECHO_BULK);
+        arc_init(podule_pump);
+
+        if (wait_for_server(30) < 0) {
+                printf("- No response from server\n");
+                return 1;
+        }
+        printf("+++ Server connected\n");
+        if (negotiate() < 0) {
+                printf("- Negotiation failed\n");
+                return 1;
+        }
+
+        int r = 0;
+        for (int i = optind; i < argc && r == 0; i++) {
+                if (!strncmp(argv[i], "ping:", 5)) {
+                        r = workload_ping(strtoul(argv[i] + 5, NULL, 0));
+                } else if (!strncmp(argv[i], "pcpl:", 5)) {
+                        r = workload_pcpl(argv[i] + 5);
+                } else if (!strncmp(argv[i], "pcpr:", 5)) {
+                        r = workload_pcpr(argv[i] + 5);
+                } else if (!strncmp(argv[i], "cat:", 4)) {
+                        r = workload_cat(argv[i] + 4);
+                } else if (!strncmp(argv[i], "pcplr:", 6)) {
+                        r = workload_pcplr(argv[i] + 6, false);
+                } else if (!strncmp(argv[i], "psync:", 6)) {
+                        r = workload_pcplr(argv[i] + 6, true);
+                } else if (!strncmp(argv[i], "disc:", 5)) {
+                        r = workload_disc(argv[i] + 5);
+                } else if (!strncmp(argv[i], "image:", 6)) {
+                        r = workload_image(argv[i] + 6);
+                } else if (!strncmp(argv[i], "fs:", 3)) {
+                        r = workload_fs(argv[i] + 3);
+                } else if (!strncmp(argv[i], "pload:", 6)) {
+                        r = workload_pload(argv[i] + 6);
+                } else if (!strncmp(argv[i], "hold:", 5)) {
+                        r = workload_hold(argv[i] + 5);
+                } else if (!strcmp(argv[i], "nego")) {
+                        r = workload_nego();
+                } else if (!strncmp(argv[i], "pbench:", 7)) {
+                        r = workload_pbench(strtoul(argv[i] + 7, NULL, 0));
+                } else {
+                        printf("- Unknown workload '%s'\n", argv[i]);
+                        r = -1;
+                }
+        }
+
+        if (link)
+                unlink(link);
+        if (ctl_link)
+                unlink(ctl_link);
+        if (vnd_path)
+                unlink(vnd_path);
+        return r < 0 ? 1 : 0;
+}
@@ -0,0 +1,263 @@
+/* Arc-side workloads:  requests, negotiation and hostinfo
+ *
+ * What the workload_*.c files share, as mod_pipe's commands share
+ * pipe_packet.S:  sending a request and waiting for its response,
+ * negotiation, and unpacking packed blocks.  Also the hostinfo channel's
+ * own workloads.  See workload.h.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "podule_interface.h"
+#include "podule_regs.h"
+#include "arc_model.h"
+#include "workload.h"
+
+unsigned int    timeout_ms = 2000;
+char            *out_dir = NULL;
+unsigned int    depth = 4;
+unsigned int    max_pkt = PR_RX_TX_BUFSZ;
+unsigned int    caps = 0;
+unsigned int    ping_every = 0;
+bool            offer_crc = true;
+bool            offer_compress = true;
+static unsigned int packed = 0;         // Blocks that came packed
+static uint64_t packed_saved = 0;       // Bytes that weren't sent
+
+////////////////////////////////////////////////////////////////////////////////
+// Stats
+
+uint64_t        now_ns(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int      cmp_u64(const void *a, const void *b)
+{
+        uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+        return x < y ? -1 : x > y;
+}
+
+void            print_latency(const char *what, uint64_t *lat, unsigned int n)
+{
+        uint64_t sum = 0;
+
+        if (n == 0)
+                return;
+        qsort(lat, n, sizeof(uint64_t), cmp_u64);
+        for (unsigned int i = 0; i < n; i++)
+                sum += lat[i];
+        printf("%s: n %u, latency us: min %.1f avg %.1f p50 %.1f p99 %.1f "
+               "max %.1f\n", what, n,
+               lat[0] / 1000.0, (double)sum / n / 1000.0,
+               lat[n / 2] / 1000.0, lat[(n * 99) / 100] / 1000.0,
+               lat[n - 1] / 1000.0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Requests and hostinfo
+
+uint8_t         pkt[PR_RX_TX_BUFSZ];
+
+/* Send a request and wait for its response (into pkt), skipping replies on
+ * other channels.  With -e, either could be lost, so it's resent every
+ * RETRY_MS (a late response is then taken by a later request).
+ */
+int             request(unsigned int cid, uint8_t *req, unsigned int len)
+{
+        unsigned int rcid;
+        int rlen;
+
+        for (unsigned int t = 0; t < timeout_ms; t += RETRY_MS) {
+                if (arc_packet_tx(cid, req, len, timeout_ms) < 0)
+                        return -1;
+                do {
+                        rlen = arc_packet_rx(pkt, &rcid, err_every ? RETRY_MS :
+                                             timeout_ms);
+                } while (rlen >= 0 && rcid != cid);
+                if (rlen >= 0 || !err_every)
+                        return rlen;
+        }
+        return -1;
+}
+
+int             hostinfo_ping(void)
+{
+        uint8_t req = 0;
+
+        return request(CID_HOSTINFO, &req, 1) < 0 ? -1 : 0;
+}
+
+/* Wait for the server to open the pty (and flush it), by pinging it */
+int             wait_for_server(unsigned int secs)
+{
+        unsigned int saved = timeout_ms;
+        int r = -1;
+
+        timeout_ms = 500;
+        for (unsigned int i = 0; i < secs * 2 && r < 0; i++) {
+                r = hostinfo_ping();
+                // If a late response turned up, drain it:
+                unsigned int cid;
+                while (r == 0 && arc_packet_rx(pkt, &cid, 50) >= 0)
+                        ;
+        }
+        timeout_ms = saved;
+        return r;
+}
+
+/* As mod_pipe's pipe_negotiate: agree caps with the firmware and server,
+ * limiting depth and max_pkt to what was agreed.
+ */
+int             negotiate(void)
+{
+        volatile uint8_t *r = podule_if_get_regs();
+        unsigned int cid;
+        uint32_t w[5];
+        uint8_t req = 0;
+
+        r[PR_LINK_CAPS] = 0;            // Plain, until agreed otherwise
+        if (arc_packet_tx(CID_HOSTINFO, &req, 1, timeout_ms) < 0 ||
+            arc_packet_rx(pkt, &cid, timeout_ms) < 4)
+                return -1;
+        memcpy(w, pkt, 4);
+        printf("+++ Server protocol %u, firmware %u caps 0x%x\n", w[0],
+               r[PR_FW_VERSION], r[PR_FW_CAPS]);
+        if (w[0] < 2) {
+                depth = 0;
+                return 0;
+        }
+        if (w[0] < 3)
+                return 0;               // Tags, but no caps exchange
+
+        uint32_t fw_max = r[PR_FW_MAXPKT] * 4;
+        w[0] = 1;                       // HOSTINFO_CAPS
+        w[1] = ((depth ? PR_CAP_TAGS : 0) | PR_CAP_STREAM |
+                (offer_compress ? PR_CAP_COMPRESS : 0) |
+                (offer_crc ? PR_CAP_CRC : 0)) &
+                (~PR_CAP_LINK_MASK | r[PR_FW_CAPS]);
+        w[2] = fw_max ? fw_max : PR_RX_TX_BUFSZ;
+        w[3] = depth;
+        if (arc_packet_tx(CID_HOSTINFO, (uint8_t *)w, 16, timeout_ms) < 0 ||
+            arc_packet_rx(pkt, &cid, timeout_ms) < 20)
+                return -1;
+        memcpy(w, pkt, 20);
+        r[PR_LINK_CAPS] = w[2];
+        caps = w[2];
+        max_pkt = w[3];
+        depth = (w[2] & PR_CAP_TAGS) ? w[4] : 0;
+        printf("+++ Agreed caps 0x%x, max packet %u, depth %u\n", w[2],
+               max_pkt, depth);
+        return 0;
+}
+
+int             workload_ping(unsigned int count)
+{
+        uint64_t *lat = calloc(count, sizeof(uint64_t));
+        uint64_t start = now_ns();
+
+        for (unsigned int i = 0; i < count; i++) {
+                uint64_t t = now_ns();
+                if (hostinfo_ping() < 0) {
+                        printf("ping: timed out after %u\n", i);
+                        free(lat);
+                        return -1;
+                }
+                lat[i] = now_ns() - t;
+        }
+        uint64_t total = now_ns() - start;
+
+        printf("ping: %u round trips in %.3fs, %.0f/s\n", count,
+               total / 1e9, count / (total / 1e9));
+        print_latency("ping", lat, count);
+        free(lat);
+        return 0;
+}
+
+/* Create PATH, then wait (up to a minute) for it to be removed, e.g. while
+ * the server's restarted
+ */
+int             workload_hold(const char *path)
+{
+        int fd = open(path, O_CREAT | O_WRONLY, 0666);
+
+        if (fd < 0) {
+                perror("- Can't create hold file");
+                return -1;
+        }
+        close(fd);
+        for (unsigned int i = 0; i < 600 && access(path, F_OK) == 0; i++)
+                usleep(100000);
+        return access(path, F_OK) == 0 ? -1 : 0;
+}
+
+/* Negotiate again, as Pipe_Info with r0 bit 0 set does.  After a server
+ * restart, the firmware's still framing, and the new server isn't.
+ */
+int             workload_nego(void)
+{
+        if (wait_for_server(30) < 0 || negotiate() < 0) {
+                printf("nego: failed\n");
+                return -1;
+        }
+        return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Packed block responses
+
+/* A block response of len bytes, for a block of bsz, as mod_pipe's
+ * rawfile_unpack:  if it's short, it was packed (see the server's struct
+ * read_block_run), and the rest of the block is the byte in its last word.
+ * Returns the block's length.
+ */
+int             unpack_block(uint8_t *data, int len, uint32_t bsz)
+{
+        if (!(caps & PR_CAP_COMPRESS) || len < 4 || len >= (int)bsz)
+                return len;
+        memset(&data[len - 4], data[len - 4], bsz - (len - 4));
+        packed++;
+        packed_saved += bsz - len;
+        return bsz;
+}
+
+void            print_packed(const char *what)
+{
+        if (packed)
+                printf("%s: %u blocks packed, %llu bytes saved\n", what,
+                       packed, (unsigned long long)packed_saved);
+        packed = 0;
+        packed_saved = 0;
+}
@@ -0,0 +1,109 @@
+/* Arc-side workloads, for vpodule
+ *
+ * Models of what mod_pipe does on the Arc, run against arc_model.c's
+ * descriptor queues.  Each workload_*.c covers a channel, doing what the
+ * matching mod_pipe command does, so that the server and firmware see the
+ * same traffic.  They stand in for mod_pipe; they don't test it.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "podule_regs.h"
+
+#define CID_HOSTINFO            1
+#define CID_RAWFILE             2
+#define CID_DIR                 3
+#define CID_BLOCK               4
+#define CID_FS                  5
+#define CID_ECHO                6
+#define CID_ECHO_ECHO           0
+#define CID_ECHO_SINK           1
+#define CID_ECHO_SOURCE         2
+#define CID_ECHO_BULK           7
+#define BLK_STREAM_SHIFT        4       // As mod_pipe's
+#define CID_F_TAGGED            0x40
+#define TAG_SIZE                4
+
+#define RETRY_MS        20              // With -e, ms before resending
+
+/* Set from vpodule's options: */
+extern unsigned int timeout_ms;
+extern char     *out_dir;
+extern unsigned int depth;              // Requests in flight, 0 = untagged
+extern unsigned int ping_every;         // pcpl: ping every N blocks
+extern bool     offer_crc;
+extern bool     offer_compress;
+extern unsigned int err_every;          // Corrupt every Nth byte on the ptys
+extern unsigned int errs_injected;
+
+/* Agreed with the server by negotiate(): */
+extern unsigned int max_pkt;
+extern unsigned int caps;
+
+/* workload.c:  shared by the workloads, and the hostinfo channel */
+extern uint8_t  pkt[PR_RX_TX_BUFSZ];
+
+uint64_t        now_ns(void);
+void            print_latency(const char *what, uint64_t *lat, unsigned int n);
+int             request(unsigned int cid, uint8_t *req, unsigned int len);
+int             hostinfo_ping(void);
+int             wait_for_server(unsigned int secs);
+int             negotiate(void);
+int             unpack_block(uint8_t *data, int len, uint32_t bsz);
+void            print_packed(const char *what);
+int             workload_ping(unsigned int count);
+int             workload_hold(const char *path);
+int             workload_nego(void);
+
+/* workload_echo.c */
+int             workload_pbench(unsigned int count);
+
+/* workload_rawfile.c (and the directory channel) */
+int             workload_pcpl(const char *name);
+int             workload_pcpr(const char *arg);
+int             workload_cat(const char *dir);
+int             workload_pcplr(const char *arg, bool sync);
+
+/* workload_block.c */
+extern unsigned int xfer_cid;
+extern uint32_t xfer_read_op, xfer_write_op;
+
+int             disc_read(uint32_t start, uint32_t len, uint8_t *buf,
+                          unsigned int *reqs, unsigned int *retries);
+int             disc_write(uint32_t start, uint32_t len, const uint8_t *buf,
+                           unsigned int *retries);
+int             workload_disc(const char *name);
+int             workload_image(const char *name);
+
+/* workload_fs.c */
+int             workload_fs(const char *dir);
+int             workload_pload(const char *name);
+
+#endif
@@ -0,0 +1,439 @@
+/* Arc-side workloads:  the block channel
+ *
+ * Disc images on the host, used as mod_pipe's block_xfer and *PDISC,
+ * *PDISCREAD and *PDISCWRITE use them (see workload.h).
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "podule_regs.h"
+#include "arc_model.h"
+#include "workload.h"
+
+/* What disc_read() and disc_write() ask, as block_xfer's WS_XFER_CID and
+ * WS_XFER_OP:  the channel, and each request's first word
+ */
+unsigned int    xfer_cid = CID_BLOCK;
+uint32_t        xfer_read_op = 1, xfer_write_op = 2;
+
+/* Ask for length bytes of the image from offset (tagged with the offset) */
+static int      disc_request(uint32_t offset, uint32_t length)
+{
+        uint8_t req[TAG_SIZE + 12] = { 0 };
+        uint8_t *r = req;
+        unsigned int rcid = xfer_cid;
+
+        if (depth) {
+                memcpy(req, &offset, TAG_SIZE);
+                r += TAG_SIZE;
+                rcid |= CID_F_TAGGED;
+        }
+        memcpy(&r[0], &xfer_read_op, 4);
+        memcpy(&r[4], &offset, 4);
+        memcpy(&r[8], &length, 4);
+        return arc_packet_tx(rcid, req, r - req + 12, timeout_ms);
+}
+
+/* As mod_pipe's block_discop reads:  requests for a stream of packets each
+ * (or one, without PR_CAP_STREAM), up to depth requests' worth outstanding.
+ * Each response's tag is where its data goes.  With -e, packets not back
+ * in RETRY_MS are asked for again, one at a time.
+ */
+int             disc_read(uint32_t start, uint32_t len, uint8_t *buf,
+                          unsigned int *reqs, unsigned int *retries)
+{
+        unsigned int bmax = depth ? max_pkt - TAG_SIZE : max_pkt;
+        unsigned int per = (caps & PR_CAP_STREAM) ?
+                bmax << BLK_STREAM_SHIFT : bmax;
+        unsigned int nchunks = (len + bmax - 1) / bmax;
+        bool *got = calloc(nchunks ? nchunks : 1, sizeof(bool));
+        uint32_t end = start + len, next = start, done = 0;
+        bool retry = err_every && depth;
+        uint64_t progress = now_ns();
+        unsigned int cid;
+        int rlen;
+
+        while (done < len) {
+                while (next < end &&
+                       next - start - done < per * (depth ? depth : 1)) {
+                        uint32_t n = end - next > per ? per : end - next;
+
+                        if (disc_request(next, n) < 0)
+                                goto fail;
+                        next += n;
+                        (*reqs)++;
+                }
+                if ((rlen = arc_packet_rx(pkt, &cid, retry ? RETRY_MS :
+                                          timeout_ms)) < 0) {
+                        if (!retry ||
+                            now_ns() - progress > timeout_ms * 1000000ULL)
+                                goto fail;
+                        for (unsigned int c = 0; c < nchunks; c++) {
+                                uint32_t o = start + c * bmax;
+
+                                if (!got[c] && o < next &&
+                                    disc_request(o, end - o > bmax ?
+                                                 bmax : end - o) < 0)
+                                        goto fail;
+                        }
+                        (*retries)++;
+                        continue;
+                }
+                if ((cid & ~CID_F_TAGGED) != xfer_cid)
+                        continue;
+
+                uint8_t *data = pkt;
+                uint32_t offset = start + done;         // Untagged: in order
+                if (depth) {
+                        if (cid != (xfer_cid | CID_F_TAGGED) ||
+                            rlen < TAG_SIZE)
+                                continue;
+                        memcpy(&offset, pkt, TAG_SIZE);
+                        data += TAG_SIZE;
+                        rlen -= TAG_SIZE;
+                }
+                if (offset < start || offset >= next ||
+                    (offset - start) % bmax) {
+                        if (retry)
+                                continue;       // From an earlier request
+                        printf("disc: bad tag 0x%x\n", offset);
+                        goto fail;
+                }
+
+                unsigned int c = (offset - start) / bmax;
+                uint32_t bsz = end - offset > bmax ? bmax : end - offset;
+                if (got[c])
+                        continue;               // Asked for twice
+                rlen = unpack_block(data, rlen, bsz);
+                if (rlen != (int)bsz) {
+                        printf("disc: at 0x%x: expected %u bytes, got %d\n",
+                               offset, bsz, rlen);
+                        goto fail;
+                }
+                got[c] = true;
+                memcpy(&buf[offset - start], data, bsz);
+                done += bsz;
+                progress = now_ns();
+        }
+        free(got);
+        return 0;
+
+ fail:
+        free(got);
+        return -1;
+}
+
+/* Send written packet b, of bmax bytes from start */
+static int      disc_send(unsigned int b, unsigned int bmax, uint32_t start,
+                          uint32_t len, const uint8_t *buf)
+{
+        uint32_t offset = start + b * bmax;
+        uint32_t bsz = len - b * bmax > bmax ? bmax : len - b * bmax;
+        uint8_t req[PR_RX_TX_BUFSZ] = { 0 };
+        uint8_t *r = req;
+        unsigned int rcid = xfer_cid;
+
+        if (depth) {
+                memcpy(req, &offset, TAG_SIZE);
+                r += TAG_SIZE;
+                rcid |= CID_F_TAGGED;
+        }
+        memcpy(&r[0], &xfer_write_op, 4);
+        memcpy(&r[4], &offset, 4);
+        memcpy(&r[8], &buf[b * bmax], bsz);
+        return arc_packet_tx(rcid, req, r - req + 8 + bsz, timeout_ms);
+}
+
+/* As block_discop's writes, which go as pcpr's blocks do */
+int             disc_write(uint32_t start, uint32_t len, const uint8_t *buf,
+                           unsigned int *retries)
+{
+        unsigned int bmax = (depth ? max_pkt - TAG_SIZE : max_pkt) - 8;
+        unsigned int nblocks = (len + bmax - 1) / bmax;
+        bool *got = calloc(nblocks ? nblocks : 1, sizeof(bool));
+        unsigned int next = 0, done = 0, cid;
+        bool retry = err_every && depth;
+        uint64_t progress = now_ns();
+        int rlen;
+
+        while (done < nblocks) {
+                while (next < nblocks && next - done < (depth ? depth : 1)) {
+                        if (disc_send(next, bmax, start, len, buf) < 0)
+                                goto fail;
+                        next++;
+                }
+                if ((rlen = arc_packet_rx(pkt, &cid, retry ? RETRY_MS :
+                                          timeout_ms)) < 0) {
+                        if (!retry ||
+                            now_ns() - progress > timeout_ms * 1000000ULL)
+                                goto fail;
+                        for (unsigned int b = 0; b < next; b++) {
+                                if (!got[b] &&
+                                    disc_send(b, bmax, start, len, buf) < 0)
+                                        goto fail;
+                        }
+                        (*retries)++;
+                        continue;
+                }
+                if ((cid & ~CID_F_TAGGED) != xfer_cid)
+                        continue;
+
+                uint8_t *data = pkt;
+                uint32_t offset = start + done * bmax;
+                if (depth) {
+                        memcpy(&offset, pkt, TAG_SIZE);
+                        data += TAG_SIZE;
+                        rlen -= TAG_SIZE;
+                }
+                unsigned int b = (offset - start) / bmax;
+                if (rlen < 4 || offset < start || b >= next ||
+                    (offset - start) % bmax) {
+                        if (retry)
+                                continue;
+                        printf("disc: bad write response, tag 0x%x\n", offset);
+                        goto fail;
+                }
+                if (data[0] != 0) {
+                        printf("disc: write error %d\n", data[0]);
+                        goto fail;
+                }
+                if (got[b])
+                        continue;
+                got[b] = true;
+                done++;
+                progress = now_ns();
+        }
+        free(got);
+        return 0;
+
+ fail:
+        free(got);
+        return -1;
+}
+
+/* Attach a host image as *PDISC does, read all of it with DiscOps (into the
+ * -o directory, if given), then copy its first half over its second, as a
+ * disc-to-disc backup would, and read that back.
+ */
+int             workload_disc(const char *name)
+{
+        uint8_t req[8 + 256] = { 0 };                   // Open, read/write
+        unsigned int reqs = 0, retries = 0;
+        uint32_t size;
+        int r = -1;
+
+        snprintf((char *)&req[8], 256, "%s", name);
+        if (request(CID_BLOCK, req, 8 + strlen(name) + 1) < 8 ||
+            pkt[0] != 0) {
+                printf("disc: can't open '%s'\n", name);
+                return -1;
+        }
+        memcpy(&size, &pkt[4], 4);
+
+        uint8_t *img = malloc(size);
+        uint64_t start = now_ns();
+        if (disc_read(0, size, img, &reqs, &retries) < 0) {
+                printf("disc: read failed\n");
+                goto out;
+        }
+        uint64_t total = now_ns() - start;
+        printf("disc: '%s' %u bytes read in %.3fs (%u requests), "
+               "%.1f KB/s\n", name, size, total / 1e9, reqs,
+               size / 1024.0 / (total / 1e9));
+        print_packed("disc");
+        if (out_dir) {
+                char path[1024];
+                FILE *out;
+
+                snprintf(path, sizeof(path), "%s/%s", out_dir, name);
+                if ((out = fopen(path, "wb")) != NULL) {
+                        fwrite(img, 1, size, out);
+                        fclose(out);
+                } else {
+                        perror("- Can't create output file");
+                }
+        }
+
+        uint32_t half = size / 2 & ~255;                // Whole sectors
+        start = now_ns();
+        if (disc_write(size - half, half, img, &retries) < 0) {
+                printf("disc: write failed\n");
+                goto out;
+        }
+        total = now_ns() - start;
+        printf("disc: %u bytes written in %.3fs, %.1f KB/s\n", half,
+               total / 1e9, half / 1024.0 / (total / 1e9));
+
+        uint8_t *back = malloc(half);
+        reqs = 0;
+        if (disc_read(size - half, half, back, &reqs, &retries) < 0 ||
+            memcmp(back, img, half)) {
+                printf("disc: read back failed\n");
+                free(back);
+                goto out;
+        }
+        free(back);
+        print_packed("disc");
+        r = 0;
+
+ out:
+        free(img);
+        req[0] = 3;                                     // Close (and sync)
+        if (request(CID_BLOCK, req, 1) < 4 || pkt[0] != 0) {
+                printf("disc: close failed\n");
+                r = -1;
+        }
+        if (err_every)
+                printf("disc: %u errors injected, %u retries\n",
+                       errs_injected, retries);
+        return r;
+}
+
+/* As *PDISCREAD and *PDISCWRITE, a chunk at a time */
+#define IMAGE_CHUNK     0x8000
+#define IMAGE_SIZE      819200                  // An ADFS E floppy
+
+/* Image a made-up floppy to a new host image, as *PDISCREAD does, then
+ * write the image back to a blank "floppy", as *PDISCWRITE does, and check
+ * they match.  The floppy's written to the -o directory, if given.  Our
+ * DiscOps are memcpy()s, so there's nothing for the host's writes to
+ * overlap with here; the Arc's last writes of a chunk are in flight while
+ * it reads the next.
+ */
+int             workload_image(const char *name)
+{
+        uint8_t req[8 + 256] = { 0x00, 0x01 };          // Open, create
+        uint32_t size = IMAGE_SIZE;
+        unsigned int reqs = 0, retries = 0;
+        uint8_t *fd = calloc(1, IMAGE_SIZE);
+        uint8_t *back = calloc(1, IMAGE_SIZE);
+        uint8_t *chunk = malloc(IMAGE_CHUNK);
+        int r = -1;
+
+        // Some files, a formatted-but-empty zone, and free space:
+        for (uint32_t o = 0; o < 100 * 1024; o += 4) {
+                uint32_t w = o * 2654435761u;
+
+                memcpy(&fd[o], &w, 4);
+        }
+        memset(&fd[400 * 1024], 0xe5, 100 * 1024);
+
+        memcpy(&req[4], &size, 4);
+        snprintf((char *)&req[8], 256, "%s", name);
+        if (request(CID_BLOCK, req, 8 + strlen(name) + 1) < 8 ||
+            pkt[0] != 0) {
+                printf("image: can't create '%s'\n", name);
+                goto out;
+        }
+        memcpy(&size, &pkt[4], 4);
+        if (size != IMAGE_SIZE) {
+                printf("image: created %u bytes, not %u\n", size,
+                       IMAGE_SIZE);
+                goto out;
+        }
+
+        uint64_t start = now_ns();
+        for (uint32_t o = 0; o < size; o += IMAGE_CHUNK) {
+                uint32_t n = size - o > IMAGE_CHUNK ? IMAGE_CHUNK : size - o;
+
+                memcpy(chunk, &fd[o], n);               // DiscOp read
+                if (disc_write(o, n, chunk, &retries) < 0) {
+                        printf("image: write failed at 0x%x\n", o);
+                        goto out;
+                }
+        }
+        uint64_t total = now_ns() - start;
+        printf("image: '%s' %u bytes imaged in %.3fs, %.1f KB/s\n", name,
+               size, total / 1e9, size / 1024.0 / (total / 1e9));
+
+        // Each command attaches the image itself, *PDISCWRITE read-only:
+        req[0] = 3;                                     // Close (and sync)
+        if (request(CID_BLOCK, req, 1) < 4 || pkt[0] != 0) {
+                printf("image: close failed\n");
+                goto out;
+        }
+        req[0] = 0;
+        req[1] = 0x02;
+        if (request(CID_BLOCK, req, 8 + strlen(name) + 1) < 8 ||
+            pkt[0] != 0) {
+                printf("image: can't open '%s'\n", name);
+                goto out;
+        }
+
+        start = now_ns();
+        for (uint32_t o = 0; o < size; o += IMAGE_CHUNK) {
+                uint32_t n = size - o > IMAGE_CHUNK ? IMAGE_CHUNK : size - o;
+
+                if (disc_read(o, n, chunk, &reqs, &retries) < 0) {
+                        printf("image: read failed at 0x%x\n", o);
+                        goto out;
+                }
+                memcpy(&back[o], chunk, n);             // DiscOp write
+        }
+        total = now_ns() - start;
+        printf("image: %u bytes written back in %.3fs (%u requests), "
+               "%.1f KB/s\n", size, total / 1e9, reqs,
+               size / 1024.0 / (total / 1e9));
+        print_packed("image");
+        if (memcmp(fd, back, size)) {
+                printf("image: written back disc differs\n");
+                goto out;
+        }
+        if (out_dir) {
+                char path[1024];
+                FILE *out;
+
+                snprintf(path, sizeof(path), "%s/%s", out_dir, name);
+                if ((out = fopen(path, "wb")) != NULL) {
+                        fwrite(fd, 1, size, out);
+                        fclose(out);
+                } else {
+                        perror("- Can't create output file");
+                }
+        }
+        r = 0;
+
+ out:
+        free(fd);
+        free(back);
+        free(chunk);
+        req[0] = 3;                                     // Close (and sync)
+        if (request(CID_BLOCK, req, 1) < 4 || pkt[0] != 0) {
+                printf("image: close failed\n");
+                r = -1;
+        }
+        if (err_every)
+                printf("image: %u errors injected, %u retries\n",
+                       errs_injected, retries);
+        return r;
+}
@@ -0,0 +1,125 @@
+/* Arc-side workloads:  the echo channels
+ *
+ * *PBENCH, as mod_pipe's commands.S runs it (see workload.h).
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "podule_regs.h"
+#include "arc_model.h"
+#include "workload.h"
+
+/* As *PBENCH:  count round trips, then count packets each way, of each
+ * size, on the server's echo channels (sink and source in the bulk class).
+ * With -e, packets from the host can be lost, so a source that comes up
+ * short is only reported.
+ */
+int             workload_pbench(unsigned int count)
+{
+        static const unsigned int sizes[] = { 1, 16, 64, 128, 256, 512 };
+        uint64_t *lat = calloc(count, sizeof(uint64_t));
+        uint8_t out[PR_RX_TX_BUFSZ];
+        unsigned int cid, size = 0;
+        char what[32];
+
+        for (unsigned int i = 1; i < sizeof(out); i++)
+                out[i] = 32 + (i - 1) % 96;
+
+        for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                uint64_t t, start;
+
+                size = sizes[s];
+
+                if (size > max_pkt)
+                        break;
+
+                out[0] = CID_ECHO_ECHO;
+                for (unsigned int i = 0; i < count; i++) {
+                        int len;
+
+                        t = now_ns();
+                        len = request(CID_ECHO, out, size);
+                        // (With -e, it can be a late one of a resend)
+                        if (len < 0 || (len != (int)size && !err_every))
+                                goto fail;
+                        lat[i] = now_ns() - t;
+                }
+                snprintf(what, sizeof(what), "pbench echo %u", size);
+                print_latency(what, lat, count);
+
+                out[0] = CID_ECHO_SINK;
+                start = now_ns();
+                for (unsigned int i = 0; i < count; i++)
+                        if (arc_packet_tx(CID_ECHO_BULK, out, size,
+                                          timeout_ms) < 0)
+                                goto fail;
+                out[0] = CID_ECHO_ECHO;
+                if (request(CID_ECHO_BULK, out, 1) < 0)
+                        goto fail;
+                t = now_ns() - start;
+                printf("pbench sink %u: %u bytes in %.3fs, %.0f KB/s\n",
+                       size, count * size, t / 1e9,
+                       count * size / (t / 1e9) / 1024);
+
+                uint32_t req[3] = { CID_ECHO_SOURCE, count, size };
+                unsigned int got = 0;
+
+                start = now_ns();
+                if (arc_packet_tx(CID_ECHO_BULK, (uint8_t *)req,
+                                  sizeof(req), timeout_ms) < 0)
+                        goto fail;
+                while (got < count) {
+                        int len = arc_packet_rx(pkt, &cid, err_every ?
+                                                RETRY_MS * 10 : timeout_ms);
+
+                        if (len < 0)
+                                break;
+                        if (cid == CID_ECHO_BULK && len == (int)size)
+                                got++;
+                }
+                t = now_ns() - start;
+                printf("pbench source %u: %u bytes in %.3fs, %.0f KB/s",
+                       size, got * size, t / 1e9,
+                       got * size / (t / 1e9) / 1024);
+                if (got < count) {
+                        printf(" (%u lost)\n", count - got);
+                        if (!err_every)
+                                goto fail;
+                } else {
+                        printf("\n");
+                }
+        }
+        free(lat);
+        return 0;
+fail:
+        printf("pbench: failed at size %u\n", size);
+        free(lat);
+        return -1;
+}
@@ -0,0 +1,486 @@
+/* Arc-side workloads:  the filing system channel
+ *
+ * The Pipe filing system, after mod_pipe's fs.S, and *PLOAD on top of it
+ * (see workload.h).
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "podule_regs.h"
+#include "arc_model.h"
+#include "workload.h"
+
+/* As mod_pipe's filing system (fs.S), which keeps catalogue info for
+ * FS_LEASE_MS, and forgets it all when it changes something
+ */
+#define FS_CACHE_N      16
+#define FS_LEASE_MS     2000
+#define FS_FILE_SIZE    (200 * 1024 + 123)
+#define FS_BUFFER       1024
+
+struct fs_info {
+        uint32_t        type, load, exec, length, attr;
+};
+
+static struct {
+        uint64_t        expiry;                 // 0 if unused
+        char            name[40];
+        struct fs_info  info;
+} fs_cache[FS_CACHE_N];
+static unsigned int fs_cache_next, fs_hits, fs_reqs;
+
+static void     fs_cache_flush(void)
+{
+        for (unsigned int i = 0; i < FS_CACHE_N; i++)
+                fs_cache[i].expiry = 0;
+}
+
+/* Keep name's info, or with leaf that of leaf in directory name */
+static void     fs_cache_add(const char *name, const char *leaf,
+                             const struct fs_info *fi)
+{
+        unsigned int i = fs_cache_next;
+        int n;
+
+        fs_cache_next = (fs_cache_next + 1) % FS_CACHE_N;
+        fs_cache[i].expiry = 0;
+        n = snprintf(fs_cache[i].name, sizeof(fs_cache[i].name), "%s%s%s",
+                     name, leaf && *name ? "." : "", leaf ? leaf : "");
+        if (n >= (int)sizeof(fs_cache[i].name))
+                return;                                 // Too long to keep
+        fs_cache[i].info = *fi;
+        fs_cache[i].expiry = now_ns() + FS_LEASE_MS * 1000000ULL;
+}
+
+static struct fs_info *fs_cache_find(const char *name)
+{
+        uint64_t now = now_ns();
+
+        for (unsigned int i = 0; i < FS_CACHE_N; i++) {
+                if (fs_cache[i].expiry > now && !strcmp(fs_cache[i].name, name))
+                        return &fs_cache[i].info;
+        }
+        return NULL;
+}
+
+/* Send hdr, then name and name2 (if given) zero-terminated.  Returns the
+ * response's length (in pkt), or -1.
+ */
+static int      fs_request(const void *hdr, unsigned int hlen, const char *name,
+                           const char *name2)
+{
+        uint8_t req[PR_RX_TX_BUFSZ];
+        unsigned int len = hlen;
+
+        memcpy(req, hdr, hlen);
+        for (const char *n = name; n; n = (n == name) ? name2 : NULL) {
+                if (len + strlen(n) + 1 > max_pkt)
+                        return -1;
+                strcpy((char *)&req[len], n);
+                len += strlen(n) + 1;
+        }
+        fs_reqs++;
+        return request(CID_FS, req, len);
+}
+
+/* STAT or DELETE (op) name.  Returns the host's status, or -1. */
+static int      fs_info_request(uint8_t op, const char *name,
+                                struct fs_info *fi)
+{
+        uint8_t hdr[4] = { op };
+        uint32_t w[4];
+
+        if (fs_request(hdr, 4, name, NULL) < 20)
+                return -1;
+        memcpy(w, &pkt[4], 16);
+        fi->type = pkt[1];
+        fi->load = w[0];
+        fi->exec = w[1];
+        fi->length = w[2];
+        fi->attr = w[3];
+        return pkt[0];
+}
+
+/* As FSEntry_File 5 */
+static int      fs_stat(const char *name, struct fs_info *fi)
+{
+        struct fs_info *c = fs_cache_find(name);
+        int r;
+
+        if (c) {
+                *fi = *c;
+                fs_hits++;
+                return 0;
+        }
+        if ((r = fs_info_request(0, name, fi)) == 0)
+                fs_cache_add(name, NULL, fi);
+        return r;
+}
+
+/* As FSEntry_Open (mode 0 read, 1 create, 2 update).  Returns the handle,
+ * 0 if it's not a file, or -1.
+ */
+static int      fs_open(unsigned int mode, const char *name, struct fs_info *fi)
+{
+        uint8_t hdr[4] = { 1, mode };
+        uint32_t w[5];
+
+        if (mode)
+                fs_cache_flush();
+        if (fs_request(hdr, 4, name, NULL) < 24 || pkt[0])
+                return -1;
+        memcpy(w, &pkt[4], 20);
+        fi->type = pkt[1];
+        fi->load = w[0];
+        fi->exec = w[1];
+        fi->length = w[2];
+        fi->attr = w[3];
+        return w[4];
+}
+
+/* FSEntry_GetBytes/PutBytes, or a whole load or save:  block_xfer, as
+ * fs.S's fs_xfer uses it
+ */
+static int      fs_xfer(bool write, unsigned int h, uint32_t offset,
+                        uint32_t len, uint8_t *buf, unsigned int *reqs,
+                        unsigned int *retries)
+{
+        int r;
+
+        xfer_cid = CID_FS;
+        xfer_read_op = (h << 8) | 2;
+        xfer_write_op = (h << 8) | 3;
+        r = write ? disc_write(offset, len, buf, retries) :
+                disc_read(offset, len, buf, reqs, retries);
+        xfer_cid = CID_BLOCK;
+        xfer_read_op = 1;
+        xfer_write_op = 2;
+        return r;
+}
+
+/* Returns the host's status, or -1 */
+static int      fs_close(unsigned int h, uint32_t load, uint32_t exec)
+{
+        uint32_t req[3] = { (h << 8) | 4, load, exec };
+
+        fs_cache_flush();
+        return fs_request(req, 12, NULL, NULL) < 4 ? -1 : pkt[0];
+}
+
+/* FSEntry_Args reason on handle h:  returns the host's status, or -1, with
+ * its results in *a and *b
+ */
+static int      fs_args(unsigned int h, unsigned int reason, uint32_t *a,
+                        uint32_t *b)
+{
+        uint32_t req[3] = { (reason << 16) | (h << 8) | 5, *a, *b };
+
+        if (reason != 4 && reason != 9)
+                fs_cache_flush();
+        if (fs_request(req, 12, NULL, NULL) < 12)
+                return -1;
+        memcpy(a, &pkt[4], 4);
+        memcpy(b, &pkt[8], 4);
+        return pkt[0];
+}
+
+/* FSEntry_Func 15 of directory name, all of it, caching each entry.
+ * Returns the number of entries, or -1.
+ */
+static int      fs_read_dir(const char *name, char leaves[][64],
+                            unsigned int max)
+{
+        uint32_t req[2] = { 6, 0 };
+        unsigned int n = 0;
+
+        fs_cache_flush();       // (As the Filer would find it)
+        do {
+                int len = fs_request(req, 8, name, NULL);
+                unsigned int pos = 8;
+
+                if (len < 8 || pkt[0])
+                        return -1;
+                for (unsigned int i = 0; i < pkt[1]; i++) {
+                        struct fs_info fi;
+                        uint32_t w[5];
+                        const char *leaf = (char *)&pkt[pos + 20];
+
+                        memcpy(w, &pkt[pos], 20);
+                        fi.load = w[0];
+                        fi.exec = w[1];
+                        fi.length = w[2];
+                        fi.attr = w[3];
+                        fi.type = w[4];
+                        fs_cache_add(name, leaf, &fi);
+                        if (n < max)
+                                snprintf(leaves[n++], 64, "%s", leaf);
+                        pos += (20 + strlen(leaf) + 1 + 3) & ~3;
+                }
+                memcpy(&req[1], &pkt[4], 4);
+        } while (req[1]);
+        return n;
+}
+
+/* A session on the Pipe filing system, in directory DIR (made if need be):
+ * save a typed file and an untyped one, open a Filer window on the
+ * directory (a listing, then catalogue info for each file), load one back
+ * and read a buffer of it, change the other's extent with FSEntry_Args,
+ * then its access and type, then rename it and delete it.  The typed file
+ * stays on the host, and goes in the -o directory too, to compare.
+ */
+int             workload_fs(const char *dir)
+{
+        char top[256], text[300], prog[300], prog2[300];
+        uint8_t *data = malloc(FS_FILE_SIZE), *back = malloc(FS_FILE_SIZE);
+        unsigned int reqs = 0, retries = 0;
+        char leaves[16][64];
+        struct fs_info fi;
+        uint32_t a, b;
+        int h, n, r = -1;
+
+        snprintf(top, sizeof(top), "$.%s", dir);
+        snprintf(text, sizeof(text), "%s.Text", top);
+        snprintf(prog, sizeof(prog), "%s.Prog", top);
+        snprintf(prog2, sizeof(prog2), "%s.Prog2", top);
+        for (uint32_t i = 0; i < FS_FILE_SIZE; i++)
+                data[i] = i * 7 + (i >> 9);
+        fs_reqs = fs_hits = 0;
+
+        // *CDir:  FSEntry_File 8
+        uint32_t cdir[4] = { (2 << 8) | 9, 0, 0, 0 };
+        fs_cache_flush();
+        if (fs_request(cdir, 16, top, NULL) < 4 || pkt[0]) {
+                printf("fs: can't create '%s'\n", top);
+                goto out;
+        }
+
+        // *Save:  FSEntry_File 0, which is open, write, close with a stamp
+        uint64_t start = now_ns();
+        if ((h = fs_open(1, text, &fi)) <= 0 ||
+            fs_xfer(true, h, 0, FS_FILE_SIZE, data, &reqs, &retries) < 0 ||
+            fs_close(h, 0xffffff33, 0x12345678) < 0) {
+                printf("fs: save of '%s' failed\n", text);
+                goto out;
+        }
+        uint64_t total = now_ns() - start;
+        printf("fs: saved %u bytes in %.3fs, %.1f KB/s\n", FS_FILE_SIZE,
+               total / 1e9, FS_FILE_SIZE / 1024.0 / (total / 1e9));
+        if ((h = fs_open(1, prog, &fi)) <= 0 ||
+            fs_xfer(true, h, 0, 1000, data, &reqs, &retries) < 0 ||
+            fs_close(h, 0x8000, 0x8000) < 0) {
+                printf("fs: save of '%s' failed\n", prog);
+                goto out;
+        }
+
+        // A Filer window:  the listing, then each file's info (cached)
+        if ((n = fs_read_dir(top, leaves, 16)) < 2) {
+                printf("fs: listing '%s' failed (%d)\n", top, n);
+                goto out;
+        }
+        for (int i = 0; i < n; i++) {
+                char name[sizeof(top) + sizeof(leaves[0])];
+
+                snprintf(name, sizeof(name), "%s.%.63s", top, leaves[i]);
+                if (fs_stat(name, &fi) || fi.type == 0) {
+                        printf("fs: '%s' listed but not found\n", name);
+                        goto out;
+                }
+        }
+        // (The host keeps the stamp to the second)
+        if (fs_stat(text, &fi) || fi.type != 1 || fi.length != FS_FILE_SIZE ||
+            fi.load != 0xffffff33 || 0x12345678 - fi.exec >= 100) {
+                printf("fs: '%s' has type %u length %u load 0x%x exec "
+                       "0x%x\n", text, fi.type, fi.length, fi.load, fi.exec);
+                goto out;
+        }
+
+        // *Load:  FSEntry_File 255 (after File 5, as FileSwitch does)
+        start = now_ns();
+        reqs = 0;
+        if ((h = fs_open(0, text, &fi)) <= 0 ||
+            fs_xfer(false, h, 0, fi.length, back, &reqs, &retries) < 0 ||
+            fs_close(h, 0, 0) < 0 || memcmp(data, back, FS_FILE_SIZE)) {
+                printf("fs: load of '%s' failed\n", text);
+                goto out;
+        }
+        total = now_ns() - start;
+        printf("fs: loaded %u bytes in %.3fs (%u requests), %.1f KB/s\n",
+               FS_FILE_SIZE, total / 1e9, reqs,
+               FS_FILE_SIZE / 1024.0 / (total / 1e9));
+        print_packed("fs");
+
+        // OS_GBPB on an open file:  FileSwitch fills a buffer at a time
+        if ((h = fs_open(0, text, &fi)) <= 0 ||
+            fs_xfer(false, h, 4 * FS_BUFFER, FS_BUFFER, back, &reqs,
+                    &retries) < 0 ||
+            fs_close(h, 0, 0) < 0 ||
+            memcmp(&data[4 * FS_BUFFER], back, FS_BUFFER)) {
+                printf("fs: buffered read of '%s' failed\n", text);
+                goto out;
+        }
+
+        // The extent, by FSEntry_Args
+        uint32_t want[5][3] = {
+                { 4, 0, 1000 },                 // Read size
+                { 3, 600, 600 },                // Set extent
+                { 7, 2000, 2000 },              // Ensure size
+                { 8, 1900, 1900 + 100 },        // Write zeroes (to 2000)
+                { 9, 0, 0x8000 },               // Read load (and exec)
+        };
+        if ((h = fs_open(2, prog, &fi)) <= 0) {
+                printf("fs: can't open '%s' for update\n", prog);
+                goto out;
+        }
+        for (unsigned int i = 0; i < 5; i++) {
+                a = want[i][1];
+                b = 100;
+                if (fs_args(h, want[i][0], &a, &b) != 0 || a != want[i][2]) {
+                        printf("fs: args %u gave 0x%x\n", want[i][0], a);
+                        goto out;
+                }
+        }
+        if (fs_close(h, 0, 0) < 0 || fs_stat(prog, &fi) || fi.length != 2000) {
+                printf("fs: '%s' is %u bytes, not 2000\n", prog, fi.length);
+                goto out;
+        }
+
+        // *Access, then *SetType (FSEntry_File 4, then 2)
+        uint32_t wi[4] = { (4 << 8) | 7, 0, 0, 0x03 };
+        fs_cache_flush();
+        if (fs_request(wi, 16, prog, NULL) < 4 || pkt[0]) {
+                printf("fs: *Access of '%s' failed\n", prog);
+                goto out;
+        }
+        wi[0] = (1 << 8) | 7;
+        wi[1] = 0xfffffa00;
+        if (fs_request(wi, 16, prog, NULL) < 4 || pkt[0] ||
+            fs_stat(prog, &fi) || (fi.load >> 8) != 0xfffffa ||
+            fi.attr != 0x03) {
+                printf("fs: '%s' has load 0x%x attributes 0x%x\n", prog,
+                       fi.load, fi.attr);
+                goto out;
+        }
+
+        // *Rename (FSEntry_Func 8), then *Delete (FSEntry_File 6)
+        uint32_t rn = 10;
+        fs_cache_flush();
+        fs_request(&rn, 4, prog, prog2);                // Checked below
+        if (fs_stat(prog, &fi) || fi.type != 0 ||
+            fs_stat(prog2, &fi) || fi.type != 1) {
+                printf("fs: rename of '%s' failed\n", prog);
+                goto out;
+        }
+        fs_cache_flush();
+        fs_info_request(8, prog2, &fi);
+        if (fs_stat(prog2, &fi) || fi.type != 0) {
+                printf("fs: delete of '%s' failed\n", prog2);
+                goto out;
+        }
+
+        printf("fs: %u requests, %u cache hits\n", fs_reqs, fs_hits);
+        if (out_dir) {
+                char path[1024];
+                FILE *out;
+
+                snprintf(path, sizeof(path), "%s/Text", out_dir);
+                if ((out = fopen(path, "wb")) != NULL) {
+                        fwrite(data, 1, FS_FILE_SIZE, out);
+                        fclose(out);
+                } else {
+                        perror("- Can't create output file");
+                }
+        }
+        r = 0;
+
+ out:
+        free(data);
+        free(back);
+        if (err_every)
+                printf("fs: %u errors injected, %u retries\n", errs_injected,
+                       retries);
+        return r;
+}
+
+/* *PLOAD (and *PRUN):  a file on the FS channel, read straight into memory.
+ * NAME is as Pipe: sees it; the memory is written out as its leaf.
+ */
+int             workload_pload(const char *name)
+{
+        unsigned int reqs = 0, retries = 0;
+        struct fs_info fi;
+        uint8_t *mem;
+        int h, r = -1;
+
+        fs_reqs = fs_hits = 0;
+        uint64_t start = now_ns();
+        if ((h = fs_open(0, name, &fi)) <= 0) {
+                printf("pload: can't open '%s'\n", name);
+                return -1;
+        }
+        if ((mem = malloc(fi.length ? fi.length : 1)) == NULL) {
+                fs_close(h, 0, 0);
+                return -1;
+        }
+        if (fs_xfer(false, h, 0, fi.length, mem, &reqs, &retries) < 0 ||
+            fs_close(h, 0, 0) < 0) {
+                printf("pload: read of '%s' failed\n", name);
+                goto out;
+        }
+        uint64_t total = now_ns() - start;
+        printf("pload: '%s' %u bytes in %.3fs (%u requests), %.1f KB/s\n",
+               name, fi.length, total / 1e9, fs_reqs + reqs,
+               fi.length / 1024.0 / (total / 1e9));
+
+        if (out_dir) {
+                const char *leaf = strrchr(name, '.');
+                char path[1024];
+                FILE *out;
+
+                snprintf(path, sizeof(path), "%s/%s", out_dir,
+                         leaf ? leaf + 1 : name);
+                if ((out = fopen(path, "wb")) != NULL) {
+                        fwrite(mem, 1, fi.length, out);
+                        fclose(out);
+                } else {
+                        perror("- Can't create output file");
+                }
+        }
+        r = 0;
+
+ out:
+        free(mem);
+        if (err_every)
+                printf("pload: %u errors injected, %u retries\n",
+                       errs_injected, retries);
+        return r;
+}
@@ -0,0 +1,793 @@
+/* Arc-side workloads:  the rawfile and directory channels
+ *
+ * Copies each way, listings and tree copies, modelled on mod_pipe's
+ * *PCPL, *PCPR, *PCAT, *PCPLR and *PSYNC (see workload.h).
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "podule_interface.h"
+#include "podule_regs.h"
+#include "arc_model.h"
+#include "workload.h"
+
+#define SYNC_BLOCK              512     // As mod_pipe's PSYNC_*
+#define SYNC_MAX                32
+#define SYNC_MIN                1024
+
+/* Ask for block b, of bmax bytes from start (tagged with its offset if
+ * depth) up to end, of the open file or (if not NO_ENTRY) of a manifest
+ * entry
+ */
+#define NO_ENTRY        0xffffffff
+
+static int      pcpl_request(unsigned int b, unsigned int bmax, uint32_t start,
+                             uint32_t end, uint32_t entry)
+{
+        uint32_t offset = start + b * bmax;
+        uint32_t bsz = end - offset > bmax ? bmax : end - offset;
+        uint8_t req[TAG_SIZE + 16] = { 0 };
+        uint8_t *r = req;
+        unsigned int rcid = CID_RAWFILE;
+
+        if (depth) {
+                memcpy(req, &offset, TAG_SIZE);
+                r += TAG_SIZE;
+                rcid |= CID_F_TAGGED;
+        }
+        r[0] = entry == NO_ENTRY ? 1 : 6;       // ReadBlock, ReadEntry
+        memcpy(&r[4], &offset, 4);
+        memcpy(&r[8], &bsz, 4);
+        memcpy(&r[12], &entry, 4);
+
+        return arc_packet_tx(rcid, req, r - req + 16, timeout_ms);
+}
+
+/* As *PCPL does: InitiateRead, ReadBlock until done, Close. */
+int             workload_pcpl(const char *name)
+{
+        unsigned int cid;
+        int len;
+
+        memset(pkt, 0, 257);
+        pkt[0] = 0;                                     // InitiateRead
+        strncpy((char *)&pkt[1], name, 255);
+
+        uint64_t start = now_ns();
+        if (request(CID_RAWFILE, pkt, 257) < 16) {
+                printf("pcpl: no response to open\n");
+                return -1;
+        }
+        if (pkt[0] != 0) {
+                printf("pcpl: can't open '%s', error %d\n", name, pkt[0]);
+                return -1;
+        }
+        uint32_t size = pkt[4] | (pkt[5] << 8) | (pkt[6] << 16) |
+                ((uint32_t)pkt[7] << 24);
+
+        // As the Arc would, write the data to a "local" file:
+        FILE *out = NULL;
+        if (out_dir) {
+                char path[1024];
+                snprintf(path, sizeof(path), "%s/%s", out_dir, name);
+                out = fopen(path, "wb");
+                if (!out)
+                        perror("- Can't create output file");
+        }
+
+        /* Tagged, up to depth blocks are requested at once, each tagged with
+         * its offset; the response's tag says where its data goes.  The tag
+         * takes 4 bytes of the packet.
+         */
+        unsigned int bmax = depth ? max_pkt - TAG_SIZE : max_pkt;
+        unsigned int nblocks = (size + bmax - 1) / bmax;
+        uint64_t *lat = calloc(nblocks ? nblocks : 1, sizeof(uint64_t));
+        uint64_t *sent = calloc(nblocks ? nblocks : 1, sizeof(uint64_t));
+        bool *got = calloc(nblocks ? nblocks : 1, sizeof(bool));
+        unsigned int next = 0, done = 0;
+        // Pings sent during the copy, as an interactive channel would:
+        uint64_t *plat = calloc(ping_every ? nblocks / ping_every + 1 : 1,
+                                sizeof(uint64_t));
+        unsigned int pings = 0;
+        uint64_t ping_sent = 0;
+        /* With -e, a request or response can be lost (its frame dropped),
+         * so tagged blocks not back in RETRY_MS are asked for again.
+         */
+        bool retry = err_every && depth;
+        unsigned int retries = 0;
+        uint64_t progress = now_ns();
+
+        while (done < nblocks) {
+                while (next < nblocks && next - done < (depth ? depth : 1)) {
+                        sent[next] = now_ns();
+                        if (pcpl_request(next, bmax, 0, size, NO_ENTRY) < 0)
+                                goto timeout;
+                        next++;
+
+                        if (ping_every && !ping_sent && next % ping_every == 0) {
+                                uint8_t preq = 0;
+
+                                ping_sent = now_ns();
+                                if (arc_packet_tx(CID_HOSTINFO, &preq, 1,
+                                                  timeout_ms) < 0)
+                                        goto timeout;
+                        }
+                }
+
+                if ((len = arc_packet_rx(pkt, &cid, retry ? RETRY_MS :
+                                         timeout_ms)) < 0) {
+                        if (!retry ||
+                            now_ns() - progress > timeout_ms * 1000000ULL)
+                                goto timeout;
+                        for (unsigned int b = 0; b < next; b++) {
+                                if (!got[b] &&
+                                    pcpl_request(b, bmax, 0, size, NO_ENTRY) < 0)
+                                        goto timeout;
+                        }
+                        ping_sent = 0;
+                        retries++;
+                        continue;
+                }
+                if (cid == CID_HOSTINFO) {
+                        // A ping given up on by a retry is ignored
+                        if (ping_sent)
+                                plat[pings++] = now_ns() - ping_sent;
+                        ping_sent = 0;
+                        continue;
+                }
+
+                uint8_t *data = pkt;
+                uint32_t offset = done * bmax;          // Untagged: in order
+                if (depth) {
+                        if (cid != (CID_RAWFILE | CID_F_TAGGED) ||
+                            len < TAG_SIZE) {
+                                printf("pcpl: unexpected CID%u len %d\n",
+                                       cid, len);
+                                goto timeout;
+                        }
+                        memcpy(&offset, pkt, TAG_SIZE);
+                        data += TAG_SIZE;
+                        len -= TAG_SIZE;
+                }
+
+                unsigned int b = offset / bmax;
+                uint32_t bsz = size - offset > bmax ? bmax : size - offset;
+                if (b >= next || offset % bmax) {
+                        printf("pcpl: bad tag 0x%x\n", offset);
+                        goto timeout;
+                }
+                if (got[b])
+                        continue;               // Asked for twice
+                got[b] = true;
+                lat[b] = now_ns() - sent[b];
+                len = unpack_block(data, len, bsz);
+                if (len != bsz)
+                        printf("pcpl: block %u: expected %u bytes, got %d\n",
+                               b, bsz, len);
+                if (out) {
+                        fseek(out, offset, SEEK_SET);
+                        fwrite(data, 1, len, out);
+                }
+                done++;
+                progress = now_ns();
+        }
+        free(got);
+        free(sent);
+        if (ping_sent && arc_packet_rx(pkt, &cid, timeout_ms) >= 0)
+                plat[pings++] = now_ns() - ping_sent;
+
+        uint8_t req = 4;                                // Close
+        arc_packet_tx(CID_RAWFILE, &req, 1, timeout_ms);
+        uint64_t total = now_ns() - start;
+        if (out)
+                fclose(out);
+
+        printf("pcpl: '%s' %u bytes in %.3fs, %.1f KB/s\n",
+               name, size, total / 1e9, size / 1024.0 / (total / 1e9));
+        print_latency("pcpl block", lat, nblocks);
+        print_latency("pcpl ping", plat, pings);
+        print_packed("pcpl");
+        if (err_every) {
+                volatile uint8_t *r = podule_if_get_regs();
+
+                printf("pcpl: %u errors injected, %u retries, firmware saw "
+                       "%u bad frames, %u resyncs\n", errs_injected, retries,
+                       r[PR_LINK_BAD], r[PR_LINK_RESYNC]);
+        }
+        free(lat);
+        free(plat);
+        return 0;
+
+ timeout:
+        printf("pcpl: failed at block %u\n", done);
+        if (out)
+                fclose(out);
+        free(got);
+        free(sent);
+        free(lat);
+        free(plat);
+        return -1;
+}
+
+/* Send written block b, of bmax bytes (tagged with its offset if depth) */
+static int      pcpr_send(unsigned int b, unsigned int bmax, const uint8_t *file,
+                          uint32_t size)
+{
+        uint32_t offset = b * bmax;
+        uint32_t bsz = size - offset > bmax ? bmax : size - offset;
+        uint8_t req[PR_RX_TX_BUFSZ] = { 0 };
+        uint8_t *r = req;
+        unsigned int rcid = CID_RAWFILE;
+
+        if (depth) {
+                memcpy(req, &offset, TAG_SIZE);
+                r += TAG_SIZE;
+                rcid |= CID_F_TAGGED;
+        }
+        r[0] = 3;                       // WriteBlock
+        memcpy(&r[4], &offset, 4);
+        memcpy(&r[8], &file[offset], bsz);
+
+        return arc_packet_tx(rcid, req, r - req + 8 + bsz, timeout_ms);
+}
+
+/* As *PCPR does: InitiateWrite, WriteBlock until done, Commit.  The file
+ * is read from the -o directory (or the current one), and given type FFD.
+ */
+int             workload_pcpr(const char *arg)
+{
+        char local[1024], name[256];
+        const char *c = strchr(arg, ':');
+        const char *le = c ? strchr(c + 1, ':') : NULL;
+        unsigned int cid;
+        int len;
+
+        // NAME[:HOSTNAME[:LOAD:EXEC]]
+        snprintf(name, sizeof(name), "%.*s", le ? (int)(le - c - 1) : 255,
+                 c ? c + 1 : arg);
+        snprintf(local, sizeof(local), "%s/%.*s", out_dir ? out_dir : ".",
+                 c ? (int)(c - arg) : (int)strlen(arg), arg);
+
+        FILE *in = fopen(local, "rb");
+        if (!in) {
+                perror("- Can't open input file");
+                return -1;
+        }
+        fseek(in, 0, SEEK_END);
+        uint32_t size = ftell(in);
+        fseek(in, 0, SEEK_SET);
+        uint8_t *file = malloc(size ? size : 1);
+        if (fread(file, 1, size, in) != size) {
+                printf("pcpr: can't read '%s'\n", local);
+                fclose(in);
+                free(file);
+                return -1;
+        }
+        fclose(in);
+
+        uint64_t at = ((uint64_t)time(NULL) + 2208988800ULL) * 100;
+        uint32_t w[3] = { 2,                            // InitiateWrite
+                          0xfff00000 | (0xffd << 8) | (uint32_t)(at >> 32),
+                          (uint32_t)at };
+
+        if (le) {                                       // Untyped
+                char *e;
+
+                w[1] = strtoul(le + 1, &e, 16);
+                w[2] = *e == ':' ? strtoul(e + 1, NULL, 16) : 0;
+        }
+
+        memset(pkt, 0, 12 + 256);
+        memcpy(pkt, w, 12);
+        snprintf((char *)&pkt[12], 256, "%s", name);
+
+        uint64_t start = now_ns();
+        if (request(CID_RAWFILE, pkt, 12 + 256) < 4 || pkt[0] != 0) {
+                printf("pcpr: can't create '%s'\n", name);
+                free(file);
+                return -1;
+        }
+
+        /* As pcpl, up to depth blocks are in flight, tagged with their
+         * offsets; each is acknowledged.
+         */
+        unsigned int bmax = (depth ? max_pkt - TAG_SIZE : max_pkt) - 8;
+        unsigned int nblocks = (size + bmax - 1) / bmax;
+        uint64_t *lat = calloc(nblocks ? nblocks : 1, sizeof(uint64_t));
+        uint64_t *sent = calloc(nblocks ? nblocks : 1, sizeof(uint64_t));
+        bool *got = calloc(nblocks ? nblocks : 1, sizeof(bool));
+        unsigned int next = 0, done = 0;
+        bool retry = err_every && depth;
+        unsigned int retries = 0;
+        uint64_t progress = now_ns();
+
+        while (done < nblocks) {
+                while (next < nblocks && next - done < (depth ? depth : 1)) {
+                        sent[next] = now_ns();
+                        if (pcpr_send(next, bmax, file, size) < 0)
+                                goto fail;
+                        next++;
+                }
+
+                if ((len = arc_packet_rx(pkt, &cid, retry ? RETRY_MS :
+                                         timeout_ms)) < 0) {
+                        if (!retry ||
+                            now_ns() - progress > timeout_ms * 1000000ULL)
+                                goto fail;
+                        for (unsigned int b = 0; b < next; b++) {
+                                if (!got[b] &&
+                                    pcpr_send(b, bmax, file, size) < 0)
+                                        goto fail;
+                        }
+                        retries++;
+                        continue;
+                }
+                if ((cid & ~CID_F_TAGGED) != CID_RAWFILE)
+                        continue;               // E.g. a late ping
+
+                uint8_t *data = pkt;
+                uint32_t offset = done * bmax;
+                if (depth) {
+                        memcpy(&offset, pkt, TAG_SIZE);
+                        data += TAG_SIZE;
+                        len -= TAG_SIZE;
+                }
+                unsigned int b = offset / bmax;
+                if (len < 4 || b >= next || offset % bmax) {
+                        printf("pcpr: bad response, tag 0x%x\n", offset);
+                        goto fail;
+                }
+                if (data[0] != 0) {
+                        printf("pcpr: write error %d\n", data[0]);
+                        goto fail;
+                }
+                if (got[b])
+                        continue;
+                got[b] = true;
+                lat[b] = now_ns() - sent[b];
+                done++;
+                progress = now_ns();
+        }
+
+        /* The server syncs the file before replying, which can take a
+         * while; a resent Commit doesn't get a second reply.
+         */
+        uint8_t req = 5;                                // Commit
+        int r = -1;
+        for (unsigned int i = 0; i < 10 && r < 0; i++)
+                r = request(CID_RAWFILE, &req, 1);
+        if (r < 4 || pkt[0] != 0) {
+                printf("pcpr: commit failed (%d)\n", pkt[0]);
+                goto fail;
+        }
+        uint64_t total = now_ns() - start;
+
+        printf("pcpr: '%s' %u bytes in %.3fs, %.1f KB/s\n",
+               name, size, total / 1e9, size / 1024.0 / (total / 1e9));
+        print_latency("pcpr block", lat, nblocks);
+        if (err_every)
+                printf("pcpr: %u errors injected, %u retries\n",
+                       errs_injected, retries);
+        free(got);
+        free(sent);
+        free(lat);
+        free(file);
+        return 0;
+
+ fail:
+        printf("pcpr: failed at block %u\n", done);
+        req = 4;                                        // Close (abandon)
+        arc_packet_tx(CID_RAWFILE, &req, 1, timeout_ms);
+        free(got);
+        free(sent);
+        free(lat);
+        free(file);
+        return -1;
+}
+
+/* As *PCAT does: ReadDir until the cookie comes back 0 */
+int             workload_cat(const char *dir)
+{
+        uint32_t cookie = 0;
+        unsigned int entries = 0, reqs = 0;
+        uint64_t start = now_ns();
+
+        do {
+                uint8_t req[8 + 256] = { 0 };           // ReadDir
+                int len;
+
+                memcpy(&req[4], &cookie, 4);
+                strncpy((char *)&req[8], dir, 255);
+                len = request(CID_DIR, req, 8 + strlen((char *)&req[8]) + 1);
+                reqs++;
+                if (len < 8 || pkt[0] != 0) {
+                        printf("cat: can't list '%s' (%d)\n", dir,
+                               len < 8 ? -1 : pkt[0]);
+                        return -1;
+                }
+                memcpy(&cookie, &pkt[4], 4);
+
+                unsigned int pos = 8;
+                for (unsigned int i = 0; i < pkt[1] && pos + 14 <= len; i++) {
+                        uint32_t w[3];
+                        const char *name = (const char *)&pkt[pos + 13];
+
+                        memcpy(w, &pkt[pos], 12);
+                        if (pkt[pos + 12] == 2)
+                                printf("  %-20s <dir>\n", name);
+                        else if ((w[0] >> 20) == 0xfff)
+                                printf("  %-20s %03x %17u\n", name,
+                                       (w[0] >> 8) & 0xfff, w[2]);
+                        else
+                                printf("  %-20s %08x %08x %u\n", name,
+                                       w[0], w[1], w[2]);
+                        pos += (13 + strlen(name) + 1 + 3) & ~3;
+                        entries++;
+                }
+        } while (cookie != 0);
+
+        uint64_t total = now_ns() - start;
+        printf("cat: '%s' %u entries in %u requests, %.3fs\n", dir, entries,
+               reqs, total / 1e9);
+        return 0;
+}
+
+/* Fetch bytes start to end of manifest entry index into out (if not NULL),
+ * as pcpl's loop without the pings
+ */
+static int      pcplr_fetch(uint32_t index, uint32_t start, uint32_t end,
+                            FILE *out, unsigned int *retries)
+{
+        unsigned int bmax = depth ? max_pkt - TAG_SIZE : max_pkt;
+        unsigned int nblocks = (end - start + bmax - 1) / bmax;
+        bool *got = calloc(nblocks ? nblocks : 1, sizeof(bool));
+        unsigned int next = 0, done = 0, cid;
+        bool retry = err_every && depth;
+        uint64_t progress = now_ns();
+        int len;
+
+        while (done < nblocks) {
+                while (next < nblocks && next - done < (depth ? depth : 1)) {
+                        if (pcpl_request(next, bmax, start, end, index) < 0)
+                                goto fail;
+                        next++;
+                }
+                if ((len = arc_packet_rx(pkt, &cid, retry ? RETRY_MS :
+                                         timeout_ms)) < 0) {
+                        if (!retry ||
+                            now_ns() - progress > timeout_ms * 1000000ULL)
+                                goto fail;
+                        for (unsigned int b = 0; b < next; b++) {
+                                if (!got[b] &&
+                                    pcpl_request(b, bmax, start, end,
+                                                 index) < 0)
+                                        goto fail;
+                        }
+                        (*retries)++;
+                        continue;
+                }
+                if ((cid & ~CID_F_TAGGED) != CID_RAWFILE)
+                        continue;               // E.g. a late manifest
+
+                uint8_t *data = pkt;
+                uint32_t offset = start + done * bmax;
+                if (depth) {
+                        if (cid != (CID_RAWFILE | CID_F_TAGGED))
+                                continue;       // E.g. a late SumBlocks
+                        memcpy(&offset, pkt, TAG_SIZE);
+                        data += TAG_SIZE;
+                        len -= TAG_SIZE;
+                }
+                unsigned int b = (offset - start) / bmax;
+                if (offset < start || b >= next || (offset - start) % bmax) {
+                        if (retry)
+                                continue;       // From an earlier fetch
+                        printf("pcplr: bad tag 0x%x\n", offset);
+                        goto fail;
+                }
+                if (got[b])
+                        continue;
+                got[b] = true;
+                uint32_t bsz = end - offset > bmax ? bmax : end - offset;
+                len = unpack_block(data, len, bsz);
+                if (out) {
+                        fseek(out, offset, SEEK_SET);
+                        fwrite(data, 1, len, out);
+                }
+                done++;
+                progress = now_ns();
+        }
+        free(got);
+        return 0;
+
+ fail:
+        free(got);
+        return -1;
+}
+
+/* As the server's crf_time_t_from_atime():  a typed file's timestamp */
+static time_t   atime_to_time_t(uint32_t load, uint32_t exec)
+{
+        uint64_t at = ((uint64_t)(load & 0xff) << 32) | exec;
+
+        return at / 100 - (time_t)(70 * 365.2425 * 24 * 60 * 60);
+}
+
+/* A block's checksum, as mod_pipe's psync_blocks:  over its words, s1 is
+ * their sum and s2 the sum of each s1 so far
+ */
+static void     block_sum(const uint8_t *b, uint32_t *s)
+{
+        uint32_t w;
+
+        s[0] = s[1] = 0;
+        for (unsigned int i = 0; i < SYNC_BLOCK; i += 4) {
+                memcpy(&w, &b[i], 4);
+                s[0] += w;
+                s[1] += s[0];
+        }
+}
+
+/* As *PSYNC's psync_blocks:  compare the blocks local and host both have
+ * by checksum, fetch those that differ and anything past the end of ours,
+ * and cut ours to the host's length.
+ */
+static int      psync_file(uint32_t index, uint32_t size, uint32_t lsize,
+                           FILE *out, unsigned int *fetched,
+                           unsigned int *compared, unsigned int *retries)
+{
+        uint32_t end = (lsize < size ? lsize : size) / SYNC_BLOCK * SYNC_BLOCK;
+        unsigned int count_max = (max_pkt - 16) / 8;
+
+        if (count_max > SYNC_MAX)
+                count_max = SYNC_MAX;
+        for (uint32_t off = 0; off < end; ) {
+                uint32_t req[4 + 2 * SYNC_MAX];
+                uint8_t block[SYNC_BLOCK];
+                unsigned int count = (end - off) / SYNC_BLOCK;
+                uint32_t differ;
+
+                if (count > count_max)
+                        count = count_max;
+                req[0] = 7;                             // SumBlocks
+                req[1] = index;
+                req[2] = off;
+                req[3] = count;
+                for (unsigned int i = 0; i < count; i++) {
+                        fseek(out, off + i * SYNC_BLOCK, SEEK_SET);
+                        if (fread(block, 1, SYNC_BLOCK, out) != SYNC_BLOCK)
+                                return -1;
+                        block_sum(block, &req[4 + i * 2]);
+                }
+                *compared += count;
+                if (request(CID_RAWFILE, (uint8_t *)req, 16 + count * 8) < 8 ||
+                    pkt[0] != 0)
+                        return -1;
+                memcpy(&differ, &pkt[4], 4);
+
+                for (unsigned int i = 0; i < count; ) {
+                        unsigned int j = i;
+
+                        while (j < count && (differ & (1U << j)))
+                                j++;
+                        if (j > i) {
+                                if (pcplr_fetch(index, off + i * SYNC_BLOCK,
+                                                off + j * SYNC_BLOCK, out,
+                                                retries) < 0)
+                                        return -1;
+                                *fetched += j - i;
+                        }
+                        i = j + 1;
+                }
+                off += count * SYNC_BLOCK;
+        }
+        if (size > end) {
+                if (pcplr_fetch(index, end, size, out, retries) < 0)
+                        return -1;
+                *fetched += (size - end + SYNC_BLOCK - 1) / SYNC_BLOCK;
+        }
+        fflush(out);
+        return ftruncate(fileno(out), size);
+}
+
+/* As *PCPLR does:  get the manifest of DIR, then each file in it by index,
+ * into LOCAL (or DIR) under the -o directory.  Or as *PSYNC, only fetching
+ * what's changed:  a typed file's timestamp is kept as its mtime.
+ */
+int             workload_pcplr(const char *arg, bool sync)
+{
+        const char *what = sync ? "psync" : "pcplr";
+        unsigned int synced = 0, same = 0, fetched = 0, compared = 0;
+        char dir[256], local[1024];
+        const char *c = strchr(arg, ':');
+        uint8_t *man = NULL;
+        uint32_t man_size = 0, man_len = 0, cookie = 0;
+        unsigned int reqs = 0, files = 0, dirs = 0, retries = 0;
+        int r;
+        uint64_t bytes = 0;
+        bool stream = (caps & PR_CAP_STREAM) && !err_every;
+        unsigned int cid;
+        int len;
+
+        // DIR[:LOCAL]
+        snprintf(dir, sizeof(dir), "%.*s",
+                 c ? (int)(c - arg) : (int)strlen(arg), arg);
+        snprintf(local, sizeof(local), "%s/%s", out_dir ? out_dir : ".",
+                 c ? c + 1 : arg);
+
+        uint64_t start = now_ns();
+        /* Streamed, one request gets the whole manifest.  With -e, a part
+         * could be lost, so each is asked for (and retried) as *PCAT does.
+         */
+        do {
+                if (!stream || reqs == 0) {
+                        uint8_t req[8 + 256] = { 1 };   // Manifest
+
+                        memcpy(&req[4], &cookie, 4);
+                        snprintf((char *)&req[8], 256, "%s", dir);
+                        len = 8 + strlen(dir) + 1;
+                        if (stream) {
+                                if (arc_packet_tx(CID_DIR, req, len,
+                                                  timeout_ms) < 0)
+                                        len = -1;
+                                else
+                                        len = arc_packet_rx(pkt, &cid,
+                                                            timeout_ms);
+                        } else {
+                                len = request(CID_DIR, req, len);
+                        }
+                        reqs++;
+                } else {
+                        len = arc_packet_rx(pkt, &cid, timeout_ms);
+                }
+                if (len < 12 || pkt[0] != 0) {
+                        printf("%s: can't get manifest of '%s' (%d)\n", what,
+                               dir, len < 12 ? -1 : pkt[0]);
+                        free(man);
+                        return -1;
+                }
+                uint32_t next;
+
+                memcpy(&next, &pkt[4], 4);
+                if (!man) {
+                        memcpy(&man_size, &pkt[8], 4);
+                        man = malloc(man_size ? man_size : 1);
+                }
+                /* With -e, a late response to a resent request can turn up
+                 * in place of the next part.  Check it follows on, else
+                 * ask again.  (A late copy of the last part would overflow,
+                 * so this comes first.)
+                 */
+                if (next ? next - pkt[1] != cookie :
+                    man_len + len - 12 != man_size) {
+                        if (stream) {
+                                printf("%s: manifest out of order\n",
+                                       what);
+                                free(man);
+                                return -1;
+                        }
+                        continue;
+                }
+                if (man_len + len - 12 > man_size) {
+                        printf("%s: manifest overflow\n", what);
+                        free(man);
+                        return -1;
+                }
+                cookie = next;
+                memcpy(&man[man_len], &pkt[12], len - 12);
+                man_len += len - 12;
+        } while (cookie != 0 || man_len < man_size);
+        uint64_t man_ns = now_ns() - start;
+
+        if (out_dir)
+                mkdir(local, 0777);
+        uint32_t index = 0;
+        for (unsigned int pos = 0; pos + 14 <= man_len; index++) {
+                uint32_t w[3];
+                char path[2048];
+                const char *name = (const char *)&man[pos + 13];
+                char *p;
+
+                memcpy(w, &man[pos], 12);
+                // RISC OS path to host:  '.' <-> '/'
+                snprintf(path, sizeof(path), "%s/%s", local, name);
+                for (p = path + strlen(local) + 1; *p; p++)
+                        *p = *p == '.' ? '/' : *p == '/' ? '.' : *p;
+
+                if (man[pos + 12] == 2) {
+                        if (out_dir)
+                                mkdir(path, 0777);
+                        dirs++;
+                } else {
+                        bool typed = (w[0] >> 20) == 0xfff;
+                        time_t t = atime_to_time_t(w[0], w[1]);
+                        struct stat sb;
+                        bool have = sync && out_dir && stat(path, &sb) == 0 &&
+                                S_ISREG(sb.st_mode);
+                        FILE *out = NULL;
+
+                        if (have && sb.st_size == w[2] &&
+                            (!typed || sb.st_mtime == t)) {
+                                same++;
+                                r = 0;
+                        } else if (have && w[2] >= SYNC_MIN &&
+                                   sb.st_size >= SYNC_MIN) {
+                                out = fopen(path, "r+b");
+                                r = out ? psync_file(index, w[2], sb.st_size,
+                                                     out, &fetched, &compared,
+                                                     &retries) : -1;
+                                synced++;
+                        } else {
+                                out = out_dir ? fopen(path, "wb") : NULL;
+                                if (out_dir && !out)
+                                        perror("- Can't create output file");
+                                r = pcplr_fetch(index, 0, w[2], out, &retries);
+                                files++;
+                                bytes += w[2];
+                        }
+                        if (out)
+                                fclose(out);
+                        if (r < 0) {
+                                printf("%s: failed fetching '%s'\n", what,
+                                       name);
+                                free(man);
+                                return -1;
+                        }
+                        if (out && typed) {
+                                struct timespec ts[2] = { { t, 0 }, { t, 0 } };
+
+                                utimensat(AT_FDCWD, path, ts, 0);
+                        }
+                }
+                pos += (13 + strlen(name) + 1 + 3) & ~3;
+        }
+        free(man);
+
+        uint8_t req = 4;                                // Close
+        arc_packet_tx(CID_RAWFILE, &req, 1, timeout_ms);
+        uint64_t total = now_ns() - start;
+        printf("%s: '%s' %u files, %u dirs, %llu bytes in %.3fs "
+               "(manifest %u bytes, %u requests, %.3fs), %.1f KB/s\n",
+               what, dir, files, dirs, (unsigned long long)bytes, total / 1e9,
+               man_size, reqs, man_ns / 1e9, bytes / 1024.0 / (total / 1e9));
+        if (sync)
+                printf("psync: updated %u (%u blocks fetched, %u compared), "
+                       "unchanged %u\n", synced, fetched, compared, same);
+        print_packed(what);
+        if (err_every)
+                printf("%s: %u errors injected, %u retries\n", what,
+                       errs_injected, retries);
+        return 0;
+}
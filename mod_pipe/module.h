@@ -30,8 +30,104 @@
 #define WS_HW           0
 #define WS_TX_HEAD      4
 #define WS_RX_TAIL      8
+/* Agreed with the firmware and host by pipe_negotiate: */
+#define WS_CAPS         12
+#define WS_MAXPKT       16
+#define WS_DEPTH        20
+/* The host image opened by *PDISC, for block_discop: */
+#define WS_BLK_SIZE     24              // Bytes, or 0 if none
+#define WS_BLK_FLAGS    28              // BLK_RO etc.
+#define WS_BLK_INFLIGHT 32              // Writes not yet acknowledged
+/* The transfer block_xfer is doing: */
+#define WS_XFER_CID     36              // Channel, and XFER_BEHIND
+#define WS_XFER_OP      40              // Each request's first word
+/* The Pipe filing system (fs.S): */
+#define WS_FS_LINKED    44              // Negotiated, since the last error
+#define WS_FS_NEXT      48              // Cache entry to replace next
+#define WS_TX_BUSY      52              // TX descriptor not yet sent, or 0
+/* The SWIs' asynchronous operations (swi.S): */
+#define WS_SWI_TICKER   56              // Non-zero while the ticker runs
+#define WS_SWI_CB       60              // Non-zero while our callback's due
+#define WS_SWI_TX       64              // Pipe_Send's routine (or 0), r12
+#define WS_SWI_RX       72              // Pipe_Receive's routine (or 0),
+                                        //  r12, buffer
+/* How long pipe_packet.S waits for the card, set by Pipe_Timeouts: */
+#define WS_TX_TIMEOUT   84              // Centiseconds, to take a packet
+#define WS_RX_TIMEOUT   88              // Centiseconds, for a response
+#define WS_IDLE         92              // Routine to call while waiting (or
+                                        //  0), and its r12
+#define WS_BENCH        100             // *PBENCH's trips taking 0-3+ cs
+/* Non-zero once pipe_negotiate has agreed the WS_CAPS etc. in use: */
+#define WS_NEGOTIATED   116
+/* *PLOAD and *PRUN (commands_load.S): */
+#define WS_LOAD_NAME    256             // 256 bytes:  the host name
+#define WS_RUN_CMD      512             // 256 bytes:  *PRUN's *Go line
+#define WS_FS_CACHE     1024            // FS_CACHE_N entries
+#define FS_CACHE_N      16
+#define FS_CACHE_SHIFT  6
+#define FS_CACHE_SZ     (1 << FS_CACHE_SHIFT)
+#define WS_MSGBUF       2048    // 512 bytes, for control messages
 #define WS_SCRATCH      3072
 
 #define ERR_BASE        0xcafef00d
 
+/* Not an allocated SWI chunk:  change it if it clashes */
+#define PIPE_SWI_CHUNK  0x5a5c0
+
+/* Protocol: */
+#define CID_HOSTINFO    1
+#define CID_RAWFILE     2
+#define CID_DIR         3
+#define CID_RAWFILE_READ_BLOCK  1
+#define CID_RAWFILE_READ_ENTRY  6       // ReadBlock of a manifest file
+#define CID_RAWFILE_SUM_BLOCKS  7       // Compare a manifest file's blocks
+#define CID_DIR_MANIFEST        1
+#define CID_BLOCK       4               // Disc images
+#define CID_BLOCK_OPEN          0
+#define CID_BLOCK_READ          1
+#define CID_BLOCK_WRITE         2
+#define CID_BLOCK_CLOSE         3
+#define BLK_CREATE      0x01            // Open flag:  create, at a size
+#define BLK_RO          0x02            // Open flag:  read-only
+#define BLK_BEHIND      0x100           // Ours:  writes return in flight
+#define XFER_BEHIND     0x100
+#define CID_FS          5               // Filing system
+#define CID_FS_STAT             0
+#define CID_FS_OPEN             1
+#define CID_FS_READ             2
+#define CID_FS_WRITE            3
+#define CID_FS_CLOSE            4
+#define CID_FS_ARGS             5
+#define CID_FS_READ_DIR         6
+#define CID_FS_WRITE_INFO       7
+#define CID_FS_DELETE           8
+#define CID_FS_CREATE           9
+#define CID_FS_RENAME           10
+#define FS_OPEN_READ    0               // Host open modes
+#define FS_OPEN_CREATE  1
+#define FS_OPEN_UPDATE  2
+#define CID_ECHO        6               // For *PBENCH
+#define CID_ECHO_ECHO           0
+#define CID_ECHO_SINK           1
+#define CID_ECHO_SOURCE         2
+#define CID_ECHO_BULK   7               // The same, as a bulk channel
+#define CID_F_TAGGED    0x40            // Payload starts with a 32-bit tag
+#define HOSTINFO_INFO   0
+#define HOSTINFO_CAPS   1
+
+/* What we offer in negotiation: */
+#define ARC_CAPS        (PR_CAP_TAGS | PR_CAP_STREAM | PR_CAP_COMPRESS | \
+                         PR_CAP_CRC)
+#define ARC_DEPTH       4               // Tagged requests in flight
+
+/* Default timeouts, in centiseconds.  The host can take a while to answer
+ * (a big directory, or a disc image being unpacked), so the RX one's long.
+ */
+#define TX_TIMEOUT      200
+#define RX_TIMEOUT      1000
+
+/* CIDs 0-7 the firmware should send after others (PR_TX_BULK0): */
+#define ARC_TX_BULK0    ((1 << CID_RAWFILE) | (1 << CID_BLOCK) | \
+                         (1 << CID_ECHO_BULK))
+
 #endif
@@ -30,14 +30,38 @@
 #define SWI_OS_WRITES   0x1
 #define SWI_OS_WRITE0   0x2
 #define SWI_OS_NEWLINE  0x3
+#define SWI_OS_CLI      0x05
 #define SWI_OS_FILE     0x08
+#define SWI_OS_ARGS     0x09
 #define SWI_OS_GBPB     0x0c
 #define SWI_OS_FIND     0x0d
+#define SWI_OS_GETENV   0x10
 #define SWI_OS_MODULE   0x1e
+#define SWI_OS_READUNSIGNED     0x21
 #define SWI_OS_GSTRANS  0x27
+#define SWI_OS_FSCONTROL        0x29
+#define SWI_OS_GENERATEERROR    0x2b
+#define SWI_OS_VALIDATEADDRESS  0x3a
+#define SWI_OS_CALLEVERY        0x3c
+#define SWI_OS_REMOVETICKEREVENT        0x3d
+#define SWI_OS_READMONOTONICTIME        0x42
+#define SWI_OS_ADDCALLBACK      0x54
+#define SWI_OS_REMOVECALLBACK   0x5f
+#define SWI_OS_CONVERTHEX8      0xd4
+#define SWI_OS_CONVERTCARDINAL4 0xd8
+#define SWI_OS_WRITEI   0x100
+#define SWI_ADFS_DISCOP 0x40240
+#define SWI_ADFS_DESCRIBEDISC   0x40245
+
+#define SERVICE_FSREDECLARE     0x40
 
 #define V_BIT           (1 << 28)
 
+/* TEQP Rn, #0:  set the (26-bit) PSR, mode included, from Rn.  Assemblers
+ * for ARMv4 don't take the P suffix, so it's written out.
+ */
+#define TEQP(rn)        .long   0xe330f000 | ((rn) << 16)
+
 // Embedded string:
 #define ES(str)        swi     SWI_OS_WRITES | SWI_X ; \
         .asciz str                                   ; \
@@ -39,24 +39,149 @@
 #include "podule_regs.h"
 
 
+#ifndef DEBUG
 #define DEBUG 2
+#endif
+
+/* The link is one or two CDC interfaces ("lanes").  With only the first
+ * connected, everything goes over it.  If the server has opened the second
+ * too, non-bulk CIDs (see PR_TX_BULK0) use that instead, so that they
+ * don't queue behind bulk data in the USB/tty buffers.  Either lane can
+ * carry packets towards the Arc; they end up in the same RX ring.
+ *
+ * The vendor interface is an alternative to the first CDC interface, for
+ * hosts that open it (see pipe_vendor_open()).  Each packet is sent as one
+ * USB transfer, so the host doesn't need to reassemble a byte stream.
+ */
+#define PIPE_LANE_DATA  0
+#define PIPE_LANE_CTL   1
+#define PIPE_LANE_VENDOR 2
+#define PIPE_LANES      3
+
+#define PIPE_VENDOR_EP_SIZE     64
+
+#define PKT_HDR_SIZE    3
+
+/* With PR_CAP_CRC in PR_LINK_CAPS, packets are sent as frames:
+ *
+ *   FRAME_SYNC, CID, size (16 bits LE), header check, payload, CRC (LE)
+ *
+ * The header check is the low byte of the CRC of the 4 bytes before it, and
+ * the CRC (16-bit CCITT) covers everything before it.  A CID is 7 bits, so
+ * FRAME_SYNC can't start a plain packet.  After a bad frame, the receiver
+ * discards up to the next FRAME_SYNC (from just after the bad one's), so
+ * only the damaged frame is lost.
+ */
+#define FRAME_SYNC      0xfa
+#define FRAME_HDR_SIZE  5
+#define FRAME_OVERHEAD  7
+#define PIPE_CID_HOSTINFO       1       // See pipe_rx_check()
 
 typedef struct {
+        unsigned int itf;
+        bool vendor;                    // Else CDC
+        bool ctl;                       // Carries non-bulk CIDs, if split
+        bool last_connected;
+
         bool tx_ongoing;
+        unsigned int tx_descr;          // Being sent
         unsigned int tx_total;
         unsigned int tx_pos;
-        uint8_t tx_buf[512 + 3];
+        uint8_t tx_buf[512 + FRAME_OVERHEAD + 1]; // Plus vendor padding
 
-        unsigned int rx_total;
+        unsigned int rx_total;          // Of the packet at rx_buf, 0 if unknown
+        unsigned int rx_hdr;            // Offset of its header
         unsigned int rx_pos;
-        unsigned int rx_last_descr;
         bool rx_packet_pending;
-        uint8_t rx_buf[512 + 3];
+        bool rx_resync;                 // After a bad frame, until a good one
+        uint8_t rx_buf[512 + FRAME_OVERHEAD];
+} pp_lane_t;
+
+typedef struct {
+        pp_lane_t lane[PIPE_LANES];
+        unsigned int tx_consumed;       // Mask, consumed ahead of tail
+        unsigned int tx_busy;           // Mask, being sent on a lane
+        unsigned int rx_last_descr;
+        bool vendor_open;
 } pp_state_t;
 
 static pp_state_t state;
 
-#define PKT_HDR_SIZE    3
+/* In RAM, as flash (XIP) lookups are slow: */
+static uint16_t crc_table[256];
+
+static void     crc_init(void)
+{
+        for (unsigned int i = 0; i < 256; i++) {
+                uint16_t c = i << 8;
+
+                for (unsigned int b = 0; b < 8; b++)
+                        c = (c & 0x8000) ? (c << 1) ^ 0x1021 : c << 1;
+                crc_table[i] = c;
+        }
+}
+
+static uint16_t crc16(const uint8_t *data, unsigned int len)
+{
+        uint16_t c = 0xffff;
+
+        while (len--)
+                c = (c << 8) ^ crc_table[(c >> 8) ^ *data++];
+        return c;
+}
+
+static bool     lane_connected(pp_lane_t *l)
+{
+        return l->vendor ? state.vendor_open : tud_cdc_n_connected(l->itf);
+}
+
+static uint32_t lane_available(pp_lane_t *l)
+{
+        return l->vendor ? tud_vendor_n_available(l->itf) :
+                tud_cdc_n_available(l->itf);
+}
+
+static uint32_t lane_read(pp_lane_t *l, void *buffer, uint32_t bufsize)
+{
+        return l->vendor ? tud_vendor_n_read(l->itf, buffer, bufsize) :
+                tud_cdc_n_read(l->itf, buffer, bufsize);
+}
+
+static uint32_t lane_write(pp_lane_t *l, void const *buffer, uint32_t bufsize)
+{
+        uint32_t r;
+
+        if (l->vendor) {
+                r = tud_vendor_n_write(l->itf, buffer, bufsize);
+                tud_vendor_n_write_flush(l->itf);
+        } else {
+                r = tud_cdc_n_write(l->itf, buffer, bufsize);
+                tud_cdc_n_write_flush(l->itf);
+        }
+        return r;
+}
+
+/* Whether a new packet can be started.  A vendor packet must go into an
+ * empty FIFO, or TinyUSB could send the end of the last one and the start
+ * of this in the same USB packet (merging the transfers).  It then goes in
+ * whole, since the FIFO is bigger than any packet.
+ */
+static bool     lane_tx_ready(pp_lane_t *l)
+{
+        return !l->vendor || tud_vendor_n_write_available(l->itf) ==
+                CFG_TUD_VENDOR_TX_BUFSIZE;
+}
+
+/* The host opens/closes the vendor interface with a control request, much
+ * as a CDC interface is opened with DTR.
+ */
+void    pipe_vendor_open(bool open)
+{
+        if (open != state.vendor_open)
+                printf("[pipe vendor interface %s]\n",
+                       open ? "opened" : "closed");
+        state.vendor_open = open;
+}
 
 
 // Called at init, but can also be requested by loader on soft reset:
@@ -70,28 +195,95 @@ void    pipe_init(void)
         r[PR_TX_TAIL] = 0;
         r[PR_RX_HEAD] = 0;
 
-        // Reset state
-        state.tx_ongoing = false;
-        state.rx_pos = 0;
-        state.tx_pos = 0;
+        // Advertise what we support, for the Arc to negotiate with:
+        r[PR_FW_VERSION] = PR_FW_VERSION_CUR;
+        r[PR_FW_CAPS] = PR_CAP_CRC;
+        r[PR_FW_RING] = PR_NUM_DESCRS;
+        r[PR_FW_MAXPKT] = PR_RX_TX_BUFSZ / 4;
+        r[PR_LINK_CAPS] = 0;
+        r[PR_LINK_BAD] = 0;
+        r[PR_LINK_RESYNC] = 0;
+        // All CIDs equal priority until the Arc says otherwise:
+        memset((void *)&r[PR_TX_BULK0], 0, PR_TX_BULK_REGS);
 
+        // Reset state
+        for (unsigned int i = 0; i < PIPE_LANES; i++) {
+                pp_lane_t *l = &state.lane[i];
+
+                l->itf = i == PIPE_LANE_VENDOR ? 0 : i;
+                l->vendor = i == PIPE_LANE_VENDOR;
+                l->ctl = i == PIPE_LANE_CTL;
+                l->tx_ongoing = false;
+                l->rx_pos = 0;
+                l->tx_pos = 0;
+                l->rx_total = 0;
+                l->rx_packet_pending = false;
+                l->rx_resync = false;
+        }
+        crc_init();
+        state.tx_consumed = 0;
+        state.tx_busy = 0;
         state.rx_last_descr = 0;
-        state.rx_packet_pending = false;
 }
 
-static void     pipe_tx_done(void)
+static void     pipe_tx_done(pp_lane_t *l)
 {
         volatile uint8_t *r = podule_if_get_regs();
         unsigned int tail = r[PR_TX_TAIL];
+        unsigned int n = l->tx_descr;
 
         // Descriptor clean/non-ready:
-        PR_TX_DESCR(r, tail) = PR_TX_DESCR(r, tail) & ~(PR_DESCR_READY);
-        // Move on tail pointer:
-        tail = (tail + 1) & PR_DESCRS_MASK;
+        PR_TX_DESCR(r, n) = PR_TX_DESCR(r, n) & ~(PR_DESCR_READY);
+        state.tx_consumed |= 1 << n;
+        state.tx_busy &= ~(1 << n);
+
+        /* Descriptors can be consumed out of order (see pipe_tx_pick()), so
+         * move on the tail pointer past however many are now done:
+         */
+        while (state.tx_consumed & (1 << tail)) {
+                state.tx_consumed &= ~(1 << tail);
+                tail = (tail + 1) & PR_DESCRS_MASK;
+        }
         r[PR_TX_TAIL] = tail;
 }
 
-static void     pipe_tx_start(uint32_t descr)
+/* Choose the next ready TX descriptor for a lane, in ring order from the
+ * tail.  If split, the data lane only takes bulk CIDs and the control lane
+ * the rest.  Otherwise (data lane on its own), non-bulk CIDs go first:
+ * strict priority, but bulk can't be starved for long since the Arc only
+ * has so many interactive requests to make.
+ * Returns its index, or -1 if none is ready.
+ */
+static int      pipe_tx_pick(pp_lane_t *l, bool split)
+{
+        volatile uint8_t *r = podule_if_get_regs();
+        unsigned int tail = r[PR_TX_TAIL];
+        int first = -1;
+
+        for (unsigned int i = 0; i < PR_NUM_DESCRS; i++) {
+                unsigned int n = (tail + i) & PR_DESCRS_MASK;
+                uint32_t descr = PR_TX_DESCR(r, n);
+
+                if (!PR_DESCR_IS_READY(descr) ||
+                    ((state.tx_consumed | state.tx_busy) & (1 << n)))
+                        continue;
+
+                bool bulk = PR_TX_IS_BULK(r, PR_DESCR_CID(descr));
+
+                if (split) {
+                        if (bulk == !l->ctl)
+                                return n;
+                        continue;
+                }
+                if (!bulk)
+                        return n;
+                if (first < 0)
+                        first = n;
+        }
+        return first;
+}
+
+static void     pipe_tx_start(pp_lane_t *l, uint32_t descr)
 {
         volatile uint8_t *r = podule_if_get_regs();
 
@@ -101,11 +293,11 @@ static void     pipe_tx_start(uint32_t descr)
         uint8_t *tx_data = (uint8_t *)((uintptr_t)&r[PR_TX_BUFFERS] +
                                        (uintptr_t)addr);
 
-        if (addr + len >= PR_RX_TX_BUFSZ) {
+        if (addr + len > PR_RX_TX_BUFSZ) {
                 printf("[pipe TX ERROR: TX off end of buffer! "
                        "%08x, CID%d, addr %d, len %d - dropping packet]\n",
                        descr, cid, addr, len);
-                pipe_tx_done();
+                pipe_tx_done(l);
                 return;
         }
 
@@ -125,34 +317,54 @@ static void     pipe_tx_start(uint32_t descr)
          * through that.
          */
 
-        state.tx_buf[0] = cid;
-        state.tx_buf[1] = len & 0xff;
-        state.tx_buf[2] = (len >> 8) & 0xff;
+        bool framed = r[PR_LINK_CAPS] & PR_CAP_CRC;
+        uint8_t *hdr = &l->tx_buf[framed ? 1 : 0];
 
-        memcpy(&state.tx_buf[PKT_HDR_SIZE], tx_data, len);
-        state.tx_total = len + 3;
+        hdr[0] = cid;
+        hdr[1] = len & 0xff;
+        hdr[2] = (len >> 8) & 0xff;
+
+        if (framed) {
+                l->tx_buf[0] = FRAME_SYNC;
+                l->tx_buf[4] = crc16(l->tx_buf, 4);
+                memcpy(&l->tx_buf[FRAME_HDR_SIZE], tx_data, len);
+                l->tx_total = FRAME_HDR_SIZE + len;
+
+                uint16_t crc = crc16(l->tx_buf, l->tx_total);
+                l->tx_buf[l->tx_total++] = crc & 0xff;
+                l->tx_buf[l->tx_total++] = crc >> 8;
+        } else {
+                memcpy(&l->tx_buf[PKT_HDR_SIZE], tx_data, len);
+                l->tx_total = len + PKT_HDR_SIZE;
+        }
+
+        /* A vendor transfer ends at a short USB packet.  Pad rather than
+         * end on a full one, so that the host's read completes with just
+         * this packet (the header says where it really ends).
+         */
+        if (l->vendor && (l->tx_total % PIPE_VENDOR_EP_SIZE) == 0)
+                l->tx_buf[l->tx_total++] = 0;
 
         /* Try to queue as much as possible in the USB TX FIFOs: */
-        unsigned int tx_written = tud_cdc_n_write(0, state.tx_buf, state.tx_total);
-        tud_cdc_n_write_flush(0);
+        unsigned int tx_written = lane_write(l, l->tx_buf, l->tx_total);
 
 #if DEBUG > 2
         for (int i = 0; i < tx_written; i++) {
-                printf("%02x ", state.tx_buf[i]);
+                printf("%02x ", l->tx_buf[i]);
         }
         printf("\n");
 #endif
-        if (tx_written == state.tx_total) {
+        if (tx_written == l->tx_total) {
 #if DEBUG > 1
                 printf("[pipe TX done: submitted %d in one go]\n", tx_written);
 #endif
                 /* Submitted entire packet, now it's SEP. */
-                state.tx_ongoing = false;
-                pipe_tx_done();
+                l->tx_ongoing = false;
+                pipe_tx_done(l);
         } else {
 #if DEBUG > 1
                 printf("[pipe TX ongoing: submitted %d, %d total]\n",
-                       tx_written, state.tx_total);
+                       tx_written, l->tx_total);
 #endif
                 /* We're not done with the packet, there's more work
                  * to do later on.
@@ -162,8 +374,8 @@ static void     pipe_tx_start(uint32_t descr)
                  * continually starting a new tx, and the rest of the
                  * work occurs via pipe_tx_continue().
                  */
-                state.tx_ongoing = true;
-                state.tx_pos = tx_written;
+                l->tx_ongoing = true;
+                l->tx_pos = tx_written;
 
                 /* The packet descriptor remains ready/unconsumed;
                  * it's consumed in pipe_tx_done().  We could consume
@@ -176,33 +388,31 @@ static void     pipe_tx_start(uint32_t descr)
         }
 }
 
-static void     pipe_tx_continue(void)
+static void     pipe_tx_continue(pp_lane_t *l)
 {
-        if (!state.tx_ongoing) {
+        if (!l->tx_ongoing) {
                 printf("[pipe TX ERROR: continue, but no work to do!\n");
                 return;
         }
 
         /* Send more data: */
-        unsigned int tx_written = tud_cdc_n_write(0,
-                                                  &state.tx_buf[state.tx_pos],
-                                                  state.tx_total - state.tx_pos);
-        tud_cdc_n_write_flush(0);
+        unsigned int tx_written = lane_write(l, &l->tx_buf[l->tx_pos],
+                                             l->tx_total - l->tx_pos);
 
-        state.tx_pos += tx_written;
-        if (state.tx_pos >= state.tx_total) {
+        l->tx_pos += tx_written;
+        if (l->tx_pos >= l->tx_total) {
 #if DEBUG > 1
                 printf("[pipe TX complete: submitted %d of %d total]\n",
-                               tx_written, state.tx_total);
+                               tx_written, l->tx_total);
 #endif
-                state.tx_ongoing = false;
-                pipe_tx_done();
+                l->tx_ongoing = false;
+                pipe_tx_done(l);
         } else {
                 if (tx_written != 0) {
                         // If it's really busy, and repeatedly writing 0, be quiet.
 #if DEBUG > 1
                         printf("[pipe TX ongoing2: submitted %d, now %d of %d total]\n",
-                               tx_written, state.tx_pos, state.tx_total);
+                               tx_written, l->tx_pos, l->tx_total);
 #endif
                 }
 
@@ -228,12 +438,14 @@ static bool     pipe_rx_packet(uint8_t cid, uint16_t len, uint8_t *data)
          */
 
         if (PR_DESCR_IS_READY(PR_RX_DESCR(r, last))) {
+#if DEBUG > 0
                 static int last_last = -1;
                 if (last_last != last) {
                         // Dumb rate-limiting
                         printf("[pipe RX: No room for packet]\n");
                         last_last = last;
                 }
+#endif
                 return false;
         }
 
@@ -261,15 +473,77 @@ static bool     pipe_rx_packet(uint8_t cid, uint16_t len, uint8_t *data)
         return true;
 }
 
+/* Find the packet (or frame) at the start of l->rx_buf, setting
+ * l->rx_total to its size and l->rx_hdr to where its header starts.
+ * l->rx_total is left 0 if more data is needed.  Bad frames are discarded,
+ * as is anything but a frame while resyncing after one.  Once CRC framing's
+ * agreed, the only plain packets taken are hostinfo, since the server may
+ * have restarted and be renegotiating.
+ */
+static void     pipe_rx_check(pp_lane_t *l)
+{
+        volatile uint8_t *r = podule_if_get_regs();
+        bool strict = r[PR_LINK_CAPS] & PR_CAP_CRC;
+        uint8_t *b = l->rx_buf;
+
+        l->rx_total = 0;
+        while (l->rx_pos > 0) {
+                if (b[0] == FRAME_SYNC) {
+                        if (l->rx_pos < FRAME_HDR_SIZE)
+                                return;
+                        unsigned int total = FRAME_OVERHEAD +
+                                (b[2] | ((uint32_t)b[3] << 8));
+
+                        if (b[4] == (crc16(b, 4) & 0xff) &&
+                            total <= sizeof(l->rx_buf)) {
+                                if (l->rx_pos < total)
+                                        return;
+                                uint16_t crc = crc16(b, total - 2);
+                                if (b[total - 2] == (crc & 0xff) &&
+                                    b[total - 1] == (crc >> 8)) {
+                                        if (l->rx_resync)
+                                                r[PR_LINK_RESYNC]++;
+                                        l->rx_resync = false;
+                                        l->rx_hdr = 1;
+                                        l->rx_total = total;
+                                        return;
+                                }
+                        }
+                } else if (!l->rx_resync &&
+                           (!strict || b[0] == PIPE_CID_HOSTINFO)) {
+                        if (l->rx_pos >= PKT_HDR_SIZE) {
+                                l->rx_hdr = 0;
+                                l->rx_total = PKT_HDR_SIZE +
+                                        (b[1] | ((uint32_t)b[2] << 8));
+                        }
+                        return;
+                }
+
+                if (!l->rx_resync) {
+#if DEBUG > 0
+                        printf("[pipe RX bad frame, resyncing]\n");
+#endif
+                        r[PR_LINK_BAD]++;
+                        l->rx_resync = true;
+                }
+                // Discard up to the next sync byte:
+                uint8_t *sync = memchr(&b[1], FRAME_SYNC, l->rx_pos - 1);
+                unsigned int skip = sync ? sync - b : l->rx_pos;
+
+                memmove(b, &b[skip], l->rx_pos - skip);
+                l->rx_pos -= skip;
+        }
+}
+
 /* Assembles a single packet from possibly multi-chunk multi-receives,
- * staging the data into the state.rx_buf buffer until it's complete, then
+ * staging the data into the l->rx_buf buffer until it's complete, then
  * copying that into the RX buffer area.
  *
  * This could be made more complex and zero-copy by receiving just the header
  * (to work out size) then allocating a correctly-sized block in the RX area,
  * but "meh" and we're not close to needing to scrimp on memory either.
  */
-static void     pipe_rx(void)
+static void     pipe_rx(pp_lane_t *l)
 {
         unsigned int len = 0;
         static unsigned int pkt_counter = 0;
@@ -277,48 +551,46 @@ static void     pipe_rx(void)
         /* If a packet's pending, try to deliver it without receiving more USB
          * data.
          */
-        if (!state.rx_packet_pending) {
-                /* If we're in the middle of a packet, state.rx_pos is
+        if (!l->rx_packet_pending) {
+                /* If we're in the middle of a packet, l->rx_pos is
                  * non-zero so that this receive places data at the end of
                  * previous data: */
-                len = tud_cdc_n_read(0, &state.rx_buf[state.rx_pos],
-                                     sizeof(state.rx_buf) - state.rx_pos);
+                len = lane_read(l, &l->rx_buf[l->rx_pos],
+                                     sizeof(l->rx_buf) - l->rx_pos);
 #if DEBUG > 0
                 printf("[pipe RX %d bytes]\n", len);
 #endif
 
-                state.rx_pos += len;
+                l->rx_pos += len;
+                pipe_rx_check(l);
         }
 
         // Check for packet partial/complete:
-        if (state.rx_pos >= PKT_HDR_SIZE) {
-                // Decode size
-                uint16_t data_len = state.rx_buf[1] | ((uint32_t)state.rx_buf[2] << 8);
-                state.rx_total = PKT_HDR_SIZE + data_len;
+        if (l->rx_total) {
+                uint8_t *hdr = &l->rx_buf[l->rx_hdr];
+                uint16_t data_len = hdr[1] | ((uint32_t)hdr[2] << 8);
 #if DEBUG > 2
                 printf("[pipe RX packet header: CID%d, size %d (data size %d)]\n",
-                       state.rx_buf[0], state.rx_total, data_len);
+                       hdr[0], l->rx_total, data_len);
 #endif
                 // Did we get all of it?
-                if (state.rx_pos >= state.rx_total) {
+                if (l->rx_pos >= l->rx_total) {
                         // Pop it into the RX buffer/descriptor for Arc to see:
-                        bool accepted = pipe_rx_packet(state.rx_buf[0],
-                                                       data_len,
-                                                       &state.rx_buf[PKT_HDR_SIZE]);
+                        bool accepted = pipe_rx_packet(hdr[0], data_len,
+                                &l->rx_buf[l->rx_hdr ? FRAME_HDR_SIZE :
+                                           PKT_HDR_SIZE]);
 #if DEBUG > 1
                         if (accepted) {
                                 printf("[pipe RX packet complete: CID%d, size %d"
                                         " (data size %d)]\n",
-                                       state.rx_buf[0], state.rx_total,
-                                       data_len);
+                                       hdr[0], l->rx_total, data_len);
                         } else {
                                 // Rate-limit this!
                                 static int last_count = ~0;
                                 if (pkt_counter != last_count) {
                                         printf("[pipe RX packet stalled: "
                                                "CID%d, size %d (data size %d)]\n",
-                                               state.rx_buf[0], state.rx_total,
-                                               data_len);
+                                               hdr[0], l->rx_total, data_len);
                                         last_count = pkt_counter;
                                 }
                         }
@@ -331,83 +603,112 @@ static void     pipe_rx(void)
                          * propagates to the host.
                          */
                         if (!accepted) {
-                                state.rx_packet_pending = true;
+                                l->rx_packet_pending = true;
                                 return;
                         } else {
                                 pkt_counter++;
-                                state.rx_packet_pending = false;
+                                l->rx_packet_pending = false;
                         }
 
                         // Did we read too much/some of the next packet?
-                        if (state.rx_pos > state.rx_total) {
+                        if (l->rx_pos > l->rx_total) {
                                 /* Move the excess data read to the
                                  * bottom of the buffer, so that the
                                  * next read just tacks data onto the
                                  * end:
                                  */
-                                unsigned int excess = state.rx_total -
-                                        state.rx_pos;
-                                memmove(&state.rx_buf[0],
-                                        &state.rx_buf[state.rx_total],
+                                unsigned int excess = l->rx_pos -
+                                        l->rx_total;
+                                memmove(&l->rx_buf[0],
+                                        &l->rx_buf[l->rx_total],
                                         excess);
-                                state.rx_pos = excess;
+                                l->rx_pos = excess;
 #if DEBUG > 1
                                 printf("[pipe RX packet excess %d]\n",
                                        excess);
 #endif
+                                /* If the excess is a whole packet, there
+                                 * may be no more USB data to prompt another
+                                 * pipe_rx(), so mark it pending:
+                                 */
+                                pipe_rx_check(l);
+                                if (l->rx_total && excess >= l->rx_total)
+                                        l->rx_packet_pending = true;
                         } else {
                                 /* We read an exact amount,  Complete now,
                                  * and next RX occurs at the start, afresh.
                                  */
-                                state.rx_pos = 0;
+                                l->rx_pos = 0;
+                                l->rx_total = 0;
                         }
                 }
         }
         // Else do nothing, next reception we'll check again.
 }
 
-// Check whether the packet descriptors have some work for us (or an ongoing transfer)
-void pipe_poll(void)
+/* If drop, this lane consumes (drops) the packets it would send even when
+ * it's not connected, since nothing else will.
+ */
+static void     pipe_poll_lane(pp_lane_t *l, bool split, bool drop)
 {
         volatile uint8_t *r = podule_if_get_regs();
 
         /* Check USB */
-        bool cdc_connected = tud_cdc_n_connected(0);
-        static bool last_connected = false;
+        bool connected = lane_connected(l);
 
-        if (!cdc_connected && last_connected) {
+        if (!connected && l->last_connected) {
                 // Disconnect occurred!
-                printf("[pipe disconnected]\n");
+                printf("[pipe %s%d disconnected]\n", l->vendor ? "vendor " : "",
+                       l->itf);
         }
-        last_connected = cdc_connected;
+        l->last_connected = connected;
 
         //////////////////////////////////////////////////////////////////////
         // Receive
 
-        if ((cdc_connected && tud_cdc_n_available(0)) || state.rx_packet_pending) {
-                pipe_rx();
+        if ((connected && lane_available(l)) ||
+            l->rx_packet_pending) {
+                pipe_rx(l);
         }
 
         //////////////////////////////////////////////////////////////////////
         // Transmit
 
-        if (state.tx_ongoing) {
-                if (cdc_connected) {
-                        pipe_tx_continue();
+        if (l->tx_ongoing) {
+                if (connected) {
+                        pipe_tx_continue(l);
                 } else {
-                        state.tx_ongoing = false;
+                        // Leave it for another lane, or to be consumed below
+                        l->tx_ongoing = false;
+                        state.tx_busy &= ~(1 << l->tx_descr);
                 }
-        } else {
+        } else if ((connected && lane_tx_ready(l)) || drop) {
                 /* Check registers: */
 
-                unsigned int tail = r[PR_TX_TAIL];
-                uint32_t descr = PR_TX_DESCR(r, tail);
+                int n = pipe_tx_pick(l, split);
 
-                if (PR_DESCR_IS_READY(descr)) {
-                        if (cdc_connected)
-                                pipe_tx_start(descr);
-                        else
-                                pipe_tx_done(); // Consume immediately
+                if (n >= 0) {
+                        l->tx_descr = n;
+                        if (connected) {
+                                state.tx_busy |= 1 << n;
+                                pipe_tx_start(l, PR_TX_DESCR(r, n));
+                        } else {
+                                pipe_tx_done(l); // Consume immediately
+                        }
                 }
         }
 }
+
+// Check whether the packet descriptors have some work for us (or an ongoing transfer)
+void pipe_poll(void)
+{
+        // The control lane first, so its packets get into the RX ring first:
+        bool split = lane_connected(&state.lane[PIPE_LANE_CTL]);
+        // With no data lane, packets are consumed immediately:
+        bool drop = !lane_connected(&state.lane[PIPE_LANE_VENDOR]) &&
+                !lane_connected(&state.lane[PIPE_LANE_DATA]);
+
+        pipe_poll_lane(&state.lane[PIPE_LANE_CTL], split, false);
+        pipe_poll_lane(&state.lane[PIPE_LANE_VENDOR], split, false);
+        pipe_poll_lane(&state.lane[PIPE_LANE_DATA], split, drop);
+}
@@ -25,7 +25,15 @@
 #ifndef PIPE_PACKET_H
 #define PIPE_PACKET_H
 
+#include <stdbool.h>
+
+/* Vendor interface control request (bmRequestType vendor/interface,
+ * wValue 1 to open, 0 to close); the server sends it too.
+ */
+#define PIPE_VENDOR_REQ_OPEN    1
+
 void    pipe_init(void);
 void    pipe_poll(void);
+void    pipe_vendor_open(bool open);
 
 #endif
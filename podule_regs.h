@@ -67,6 +67,41 @@
 #define PR_TX_TAIL      0x40
 #define PR_RX_HEAD      0x41
 
+/* Firmware capabilities:  written by the podule at init, and read by the
+ * Arc to negotiate with the server.  Firmware predating these leaves them
+ * zero.
+ */
+#define PR_FW_VERSION   0x48
+#define PR_FW_CAPS      0x49    // PR_CAP_* supported by the firmware
+#define PR_FW_RING      0x4a    // Descriptors per ring
+#define PR_FW_MAXPKT    0x4b    // Max packet size / 4
+/* Capabilities agreed by the Arc and the server, written by the Arc: */
+#define PR_LINK_CAPS    0x4c
+/* Link error counters (mod 256), kept by the firmware with PR_CAP_CRC: */
+#define PR_LINK_BAD     0x4d    // Bad frames (or junk) that lost the stream
+#define PR_LINK_RESYNC  0x4e    // Times the stream was found again after
+
+/* TX priority:  one bit per CID (ignoring CID bit 6, the tag flag), set by
+ * the Arc for bulk channels.  With a control lane, the others are sent on
+ * it.  When several TX descriptors are ready, the firmware sends those for
+ * other CIDs first; mod_pipe only has one ready at a time (there's one TX
+ * buffer), though.
+ */
+#define PR_TX_BULK0     0x50    // CIDs 0-7, ... through 0x57
+#define PR_TX_BULK_REGS 8
+#define PR_TX_IS_BULK(pb, cid)  ( !!((pb)[PR_TX_BULK0 + (((cid) & 0x3f) >> 3)] & \
+                                     (1 << ((cid) & 7))) )
+
+#define PR_FW_VERSION_CUR       1
+
+/* Capability bits, as exchanged with the server over CID_HOSTINFO: */
+#define PR_CAP_TAGS     0x01    // Tagged requests, out-of-order responses
+#define PR_CAP_STREAM   0x02    // Several responses to one request
+#define PR_CAP_COMPRESS 0x04    // Compressed block responses
+#define PR_CAP_CRC      0x08    // CRC-checked framing on the USB link
+/* These need the firmware's support too; the rest are Arc<->server only: */
+#define PR_CAP_LINK_MASK        (PR_CAP_CRC)
+
 #define PR_TX0_0        0x80
 #define PR_TX0_1        0x81
 #define PR_TX0_2        0x82
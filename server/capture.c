@@ -0,0 +1,80 @@
+/* Packet capture
+ *
+ * Records every framed packet, in both directions, for the replay tool.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <endian.h>
+#include <stdbool.h>
+
+#include "capture.h"
+#include "device.h"
+#include "stats.h"
+
+static FILE     *cap_file = NULL;
+static uint64_t cap_t0;
+
+int             capture_open(const char *path)
+{
+        cap_file = fopen(path, "wb");
+        if (!cap_file) {
+                perror("Can't open capture file:");
+                return -1;
+        }
+        fwrite(CAPTURE_MAGIC, CAPTURE_MAGIC_LEN, 1, cap_file);
+        cap_t0 = stats_now();
+        printf("+++ Capturing to %s\n", path);
+        return 0;
+}
+
+void            capture_packet(struct device *d, bool tx, unsigned int cid,
+                               unsigned int len, const uint8_t *data)
+{
+        struct capture_rec rec;
+
+        if (!cap_file)
+                return;
+
+        rec.t_ns = htole64(stats_now() - cap_t0);
+        rec.len = htole16(len);
+        rec.cid = cid;
+        rec.flags = (tx ? CAPTURE_F_TX : 0) |
+                (d->cap_id << CAPTURE_F_DEV_SHIFT);
+
+        if (fwrite(&rec, sizeof(rec), 1, cap_file) != 1 ||
+            fwrite(data, 1, len, cap_file) != len) {
+                printf("- Capture write failed, stopping capture\n");
+                fclose(cap_file);
+                cap_file = NULL;
+        }
+}
+
+void            capture_flush(void)
+{
+        if (cap_file)
+                fflush(cap_file);
+}
@@ -0,0 +1,56 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>
+#include <inttypes.h>
+
+/* Capture file format:  CAPTURE_MAGIC, then a capture_rec (little-endian)
+ * followed by len bytes of payload, per packet.
+ */
+#define CAPTURE_MAGIC           "PIPECAP1"
+#define CAPTURE_MAGIC_LEN       8
+
+#define CAPTURE_F_TX            0x01    // Host to podule
+#define CAPTURE_F_DEV_SHIFT     1       // Device number, 0-127
+
+struct capture_rec {
+        uint64_t        t_ns;           // Since capture start
+        uint16_t        len;
+        uint8_t         cid;
+        uint8_t         flags;
+} __attribute__((packed));
+
+struct device;
+
+extern int      capture_open(const char *path);
+/* RX packets are recorded on dispatch, TX when handed to send_packet() */
+extern void     capture_packet(struct device *d, bool tx, unsigned int cid,
+                               unsigned int len, const uint8_t *data);
+extern void     capture_flush(void);
+
+#endif
@@ -0,0 +1,373 @@
+/* channel_block
+ *
+ * Disc images, for FileCore:  a host image file (e.g. a .hdf) is mapped,
+ * and read or written by byte offset in sectors' worth at a time.  A read
+ * can ask for many sectors, which with CAP_STREAM come back as several
+ * responses.  Writes go into the mapping, and the sectors they touch are
+ * synced once the Arc has been quiet for a while (or on Flush/Close).
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <string.h>
+#include <endian.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "channels.h"
+#include "device.h"
+#include "stats.h"
+
+
+#ifndef DEBUG
+#define DEBUG   3
+#endif
+
+
+#define CBLK_CREATE     0x01            // Create (or empty) at the size given
+#define CBLK_RO         0x02            // Read-only
+
+struct block_open_request {
+        uint8_t  opcode;
+        uint8_t  flags;
+        uint8_t  pad1[2];
+        uint32_t size;                  // For CBLK_CREATE
+        char     name[];
+};
+
+struct block_open_response {
+        uint8_t  success;
+        uint8_t  flags;                 // CBLK_RO if it's read-only
+        uint8_t  pad1[2];
+        uint32_t size;
+};
+
+/* The response is the data, length bytes of it from offset (zeroes past the
+ * end of the image).  With CAP_STREAM, a read of more than fits in a
+ * packet is sent as several; each goes to the offset in its tag, which is
+ * the request's plus its position in the read.  Each is packed as a
+ * rawfile ReadBlock response is, with CAP_COMPRESS.
+ */
+struct block_read_request {
+        uint8_t  opcode;
+        uint8_t  pad1[3];
+        uint32_t offset;
+        uint32_t length;
+};
+
+struct block_write_request {
+        uint8_t  opcode;
+        uint8_t  pad1[3];
+        uint32_t offset;
+        uint8_t  data[];
+};
+
+/* Response to WRITE, CLOSE and FLUSH */
+struct block_response {
+        uint8_t  success;
+        uint8_t  pad1[3];
+};
+
+/* Writes are tracked in sectors of this, FileCore's smallest: */
+#define CBLK_SECTOR     256
+/* A streamed read is limited to this: */
+#define CBLK_READ_MAX   (32 * 1024)
+/* Written sectors are synced once there have been no writes for this: */
+#define CBLK_IDLE_MS    500
+
+struct cblk_state {
+        int             fd;             // -1 if no image
+        uint8_t         *map;
+        uint32_t        size;
+        bool            ro;
+        char            name[PATH_MAX];
+        uint8_t         *dirty;         // Bit per sector, since last synced
+        bool            any_dirty;
+        uint64_t        last_write;
+};
+
+void            channel_block_init(struct device *d)
+{
+        d->block = calloc(1, sizeof(struct cblk_state));
+        d->block->fd = -1;
+}
+
+/* Sync the dirty sectors, a run at a time (rounded out to pages) */
+static int      cblk_flush(struct cblk_state *cs)
+{
+        uint32_t nsec = (cs->size + CBLK_SECTOR - 1) / CBLK_SECTOR;
+        uintptr_t page = sysconf(_SC_PAGESIZE);
+        unsigned int runs = 0;
+        int err = 0;
+
+        if (!cs->any_dirty)
+                return 0;
+        for (uint32_t s = 0; s < nsec; s++) {
+                if (!(cs->dirty[s / 8] & (1 << (s % 8))))
+                        continue;
+
+                uint32_t e = s;
+                while (e < nsec && (cs->dirty[e / 8] & (1 << (e % 8)))) {
+                        cs->dirty[e / 8] &= ~(1 << (e % 8));
+                        e++;
+                }
+                uintptr_t start = (uintptr_t)s * CBLK_SECTOR & ~(page - 1);
+                uintptr_t end = (uintptr_t)e * CBLK_SECTOR;
+
+                if (end > cs->size)
+                        end = cs->size;
+                if (msync(cs->map + start, end - start, MS_SYNC) < 0) {
+                        err = errno;
+                        perror("--- Image msync");
+                }
+                runs++;
+                s = e;
+        }
+        cs->any_dirty = false;
+#if DEBUG > 1
+        printf("+++ Image '%s': synced %u runs of sectors\n", cs->name, runs);
+#endif
+        return err;
+}
+
+static int      cblk_close(struct cblk_state *cs)
+{
+        int err;
+
+        if (cs->fd == -1)
+                return 0;
+        err = cblk_flush(cs);
+        munmap(cs->map, cs->size);
+        close(cs->fd);
+        free(cs->dirty);
+        cs->fd = -1;
+        cs->map = NULL;
+        cs->dirty = NULL;
+        cs->size = 0;
+        return err;
+}
+
+void            channel_block_fini(struct device *d)
+{
+        cblk_close(d->block);
+        free(d->block);
+        d->block = NULL;
+}
+
+/* Called from time to time (now is stats_now()):  sync writes once they've
+ * stopped coming
+ */
+void            channel_block_idle(struct device *d, uint64_t now)
+{
+        struct cblk_state *cs = d->block;
+
+        if (cs->any_dirty &&
+            now - cs->last_write >= CBLK_IDLE_MS * 1000000ULL)
+                cblk_flush(cs);
+}
+
+static int      cblk_open(struct cblk_state *cs, const char *name,
+                          unsigned int flags, uint32_t size)
+{
+        struct stat sb;
+        int fd;
+
+        cblk_close(cs);
+        if (flags & CBLK_CREATE) {
+                fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+                if (fd >= 0 && ftruncate(fd, size) < 0) {
+                        int err = errno;
+
+                        close(fd);
+                        return err;
+                }
+        } else {
+                fd = open(name, (flags & CBLK_RO) ? O_RDONLY : O_RDWR);
+                // Read-only, if that's all we're allowed:
+                if (fd < 0 && (errno == EACCES || errno == EROFS)) {
+                        fd = open(name, O_RDONLY);
+                        flags |= CBLK_RO;
+                }
+        }
+        if (fd < 0) {
+                int err = errno;
+
+                perror("--- Image open");
+                return err;
+        }
+        if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) || sb.st_size == 0 ||
+            sb.st_size > UINT32_MAX) {
+                printf("--- Image '%s' isn't a usable file\n", name);
+                close(fd);
+                return EINVAL;
+        }
+        cs->size = sb.st_size;
+        cs->ro = flags & CBLK_RO;
+        cs->map = mmap(NULL, cs->size, PROT_READ | (cs->ro ? 0 : PROT_WRITE),
+                       MAP_SHARED, fd, 0);
+        if (cs->map == MAP_FAILED) {
+                int err = errno;
+
+                perror("--- Image mmap");
+                close(fd);
+                cs->map = NULL;
+                cs->size = 0;
+                return err;
+        }
+        cs->dirty = calloc((cs->size / CBLK_SECTOR + 8) / 8, 1);
+        cs->any_dirty = false;
+        cs->fd = fd;
+        snprintf(cs->name, sizeof(cs->name), "%s", name);
+#if DEBUG > 0
+        printf("+++ Opened image '%s', %u bytes%s\n", name, cs->size,
+               cs->ro ? " (read-only)" : "");
+#endif
+        return 0;
+}
+
+/* Send length bytes from offset, one packet's worth at a time */
+static void     cblk_read(struct device *d, uint32_t offset, uint32_t length)
+{
+        struct cblk_state *cs = d->block;
+        struct req_ctx req = d->req;
+        uint8_t buff[PKT_MAX_PAYLOAD];
+        // Not negotiated (0) means the podule's maximum:
+        unsigned int max = d->max_pkt ? d->max_pkt : sizeof(buff);
+        uint32_t pos = 0;
+
+        max -= d->req.tagged ? CID_TAG_SIZE : 0;
+        if (!(d->caps & CAP_STREAM) && length > max)
+                length = max;
+        if (length > CBLK_READ_MAX)
+                length = CBLK_READ_MAX;
+
+        do {
+                uint32_t n = length - pos > max ? max : length - pos;
+                uint32_t at = offset + pos;
+                unsigned int len = n;
+
+                memset(buff, 0, n);
+                if (at < cs->size)
+                        memcpy(buff, cs->map + at,
+                               cs->size - at < n ? cs->size - at : n);
+                if (d->caps & CAP_COMPRESS)
+                        len = crf_pack_block(buff, n);
+                req.tag = d->req.tag + pos;
+                send_reply(d, &req, CID_BLOCK, len, buff);
+                req.st.valid = false;           // Timed on the first
+                pos += n;
+        } while (pos < length);
+        d->req.st.valid = false;
+}
+
+static int      cblk_write(struct cblk_state *cs, uint32_t offset,
+                           const uint8_t *data, unsigned int n)
+{
+        if (cs->fd == -1)
+                return EBADF;
+        if (cs->ro)
+                return EROFS;
+        if (offset > cs->size || cs->size - offset < n)
+                return ENOSPC;
+        memcpy(cs->map + offset, data, n);
+        for (uint32_t s = offset / CBLK_SECTOR;
+             n && s <= (offset + n - 1) / CBLK_SECTOR; s++)
+                cs->dirty[s / 8] |= 1 << (s % 8);
+        cs->any_dirty = true;
+        cs->last_write = stats_now();
+        return 0;
+}
+
+void            channel_block_rx(struct device *d, uint8_t *data,
+                                 unsigned int len)
+{
+        struct cblk_state *cs = d->block;
+        struct block_response resp;
+
+        memset(&resp, 0, sizeof(resp));
+        if (data[0] == CID_BLOCK_OPEN &&
+            len > sizeof(struct block_open_request)) {
+                struct block_open_request *req =
+                        (struct block_open_request *)data;
+                struct block_open_response oresp;
+                char name[PATH_MAX];
+                unsigned int nlen = len - sizeof(*req);
+
+                if (nlen >= sizeof(name))
+                        nlen = sizeof(name) - 1;
+                memcpy(name, req->name, nlen);
+                name[nlen] = '\0';
+
+                memset(&oresp, 0, sizeof(oresp));
+                oresp.success = cblk_open(cs, name, req->flags,
+                                          le32toh(req->size));
+                if (!oresp.success) {
+                        oresp.flags = cs->ro ? CBLK_RO : 0;
+                        oresp.size = htole32(cs->size);
+                }
+                send_packet(d, CID_BLOCK, sizeof(oresp), (uint8_t *)&oresp);
+        } else if (data[0] == CID_BLOCK_READ &&
+                   len >= sizeof(struct block_read_request)) {
+                struct block_read_request *req =
+                        (struct block_read_request *)data;
+
+#if DEBUG > 2
+                printf("+++ Image read offset %u, length %u\n",
+                       le32toh(req->offset), le32toh(req->length));
+#endif
+                if (cs->fd == -1) {
+                        printf("--- No image open, ignoring request!\n");
+                        return;
+                }
+                cblk_read(d, le32toh(req->offset), le32toh(req->length));
+        } else if (data[0] == CID_BLOCK_WRITE &&
+                   len >= sizeof(struct block_write_request)) {
+                struct block_write_request *req =
+                        (struct block_write_request *)data;
+
+                resp.success = cblk_write(cs, le32toh(req->offset), req->data,
+                                          len - sizeof(*req));
+#if DEBUG > 2
+                printf("+++ Image write offset %u, length %u: %d\n",
+                       le32toh(req->offset), len - (unsigned)sizeof(*req),
+                       resp.success);
+#endif
+                send_packet(d, CID_BLOCK, sizeof(resp), (uint8_t *)&resp);
+        } else if (data[0] == CID_BLOCK_CLOSE) {
+                resp.success = cblk_close(cs);
+                send_packet(d, CID_BLOCK, sizeof(resp), (uint8_t *)&resp);
+        } else if (data[0] == CID_BLOCK_FLUSH) {
+                resp.success = cs->fd == -1 ? EBADF : cblk_flush(cs);
+                send_packet(d, CID_BLOCK, sizeof(resp), (uint8_t *)&resp);
+        } else {
+                printf("block: Odd byte 0: 0x%x\n", data[0]);
+        }
+}
@@ -0,0 +1,461 @@
+/* channel_dir
+ *
+ * Directory listing:  each request returns as many entries as fit in a
+ * packet, with a cookie to carry on from.  Names are shown as RISC OS would
+ * see them, i.e. with the ",xxx" suffixes that channel_rawfile uses turned
+ * into type or load/exec (see crf_name_attrs()).
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <string.h>
+#include <endian.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "channels.h"
+#include "device.h"
+#include "image.h"
+
+
+#ifndef DEBUG
+#define DEBUG   3
+#endif
+
+
+struct dir_read_request {
+        uint8_t  opcode;
+        uint8_t  pad1[3];
+        uint32_t cookie;                // 0 to start
+        char     path[];
+};
+
+/* Followed by count entries, each:
+ *
+ *   load, exec, length (32 bits each), object type (1 file, 2 directory),
+ *   name, zero-terminated, padded to a word
+ */
+struct dir_read_response {
+        uint8_t  success;
+        uint8_t  count;
+        uint8_t  pad1[2];
+        uint32_t next;                  // Cookie to carry on with, 0 if done
+};
+
+#define CDIR_ENTRY_HDR  13
+
+struct dir_manifest_request {
+        uint8_t  opcode;
+        uint8_t  pad1[3];
+        uint32_t cookie;                // 0 to start
+        char     path[];
+};
+
+/* As dir_read_response, but each entry's name is its path from the top
+ * directory (with RISC OS '.' separators), and directories come before
+ * what's in them.
+ */
+struct dir_manifest_response {
+        uint8_t  success;
+        uint8_t  count;
+        uint8_t  pad1[2];
+        uint32_t next;                  // Cookie to carry on with, 0 if done
+        uint32_t total;                 // Bytes of entries in the manifest
+};
+
+/* Manifest paths are limited to this, with the terminator: */
+#define CDIR_MAN_NAME   256
+/* Directories deeper than this aren't descended into (links can loop): */
+#define CDIR_MAN_DEPTH  16
+
+struct cdir_man_entry {
+        uint32_t        load;
+        uint32_t        exec;
+        uint32_t        length;
+        uint8_t         type;
+        char            *name;          // Relative, RISC OS style
+        char            *host;          // Host path
+};
+
+/* Per-device channel state:  the directory last listed, read in full when
+ * a listing starts, so that carrying on is cheap and consistent.  Likewise
+ * the tree last asked for by a manifest, whose files can then be read by
+ * index (see cdir_manifest_file()).
+ */
+struct cdir_state {
+        char            path[PATH_MAX];
+        struct cdir_entry *ents;
+        unsigned int    n;
+
+        char            man_path[PATH_MAX];
+        struct cdir_man_entry *man;
+        unsigned int    man_n;
+        unsigned int    man_max;
+        uint32_t        man_bytes;
+};
+
+void            channel_dir_init(struct device *d)
+{
+        d->dir = calloc(1, sizeof(struct cdir_state));
+}
+
+static void     cdir_man_free(struct cdir_state *cs)
+{
+        for (unsigned int i = 0; i < cs->man_n; i++) {
+                free(cs->man[i].name);
+                free(cs->man[i].host);
+        }
+        free(cs->man);
+        cs->man = NULL;
+        cs->man_n = cs->man_max = 0;
+        cs->man_bytes = 0;
+        cs->man_path[0] = '\0';
+}
+
+void            channel_dir_fini(struct device *d)
+{
+        cdir_man_free(d->dir);
+        free(d->dir->ents);
+        free(d->dir);
+        d->dir = NULL;
+}
+
+/* RISC OS access attributes (owner R/W, public R/W) from a host mode */
+uint8_t         cdir_attr(mode_t mode)
+{
+        return ((mode & S_IRUSR) ? 0x01 : 0) | ((mode & S_IWUSR) ? 0x02 : 0) |
+                ((mode & S_IROTH) ? 0x10 : 0) | ((mode & S_IWOTH) ? 0x20 : 0);
+}
+
+static int      cdir_cmp(const void *a, const void *b)
+{
+        const struct cdir_entry *x = a, *y = b;
+        int c = strcmp(x->name, y->name);
+
+        return c ? c : x->rank - y->rank;
+}
+
+/* Read directory path into *ents (sorted), giving its length in *n.  The
+ * path can lead into an image (see image.c).
+ */
+int             cdir_list(const char *path, struct cdir_entry **ents,
+                          unsigned int *n)
+{
+        DIR *dir;
+        struct dirent *de;
+        unsigned int max = 0;
+        int r;
+
+        if ((r = img_list(path, ents, n)) >= 0)
+                return r;
+        *ents = NULL;
+        *n = 0;
+        if (!(dir = opendir(path[0] ? path : "."))) {
+                perror("--- Dir open");
+                return errno;
+        }
+
+        while ((de = readdir(dir)) != NULL) {
+                struct stat sb;
+
+                // Hidden, and in-progress *PCPR writes:
+                if (de->d_name[0] == '.' || strstr(de->d_name, ".pcpr~"))
+                        continue;
+                if (fstatat(dirfd(dir), de->d_name, &sb, 0) < 0)
+                        continue;
+                if (*n == max) {
+                        max = max ? max * 2 : 64;
+                        struct cdir_entry *ne = realloc(*ents,
+                                                        max * sizeof(*ne));
+                        if (!ne)
+                                break;
+                        *ents = ne;
+                }
+
+                struct cdir_entry *e = &(*ents)[(*n)++];
+
+                e->rank = crf_name_attrs(de->d_name, sb.st_mtime, e->name,
+                                         sizeof(e->name), &e->load, &e->exec);
+                snprintf(e->host, sizeof(e->host), "%s", de->d_name);
+                e->type = S_ISDIR(sb.st_mode) ? 2 : 1;
+                e->attr = cdir_attr(sb.st_mode);
+                e->length = e->type == 2 ? 0 :
+                        sb.st_size > UINT32_MAX ? UINT32_MAX : sb.st_size;
+        }
+        closedir(dir);
+
+        /* Sorted by name, so that a name with several suffixed versions
+         * shows the one that channel_rawfile would open:
+         */
+        if (*n)
+                qsort(*ents, *n, sizeof(**ents), cdir_cmp);
+        unsigned int j = 0;
+        for (unsigned int i = 0; i < *n; i++) {
+                if (j > 0 && !strcmp((*ents)[i].name, (*ents)[j - 1].name))
+                        continue;
+                (*ents)[j++] = (*ents)[i];
+        }
+        *n = j;
+        return 0;
+}
+
+static int      cdir_scan(struct cdir_state *cs, const char *path)
+{
+        int r;
+
+        free(cs->ents);
+        cs->path[0] = '\0';
+        r = cdir_list(path, &cs->ents, &cs->n);
+        if (r)
+                return r;
+        snprintf(cs->path, sizeof(cs->path), "%s", path);
+#if DEBUG > 1
+        printf("+++ Listed '%s', %u entries\n", path, cs->n);
+#endif
+        return 0;
+}
+
+/* Put an entry at buff[pos], if it fits below max.  Returns the position
+ * after it, or 0.
+ */
+static unsigned int cdir_put_entry(uint8_t *buff, unsigned int pos,
+                                   unsigned int max, uint32_t load,
+                                   uint32_t exec, uint32_t length,
+                                   uint8_t type, const char *name)
+{
+        unsigned int nlen = strlen(name);
+        unsigned int esz = (CDIR_ENTRY_HDR + nlen + 1 + 3) & ~3;
+        uint32_t w[3] = { htole32(load), htole32(exec), htole32(length) };
+
+        if (pos + esz > max)
+                return 0;
+        memset(&buff[pos], 0, esz);
+        memcpy(&buff[pos], w, sizeof(w));
+        buff[pos + 12] = type;
+        memcpy(&buff[pos + CDIR_ENTRY_HDR], name, nlen);
+        return pos + esz;
+}
+
+/* Add host directory path's contents to the manifest, named under prefix */
+static void     cdir_man_add(struct cdir_state *cs, const char *path,
+                             const char *prefix, unsigned int depth)
+{
+        struct cdir_entry *ents;
+        unsigned int n;
+
+        if (cdir_list(path, &ents, &n))
+                return;
+        for (unsigned int i = 0; i < n; i++) {
+                struct cdir_entry *e = &ents[i];
+                struct cdir_man_entry *m;
+                char name[CDIR_MAN_NAME + 1];
+                char host[PATH_MAX];
+                int nl;
+
+                // A '.' in a host name is a '/' on RISC OS, and vice versa:
+                for (char *c = e->name; *c; c++)
+                        if (*c == '.')
+                                *c = '/';
+                nl = snprintf(name, sizeof(name), "%s%s%s", prefix,
+                              prefix[0] ? "." : "", e->name);
+                if (nl >= CDIR_MAN_NAME ||
+                    snprintf(host, sizeof(host), "%s/%s", path,
+                             e->host) >= (int)sizeof(host)) {
+                        printf("--- Manifest: '%s/%s' too long, skipped\n",
+                               path, e->host);
+                        continue;
+                }
+                if (cs->man_n == cs->man_max) {
+                        unsigned int max = cs->man_max ? cs->man_max * 2 : 64;
+                        struct cdir_man_entry *nm = realloc(cs->man,
+                                                            max * sizeof(*nm));
+                        if (!nm)
+                                break;
+                        cs->man = nm;
+                        cs->man_max = max;
+                }
+                m = &cs->man[cs->man_n++];
+                m->load = e->load;
+                m->exec = e->exec;
+                m->length = e->length;
+                m->type = e->type;
+                m->name = strdup(name);
+                m->host = strdup(host);
+                cs->man_bytes += (CDIR_ENTRY_HDR + nl + 1 + 3) & ~3;
+
+                if (e->type == 2 && depth < CDIR_MAN_DEPTH)
+                        cdir_man_add(cs, host, name, depth + 1);
+        }
+        free(ents);
+}
+
+static int      cdir_man_scan(struct cdir_state *cs, const char *path)
+{
+        struct cdir_entry ie;
+        struct stat sb;
+        int r;
+
+        cdir_man_free(cs);
+        if ((r = img_stat(path, &ie)) > 0)
+                return r;
+        if (r < 0 && stat(path[0] ? path : ".", &sb) < 0) {
+                perror("--- Manifest");
+                return errno;
+        }
+        if (r < 0 ? !S_ISDIR(sb.st_mode) : ie.type != 2)
+                return ENOTDIR;
+        cdir_man_add(cs, path[0] ? path : ".", "", 0);
+        snprintf(cs->man_path, sizeof(cs->man_path), "%s", path);
+        printf("+++ Manifest of '%s', %u entries (%u bytes)\n", path,
+               cs->man_n, cs->man_bytes);
+        return 0;
+}
+
+/* Host path of file index in the last manifest, or NULL */
+const char      *cdir_manifest_file(struct device *d, uint32_t index)
+{
+        struct cdir_state *cs = d->dir;
+
+        if (index >= cs->man_n || cs->man[index].type != 1)
+                return NULL;
+        return cs->man[index].host;
+}
+
+/* Send the manifest from entry idx, as many entries as fit, or with
+ * CAP_STREAM all of it (as several responses).
+ */
+static void     cdir_manifest(struct device *d, const char *path, uint32_t idx)
+{
+        struct cdir_state *cs = d->dir;
+        uint8_t buff[PKT_MAX_PAYLOAD];
+        struct dir_manifest_response *resp =
+                (struct dir_manifest_response *)buff;
+        // Not negotiated (0) means the podule's maximum:
+        unsigned int max = d->max_pkt ? d->max_pkt : sizeof(buff);
+
+        max -= d->req.tagged ? CID_TAG_SIZE : 0;
+
+        memset(resp, 0, sizeof(*resp));
+        if (idx == 0 || !cs->man_path[0] || strcmp(path, cs->man_path))
+                resp->success = cdir_man_scan(cs, path);
+        if (resp->success) {
+                send_packet(d, CID_DIR, sizeof(*resp), buff);
+                return;
+        }
+
+        do {
+                unsigned int pos = sizeof(*resp), npos;
+
+                resp->count = 0;
+                while (idx < cs->man_n && resp->count < 255) {
+                        struct cdir_man_entry *m = &cs->man[idx];
+
+                        npos = cdir_put_entry(buff, pos, max, m->load,
+                                              m->exec, m->length, m->type,
+                                              m->name);
+                        if (!npos)
+                                break;
+                        pos = npos;
+                        idx++;
+                        resp->count++;
+                }
+                if (resp->count == 0 && idx < cs->man_n) {
+                        // Too long for the packet size agreed:
+                        resp->success = ENAMETOOLONG;
+                        pos = sizeof(*resp);
+                }
+                resp->next = htole32(idx < cs->man_n ? idx : 0);
+                resp->total = htole32(cs->man_bytes);
+                send_packet(d, CID_DIR, pos, buff);
+        } while (!resp->success && (d->caps & CAP_STREAM) &&
+                 idx < cs->man_n);
+}
+
+void            channel_dir_rx(struct device *d, uint8_t *data,
+                               unsigned int len)
+{
+        struct cdir_state *cs = d->dir;
+
+        if (data[0] == CID_DIR_READ && len >= sizeof(struct dir_read_request)) {
+                struct dir_read_request *req = (struct dir_read_request *)data;
+                uint8_t buff[PKT_MAX_PAYLOAD];
+                struct dir_read_response *resp =
+                        (struct dir_read_response *)buff;
+                char path[PATH_MAX];
+                unsigned int plen = len - sizeof(*req);
+                uint32_t idx = le32toh(req->cookie);
+                unsigned int pos = sizeof(*resp);
+                // Not negotiated (0) means the podule's maximum:
+                unsigned int max = d->max_pkt ? d->max_pkt : sizeof(buff);
+
+                max -= d->req.tagged ? CID_TAG_SIZE : 0;
+                if (plen >= sizeof(path))
+                        plen = sizeof(path) - 1;
+                memcpy(path, req->path, plen);
+                path[plen] = '\0';
+
+                memset(resp, 0, sizeof(*resp));
+                if (idx == 0 || !cs->ents || strcmp(path, cs->path))
+                        resp->success = cdir_scan(cs, path);
+
+                while (!resp->success && idx < cs->n && resp->count < 255) {
+                        struct cdir_entry *e = &cs->ents[idx];
+                        unsigned int npos;
+
+                        npos = cdir_put_entry(buff, pos, max, e->load, e->exec,
+                                              e->length, e->type, e->name);
+                        if (!npos)
+                                break;
+                        pos = npos;
+                        idx++;
+                        resp->count++;
+                }
+                resp->next = htole32(idx < cs->n ? idx : 0);
+#if DEBUG > 2
+                printf("+++ Dir '%s': %d entries, next %d\n", path,
+                       resp->count, idx < cs->n ? idx : 0);
+#endif
+                send_packet(d, CID_DIR, pos, buff);
+        } else if (data[0] == CID_DIR_MANIFEST &&
+                   len >= sizeof(struct dir_manifest_request)) {
+                struct dir_manifest_request *req =
+                        (struct dir_manifest_request *)data;
+                char path[PATH_MAX];
+                unsigned int plen = len - sizeof(*req);
+
+                if (plen >= sizeof(path))
+                        plen = sizeof(path) - 1;
+                memcpy(path, req->path, plen);
+                path[plen] = '\0';
+                cdir_manifest(d, path, le32toh(req->cookie));
+        } else {
+                printf("dir: Odd byte 0: 0x%x\n", data[0]);
+        }
+}
@@ -0,0 +1,1041 @@
+/* Filing system channel:  the host's files, by RISC OS name, for mod_pipe's
+ * FileSwitch filing system
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <endian.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "channels.h"
+#include "device.h"
+#include "image.h"
+#include "stats.h"
+
+
+#ifndef DEBUG
+#define DEBUG   3
+#endif
+
+
+/* Names are RISC OS style, from the top of the share:  "$.dir.file/txt"
+ * is dir/file.txt, found as crf_open_read() would (so maybe with a type
+ * suffix), but without regard to case.
+ */
+
+/* An object's catalogue info:  the response to STAT and DELETE (of what
+ * was deleted), and the start of OPEN's.  Type 0 is "not found", which
+ * isn't an error.
+ */
+struct fs_info {
+        uint8_t  success;
+        uint8_t  type;                  // 0 none, 1 file, 2 directory
+        uint8_t  pad1[2];
+        uint32_t load;
+        uint32_t exec;
+        uint32_t length;
+        uint32_t attr;
+};
+
+/* STAT and DELETE */
+struct fs_name_request {
+        uint8_t  opcode;
+        uint8_t  pad1[3];
+        char     name[];
+};
+
+#define CFS_OPEN_READ   0
+#define CFS_OPEN_CREATE 1               // Create, or empty
+#define CFS_OPEN_UPDATE 2
+
+struct fs_open_request {
+        uint8_t  opcode;
+        uint8_t  mode;                  // CFS_OPEN_*
+        uint8_t  pad1[2];
+        char     name[];
+};
+
+/* A file that's found has a handle; a directory doesn't */
+struct fs_open_response {
+        struct fs_info info;
+        uint32_t handle;                // Or 0
+};
+
+/* The response is as for a block channel READ:  streamed with CAP_STREAM
+ * (each part tagged with the request's tag plus its position) and packed
+ * with CAP_COMPRESS.  Past the end of the file is zeroes.
+ */
+struct fs_read_request {
+        uint8_t  opcode;
+        uint8_t  handle;
+        uint8_t  pad1[2];
+        uint32_t offset;
+        uint32_t length;
+};
+
+struct fs_write_request {
+        uint8_t  opcode;
+        uint8_t  handle;
+        uint8_t  pad1[2];
+        uint32_t offset;
+        uint8_t  data[];
+};
+
+/* Load/exec of 0/0 leaves the file's be */
+struct fs_close_request {
+        uint8_t  opcode;
+        uint8_t  handle;
+        uint8_t  pad1[2];
+        uint32_t load;
+        uint32_t exec;
+};
+
+/* FSEntry_Args on an open file.  The reasons are RISC OS's:  3 set extent
+ * (a), 4 read size (to a), 7 ensure size (a, giving it in a), 8 write b
+ * zeroes at a, 9 read load/exec (to a and b).
+ */
+struct fs_args_request {
+        uint8_t  opcode;
+        uint8_t  handle;
+        uint8_t  reason;
+        uint8_t  pad1;
+        uint32_t a;
+        uint32_t b;
+};
+
+struct fs_args_response {
+        uint8_t  success;
+        uint8_t  pad1[3];
+        uint32_t a;
+        uint32_t b;
+};
+
+/* Followed by count entries, as FSEntry_Func 15 wants them:
+ *
+ *   load, exec, length, attributes, object type (32 bits each), name,
+ *   zero-terminated, padded to a word
+ */
+struct fs_dir_request {
+        uint8_t  opcode;
+        uint8_t  pad1[3];
+        uint32_t cookie;                // 0 to start
+        char     name[];
+};
+
+struct fs_dir_response {
+        uint8_t  success;
+        uint8_t  count;
+        uint8_t  pad1[2];
+        uint32_t next;                  // Cookie to carry on with, 0 if done
+};
+
+#define CFS_ENTRY_HDR   20
+
+#define CFS_INFO_LOAD   0x01
+#define CFS_INFO_EXEC   0x02
+#define CFS_INFO_ATTR   0x04
+
+struct fs_write_info_request {
+        uint8_t  opcode;
+        uint8_t  which;                 // CFS_INFO_*
+        uint8_t  pad1[2];
+        uint32_t load;
+        uint32_t exec;
+        uint32_t attr;
+        char     name[];
+};
+
+/* A file of length (zeroes), or with type 2 a directory */
+struct fs_create_request {
+        uint8_t  opcode;
+        uint8_t  type;
+        uint8_t  pad1[2];
+        uint32_t load;
+        uint32_t exec;
+        uint32_t length;
+        char     name[];
+};
+
+/* Old name, zero-terminated, then the new */
+struct fs_rename_request {
+        uint8_t  opcode;
+        uint8_t  pad1[3];
+        char     names[];
+};
+
+/* Response to WRITE, CLOSE, WRITE_INFO, CREATE and RENAME */
+struct fs_response {
+        uint8_t  success;
+        uint8_t  pad1[3];
+};
+
+#define CFS_FILES       32
+/* Listings of this many directories are kept, each for up to CFS_DIR_MS
+ * (less, if the directory's mtime changes, or we change something in it):
+ * a *Cat followed by a *Info or load of each file costs one scan.
+ */
+#define CFS_DIRS        16
+#define CFS_DIR_MS      1000
+/* A streamed read is limited to this: */
+#define CFS_READ_MAX    (32 * 1024)
+
+struct cfs_dir {
+        char            path[PATH_MAX]; // Host path, or "" if unused
+        struct cdir_entry *ents;
+        unsigned int    n;
+        uint64_t        when;
+        struct timespec mtime;
+};
+
+struct cfs_file {
+        int             fd;             // -1 if unused
+        char            path[PATH_MAX]; // Host path
+        /* A file in an image is read-only, length bytes of fd from base;
+         * for others, length is IMG_NO_LIMIT:
+         */
+        off_t           base;
+        uint32_t        length;
+        uint32_t        load;
+        uint32_t        exec;
+};
+
+struct cfs_state {
+        struct cfs_dir  dirs[CFS_DIRS];
+        unsigned int    next_dir;
+        struct cfs_file files[CFS_FILES];
+        unsigned int    lookups;
+        unsigned int    scans;
+};
+
+void            channel_fs_init(struct device *d)
+{
+        d->fs = calloc(1, sizeof(struct cfs_state));
+        for (unsigned int i = 0; i < CFS_FILES; i++)
+                d->fs->files[i].fd = -1;
+}
+
+void            channel_fs_fini(struct device *d)
+{
+        struct cfs_state *cs = d->fs;
+
+        for (unsigned int i = 0; i < CFS_FILES; i++) {
+                if (cs->files[i].fd != -1)
+                        close(cs->files[i].fd);
+        }
+        for (unsigned int i = 0; i < CFS_DIRS; i++)
+                free(cs->dirs[i].ents);
+#if DEBUG > 0
+        if (cs->lookups)
+                printf("+++ FS: %u directory lookups, %u scans\n",
+                       cs->lookups, cs->scans);
+#endif
+        free(cs);
+        d->fs = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Names
+
+/* RISC OS leaf names have '/' where host ones have '.', and vice versa */
+static void     cfs_swap_dots(char *s)
+{
+        for (; *s; s++) {
+                if (*s == '.')
+                        *s = '/';
+                else if (*s == '/')
+                        *s = '.';
+        }
+}
+
+/* The directory a host path is in */
+static void     cfs_parent(const char *path, char *dir, size_t len)
+{
+        const char *slash = strrchr(path, '/');
+
+        if (slash)
+                snprintf(dir, len, "%.*s", (int)(slash - path), path);
+        else
+                snprintf(dir, len, ".");
+}
+
+/* Host directory path's listing, from the cache if it's fresh, or NULL
+ * (and errno).  Disc and archive images (see image.c) are directories
+ * here, which are read-only.
+ */
+static struct cfs_dir *cfs_listing(struct cfs_state *cs, const char *path)
+{
+        struct cfs_dir *cd = NULL;
+        uint64_t now = stats_now();
+        struct cdir_entry ie;
+        struct stat sb;
+        int err, in_img;
+
+        cs->lookups++;
+        if ((in_img = img_stat(path, &ie)) > 0) {
+                errno = in_img;
+                return NULL;
+        }
+        if (in_img < 0 && stat(path, &sb) < 0)
+                return NULL;
+        if (in_img < 0 ? !S_ISDIR(sb.st_mode) : ie.type != 2) {
+                errno = ENOTDIR;
+                return NULL;
+        }
+        if (in_img == 0)                // Kept for CFS_DIR_MS, then
+                memset(&sb, 0, sizeof(sb));
+        for (unsigned int i = 0; i < CFS_DIRS; i++) {
+                if (!strcmp(cs->dirs[i].path, path)) {
+                        cd = &cs->dirs[i];
+                        break;
+                }
+        }
+        if (cd && now - cd->when < CFS_DIR_MS * 1000000ULL &&
+            cd->mtime.tv_sec == sb.st_mtim.tv_sec &&
+            cd->mtime.tv_nsec == sb.st_mtim.tv_nsec)
+                return cd;
+
+        if (!cd) {
+                cd = &cs->dirs[cs->next_dir];
+                cs->next_dir = (cs->next_dir + 1) % CFS_DIRS;
+        }
+        free(cd->ents);
+        cd->ents = NULL;
+        cd->path[0] = '\0';
+        cs->scans++;
+        if ((err = cdir_list(path, &cd->ents, &cd->n)) != 0) {
+                errno = err;
+                return NULL;
+        }
+        for (unsigned int i = 0; in_img < 0 && i < cd->n; i++) {
+                struct cdir_entry *e = &cd->ents[i];
+
+                if (e->type == 1 && img_name(e->host)) {
+                        e->type = 2;
+                        e->length = 0;
+                }
+        }
+        snprintf(cd->path, sizeof(cd->path), "%s", path);
+        cd->when = now;
+        cd->mtime = sb.st_mtim;
+        return cd;
+}
+
+/* Something in host directory path has changed */
+static void     cfs_invalidate(struct cfs_state *cs, const char *path)
+{
+        for (unsigned int i = 0; i < CFS_DIRS; i++) {
+                if (!strcmp(cs->dirs[i].path, path)) {
+                        free(cs->dirs[i].ents);
+                        cs->dirs[i].ents = NULL;
+                        cs->dirs[i].path[0] = '\0';
+                }
+        }
+}
+
+static void     cfs_invalidate_parent(struct cfs_state *cs, const char *path)
+{
+        char dir[PATH_MAX];
+
+        cfs_parent(path, dir, sizeof(dir));
+        cfs_invalidate(cs, dir);
+}
+
+/* Whether host path is in an image (or is one), so can't be changed */
+static bool     cfs_in_image(const char *path)
+{
+        struct cdir_entry e;
+
+        return img_stat(path, &e) >= 0;
+}
+
+/* Leaf (in host form) in a listing:  an exact match, else one that
+ * differs only in case
+ */
+static struct cdir_entry *cfs_find(struct cfs_dir *cd, const char *leaf)
+{
+        struct cdir_entry *e = NULL;
+
+        for (unsigned int i = 0; i < cd->n; i++) {
+                if (!strcmp(cd->ents[i].name, leaf))
+                        return &cd->ents[i];
+                if (!e && !strcasecmp(cd->ents[i].name, leaf))
+                        e = &cd->ents[i];
+        }
+        return e;
+}
+
+/* Find RISC OS name on the host.  Each directory on the way is looked up
+ * in its listing, so that suffixes and case are dealt with.
+ *
+ * Returns 0 with the host path in host and its entry in *ep (NULL for the
+ * top); ENOENT if only the leaf is missing, with host being where it would
+ * go; or another errno.
+ */
+static int      cfs_resolve(struct cfs_state *cs, const char *name,
+                            char *host, size_t len, struct cdir_entry **ep)
+{
+        char cur[PATH_MAX] = ".";
+        char comp[256];
+        const char *p = name;
+
+        *ep = NULL;
+        if (p[0] == '$' && (p[1] == '.' || p[1] == '\0'))
+                p += p[1] ? 2 : 1;
+
+        while (*p) {
+                const char *dot = strchr(p, '.');
+                size_t n = dot ? (size_t)(dot - p) : strlen(p);
+                struct cfs_dir *cd;
+                struct cdir_entry *e;
+
+                if (n >= sizeof(comp))
+                        return ENAMETOOLONG;
+                memcpy(comp, p, n);
+                comp[n] = '\0';
+                p += n;
+                if (*p)
+                        p++;                            // Past the '.'
+                if (!comp[0])
+                        continue;
+                cfs_swap_dots(comp);
+
+                if ((cd = cfs_listing(cs, cur)) == NULL)
+                        return errno;
+                e = cfs_find(cd, comp);
+                if (!e || (*p && e->type != 2)) {
+                        if (*p)
+                                return ENOTDIR;
+                        if (!strcmp(cur, "."))
+                                snprintf(host, len, "%s", comp);
+                        else
+                                snprintf(host, len, "%s/%s", cur, comp);
+                        return ENOENT;
+                }
+                *ep = e;
+                if (!strcmp(cur, "."))
+                        snprintf(cur, sizeof(cur), "%s", e->host);
+                else if (strlen(cur) + 1 + strlen(e->host) < sizeof(cur))
+                        strcat(strcat(cur, "/"), e->host);
+                else
+                        return ENAMETOOLONG;
+        }
+        snprintf(host, len, "%s", cur);
+        return 0;
+}
+
+static void     cfs_info(struct fs_info *info, struct cdir_entry *e)
+{
+        memset(info, 0, sizeof(*info));
+        if (!e) {                                       // The top
+                info->type = 2;
+                return;
+        }
+        info->type = e->type;
+        info->load = htole32(e->load);
+        info->exec = htole32(e->exec);
+        info->length = htole32(e->length);
+        info->attr = htole32(e->attr);
+}
+
+/* Rename host file path (in place) for new load/exec, as crf_host_name().
+ * A file without a suffix stays that way if it's still a Data file.
+ */
+static int      cfs_retype(char *path, size_t len, uint32_t load,
+                           uint32_t exec)
+{
+        char name[256], leaf[PATH_MAX], newpath[PATH_MAX];
+        const char *slash = strrchr(path, '/');
+        const char *old = slash ? slash + 1 : path;
+        uint32_t l, x;
+        int rank = crf_name_attrs(old, 0, name, sizeof(name), &l, &x);
+
+        if (rank == 2 && (load >> 8) == 0xfffffd)
+                return 0;
+        if (crf_host_name(name, load, exec, leaf, sizeof(leaf)))
+                return ENAMETOOLONG;
+        if (snprintf(newpath, sizeof(newpath), "%.*s%s", (int)(old - path),
+                     path, leaf) >= (int)sizeof(newpath))
+                return ENAMETOOLONG;
+        if (!strcmp(newpath, path))
+                return 0;
+        if (rename(path, newpath) < 0)
+                return errno;
+#if DEBUG > 1
+        printf("+++ FS: '%s' is now '%s'\n", path, newpath);
+#endif
+        snprintf(path, len, "%s", newpath);
+        return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Operations
+
+static struct cfs_file *cfs_handle(struct cfs_state *cs, unsigned int h)
+{
+        if (h < 1 || h > CFS_FILES || cs->files[h - 1].fd == -1)
+                return NULL;
+        return &cs->files[h - 1];
+}
+
+static void     cfs_open(struct device *d, unsigned int mode, const char *name)
+{
+        struct cfs_state *cs = d->fs;
+        struct fs_open_response resp;
+        struct cdir_entry *e;
+        struct img_file img;
+        char host[PATH_MAX];
+        unsigned int h;
+        int r, fd;
+
+        memset(&resp, 0, sizeof(resp));
+        r = cfs_resolve(cs, name, host, sizeof(host), &e);
+        if (r == ENOENT && mode != CFS_OPEN_CREATE)
+                goto reply;                             // Not found
+        if (r && r != ENOENT) {
+                resp.info.success = r;
+                goto reply;
+        }
+        if (r == 0 && (!e || e->type == 2)) {
+                cfs_info(&resp.info, e);                // A directory
+                goto reply;
+        }
+        if (mode != CFS_OPEN_READ && cfs_in_image(host)) {
+                resp.info.success = EROFS;
+                goto reply;
+        }
+        for (h = 0; h < CFS_FILES && cs->files[h].fd != -1; h++)
+                ;
+        if (h == CFS_FILES) {
+                resp.info.success = EMFILE;
+                goto reply;
+        }
+
+        if (mode == CFS_OPEN_READ && (r = img_open(host, &img)) >= 0) {
+                if (r) {
+                        resp.info.success = r;
+                        goto reply;
+                }
+                cs->files[h].fd = img.fd;
+                cs->files[h].base = img.base;
+                cs->files[h].length = img.length;
+                cs->files[h].load = img.load;
+                cs->files[h].exec = img.exec;
+                snprintf(cs->files[h].path, sizeof(cs->files[h].path), "%s",
+                         host);
+                cfs_info(&resp.info, e);
+                resp.handle = htole32(h + 1);
+                goto reply;
+        }
+        if (mode == CFS_OPEN_READ)
+                fd = open(host, O_RDONLY);
+        else if (mode == CFS_OPEN_UPDATE)
+                fd = open(host, O_RDWR);
+        else
+                fd = open(host, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+                resp.info.success = errno;
+                perror("--- FS open");
+                goto reply;
+        }
+        if (mode != CFS_OPEN_READ)
+                cfs_invalidate_parent(cs, host);
+        cs->files[h].fd = fd;
+        cs->files[h].length = IMG_NO_LIMIT;
+        snprintf(cs->files[h].path, sizeof(cs->files[h].path), "%s", host);
+
+        struct stat sb;
+        char leaf[256];
+        uint32_t load, exec;
+        const char *slash = strrchr(host, '/');
+
+        fstat(fd, &sb);
+        crf_name_attrs(slash ? slash + 1 : host, sb.st_mtime, leaf,
+                       sizeof(leaf), &load, &exec);
+        resp.info.type = 1;
+        resp.info.load = htole32(load);
+        resp.info.exec = htole32(exec);
+        resp.info.length = htole32(sb.st_size > UINT32_MAX ? UINT32_MAX :
+                                   sb.st_size);
+        resp.info.attr = htole32(cdir_attr(sb.st_mode));
+        resp.handle = htole32(h + 1);
+#if DEBUG > 1
+        printf("+++ FS: opened '%s' (%u) as %u\n", host, mode, h + 1);
+#endif
+ reply:
+        send_packet(d, CID_FS, sizeof(resp), (uint8_t *)&resp);
+}
+
+/* As cblk_read(), from a file */
+static void     cfs_read(struct device *d, struct cfs_file *f, uint32_t offset,
+                         uint32_t length)
+{
+        struct req_ctx req = d->req;
+        uint8_t buff[PKT_MAX_PAYLOAD];
+        // Not negotiated (0) means the podule's maximum:
+        unsigned int max = d->max_pkt ? d->max_pkt : sizeof(buff);
+        uint32_t pos = 0;
+
+        max -= d->req.tagged ? CID_TAG_SIZE : 0;
+        if (!(d->caps & CAP_STREAM) && length > max)
+                length = max;
+        if (length > CFS_READ_MAX)
+                length = CFS_READ_MAX;
+
+        do {
+                uint32_t n = length - pos > max ? max : length - pos;
+                unsigned int len = n;
+                ssize_t r;
+
+                memset(buff, 0, n);
+                r = pread(f->fd, buff, img_avail(f->length, offset + pos, n),
+                          f->base + offset + pos);
+                if (r < 0)
+                        perror("--- FS read");
+                if (d->caps & CAP_COMPRESS)
+                        len = crf_pack_block(buff, n);
+                req.tag = d->req.tag + pos;
+                send_reply(d, &req, CID_FS, len, buff);
+                req.st.valid = false;           // Timed on the first
+                pos += n;
+        } while (pos < length);
+        d->req.st.valid = false;
+}
+
+static int      cfs_close(struct cfs_state *cs, struct cfs_file *f,
+                          uint32_t load, uint32_t exec)
+{
+        int err = 0;
+
+        if (f->length != IMG_NO_LIMIT) {                // In an image
+                close(f->fd);
+                f->fd = -1;
+                return 0;
+        }
+        if (load || exec) {
+                err = cfs_retype(f->path, sizeof(f->path), load, exec);
+                crf_set_stamp(f->fd, load, exec);
+        }
+        if (close(f->fd) < 0 && !err)
+                err = errno;
+        f->fd = -1;
+        cfs_invalidate_parent(cs, f->path);
+        return err;
+}
+
+static int      cfs_args(struct cfs_file *f, struct fs_args_request *req,
+                         struct fs_args_response *resp)
+{
+        uint32_t a = le32toh(req->a), b = le32toh(req->b);
+        struct stat sb;
+
+        if (f->length != IMG_NO_LIMIT) {                // In an image
+                if (req->reason == 4) {
+                        a = f->length;
+                } else if (req->reason == 9) {
+                        a = f->load;
+                        b = f->exec;
+                } else {
+                        return req->reason == 3 || req->reason == 7 ||
+                                req->reason == 8 ? EROFS : EINVAL;
+                }
+                resp->a = htole32(a);
+                resp->b = htole32(b);
+                return 0;
+        }
+        if (fstat(f->fd, &sb) < 0)
+                return errno;
+        switch (req->reason) {
+        case 3:                                         // Set extent
+                if (ftruncate(f->fd, a) < 0)
+                        return errno;
+                break;
+        case 4:                                         // Read size
+                a = sb.st_size > UINT32_MAX ? UINT32_MAX : sb.st_size;
+                break;
+        case 7:                                         // Ensure size
+                if (sb.st_size < a && ftruncate(f->fd, a) < 0)
+                        return errno;
+                if (sb.st_size > a)
+                        a = sb.st_size > UINT32_MAX ? UINT32_MAX : sb.st_size;
+                break;
+        case 8: {                                       // Write zeroes
+                static const uint8_t zero[4096];
+
+                while (b) {
+                        uint32_t n = b > sizeof(zero) ? sizeof(zero) : b;
+
+                        if (pwrite(f->fd, zero, n, a) != (ssize_t)n)
+                                return errno ? errno : ENOSPC;
+                        a += n;
+                        b -= n;
+                }
+                break;
+        }
+        case 9: {                                       // Read load/exec
+                const char *slash = strrchr(f->path, '/');
+                char leaf[256];
+
+                crf_name_attrs(slash ? slash + 1 : f->path, sb.st_mtime, leaf,
+                               sizeof(leaf), &a, &b);
+                break;
+        }
+        default:
+                return EINVAL;
+        }
+        resp->a = htole32(a);
+        resp->b = htole32(b);
+        return 0;
+}
+
+static void     cfs_read_dir(struct device *d, const char *name, uint32_t idx)
+{
+        struct cfs_state *cs = d->fs;
+        uint8_t buff[PKT_MAX_PAYLOAD];
+        struct fs_dir_response *resp = (struct fs_dir_response *)buff;
+        // Not negotiated (0) means the podule's maximum:
+        unsigned int max = d->max_pkt ? d->max_pkt : sizeof(buff);
+        unsigned int pos = sizeof(*resp);
+        struct cdir_entry *e;
+        struct cfs_dir *cd = NULL;
+        char host[PATH_MAX];
+        int r;
+
+        max -= d->req.tagged ? CID_TAG_SIZE : 0;
+        memset(resp, 0, sizeof(*resp));
+        r = cfs_resolve(cs, name, host, sizeof(host), &e);
+        if (!r && e && e->type != 2)
+                r = ENOTDIR;
+        if (!r && (cd = cfs_listing(cs, host)) == NULL)
+                r = errno;
+        resp->success = r;
+
+        while (cd && idx < cd->n && resp->count < 255) {
+                struct cdir_entry *de = &cd->ents[idx];
+                unsigned int nlen = strlen(de->name);
+                unsigned int esz = (CFS_ENTRY_HDR + nlen + 1 + 3) & ~3;
+                uint32_t w[5] = { htole32(de->load), htole32(de->exec),
+                                  htole32(de->length), htole32(de->attr),
+                                  htole32(de->type) };
+
+                if (pos + esz > max)
+                        break;
+                memset(&buff[pos], 0, esz);
+                memcpy(&buff[pos], w, sizeof(w));
+                memcpy(&buff[pos + CFS_ENTRY_HDR], de->name, nlen);
+                cfs_swap_dots((char *)&buff[pos + CFS_ENTRY_HDR]);
+                pos += esz;
+                idx++;
+                resp->count++;
+        }
+        resp->next = htole32(cd && idx < cd->n ? idx : 0);
+#if DEBUG > 2
+        printf("+++ FS: dir '%s': %d entries, next %d\n", name, resp->count,
+               le32toh(resp->next));
+#endif
+        send_packet(d, CID_FS, pos, buff);
+}
+
+static int      cfs_write_info(struct cfs_state *cs,
+                               struct fs_write_info_request *req,
+                               const char *name)
+{
+        struct cdir_entry *e;
+        char host[PATH_MAX];
+        uint32_t load, exec;
+        int r, fd;
+
+        if ((r = cfs_resolve(cs, name, host, sizeof(host), &e)) != 0)
+                return r;
+        if (!e)
+                return EPERM;                           // The top
+        if (cfs_in_image(host))
+                return EROFS;
+        cfs_invalidate_parent(cs, host);
+        if (req->which & CFS_INFO_ATTR) {
+                struct stat sb;
+                uint32_t attr = le32toh(req->attr);
+                mode_t m;
+
+                if (stat(host, &sb) < 0)
+                        return errno;
+                m = sb.st_mode & ~0666;
+                m |= (attr & 0x01) ? S_IRUSR : 0;
+                m |= (attr & 0x02) ? S_IWUSR : 0;
+                m |= (attr & 0x10) ? S_IRGRP | S_IROTH : 0;
+                m |= (attr & 0x20) ? S_IWGRP | S_IWOTH : 0;
+                if (chmod(host, m) < 0)
+                        return errno;
+        }
+        if (!(req->which & (CFS_INFO_LOAD | CFS_INFO_EXEC)) || e->type == 2)
+                return 0;
+
+        load = (req->which & CFS_INFO_LOAD) ? le32toh(req->load) : e->load;
+        exec = (req->which & CFS_INFO_EXEC) ? le32toh(req->exec) : e->exec;
+        if ((r = cfs_retype(host, sizeof(host), load, exec)) != 0)
+                return r;
+        if ((fd = open(host, O_RDONLY)) >= 0) {
+                crf_set_stamp(fd, load, exec);
+                close(fd);
+        }
+        return 0;
+}
+
+static void     cfs_delete(struct device *d, const char *name)
+{
+        struct cfs_state *cs = d->fs;
+        struct fs_info resp;
+        struct cdir_entry *e;
+        char host[PATH_MAX];
+        int r;
+
+        memset(&resp, 0, sizeof(resp));
+        r = cfs_resolve(cs, name, host, sizeof(host), &e);
+        if (r == 0 && !e)
+                r = EPERM;                              // The top
+        if (r == 0 && cfs_in_image(host))
+                r = EROFS;
+        if (r == 0) {
+                cfs_info(&resp, e);
+                if ((e->type == 2 ? rmdir(host) : unlink(host)) < 0)
+                        r = errno;
+                cfs_invalidate_parent(cs, host);
+                cfs_invalidate(cs, host);
+        }
+        if (r != ENOENT)
+                resp.success = r;
+        send_packet(d, CID_FS, sizeof(resp), (uint8_t *)&resp);
+}
+
+static int      cfs_create(struct cfs_state *cs, struct fs_create_request *req,
+                           const char *name)
+{
+        uint32_t load = le32toh(req->load), exec = le32toh(req->exec);
+        struct cdir_entry *e;
+        char host[PATH_MAX];
+        int r, fd;
+
+        r = cfs_resolve(cs, name, host, sizeof(host), &e);
+        if (r && r != ENOENT)
+                return r;
+        if (cfs_in_image(host))
+                return EROFS;
+        cfs_invalidate_parent(cs, host);
+        if (req->type == 2) {
+                if (r == 0)
+                        return (e && e->type == 1) ? EEXIST : 0;
+                return mkdir(host, 0777) < 0 ? errno : 0;
+        }
+        if (r == 0 && (!e || e->type == 2))
+                return EISDIR;
+        if (r == ENOENT) {
+                char path[PATH_MAX];
+
+                if (crf_host_name(host, load, exec, path, sizeof(path)))
+                        return ENAMETOOLONG;
+                snprintf(host, sizeof(host), "%s", path);
+        } else if ((r = cfs_retype(host, sizeof(host), load, exec)) != 0) {
+                return r;
+        }
+        if ((fd = open(host, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0)
+                return errno;
+        r = ftruncate(fd, le32toh(req->length)) < 0 ? errno : 0;
+        crf_set_stamp(fd, load, exec);
+        close(fd);
+        return r;
+}
+
+/* The host file keeps its suffix (so its type) under the new name */
+static int      cfs_rename(struct cfs_state *cs, const char *from,
+                           const char *to)
+{
+        struct cdir_entry *e, *te;
+        char host[PATH_MAX], thost[PATH_MAX], path[PATH_MAX];
+        int r;
+
+        if ((r = cfs_resolve(cs, from, host, sizeof(host), &e)) != 0)
+                return r;
+        if (!e)
+                return EPERM;
+        r = cfs_resolve(cs, to, thost, sizeof(thost), &te);
+        if (r == 0)
+                return EEXIST;
+        if (r != ENOENT)
+                return r;
+        if (cfs_in_image(host) || cfs_in_image(thost))
+                return EROFS;
+        if (snprintf(path, sizeof(path), "%s%s", thost,
+                     e->host + strlen(e->name)) >= (int)sizeof(path))
+                return ENAMETOOLONG;
+        if (rename(host, path) < 0)
+                return errno;
+        cfs_invalidate_parent(cs, host);
+        cfs_invalidate_parent(cs, path);
+        cfs_invalidate(cs, host);
+        return 0;
+}
+
+/* Copy the name after a request's header, zero-terminated */
+static void     cfs_name(char *name, const void *from, unsigned int len)
+{
+        if (len >= PATH_MAX)
+                len = PATH_MAX - 1;
+        memcpy(name, from, len);
+        name[len] = '\0';
+}
+
+void            channel_fs_rx(struct device *d, uint8_t *data, unsigned int len)
+{
+        struct cfs_state *cs = d->fs;
+        struct fs_response resp;
+        char name[PATH_MAX];
+
+        memset(&resp, 0, sizeof(resp));
+        if ((data[0] == CID_FS_STAT || data[0] == CID_FS_DELETE) &&
+            len >= sizeof(struct fs_name_request)) {
+                struct fs_name_request *req = (struct fs_name_request *)data;
+
+                cfs_name(name, req->name, len - sizeof(*req));
+                if (data[0] == CID_FS_DELETE) {
+                        cfs_delete(d, name);
+                } else {
+                        struct fs_info info;
+                        struct cdir_entry *e;
+                        char host[PATH_MAX];
+                        int r = cfs_resolve(cs, name, host, sizeof(host), &e);
+
+                        cfs_info(&info, e);
+                        if (r) {
+                                memset(&info, 0, sizeof(info));
+                                info.success = r == ENOENT ? 0 : r;
+                        }
+#if DEBUG > 2
+                        printf("+++ FS: stat '%s': type %d\n", name,
+                               info.type);
+#endif
+                        send_packet(d, CID_FS, sizeof(info),
+                                    (uint8_t *)&info);
+                }
+        } else if (data[0] == CID_FS_OPEN &&
+                   len >= sizeof(struct fs_open_request)) {
+                struct fs_open_request *req = (struct fs_open_request *)data;
+
+                cfs_name(name, req->name, len - sizeof(*req));
+                cfs_open(d, req->mode, name);
+        } else if (data[0] == CID_FS_READ &&
+                   len >= sizeof(struct fs_read_request)) {
+                struct fs_read_request *req = (struct fs_read_request *)data;
+                struct cfs_file *f = cfs_handle(cs, req->handle);
+
+                if (!f) {
+                        printf("--- FS: read of bad handle %d, ignoring\n",
+                               req->handle);
+                        return;
+                }
+                cfs_read(d, f, le32toh(req->offset), le32toh(req->length));
+        } else if (data[0] == CID_FS_WRITE &&
+                   len >= sizeof(struct fs_write_request)) {
+                struct fs_write_request *req = (struct fs_write_request *)data;
+                struct cfs_file *f = cfs_handle(cs, req->handle);
+                unsigned int n = len - sizeof(*req);
+
+                if (!f)
+                        resp.success = EBADF;
+                else if (f->length != IMG_NO_LIMIT)
+                        resp.success = EROFS;
+                else if (pwrite(f->fd, req->data, n, le32toh(req->offset)) !=
+                         (ssize_t)n)
+                        resp.success = errno ? errno : ENOSPC;
+                send_packet(d, CID_FS, sizeof(resp), (uint8_t *)&resp);
+        } else if (data[0] == CID_FS_CLOSE &&
+                   len >= sizeof(struct fs_close_request)) {
+                struct fs_close_request *req = (struct fs_close_request *)data;
+                struct cfs_file *f = cfs_handle(cs, req->handle);
+
+                resp.success = f ? cfs_close(cs, f, le32toh(req->load),
+                                             le32toh(req->exec)) : EBADF;
+                send_packet(d, CID_FS, sizeof(resp), (uint8_t *)&resp);
+        } else if (data[0] == CID_FS_ARGS &&
+                   len >= sizeof(struct fs_args_request)) {
+                struct fs_args_request *req = (struct fs_args_request *)data;
+                struct cfs_file *f = cfs_handle(cs, req->handle);
+                struct fs_args_response aresp;
+
+                memset(&aresp, 0, sizeof(aresp));
+                aresp.success = f ? cfs_args(f, req, &aresp) : EBADF;
+                if (f && req->reason != 4 && req->reason != 9)
+                        cfs_invalidate_parent(cs, f->path);
+                send_packet(d, CID_FS, sizeof(aresp), (uint8_t *)&aresp);
+        } else if (data[0] == CID_FS_READ_DIR &&
+                   len >= sizeof(struct fs_dir_request)) {
+                struct fs_dir_request *req = (struct fs_dir_request *)data;
+
+                cfs_name(name, req->name, len - sizeof(*req));
+                cfs_read_dir(d, name, le32toh(req->cookie));
+        } else if (data[0] == CID_FS_WRITE_INFO &&
+                   len >= sizeof(struct fs_write_info_request)) {
+                struct fs_write_info_request *req =
+                        (struct fs_write_info_request *)data;
+
+                cfs_name(name, req->name, len - sizeof(*req));
+                resp.success = cfs_write_info(cs, req, name);
+                send_packet(d, CID_FS, sizeof(resp), (uint8_t *)&resp);
+        } else if (data[0] == CID_FS_CREATE &&
+                   len >= sizeof(struct fs_create_request)) {
+                struct fs_create_request *req =
+                        (struct fs_create_request *)data;
+
+                cfs_name(name, req->name, len - sizeof(*req));
+                resp.success = cfs_create(cs, req, name);
+                send_packet(d, CID_FS, sizeof(resp), (uint8_t *)&resp);
+        } else if (data[0] == CID_FS_RENAME &&
+                   len >= sizeof(struct fs_rename_request)) {
+                struct fs_rename_request *req =
+                        (struct fs_rename_request *)data;
+                unsigned int from_len;
+
+                cfs_name(name, req->names, len - sizeof(*req));
+                from_len = strlen(name) + 1;
+                if (from_len >= len - sizeof(*req)) {
+                        resp.success = EINVAL;
+                } else {
+                        char to[PATH_MAX];
+
+                        cfs_name(to, req->names + from_len,
+                                 len - sizeof(*req) - from_len);
+                        resp.success = cfs_rename(cs, name, to);
+                }
+                send_packet(d, CID_FS, sizeof(resp), (uint8_t *)&resp);
+        } else {
+                printf("fs: Odd byte 0: 0x%x\n", data[0]);
+        }
+}
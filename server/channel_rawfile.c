@@ -1,7 +1,8 @@
 /* channel_rawfile
  *
  * World's simplest host file access:  responds to messages to open a file,
- * access blocks, and close the file.
+ * access blocks, and close the file.  Files can be written too:  the data
+ * goes into a temporary file, which replaces the real one on commit.
  *
  * Supports basic file type mapping (using filename suffixes in the host FS).
  *
@@ -45,12 +46,18 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <glob.h>
+#include <fnmatch.h>
 #include <limits.h>
 
 #include "channels.h"
+#include "device.h"
+#include "image.h"
+#include "io.h"
 
 
+#ifndef DEBUG
 #define DEBUG   3
+#endif
 
 
 struct init_read_response {
@@ -68,14 +75,156 @@ struct read_block_request {
         uint32_t size;
 };
 
-static int     current_file = -1;
-static uint8_t read_buff[512];
+/* With CAP_COMPRESS, a block that ends in a run of one byte value (e.g. a
+ * sector of zeroes, or an unused part of one) is sent as the data up to the
+ * run, padded to a word, and then a word holding the run's byte.  Such a
+ * response is shorter than the size asked for, which is how the Arc tells
+ * it apart; it fills the rest of the block in, rather than copying it out
+ * of the podule a byte at a time.
+ */
+struct read_block_run {
+        uint8_t  byte;
+        uint8_t  pad1[3];
+};
+
+/* ReadBlock from file index in the last CID_DIR_MANIFEST, which is opened
+ * as needed:  a tree can be copied without a round trip to open each file.
+ */
+struct read_entry_request {
+        uint8_t  opcode;
+        uint8_t  pad1[3];
+        uint32_t offset;
+        uint32_t size;
+        uint32_t index;
+};
+
+/* Compare count blocks of a manifest file from offset (block-aligned) with
+ * the Arc's copy, by checksum (see crf_block_sum()).  The response has a
+ * bit set for each block that differs, so that only those are fetched.
+ */
+#define CRF_SUM_BLOCK   512
+#define CRF_SUM_MAX     32
+
+struct sum_blocks_request {
+        uint8_t  opcode;
+        uint8_t  pad1[3];
+        uint32_t index;
+        uint32_t offset;
+        uint32_t count;
+        uint32_t sums[][2];
+};
+
+struct sum_blocks_response {
+        uint8_t  success;
+        uint8_t  pad1[3];
+        uint32_t differ;                // Bit n:  block n differs
+};
+
+struct init_write_request {
+        uint8_t  opcode;
+        uint8_t  pad1[3];
+        uint32_t load;
+        uint32_t exec;
+        char     name[];
+};
+
+struct write_block_request {
+        uint8_t  opcode;
+        uint8_t  pad1[3];
+        uint32_t offset;
+        uint8_t  data[];
+};
+
+/* Response to INIT_WRITE, WRITE_BLOCK and COMMIT */
+struct write_response {
+        uint8_t  success;
+        uint8_t  pad1[3];
+};
+
+/* Written blocks are gathered into chunks of up to this, aligned to it in
+ * the file, before being written out.  The Arc's blocks are acknowledged
+ * as they're gathered; a write error is reported by the next response.
+ */
+#define CRF_WB_SIZE     (64 * 1024)
+
+/* In a write's temporary name, after the name it'll be given */
+#define CRF_TMP_MARK    ".pcpr~"
+
+struct crf_write;
+
+struct crf_wbuf {
+        struct crf_write *w;
+        uint32_t        offset;
+        unsigned int    len;
+        uint8_t         buff[CRF_WB_SIZE];
+};
+
+/* A file being written.  This can outlive the request that abandons it,
+ * until its chunks have been written.
+ */
+struct crf_write {
+        struct device   *d;
+        int             fd;
+        char            name[PATH_MAX];         // As given
+        char            path[PATH_MAX];         // Plus type suffix
+        char            tmp[PATH_MAX + 16];     // Or "" once renamed
+        uint32_t        load;
+        uint32_t        exec;
+        struct crf_wbuf *wb;                    // Being gathered
+        unsigned int    inflight;               // Chunk writes, or fsync
+        int             err;                    // First error (errno)
+        bool            committing;
+        bool            aborted;
+        struct req_ctx  commit_req;
+};
+
+/* Per-device channel state: */
+struct crf_state {
+        int             current_file;
+        off_t           base;                   // Where it is, in an image
+        uint32_t        length;                 // Or IMG_NO_LIMIT
+        uint32_t        entry;                  // Manifest index, if open
+        struct crf_write *write;
+};
+
+#define CRF_NO_ENTRY    0xffffffff
+
+static void     crf_write_abort(struct crf_state *cs);
+
+/* One outstanding READ_BLOCK.  Tagged requests can have several of these
+ * in flight, completing in whatever order the disc gets to them.
+ */
+struct crf_read {
+        struct device   *d;
+        struct req_ctx  req;
+        unsigned int    size;
+        uint8_t         buff[PKT_MAX_PAYLOAD];
+};
+
+/* One outstanding SUM_BLOCKS */
+struct crf_sums {
+        struct device   *d;
+        struct req_ctx  req;
+        unsigned int    count;
+        uint32_t        sums[CRF_SUM_MAX][2];
+        uint8_t         buff[CRF_SUM_MAX * CRF_SUM_BLOCK];
+};
 
-void            channel_rawfile_init(void)
+void            channel_rawfile_init(struct device *d)
 {
-        if (current_file != -1)
-                close(current_file);
-        current_file = -1;
+        d->rawfile = calloc(1, sizeof(struct crf_state));
+        d->rawfile->current_file = -1;
+        d->rawfile->length = IMG_NO_LIMIT;
+        d->rawfile->entry = CRF_NO_ENTRY;
+}
+
+void            channel_rawfile_fini(struct device *d)
+{
+        if (d->rawfile->current_file != -1)
+                close(d->rawfile->current_file);
+        crf_write_abort(d->rawfile);
+        free(d->rawfile);
+        d->rawfile = NULL;
 }
 
 /* Acorn time is 40-bit, centiseconds from midnight 1 Jan 1900.
@@ -88,6 +237,11 @@ static  uint64_t crf_atime_from_time_t(time_t t)
         return at;
 }
 
+static  time_t  crf_time_t_from_atime(uint64_t at)
+{
+        return at / 100 - (time_t)(70 * 365.2425 * 24 * 60 * 60);
+}
+
 static  void    crf_create_type(uint16_t type, time_t timestamp,
                                 uint32_t *load, uint32_t *exec)
 {
@@ -97,6 +251,102 @@ static  void    crf_create_type(uint16_t type, time_t timestamp,
         *exec = at & 0xffffffff;
 }
 
+/* Length of a block's response, packing any run at its end as described
+ * at struct read_block_run, or its size if that wouldn't be shorter.  Also
+ * used for channel_block's reads.
+ */
+unsigned int    crf_pack_block(uint8_t *b, unsigned int size)
+{
+        unsigned int lit = size;
+        struct read_block_run *run;
+
+        if (size == 0)
+                return 0;
+        while (lit > 0 && b[lit - 1] == b[size - 1])
+                lit--;
+        lit = (lit + 3) & ~3;
+        if (lit + sizeof(*run) >= size)
+                return size;
+        run = (struct read_block_run *)&b[lit];
+        run->byte = b[size - 1];
+        memset(run->pad1, 0, sizeof(run->pad1));
+        return lit + sizeof(*run);
+}
+
+static  void    crf_read_done(void *ctx, int res)
+{
+        struct crf_read *rd = ctx;
+        struct device *d = rd->d;
+        unsigned int len = rd->size;
+
+        d->io_inflight--;
+        if (!d->hup) {
+                if (res < 0)
+                        printf("--- Read block error %d\n", -res);
+                /* Always respond with the requested size, as the Arc is
+                 * expecting it; short reads leave zeroes.
+                 */
+                if (d->caps & CAP_COMPRESS)
+                        len = crf_pack_block(rd->buff, rd->size);
+#if DEBUG > 2
+                if (len != rd->size)
+                        printf("+++ Packed block of %u to %u\n",
+                               rd->size, len);
+#endif
+                send_reply(d, &rd->req, CID_RAWFILE, len, rd->buff);
+        }
+        free(rd);
+}
+
+/* A block's checksum, as mod_pipe works it out:  over its little-endian
+ * words, s1 is their sum and s2 the sum of each s1 so far (Fletcher's,
+ * with 32-bit sums).  That's two adds a word on an ARM2.
+ */
+static  void    crf_block_sum(const uint8_t *b, uint32_t *s1, uint32_t *s2)
+{
+        uint32_t a = 0, c = 0;
+
+        for (unsigned int i = 0; i < CRF_SUM_BLOCK; i += 4) {
+                a += b[i] | (b[i + 1] << 8) | (b[i + 2] << 16) |
+                        ((uint32_t)b[i + 3] << 24);
+                c += a;
+        }
+        *s1 = a;
+        *s2 = c;
+}
+
+static  void    crf_sums_done(void *ctx, int res)
+{
+        struct crf_sums *cs = ctx;
+        struct device *d = cs->d;
+        struct sum_blocks_response response;
+
+        d->io_inflight--;
+        memset(&response, 0, sizeof(response));
+        if (res < 0) {
+                printf("--- Sum blocks read error %d\n", -res);
+                response.success = -res;
+        }
+        // Past the end (short read) is zeroes, as calloc() left it:
+        for (unsigned int i = 0; i < cs->count && res >= 0; i++) {
+                uint32_t s1, s2;
+
+                crf_block_sum(&cs->buff[i * CRF_SUM_BLOCK], &s1, &s2);
+                if (s1 != le32toh(cs->sums[i][0]) ||
+                    s2 != le32toh(cs->sums[i][1]))
+                        response.differ |= 1U << i;
+        }
+#if DEBUG > 2
+        printf("+++ Sum blocks: %u, differ 0x%08x\n", cs->count,
+               response.differ);
+#endif
+        response.differ = htole32(response.differ);
+        if (!d->hup)
+                send_reply(d, &cs->req, CID_RAWFILE, sizeof(response),
+                           (uint8_t *)&response);
+        free(cs);
+}
+
 // Turn a filename in format 'filename,([0-9a-f]{3})' into a numeric type:
 static  uint16_t crf_parse_type(char *pathname)
 {
@@ -123,19 +373,107 @@ static  void    crf_parse_lx(char *pathname, uint32_t *load, uint32_t *exec)
         }
 }
 
+/* Split a host filename's ",xxx" or ",load-exec" suffix (as looked for by
+ * crf_open_read()) off into name, giving the file's load/exec.  A typed
+ * file's timestamp comes from mtime.  Without a suffix, it's a Data file
+ * (also stamped), so that a sync can tell when it's changed.
+ *
+ * Returns 0 for a type suffix, 1 for load/exec and 2 for none:  the order
+ * in which crf_open_read() prefers them.
+ */
+int             crf_name_attrs(const char *fname, time_t mtime, char *name,
+                               size_t namelen, uint32_t *load, uint32_t *exec)
+{
+        char    buf[PATH_MAX];
+        char    *c;
+        int     r;
+
+        strncpy(buf, fname, sizeof(buf) - 1);
+        buf[sizeof(buf) - 1] = '\0';
+        *load = 0xfff00000 | (0xffd << 8);             // Filetype: Data
+        *exec = 0;
+
+        if (fnmatch("*,[0-9a-f][0-9a-f][0-9a-f]", buf, 0) == 0) {
+                crf_create_type(crf_parse_type(buf), mtime, load, exec);
+                r = 0;
+        } else if (fnmatch("*,[0-9a-f]*-[0-9a-f]*", buf, 0) == 0) {
+                crf_parse_lx(buf, load, exec);
+                r = 1;
+        } else {
+                crf_create_type(0xffd, mtime, load, exec);
+                snprintf(name, namelen, "%s", buf);
+                return 2;
+        }
+        c = rindex(buf, ',');
+        *c = '\0';
+        snprintf(name, namelen, "%s", buf);
+        return r;
+}
+
+/* Host name for a file called name with load/exec:  with a ",xxx" suffix if
+ * it's typed, else ",load-exec", as crf_open_read() looks for.  Returns
+ * ENAMETOOLONG if it doesn't fit.
+ */
+int             crf_host_name(const char *name, uint32_t load, uint32_t exec,
+                              char *path, size_t len)
+{
+        int n;
+
+        if ((load >> 20) == 0xfff)
+                n = snprintf(path, len, "%s,%03x", name, (load >> 8) & 0xfff);
+        else
+                n = snprintf(path, len, "%s,%x-%x", name, load, exec);
+        return (n < 0 || n >= (int)len) ? ENAMETOOLONG : 0;
+}
+
+/* A typed file's load/exec hold a timestamp:  give the file that mtime */
+void            crf_set_stamp(int fd, uint32_t load, uint32_t exec)
+{
+        struct timespec ts[2];
+
+        if ((load >> 20) != 0xfff)
+                return;
+        ts[0].tv_sec = 0;
+        ts[0].tv_nsec = UTIME_OMIT;
+        ts[1].tv_sec = crf_time_t_from_atime(((uint64_t)(load & 0xff) << 32) |
+                                             exec);
+        ts[1].tv_nsec = 0;
+        futimens(fd, ts);
+}
+
 /* Opens the given filename for reading.
  * Looks for ",xxx" and ",xxxx-xxxx" alternative files to get type/load/exec
  * metadata; returns into load/exec parameters.  (Same format as HostFS, FWIW.)
  */
-static int      crf_open_read(char *filename, uint32_t *load, uint32_t *exec)
+static int      crf_open_read(struct crf_state *cs, char *filename,
+                              uint32_t *load, uint32_t *exec)
 {
-        if (current_file != -1)
-                close(current_file);
+        struct img_file f;
+        int r;
+
+        if (cs->current_file != -1)
+                close(cs->current_file);
+        cs->current_file = -1;
+        cs->entry = CRF_NO_ENTRY;
+        cs->base = 0;
+        cs->length = IMG_NO_LIMIT;
 
         printf("+++ Opening '%s'\n", filename);
 
-        // Default Arc file attributes:
-        uint16_t ftype = 0xffff;                        // If <= 0xfff, filetype
+        // In an image, the image has its type and stamp:
+        if ((r = img_open(filename, &f)) >= 0) {
+                if (r)
+                        return r;
+                cs->current_file = f.fd;
+                cs->base = f.base;
+                cs->length = f.length;
+                *load = f.load;
+                *exec = f.exec;
+                return 0;
+        }
+
+        // Default Arc file attributes, a Data file stamped as typed ones:
+        uint16_t ftype = 0xffd;                         // If <= 0xfff, filetype
         *load = 0xfff00000 | (0xffd << 8);              // Filetype: Data
         *exec = 0;
 
@@ -179,6 +517,7 @@ static int      crf_open_read(char *filename, uint32_t *load, uint32_t *exec)
                         ofn = pathname;
 
                         crf_parse_lx(pathname, load, exec);
+                        ftype = 0xffff;
 #if DEBUG > 1
                         printf("(Found %s with load 0x%x/exec 0x%x)\n",
                                gt.gl_pathv[0], *load, *exec);
@@ -191,10 +530,10 @@ static int      crf_open_read(char *filename, uint32_t *load, uint32_t *exec)
                 globfree(&gt);
         // Else, just try given pathname.
 
-        current_file = open(ofn, O_RDONLY);
+        cs->current_file = open(ofn, O_RDONLY);
 
-        if (current_file < 0) {
-                current_file = -1;
+        if (cs->current_file < 0) {
+                cs->current_file = -1;
                 perror("--- File open for read");
                 return errno;
         }
@@ -202,35 +541,332 @@ static int      crf_open_read(char *filename, uint32_t *load, uint32_t *exec)
         if (ftype <= 0xfff) {
                 // File has a type.  Create attributes, together with mtime:
                 struct stat sb;
-                fstat(current_file, &sb);
+                fstat(cs->current_file, &sb);
                 crf_create_type(ftype, sb.st_mtime, load, exec);
         }
 
         return 0;
 }
 
-void            channel_rawfile_rx(uint8_t *data, unsigned int len)
+////////////////////////////////////////////////////////////////////////////////
+// Writing
+
+static void     crf_write_free(struct crf_write *w)
+{
+        if (w->fd >= 0)
+                close(w->fd);
+        if (w->tmp[0])
+                unlink(w->tmp);
+        free(w->wb);
+        free(w);
+}
+
+/* Drop the current write, without committing it */
+static void     crf_write_abort(struct crf_state *cs)
+{
+        struct crf_write *w = cs->write;
+
+        if (!w)
+                return;
+        printf("--- Abandoning write of '%s'\n", w->name);
+        cs->write = NULL;
+        w->aborted = true;
+        if (w->inflight == 0)
+                crf_write_free(w);
+}
+
+/* Opens a temporary file next to the one to be written, which is named
+ * with a ",xxx" or ",load-exec" suffix as crf_open_read() looks for.  The
+ * temporary name can still match a ",load-exec" pattern (its suffix has
+ * a '-' in it), so crf_unlink_alternatives() skips temporary names.
+ */
+static int      crf_open_write(struct crf_write *w, const char *name,
+                               uint32_t load, uint32_t exec)
+{
+        snprintf(w->name, sizeof(w->name), "%s", name);
+        w->load = load;
+        w->exec = exec;
+        if (crf_host_name(name, load, exec, w->path, sizeof(w->path)))
+                return ENAMETOOLONG;
+        snprintf(w->tmp, sizeof(w->tmp), "%s" CRF_TMP_MARK "XXXXXX", w->path);
+
+        printf("+++ Writing '%s'\n", w->path);
+        w->fd = mkstemp(w->tmp);
+        if (w->fd < 0) {
+                w->tmp[0] = '\0';
+                perror("--- File open for write");
+                return errno;
+        }
+        // mkstemp() makes it private; give it the usual permissions:
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(w->fd, 0666 & ~mask);
+        return 0;
+}
+
+static  void    crf_commit(struct crf_write *w);
+
+static  void    crf_write_done(void *ctx, int res)
+{
+        struct crf_wbuf *wb = ctx;
+        struct crf_write *w = wb->w;
+
+        w->d->io_inflight--;
+        w->inflight--;
+        if (res != (int)wb->len && !w->err) {
+                printf("--- Write error %d\n", -res);
+                w->err = res < 0 ? -res : EIO;
+        }
+        free(wb);
+        if (w->aborted) {
+                if (w->inflight == 0)
+                        crf_write_free(w);
+        } else if (w->committing && w->inflight == 0) {
+                crf_commit(w);
+        }
+}
+
+static void     crf_write_flush(struct crf_write *w)
+{
+        struct crf_wbuf *wb = w->wb;
+
+        if (!wb)
+                return;
+        w->wb = NULL;
+        w->inflight++;
+        w->d->io_inflight++;
+        io_pwrite(w->fd, wb->buff, wb->len, wb->offset, crf_write_done, wb);
+}
+
+/* Gather a block into the current chunk, writing chunks out as they fill
+ * (or if the block isn't contiguous with it).
+ */
+static void     crf_write_block(struct crf_write *w, uint32_t offset,
+                                const uint8_t *data, unsigned int len)
+{
+        while (len > 0) {
+                struct crf_wbuf *wb = w->wb;
+
+                if (wb && offset != wb->offset + wb->len) {
+                        crf_write_flush(w);
+                        wb = NULL;
+                }
+                if (!wb) {
+                        wb = malloc(sizeof(*wb));
+                        if (!wb) {
+                                w->err = ENOMEM;
+                                return;
+                        }
+                        wb->w = w;
+                        wb->offset = offset;
+                        wb->len = 0;
+                        w->wb = wb;
+                }
+
+                // Up to the next CRF_WB_SIZE boundary in the file:
+                unsigned int room = CRF_WB_SIZE - (offset % CRF_WB_SIZE);
+                unsigned int n = len < room ? len : room;
+
+                memcpy(&wb->buff[wb->len], data, n);
+                wb->len += n;
+                offset += n;
+                data += n;
+                len -= n;
+                if (offset % CRF_WB_SIZE == 0)
+                        crf_write_flush(w);
+        }
+}
+
+/* Remove other files that crf_open_read() might find for this name, other
+ * than ours and writes in progress
+ */
+static void     crf_unlink_alternatives(struct crf_write *w)
+{
+        static const char *pats[] = { "%s", "%s,[0-9a-f][0-9a-f][0-9a-f]",
+                                      "%s,[0-9a-f]*-[0-9a-f]*" };
+        char    pathname[PATH_MAX];
+        glob_t  gt;
+
+        for (unsigned int i = 0; i < sizeof(pats) / sizeof(pats[0]); i++) {
+                snprintf(pathname, PATH_MAX, pats[i], w->name);
+                if (glob(pathname, 0, NULL, &gt) != 0)
+                        continue;
+                for (size_t j = 0; j < gt.gl_pathc; j++) {
+                        if (strcmp(gt.gl_pathv[j], w->path) == 0 ||
+                                strstr(gt.gl_pathv[j], CRF_TMP_MARK))
+                                continue;
+#if DEBUG > 1
+                        printf("(Replacing %s)\n", gt.gl_pathv[j]);
+#endif
+                        unlink(gt.gl_pathv[j]);
+                }
+                globfree(&gt);
+        }
+}
+
+/* The file's synced:  give it its name, and tell the Arc */
+static void     crf_commit_done(void *ctx, int res)
+{
+        struct crf_write *w = ctx;
+        struct device *d = w->d;
+        struct write_response response;
+
+        d->io_inflight--;
+        w->inflight--;
+        if (w->aborted) {
+                crf_write_free(w);
+                return;
+        }
+        if (res < 0 && !w->err)
+                w->err = -res;
+
+        if (!w->err)
+                crf_set_stamp(w->fd, w->load, w->exec);
+        if (!w->err) {
+                crf_unlink_alternatives(w);
+                if (rename(w->tmp, w->path) < 0)
+                        w->err = errno;
+                else
+                        w->tmp[0] = '\0';
+        }
+        if (w->err)
+                printf("--- Write of '%s' failed (%d)\n", w->path, w->err);
+#if DEBUG > 0
+        else
+                printf("+++ Wrote '%s'\n", w->path);
+#endif
+
+        memset(&response, 0, sizeof(response));
+        response.success = w->err;
+        if (!d->hup)
+                send_reply(d, &w->commit_req, CID_RAWFILE, sizeof(response),
+                           (uint8_t *)&response);
+        d->rawfile->write = NULL;
+        crf_write_free(w);
+}
+
+/* All chunks are written:  sync the data before it takes the file's name,
+ * so a crash can't leave a truncated file in place of the old one.
+ */
+static void     crf_commit(struct crf_write *w)
+{
+        w->inflight++;
+        w->d->io_inflight++;
+        if (w->err)
+                crf_commit_done(w, 0);
+        else
+                io_fsync(w->fd, crf_commit_done, w);
+}
+
+static void     crf_write_reply(struct device *d, int err)
 {
+        struct write_response response;
+
+        memset(&response, 0, sizeof(response));
+        response.success = err;
+        send_packet(d, CID_RAWFILE, sizeof(response), (uint8_t *)&response);
+}
+
+/* Read a block of the open file, replying to the current request when done */
+static void     crf_read_block(struct device *d, uint32_t offset, uint32_t size)
+{
+        struct crf_state *cs = d->rawfile;
+
+        if (cs->current_file == -1) {
+                printf("--- No file open, ignoring request!\n");
+                return;
+        }
+
+        struct crf_read *rd = calloc(1, sizeof(*rd));
+        // Not negotiated (0) means the podule's maximum:
+        unsigned int max = d->max_pkt ? d->max_pkt : sizeof(rd->buff);
+        max -= d->req.tagged ? CID_TAG_SIZE : 0;
+
+        if (!rd) {
+                printf("--- Out of memory, ignoring request!\n");
+                return;
+        }
+        if (size > max)
+                size = max;
+        rd->d = d;
+        rd->req = d->req;
+        d->req.st.valid = false;        // rd has it now
+        rd->size = size;
+        d->io_inflight++;
+        io_pread(cs->current_file, rd->buff, img_avail(cs->length, offset, size),
+                 cs->base + offset, crf_read_done, rd);
+}
+
+/* Make manifest file index the open file, if it isn't already */
+static void     crf_open_entry(struct device *d, uint32_t index)
+{
+        struct crf_state *cs = d->rawfile;
+        struct img_file f;
+        const char *path;
+        int r;
+
+        if (index == cs->entry)
+                return;
+        path = cdir_manifest_file(d, index);
+        if (cs->current_file != -1)
+                close(cs->current_file);
+        cs->current_file = -1;
+        cs->entry = CRF_NO_ENTRY;
+        cs->base = 0;
+        cs->length = IMG_NO_LIMIT;
+        if (!path) {
+                printf("--- No manifest file %u!\n", index);
+        } else if ((r = img_open(path, &f)) >= 0) {
+                if (r == 0) {
+                        cs->current_file = f.fd;
+                        cs->base = f.base;
+                        cs->length = f.length;
+                        cs->entry = index;
+                } else {
+                        printf("--- Manifest file open for read: %s\n",
+                               strerror(r));
+                }
+        } else if ((cs->current_file = open(path, O_RDONLY)) < 0) {
+                cs->current_file = -1;
+                perror("--- Manifest file open for read");
+        } else {
+                cs->entry = index;
+#if DEBUG > 1
+                printf("+++ Opened manifest file %u '%s'\n", index, path);
+#endif
+        }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void            channel_rawfile_rx(struct device *d, uint8_t *data,
+                                   unsigned int len)
+{
+        struct crf_state *cs = d->rawfile;
+
         if (data[0] == CID_RAWFILE_INIT_READ) {
 #if DEBUG > 1
                 printf("+++ raw file request (%d)\n", data[0]);
 #endif
                 uint32_t load, exec;
-                int r = crf_open_read(&data[1], &load, &exec);
+                int r = crf_open_read(cs, (char *)&data[1], &load, &exec);
 
                 struct init_read_response response;
+                memset(&response, 0, sizeof(response));
                 response.success = r;
 
-                if (r >= 0) {
+                if (r == 0) {
                         struct stat sb;
 
-                        fstat(current_file, &sb);
-                        response.filesize = htole32(sb.st_size);
+                        fstat(cs->current_file, &sb);
+                        response.filesize = htole32(cs->length != IMG_NO_LIMIT ?
+                                                    cs->length : sb.st_size);
                         response.load = load;
                         response.exec = exec;
                 }
 
-                send_packet(CID_RAWFILE, sizeof(response), (uint8_t *)&response);
+                send_packet(d, CID_RAWFILE, sizeof(response),
+                            (uint8_t *)&response);
         } else if (data[0] == CID_RAWFILE_READ_BLOCK) {
                 struct read_block_request *rbr =
                         (struct read_block_request *)data;
@@ -241,19 +877,118 @@ void            channel_rawfile_rx(uint8_t *data, unsigned int len)
                 printf("+++ Read block (%d) offset %d, size %d\n",
                        data[0], offset, size);
 #endif
-                if (current_file != -1) {
-                        pread(current_file, read_buff, size, offset);
-                        send_packet(CID_RAWFILE, size, read_buff);
-                } else {
+                crf_read_block(d, offset, size);
+        } else if (data[0] == CID_RAWFILE_READ_ENTRY &&
+                   len >= sizeof(struct read_entry_request)) {
+                struct read_entry_request *rer =
+                        (struct read_entry_request *)data;
+
+                crf_open_entry(d, le32toh(rer->index));
+                crf_read_block(d, le32toh(rer->offset), le32toh(rer->size));
+        } else if (data[0] == CID_RAWFILE_SUM_BLOCKS &&
+                   len >= sizeof(struct sum_blocks_request)) {
+                struct sum_blocks_request *sbr =
+                        (struct sum_blocks_request *)data;
+                uint32_t count = le32toh(sbr->count);
+                struct crf_sums *sums;
+
+                if (count > CRF_SUM_MAX ||
+                    len < sizeof(*sbr) + count * sizeof(sbr->sums[0])) {
+                        printf("--- Bad sum blocks request!\n");
+                        return;
+                }
+                crf_open_entry(d, le32toh(sbr->index));
+                if (cs->current_file == -1) {
                         printf("--- No file open, ignoring request!\n");
+                        return;
+                }
+                sums = calloc(1, sizeof(*sums));
+                if (!sums) {
+                        printf("--- Out of memory, ignoring request!\n");
+                        return;
+                }
+                sums->d = d;
+                sums->req = d->req;
+                d->req.st.valid = false;        // sums has it now
+                sums->count = count;
+                memcpy(sums->sums, sbr->sums, count * sizeof(sbr->sums[0]));
+                d->io_inflight++;
+                io_pread(cs->current_file, sums->buff,
+                         img_avail(cs->length, le32toh(sbr->offset),
+                                   count * CRF_SUM_BLOCK),
+                         cs->base + le32toh(sbr->offset), crf_sums_done, sums);
+        } else if (data[0] == CID_RAWFILE_INIT_WRITE &&
+                   len > sizeof(struct init_write_request)) {
+                struct init_write_request *iwr =
+                        (struct init_write_request *)data;
+                char name[PATH_MAX];
+                unsigned int nlen = len - sizeof(*iwr);
+
+                if (nlen >= sizeof(name))
+                        nlen = sizeof(name) - 1;
+                memcpy(name, iwr->name, nlen);
+                name[nlen] = '\0';
+
+                crf_write_abort(cs);
+                struct crf_write *w = calloc(1, sizeof(*w));
+                int r = ENOMEM;
+
+                if (w) {
+                        w->d = d;
+                        w->fd = -1;
+                        r = crf_open_write(w, name, le32toh(iwr->load),
+                                           le32toh(iwr->exec));
+                        if (r == 0)
+                                cs->write = w;
+                        else
+                                crf_write_free(w);
+                }
+                crf_write_reply(d, r);
+        } else if (data[0] == CID_RAWFILE_WRITE_BLOCK &&
+                   len >= sizeof(struct write_block_request)) {
+                struct write_block_request *wbr =
+                        (struct write_block_request *)data;
+                uint32_t offset = le32toh(wbr->offset);
+#if DEBUG > 2
+                printf("+++ Write block (%d) offset %d, size %d\n",
+                       data[0], offset, len - (int)sizeof(*wbr));
+#endif
+                if (!cs->write) {
+                        printf("--- No file open for write!\n");
+                        crf_write_reply(d, EBADF);
+                        return;
+                }
+                crf_write_block(cs->write, offset, wbr->data,
+                                len - sizeof(*wbr));
+                crf_write_reply(d, cs->write->err);
+        } else if (data[0] == CID_RAWFILE_COMMIT) {
+                struct crf_write *w = cs->write;
+
+                if (w && w->committing) {
+                        // Resent while syncing; it'll get the one reply
+                        return;
+                }
+                if (!w) {
+                        printf("--- No file open for write!\n");
+                        crf_write_reply(d, EBADF);
+                        return;
                 }
+                w->commit_req = d->req;
+                d->req.st.valid = false;        // w has it now
+                crf_write_flush(w);
+                w->committing = true;
+                if (w->inflight == 0)
+                        crf_commit(w);
         } else if (data[0] == CID_RAWFILE_CLOSE) {
 #if DEBUG > 1
                 printf("+++ Closing file\n");
 #endif
-                if (current_file != -1)
-                        close(current_file);
-                current_file = -1;
+                if (cs->current_file != -1)
+                        close(cs->current_file);
+                cs->current_file = -1;
+                cs->entry = CRF_NO_ENTRY;
+                cs->length = IMG_NO_LIMIT;
+                crf_write_abort(cs);
         } else {
                 printf("rawfile: Odd byte 0: 0x%x\n", data[0]);
         }
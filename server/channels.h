@@ -25,21 +25,171 @@
 #ifndef CHANNELS_H
 #define CHANNELS_H
 
+#include <time.h>
+#include <sys/types.h>
+
 // Channel types
+/* A tagged packet's payload starts with a 32-bit LE tag, which is echoed
+ * at the start of the response.  The tag keeps the rest of the payload
+ * word-aligned for the Arc.  Responses to tagged requests can arrive out
+ * of order.
+ */
+#define CID_F_TAGGED                    0x40
+#define CID_MASK                        0x3f
+#define CID_TAG_SIZE                    4
+
+/* The podule's buffer size (PR_RX_TX_BUFSZ) limits the payload: */
+#define PKT_MAX_PAYLOAD                 512
+
 #define CID_IGNORE                      0
 #define CID_HOSTINFO                    1
-#define CID_HOSTINFO_PROTO_VERSION      1
+#define CID_HOSTINFO_PROTO_VERSION      3       // 2: Tags, 3: Caps
+#define CID_HOSTINFO_INFO               0
+#define CID_HOSTINFO_CAPS               1
+#define CID_HOSTINFO_ERROR              0xff    // Reply to a bad request
+
+/* Capabilities, as PR_CAP_* in podule_regs.h: */
+#define CAP_TAGS                        0x01
+#define CAP_STREAM                      0x02
+#define CAP_COMPRESS                    0x04
+#define CAP_CRC                         0x08
+
+#define SERVER_CAPS                     (CAP_TAGS | CAP_STREAM | CAP_COMPRESS | \
+                                         CAP_CRC)
 #define CID_HOSTINFO_STRING             "ArcPipePodule host server" // 28 max
 #define CID_RAWFILE                     2
 #define CID_RAWFILE_INIT_READ           0
 #define CID_RAWFILE_READ_BLOCK          1
+#define CID_RAWFILE_INIT_WRITE          2
+#define CID_RAWFILE_WRITE_BLOCK         3
 #define CID_RAWFILE_CLOSE               4
+#define CID_RAWFILE_COMMIT              5
+#define CID_RAWFILE_READ_ENTRY          6       // ReadBlock, of a manifest file
+#define CID_RAWFILE_SUM_BLOCKS          7       // Compare a manifest file's blocks
+#define CID_DIR                         3
+#define CID_DIR_READ                    0
+#define CID_DIR_MANIFEST                1
+#define CID_BLOCK                       4       // Disc images, by sector
+#define CID_BLOCK_OPEN                  0
+#define CID_BLOCK_READ                  1
+#define CID_BLOCK_WRITE                 2
+#define CID_BLOCK_CLOSE                 3
+#define CID_BLOCK_FLUSH                 4
+#define CID_FS                          5       // A filing system, by name
+#define CID_FS_STAT                     0
+#define CID_FS_OPEN                     1
+#define CID_FS_READ                     2
+#define CID_FS_WRITE                    3
+#define CID_FS_CLOSE                    4
+#define CID_FS_ARGS                     5
+#define CID_FS_READ_DIR                 6
+#define CID_FS_WRITE_INFO               7
+#define CID_FS_DELETE                   8
+#define CID_FS_CREATE                   9
+#define CID_FS_RENAME                   10
+#define CID_ECHO                        6       // For benchmarking the link
+#define CID_ECHO_ECHO                   0       // Send the packet back
+#define CID_ECHO_SINK                   1       // Drop it
+#define CID_ECHO_SOURCE                 2       // Send count packets of size
+#define CID_ECHO_SOURCE_MAX             10000
+#define CID_ECHO_ERROR                  0xff    // Reply to a bad request
+#define CID_ECHO_BULK                   7       // The same, as a bulk channel
+
+typedef struct {
+        uint8_t cid;
+        uint8_t sizel;
+        uint8_t sizeh;
+} pkt_header_t;
+
+/* With CAP_CRC, packets are sent as frames (as pipe_packet.c):
+ *
+ *   FRAME_SYNC, header, header check, payload, CRC16 (LE)
+ *
+ * The header check is the low byte of crc16() of the 4 bytes before it, and
+ * the CRC covers everything before it.  FRAME_SYNC isn't a valid CID, so
+ * plain packets and frames can be told apart.  After a bad frame, the
+ * receiver skips to the next FRAME_SYNC.  See rx_check().
+ *
+ * Framing starts with the packet after the HOSTINFO_CAPS reply:  the reply
+ * itself is plain, as the Arc hasn't told its firmware yet.  Each end takes
+ * a plain hostinfo packet while framing, so either can renegotiate.
+ */
+#define FRAME_SYNC                      0xfa
+#define FRAME_HDR_SIZE                  5
+#define FRAME_OVERHEAD                  7
+
+extern uint16_t crc16(const uint8_t *data, unsigned int len);
+
+struct device;
+
+extern void     process_packet(struct device *d, unsigned int cid,
+                               unsigned int len, uint8_t *data);
+
+extern void     channel_hostinfo_rx(struct device *d, uint8_t *data,
+                                    unsigned int len);
+extern void     channel_echo_rx(struct device *d, unsigned int cid,
+                                uint8_t *data, unsigned int len);
+extern void     channel_echo_refill(struct device *d);
+extern void     channel_echo_fini(struct device *d);
+
+extern void     channel_rawfile_init(struct device *d);
+extern void     channel_rawfile_fini(struct device *d);
+extern void     channel_rawfile_rx(struct device *d, uint8_t *data,
+                                   unsigned int len);
+extern int      crf_name_attrs(const char *fname, time_t mtime, char *name,
+                               size_t namelen, uint32_t *load, uint32_t *exec);
+extern unsigned int crf_pack_block(uint8_t *b, unsigned int size);
+extern int      crf_host_name(const char *name, uint32_t load, uint32_t exec,
+                              char *path, size_t len);
+extern void     crf_set_stamp(int fd, uint32_t load, uint32_t exec);
+
+extern void     channel_dir_init(struct device *d);
+extern void     channel_dir_fini(struct device *d);
+extern void     channel_dir_rx(struct device *d, uint8_t *data,
+                               unsigned int len);
+extern const char *cdir_manifest_file(struct device *d, uint32_t index);
+
+/* A host directory entry, as listed by cdir_list() */
+struct cdir_entry {
+        uint32_t        load;
+        uint32_t        exec;
+        uint32_t        length;
+        uint8_t         type;           // 1 file, 2 directory
+        uint8_t         rank;           // From crf_name_attrs()
+        uint8_t         attr;           // From cdir_attr()
+        char            name[256];
+        char            host[256];      // d_name
+};
+
+extern int      cdir_list(const char *path, struct cdir_entry **ents,
+                          unsigned int *n);
+extern uint8_t  cdir_attr(mode_t mode);
+
+extern void     channel_block_init(struct device *d);
+extern void     channel_block_fini(struct device *d);
+extern void     channel_block_rx(struct device *d, uint8_t *data,
+                                 unsigned int len);
+extern void     channel_block_idle(struct device *d, uint64_t now);
+
+extern void     channel_fs_init(struct device *d);
+extern void     channel_fs_fini(struct device *d);
+extern void     channel_fs_rx(struct device *d, uint8_t *data, unsigned int len);
 
-extern void     channel_hostinfo_rx(uint8_t *data, unsigned int len);
+struct req_ctx;
 
-extern void     channel_rawfile_init(void);
-extern void     channel_rawfile_rx(uint8_t *data, unsigned int len);
+/* Reply to the request being dispatched */
+extern void     send_packet(struct device *d, unsigned int cid,
+                            unsigned int len, uint8_t *data);
+/* Reply to a request dispatched earlier, whose req_ctx was saved */
+extern void     send_reply(struct device *d, struct req_ctx *req,
+                           unsigned int cid, unsigned int len, uint8_t *data);
+/* TX queue class (TXQ_PRIO_*) for a CID */
+extern unsigned int cid_priority(unsigned int cid);
+struct lane;
 
-extern void     send_packet(unsigned int cid, unsigned int len, uint8_t *data);
+/* The packet to write next on a lane, or NULL */
+extern struct tx_pkt *tx_next(struct lane *l);
+/* Remove that packet once written, returning it to be freed */
+extern struct tx_pkt *tx_dequeue(struct lane *l);
 
 #endif
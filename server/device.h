@@ -0,0 +1,185 @@
+/* Per-device (per-podule) state
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#include "stats.h"
+
+struct crf_state;
+struct cdir_state;
+struct cblk_state;
+struct cfs_state;
+
+/* Don't take more requests off the link while this many responses are
+ * queued or in preparation:
+ */
+#define TXQ_MAX         8
+
+/* Responses are queued by priority class, so that interactive channels
+ * aren't stuck behind a bulk transfer.  See cid_priority().
+ */
+#define TXQ_PRIO_HIGH   0
+#define TXQ_PRIO_BULK   1
+#define TXQ_PRIOS       2
+/* After this many high-priority packets in a row, a waiting bulk packet
+ * gets a turn:
+ */
+#define TXQ_HIGH_BURST  8
+
+/* A framed packet waiting to go out */
+struct tx_pkt {
+        struct tx_pkt   *next;
+        struct stats_req st;
+        unsigned int    len;            // Including header (and framing)
+        unsigned int    hdr;            // Offset of header:  1 if framed
+        uint8_t         data[];
+};
+
+struct tx_queue {
+        struct tx_pkt   *head;
+        struct tx_pkt   *tail;
+        unsigned int    depth;
+};
+
+/* A device talks over one or two ttys (CDC interfaces):  the data lane,
+ * and optionally a control lane.  The data lane can instead be the vendor
+ * interface (via usbfs), or for testing a socket from vpodule.  When
+ * there's a control lane, it carries the TXQ_PRIO_HIGH class, so that it
+ * isn't stuck behind bulk data in the tty/USB buffers.  Requests can
+ * arrive on either.
+ */
+#define LANE_DATA       0
+#define LANE_CTL        1
+#define LANES           2
+
+/* How a lane's fd carries packets: */
+#define LANE_STREAM     0       // A tty (or pty):  a byte stream
+#define LANE_PACKET     1       // A SOCK_SEQPACKET socket:  one per message
+#define LANE_USBFS      2       // The vendor interface:  one per transfer
+
+struct device;
+struct usbfs_lane;
+
+struct lane {
+        struct device   *dev;
+        int             fd;             // -1 if absent
+        unsigned int    kind;           // LANE_STREAM etc.
+        char            path[PATH_MAX];
+        struct usbfs_lane *usb;         // LANE_USBFS state
+
+        uint8_t         rx_buffer[4096];
+        unsigned int    rx_pos;
+        /* Packet at the start of rx_buffer, once its header (or for a
+         * frame, all of it) has been checked; see rx_check():
+         */
+        unsigned int    rx_total;       // Or 0
+        unsigned int    rx_hdr;
+        bool            rx_resync;      // After a bad frame, until a good one
+
+        /* Packet being written, tx_pos bytes of it so far: */
+        struct tx_pkt   *tx_cur;
+        unsigned int    tx_pos;
+
+        /* io_uring engine state: */
+        bool            ur_rx_posted;
+        bool            ur_tx_posted;
+        /* The posted read lands here rather than in rx_buffer, since
+         * rx_consume() shuffles rx_buffer while the read is outstanding.
+         * Packet lanes read whole messages into it with either engine.
+         */
+        uint8_t         ur_rx_buf[1024];
+};
+
+/* From main.c, for transports:  data received, and tx_cur written */
+extern void     lane_rx_in(struct lane *l, const uint8_t *buf,
+                           unsigned int len);
+extern void     lane_tx_done(struct lane *l);
+
+/* What a response needs to know about the request it answers.  Channels
+ * that reply later (e.g. after disc I/O) keep a copy of this and reply
+ * with send_reply().
+ */
+struct req_ctx {
+        bool            tagged;
+        uint32_t        tag;
+        struct stats_req st;
+};
+
+/* Everything to do with one connected podule lives in here, so that one
+ * server process can service several of them.
+ */
+struct device {
+        struct device   *next;
+        char            path[PATH_MAX]; // Of the data lane
+        char            usb_dev[PATH_MAX]; // sysfs USB device, or ""
+        bool            hup;
+        unsigned int    cap_id;         // Distinguishes devices in a capture
+
+        struct lane     lane[LANES];
+
+        /* Responses wait in txq[] by class; tx_next() picks each lane's
+         * tx_cur from those.
+         */
+        struct tx_queue txq[TXQ_PRIOS];
+        unsigned int    txq_depth;      // All classes, plus each tx_cur
+        unsigned int    tx_burst;       // High-priority packets in a row
+
+        /* Channel I/O (io_pread() etc.) outstanding, referencing this: */
+        unsigned int    io_inflight;
+
+        struct req_ctx  req;            // Request being dispatched
+
+        /* Negotiated with the Arc via CID_HOSTINFO_CAPS: */
+        unsigned int    caps;
+        unsigned int    max_pkt;
+        unsigned int    depth;
+
+        /* Metrics: */
+        uint64_t        st_idle;        // Time the link last went idle
+        uint64_t        st_rx_bytes;
+        uint64_t        st_tx_bytes;
+        unsigned int    st_tx_depth_max;
+        uint64_t        st_bad_frames;  // Bad frames (or junk) that lost sync
+        uint64_t        st_resync_bytes; // Discarded looking for a frame
+
+        /* Channel state: */
+        struct crf_state *rawfile;
+        struct cdir_state *dir;
+        struct cblk_state *block;
+        struct cfs_state *fs;
+        struct {                        // CID_ECHO_SOURCE's packets to come
+                struct req_ctx  req;
+                unsigned int    cid;
+                unsigned int    left;
+                unsigned int    size;
+        } echo;
+};
+
+#endif
@@ -0,0 +1,450 @@
+/* Packet dispatch to channels, and TX framing
+ *
+ * Split out from main.c so that tools (e.g. replay) can drive the channels
+ * without the device/service loop.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <endian.h>
+#include <stdbool.h>
+
+#include "channels.h"
+#include "device.h"
+#include "capture.h"
+#include "stats.h"
+
+#ifndef DEBUG
+#define DEBUG 2
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Utils
+
+// scandir/opendir
+
+static void     pretty_hexdump(uint8_t *r, unsigned int len)
+{
+        unsigned int left = len;
+        for (int i = 0; i < len; i += 16) {
+                unsigned int rowlen = left > 16 ? 16 : left;
+                printf("%03x: ", i);
+                for (int j = 0; j < rowlen; j++) {
+                        printf("%02x ", r[i+j]);
+                }
+                printf("  ");
+                for (int j = 0; j < rowlen; j++) {
+                        uint8_t c = r[i+j];
+                        printf("%c", c >= 32 ? c : '.');
+                }
+                printf("\n");
+                left -= 16;
+        }
+}
+
+/* CRC-16/CCITT, as the firmware's */
+uint16_t        crc16(const uint8_t *data, unsigned int len)
+{
+        static uint16_t table[256];
+        uint16_t c = 0xffff;
+
+        if (!table[1]) {
+                for (unsigned int i = 0; i < 256; i++) {
+                        uint16_t t = i << 8;
+
+                        for (unsigned int b = 0; b < 8; b++)
+                                t = (t & 0x8000) ? (t << 1) ^ 0x1021 : t << 1;
+                        table[i] = t;
+                }
+        }
+        while (len--)
+                c = (c << 8) ^ table[(c >> 8) ^ *data++];
+        return c;
+}
+
+void            send_reply(struct device *d, struct req_ctx *req,
+                           unsigned int cid, unsigned int len, uint8_t *data)
+{
+        unsigned int plen = len + (req->tagged ? CID_TAG_SIZE : 0);
+        bool framed = d->caps & CAP_CRC;
+        unsigned int hdr = framed ? 1 : 0;
+        struct tx_pkt *p = malloc(sizeof(*p) + FRAME_OVERHEAD + plen);
+
+        if (!p) {
+                printf("--- Out of memory, dropping TX\n");
+                return;
+        }
+
+        pkt_header_t *pkt = (pkt_header_t *)&p->data[hdr];
+        uint8_t *payload = &p->data[framed ? FRAME_HDR_SIZE :
+                                    sizeof(pkt_header_t)];
+
+        pkt->cid = cid;
+        pkt->sizel = plen & 0xff;
+        pkt->sizeh = plen >> 8;
+        if (req->tagged) {
+                uint32_t tag = htole32(req->tag);
+
+                pkt->cid |= CID_F_TAGGED;
+                memcpy(payload, &tag, CID_TAG_SIZE);
+                memcpy(payload + CID_TAG_SIZE, data, len);
+        } else {
+                memcpy(payload, data, len);
+        }
+        p->len = payload + plen - p->data;
+        p->hdr = hdr;
+        p->next = NULL;
+        if (framed) {
+                p->data[0] = FRAME_SYNC;
+                p->data[4] = crc16(p->data, 4);
+
+                uint16_t crc = crc16(p->data, p->len);
+                p->data[p->len++] = crc & 0xff;
+                p->data[p->len++] = crc >> 8;
+        }
+
+        capture_packet(d, true, pkt->cid, plen, payload);
+        stats_response_queued(d, &req->st, &p->st, plen, d->txq_depth + 1);
+
+        struct tx_queue *q = &d->txq[cid_priority(cid)];
+
+        if (q->tail)
+                q->tail->next = p;
+        else
+                q->head = p;
+        q->tail = p;
+        q->depth++;
+        d->txq_depth++;
+
+        // Main loop sorts it.
+}
+
+void            send_packet(struct device *d, unsigned int cid, unsigned int len,
+                            uint8_t *data)
+{
+        send_reply(d, &d->req, cid, len, data);
+}
+
+/* Which TX class a channel's responses (and requests) belong to */
+unsigned int    cid_priority(unsigned int cid)
+{
+        switch (cid & CID_MASK) {
+        case CID_RAWFILE:
+        case CID_BLOCK:
+        case CID_ECHO_BULK:
+                return TXQ_PRIO_BULK;
+        default:
+                return TXQ_PRIO_HIGH;
+        }
+}
+
+/* The packet to write next on a lane.  Once picked, it stays current until
+ * it's been written in full, since packets can't be interleaved.
+ */
+struct tx_pkt   *tx_next(struct lane *l)
+{
+        struct device *d = l->dev;
+        struct tx_queue *hi = &d->txq[TXQ_PRIO_HIGH];
+        struct tx_queue *bulk = &d->txq[TXQ_PRIO_BULK];
+        struct tx_queue *q;
+
+        if (l->tx_cur)
+                return l->tx_cur;
+
+        if (d->lane[LANE_CTL].fd >= 0) {
+                // Each class has a lane to itself
+                q = l == &d->lane[LANE_CTL] ? hi : bulk;
+        } else if (hi->head && !(bulk->head && d->tx_burst >= TXQ_HIGH_BURST)) {
+                /* Strict priority, except that bulk gets one packet in
+                 * every TXQ_HIGH_BURST+1 while both are busy:
+                 */
+                q = hi;
+                d->tx_burst++;
+        } else {
+                q = bulk;
+                d->tx_burst = 0;
+        }
+
+        struct tx_pkt *p = q->head;
+
+        if (p) {
+                q->head = p->next;
+                if (!q->head)
+                        q->tail = NULL;
+                q->depth--;
+                l->tx_cur = p;
+                l->tx_pos = 0;
+        }
+        return p;
+}
+
+/* Remove a lane's current packet (picking one if need be), e.g. once
+ * written, and top up an echo source
+ */
+struct tx_pkt   *tx_dequeue(struct lane *l)
+{
+        struct tx_pkt *p = tx_next(l);
+
+        if (p) {
+                l->tx_cur = NULL;
+                l->tx_pos = 0;
+                l->dev->txq_depth--;
+                channel_echo_refill(l->dev);
+        }
+        return p;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Channel Hostinfo
+
+void            channel_hostinfo_rx(struct device *d, uint8_t *data,
+                                    unsigned int len)
+{
+        if (len < 1 || (data[0] == CID_HOSTINFO_CAPS && len < 16)) {
+                uint8_t err = CID_HOSTINFO_ERROR;
+
+                printf("--- hostinfo: Short request (%d)\n", len);
+                send_packet(d, CID_HOSTINFO, 1, &err);
+                return;
+        }
+
+        if (data[0] == CID_HOSTINFO_INFO) {
+#if DEBUG > 1
+                printf("+++ hostinfo request (%d)\n", data[0]);
+#endif
+                // Format host info string
+                struct {
+                        uint32_t proto_ver;
+                        char    hinfo[28];
+                        uint32_t pad;
+                } response;
+
+                response.proto_ver = htole32(CID_HOSTINFO_PROTO_VERSION);
+                memset(response.hinfo, 0, 28);
+                strncpy(response.hinfo, CID_HOSTINFO_STRING, 28);
+                response.pad = 0;
+
+                send_packet(d, CID_HOSTINFO, sizeof(response),
+                            (uint8_t *)&response);
+        } else if (data[0] == CID_HOSTINFO_CAPS) {
+                /* The Arc offers what it (and, for link features, the
+                 * firmware) supports; we agree the common subset.
+                 */
+                struct {
+                        uint8_t  opcode;
+                        uint8_t  pad[3];
+                        uint32_t caps;
+                        uint32_t max_pkt;
+                        uint32_t depth;
+                } req;
+                struct {
+                        uint32_t proto_ver;
+                        uint32_t server_caps;
+                        uint32_t caps;
+                        uint32_t max_pkt;
+                        uint32_t depth;
+                } response;
+
+                memcpy(&req, data, sizeof(req));
+                unsigned int caps = le32toh(req.caps) & SERVER_CAPS;
+
+                d->max_pkt = le32toh(req.max_pkt);
+                if (d->max_pkt > PKT_MAX_PAYLOAD || d->max_pkt == 0)
+                        d->max_pkt = PKT_MAX_PAYLOAD;
+                d->depth = le32toh(req.depth);
+                if (d->depth > TXQ_MAX)
+                        d->depth = TXQ_MAX;
+                if (d->depth == 0 || !(caps & CAP_TAGS))
+                        d->depth = 1;
+#if DEBUG > 0
+                printf("+++ %s: caps 0x%x, max packet %d, depth %d\n",
+                       d->path, caps, d->max_pkt, d->depth);
+#endif
+                response.proto_ver = htole32(CID_HOSTINFO_PROTO_VERSION);
+                response.server_caps = htole32(SERVER_CAPS);
+                response.caps = htole32(caps);
+                response.max_pkt = htole32(d->max_pkt);
+                response.depth = htole32(d->depth);
+
+                /* The Arc only tells its firmware about framing once it has
+                 * this, so it goes plain; the new caps apply after it.
+                 */
+                d->caps = 0;
+                send_packet(d, CID_HOSTINFO, sizeof(response),
+                            (uint8_t *)&response);
+                d->caps = caps;
+        } else {
+                uint8_t err = CID_HOSTINFO_ERROR;
+
+                printf("hostinfo: Odd byte 0: 0x%x\n", data[0]);
+                send_packet(d, CID_HOSTINFO, 1, &err);
+        }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Channel Echo
+/* For *PBENCH:  round trips (ECHO), and one-way throughput each way (SINK,
+ * and SOURCE).  Byte 0 is the op; a SOURCE request then has a 32-bit count
+ * and size at 4 and 8.  What's sent back is on the request's channel, too;
+ * a bad request gets CID_ECHO_ERROR alone.  CID_ECHO_BULK is the same, but
+ * in the bulk class, as throughput's what it measures.
+ */
+
+/* Queue more of a SOURCE's packets.  Called as the TX queues drain, so at
+ * most ECHO_QUEUED are waiting at once, and other requests of its class
+ * (which are held back once TXQ_MAX are queued) still get a look in.
+ */
+#define ECHO_QUEUED     (TXQ_MAX / 2)
+
+void            channel_echo_refill(struct device *d)
+{
+        uint8_t buf[PKT_MAX_PAYLOAD];
+        struct tx_queue *q;
+
+        if (!d->echo.left)
+                return;
+        q = &d->txq[cid_priority(d->echo.cid)];
+        if (q->depth >= ECHO_QUEUED)
+                return;
+        for (unsigned int i = 0; i < d->echo.size; i++)
+                buf[i] = 32 + (i % 96);
+        while (d->echo.left && q->depth < ECHO_QUEUED) {
+                send_reply(d, &d->echo.req, d->echo.cid, d->echo.size, buf);
+                d->echo.left--;
+        }
+}
+
+void            channel_echo_fini(struct device *d)
+{
+        d->echo.left = 0;
+}
+
+void            channel_echo_rx(struct device *d, unsigned int cid,
+                                uint8_t *data, unsigned int len)
+{
+        uint8_t err = CID_ECHO_ERROR;
+
+        if (len < 1 || (data[0] == CID_ECHO_SOURCE && len < 12)) {
+                printf("--- echo: Short request (%d)\n", len);
+                send_packet(d, cid, 1, &err);
+                return;
+        }
+
+        if (data[0] == CID_ECHO_ECHO) {
+                send_packet(d, cid, len, data);
+        } else if (data[0] == CID_ECHO_SINK) {
+                // Nothing to do
+        } else if (data[0] == CID_ECHO_SOURCE) {
+                uint32_t count, size;
+                unsigned int max = (d->max_pkt ? d->max_pkt :
+                                    PKT_MAX_PAYLOAD) -
+                        (d->req.tagged ? CID_TAG_SIZE : 0);
+
+                memcpy(&count, &data[4], 4);
+                memcpy(&size, &data[8], 4);
+                count = le32toh(count);
+                size = le32toh(size);
+                if (count > CID_ECHO_SOURCE_MAX)
+                        count = CID_ECHO_SOURCE_MAX;
+                if (size > max)
+                        size = max;
+                if (size == 0)
+                        size = 1;
+#if DEBUG > 1
+                printf("+++ echo: source %u x %u\n", count, size);
+#endif
+                d->echo.req = d->req;
+                d->echo.cid = cid;
+                d->echo.left = count;
+                d->echo.size = size;
+                channel_echo_refill(d);
+        } else {
+                printf("echo: Odd byte 0: 0x%x\n", data[0]);
+                send_packet(d, cid, 1, &err);
+        }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Core packet dispatch
+
+void            process_packet(struct device *d, unsigned int cid,
+                               unsigned int len, uint8_t *data)
+{
+#if DEBUG > 1
+        printf("+++ %s: Packet CID%d, len %d\n", d->path, cid, len);
+#if DEBUG > 2
+        pretty_hexdump(data, len);
+#endif
+#endif
+        capture_packet(d, false, cid, len, data);
+
+        d->req.tagged = false;
+        if (cid & CID_F_TAGGED) {
+                if (len < CID_TAG_SIZE) {
+                        printf("--- Tagged packet too short (%d)\n", len);
+                        return;
+                }
+                memcpy(&d->req.tag, data, CID_TAG_SIZE);
+                d->req.tag = le32toh(d->req.tag);
+                d->req.tagged = true;
+                cid &= CID_MASK;
+                data += CID_TAG_SIZE;
+                len -= CID_TAG_SIZE;
+        }
+        stats_request(d, cid, len, data);
+
+        switch (cid) {
+        case CID_IGNORE:
+                break;
+
+        case CID_HOSTINFO:
+                channel_hostinfo_rx(d, data, len);
+                break;
+
+        case CID_RAWFILE:
+                channel_rawfile_rx(d, data, len);
+                break;
+
+        case CID_DIR:
+                channel_dir_rx(d, data, len);
+                break;
+
+        case CID_BLOCK:
+                channel_block_rx(d, data, len);
+                break;
+
+        case CID_FS:
+                channel_fs_rx(d, data, len);
+                break;
+
+        case CID_ECHO:
+        case CID_ECHO_BULK:
+                channel_echo_rx(d, cid, data, len);
+                break;
+        }
+}
+
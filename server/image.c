@@ -0,0 +1,1297 @@
+/* Disc and archive images as directories:  a host path can lead into an
+ * ADFS disc image or a zip file
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef CONFIG_ZLIB
+#include <zlib.h>
+#endif
+
+#include "channels.h"
+#include "image.h"
+
+
+#ifndef DEBUG
+#define DEBUG   3
+#endif
+
+/* "games/elite.adf/!Elite/!Run" is !Run in the image's !Elite directory.
+ * Names inside an image are in host form, with '.' for a RISC OS '/', as
+ * cdir_list() gives them.
+ *
+ * Each image's catalogue is read once, into an index of its objects, which
+ * is kept until the image changes (by mtime, size or inode).  A file that
+ * is in one piece in the image is read straight from it.  Others (a
+ * fragmented ADFS file, or a deflated zip member) are put together once,
+ * into an extent held in memory, and read from that.  Images aren't
+ * written to.
+ */
+#define IMG_CACHE       8
+#define IMG_XCACHE      16
+#define IMG_XCACHE_BYTES (64 * 1024 * 1024)
+/* A bad image could loop, or claim anything: */
+#define IMG_DEPTH       16
+#define IMG_MAX_NODES   65536
+#define IMG_MAX_DIR     (4 * 1024 * 1024)
+
+#define IMG_NONE        0               // Not an image we understand
+#define IMG_ADFS_OLD    1               // S/M/L, D:  files are contiguous
+#define IMG_ADFS_NEW    2               // E/F, hard discs:  fragments
+#define IMG_ZIP         3
+
+struct img_node {
+        char            *name;          // Without any ",xxx" suffix
+        char            *host;          // As found in a path
+        unsigned int    parent;         // The root (0) is its own
+        uint8_t         type;           // 1 file, 2 directory
+        uint8_t         attr;           // RISC OS attributes
+        uint16_t        method;         // Zip:  0 stored, 8 deflated
+        uint32_t        load;
+        uint32_t        exec;
+        uint32_t        length;
+        uint32_t        addr;           // Disc address, or zip local header
+        uint32_t        csize;          // Zip:  compressed size
+        uint32_t        crc;            // Zip
+};
+
+/* A new map fragment:  bits map bits, from map block blk */
+struct adfs_frag {
+        uint32_t        id;
+        uint32_t        blk;
+        uint32_t        bits;
+};
+
+struct img_ext {
+        uint64_t        off;
+        uint32_t        len;
+};
+
+struct img {
+        char            path[PATH_MAX];
+        dev_t           dev;
+        ino_t           ino;
+        struct timespec mtime;
+        off_t           size;
+        unsigned int    id;             // Distinguishes its extents
+        uint64_t        used;
+        int             fd;
+        unsigned int    kind;
+
+        struct img_node *nodes;
+        unsigned int    n;
+        unsigned int    max;
+
+        /* ADFS new map, from the disc record: */
+        unsigned int    log2secsize;
+        unsigned int    idlen;
+        unsigned int    log2bpmb;
+        unsigned int    log2sharesize;
+        unsigned int    nzones;
+        unsigned int    zone_size;      // Bits of each zone's map block
+        unsigned int    ids_per_zone;
+        struct adfs_frag *frags;        // In map order
+        unsigned int    *zone_frag;     // First of each zone's, and the end
+};
+
+/* A file of an image put together in memory */
+struct img_extent {
+        unsigned int    id;             // The image's, or 0 if unused
+        unsigned int    node;
+        int             fd;             // A memfd
+        uint32_t        length;
+        uint64_t        used;
+};
+
+static struct img *img_cache[IMG_CACHE];
+static struct img_extent img_xcache[IMG_XCACHE];
+static uint64_t img_clock;
+static unsigned int img_next_id = 1;
+
+static uint32_t le16(const uint8_t *p)
+{
+        return p[0] | (p[1] << 8);
+}
+
+static uint32_t le24(const uint8_t *p)
+{
+        return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+static uint32_t le32(const uint8_t *p)
+{
+        return le24(p) | ((uint32_t)p[3] << 24);
+}
+
+static int      img_read(struct img *im, void *buf, size_t len, uint64_t off)
+{
+        ssize_t r = pread(im->fd, buf, len, off);
+
+        return r == (ssize_t)len ? 0 : (r < 0 ? errno : EIO);
+}
+
+/* Returns the new node's index, or -1 */
+static int      img_add(struct img *im, unsigned int parent, const char *name,
+                        const char *host, uint8_t type)
+{
+        struct img_node *nd;
+
+        if (im->n == im->max) {
+                unsigned int max = im->max ? im->max * 2 : 64;
+
+                if (max > IMG_MAX_NODES)
+                        return -1;
+                nd = realloc(im->nodes, max * sizeof(*nd));
+                if (!nd)
+                        return -1;
+                im->nodes = nd;
+                im->max = max;
+        }
+        nd = &im->nodes[im->n];
+        memset(nd, 0, sizeof(*nd));
+        nd->name = strdup(name);
+        nd->host = strdup(host);
+        if (!nd->name || !nd->host) {
+                free(nd->name);
+                free(nd->host);
+                return -1;
+        }
+        nd->parent = parent;
+        nd->type = type;
+        return im->n++;
+}
+
+/* Child of directory node dir called leaf:  an exact match, else one that
+ * differs only in case (as RISC OS would find it)
+ */
+static int      img_child(struct img *im, unsigned int dir, const char *leaf)
+{
+        int found = -1;
+
+        for (unsigned int i = 1; i < im->n; i++) {
+                struct img_node *nd = &im->nodes[i];
+
+                if (nd->parent != dir)
+                        continue;
+                if (!strcmp(nd->host, leaf))
+                        return i;
+                if (found < 0 && (!strcasecmp(nd->host, leaf) ||
+                                  !strcasecmp(nd->name, leaf)))
+                        found = i;
+        }
+        return found;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ADFS
+
+/* Disc record fields (as FileCore's) */
+#define DR_LOG2SECSIZE  0
+#define DR_IDLEN        4
+#define DR_LOG2BPMB     5
+#define DR_NZONES       9
+#define DR_ZONE_SPARE   10
+#define DR_ROOT         12
+#define DR_DISC_SIZE    16
+#define DR_DISC_SIZE_HI 36
+#define DR_SHARE_SIZE   40
+#define DR_NZONES_HI    42
+#define DR_FORMAT       44
+#define DR_ROOT_SIZE    48
+#define DR_SIZE         60
+#define DR_BITS         (DR_SIZE * 8)   // Of zone 0's map block
+
+/* Where a hard disc (or F format floppy) keeps its disc record */
+#define ADFS_BOOT_DR    (0xc00 + 0x1c0)
+
+#define ADFS_OLD_DIR    0x500           // "Hugo"
+#define ADFS_NEW_DIR    0x800           // "Nick"
+#define ADFS_DIR_ENTRY  26
+#define ADFS_BIG_ENTRY  28              // "SBPr"
+
+/* FileCore directory attributes, and RISC OS ones from them */
+#define ADFS_ATTR_R     0x01
+#define ADFS_ATTR_W     0x02
+#define ADFS_ATTR_L     0x04
+#define ADFS_ATTR_D     0x08
+#define ADFS_ATTR_PR    0x20
+#define ADFS_ATTR_PW    0x40
+
+static uint8_t  adfs_attr(uint8_t a)
+{
+        return (a & (ADFS_ATTR_R | ADFS_ATTR_W)) |
+                ((a & ADFS_ATTR_L) ? 0x08 : 0) |
+                ((a & ADFS_ATTR_PR) ? 0x10 : 0) |
+                ((a & ADFS_ATTR_PW) ? 0x20 : 0);
+}
+
+static uint32_t adfs_bits(const uint8_t *map, unsigned int bit, unsigned int n)
+{
+        uint32_t v = 0;
+
+        for (unsigned int i = 0; i < n; i++, bit++)
+                v |= (uint32_t)((map[bit >> 3] >> (bit & 7)) & 1) << i;
+        return v;
+}
+
+/* List the new map's fragments, zone by zone.  Each zone's block starts
+ * with 32 bits of header (zone 0's then has the disc record); each
+ * fragment is an idlen-bit id, then zeroes up to a 1 bit at its end.  Free
+ * space is a chain of fragments whose ids are the offset to the next.
+ */
+static int      adfs_scan_map(struct img *im, const uint8_t *map,
+                              uint64_t disc_bits)
+{
+        unsigned int max = 0, nf = 0;
+
+        im->zone_frag = calloc(im->nzones + 1, sizeof(*im->zone_frag));
+        if (!im->zone_frag)
+                return ENOMEM;
+        for (unsigned int z = 0; z < im->nzones; z++) {
+                const uint8_t *zm = &map[(size_t)z << im->log2secsize];
+                unsigned int start = z ? 32 : 32 + DR_BITS;
+                unsigned int end = 32 + im->zone_size;
+                uint32_t blk = z ? z * im->zone_size - DR_BITS : 0;
+                uint32_t free = adfs_bits(zm, 8, im->idlen) & 0x7fff;
+                unsigned int zstart = start;
+
+                if (z == im->nzones - 1) {
+                        int64_t last = disc_bits - ((int64_t)z * im->zone_size -
+                                                    DR_BITS);
+
+                        if (last > 0 && last < im->zone_size)
+                                end = 32 + last;
+                }
+                if (free)
+                        free += 8;
+                im->zone_frag[z] = nf;
+                while (start < end) {
+                        uint32_t id = adfs_bits(zm, start, im->idlen);
+                        unsigned int fend = start + im->idlen;
+
+                        while (fend < end && !((zm[fend >> 3] >> (fend & 7)) & 1))
+                                fend++;
+                        if (fend >= end)
+                                break;
+                        if (start == free) {
+                                free += id & 0x7fff;
+                        } else {
+                                if (nf == max) {
+                                        struct adfs_frag *f;
+
+                                        max = max ? max * 2 : 256;
+                                        f = realloc(im->frags, max * sizeof(*f));
+                                        if (!f)
+                                                return ENOMEM;
+                                        im->frags = f;
+                                }
+                                im->frags[nf].id = id;
+                                im->frags[nf].blk = blk + start - zstart;
+                                im->frags[nf].bits = fend + 1 - start;
+                                nf++;
+                        }
+                        start = fend + 1;
+                }
+        }
+        im->zone_frag[im->nzones] = nf;
+        return 0;
+}
+
+/* Where the first length bytes of an object are on the disc.  ind is its
+ * indirect disc address:  for the old map, in 256-byte units; for the new,
+ * a fragment id, and (if it shares a fragment) its offset in that, in
+ * share units plus one.  The object's fragments are found in map order,
+ * from the zone its id belongs to.  Returns the number of extents (in
+ * *xp, to be freed), or -1.
+ */
+static int      adfs_extents(struct img *im, uint32_t ind, uint32_t length,
+                             struct img_ext **xp)
+{
+        uint32_t id = ind >> 8;
+        uint64_t skip = 0;
+        unsigned int zone, nx = 0, max = 0;
+        struct img_ext *x = NULL;
+
+        *xp = NULL;
+        if (im->kind == IMG_ADFS_OLD) {
+                if (!length)
+                        return 0;
+                if (!(x = malloc(sizeof(*x))))
+                        return -1;
+                x->off = (uint64_t)ind * 256;
+                x->len = length;
+                *xp = x;
+                return 1;
+        }
+        if (ind & 0xff)
+                skip = (uint64_t)((ind & 0xff) - 1) <<
+                        (im->log2sharesize + im->log2secsize);
+        zone = id == 2 ? im->nzones / 2 : id / im->ids_per_zone;
+        if (zone >= im->nzones)
+                return -1;
+        for (unsigned int k = 0; k < im->nzones && length; k++) {
+                unsigned int z = (zone + k) % im->nzones;
+
+                for (unsigned int i = im->zone_frag[z];
+                     i < im->zone_frag[z + 1] && length; i++) {
+                        struct adfs_frag *f = &im->frags[i];
+                        uint64_t off = (uint64_t)f->blk << im->log2bpmb;
+                        uint64_t len = (uint64_t)f->bits << im->log2bpmb;
+
+                        if (f->id != id)
+                                continue;
+                        if (skip >= len) {
+                                skip -= len;
+                                continue;
+                        }
+                        off += skip;
+                        len -= skip;
+                        skip = 0;
+                        if (len > length)
+                                len = length;
+                        if (nx == max) {
+                                struct img_ext *nxp;
+
+                                max = max ? max * 2 : 8;
+                                if (!(nxp = realloc(x, max * sizeof(*x)))) {
+                                        free(x);
+                                        return -1;
+                                }
+                                x = nxp;
+                        }
+                        x[nx].off = off;
+                        x[nx].len = len;
+                        nx++;
+                        length -= len;
+                }
+        }
+        if (length) {
+                free(x);
+                return -1;
+        }
+        *xp = x;
+        return nx;
+}
+
+/* Read an object's first len bytes */
+static int      adfs_read(struct img *im, uint32_t ind, uint8_t *buf,
+                          uint32_t len)
+{
+        struct img_ext *x;
+        int nx = adfs_extents(im, ind, len, &x), r = 0;
+
+        if (nx < 0)
+                return EIO;
+        for (int i = 0; i < nx && !r; i++) {
+                r = img_read(im, buf, x[i].len, x[i].off);
+                buf += x[i].len;
+        }
+        free(x);
+        return r;
+}
+
+static int      adfs_dir(struct img *im, unsigned int dir, uint32_t ind,
+                         uint32_t size, unsigned int depth);
+
+/* Add an entry of directory dir, reading it in if it's a directory */
+static int      adfs_entry(struct img *im, unsigned int dir, const char *rname,
+                           const uint8_t *w, uint32_t ind, uint8_t attr,
+                           unsigned int depth)
+{
+        char name[256];
+        uint8_t type = (attr & ADFS_ATTR_D) ? 2 : 1;
+        struct img_node *nd;
+        int n;
+
+        snprintf(name, sizeof(name), "%s", rname);
+        for (char *c = name; *c; c++)
+                if (*c == '/')
+                        *c = '.';
+        if ((n = img_add(im, dir, name, name, type)) < 0)
+                return ENOMEM;
+        nd = &im->nodes[n];
+        nd->load = le32(&w[0]);
+        nd->exec = le32(&w[4]);
+        nd->length = le32(&w[8]);
+        nd->addr = ind;
+        nd->attr = adfs_attr(attr);
+        if (type == 1)
+                return 0;
+
+        uint32_t size = nd->length;
+
+        nd->length = 0;
+        if (size < ADFS_OLD_DIR || size > IMG_MAX_DIR)
+                size = im->kind == IMG_ADFS_OLD ? 0 : ADFS_NEW_DIR;
+        /* A bad subdirectory is left empty, rather than losing the image: */
+        if (adfs_dir(im, n, ind, size, depth + 1))
+                printf("--- Image '%s': bad directory '%s'\n", im->path, name);
+        return 0;
+}
+
+/* "Hugo" (old) and "Nick" (new) directories:  a fixed number of 26-byte
+ * entries, each a name of up to 10 characters, load, exec, length, a
+ * 3-byte disc address and (for new directories) the attributes.  Old ones
+ * keep those in the top bits of the name's characters.
+ */
+static int      adfs_dir_fixed(struct img *im, unsigned int dir,
+                               const uint8_t *b, uint32_t size,
+                               unsigned int depth)
+{
+        bool old = !memcmp(&b[1], "Hugo", 4);
+        unsigned int tail = old ? 53 : 41;
+        unsigned int n = (size - 5 - tail) / ADFS_DIR_ENTRY;
+
+        if (memcmp(&b[size - 5], &b[1], 4))
+                return EIO;
+        for (unsigned int i = 0; i < n; i++) {
+                const uint8_t *e = &b[5 + i * ADFS_DIR_ENTRY];
+                char name[11];
+                uint8_t attr = e[25];
+                unsigned int j;
+                int r;
+
+                if (e[0] == 0)
+                        break;
+                for (j = 0; j < 10 && (e[j] & 0x7f) >= ' '; j++)
+                        name[j] = e[j] & 0x7f;
+                name[j] = '\0';
+                if (old)
+                        attr = ((e[0] >> 7) ? ADFS_ATTR_R : 0) |
+                                ((e[1] >> 7) ? ADFS_ATTR_W : 0) |
+                                ((e[2] >> 7) ? ADFS_ATTR_L : 0) |
+                                ((e[3] >> 7) ? ADFS_ATTR_D : 0);
+                if ((r = adfs_entry(im, dir, name, &e[10], le24(&e[22]), attr,
+                                    depth)) != 0)
+                        return r;
+        }
+        return 0;
+}
+
+/* "SBPr" (big) directories:  a header with the count of entries, then
+ * 28-byte entries (load, exec, length, disc address, attributes, name
+ * length and offset), then the names
+ */
+static int      adfs_dir_big(struct img *im, unsigned int dir,
+                             const uint8_t *b, uint32_t size,
+                             unsigned int depth)
+{
+        uint32_t nlen = le32(&b[8]), n = le32(&b[16]), nsize = le32(&b[20]);
+        uint64_t hdr = 28 + ((nlen + 4) & ~3), names = hdr + n * ADFS_BIG_ENTRY;
+
+        if (nlen > 255 || n > size / ADFS_BIG_ENTRY || names + nsize > size ||
+            memcmp(&b[size - 8], "oven", 4))
+                return EIO;
+        for (uint32_t i = 0; i < n; i++) {
+                const uint8_t *e = &b[hdr + i * ADFS_BIG_ENTRY];
+                uint32_t len = le32(&e[20]), ptr = le32(&e[24]);
+                char name[256];
+                int r;
+
+                if (len > 255 || (uint64_t)ptr + len > nsize)
+                        return EIO;
+                memcpy(name, &b[names + ptr], len);
+                name[len] = '\0';
+                for (char *c = name; *c; c++)
+                        if (*c < ' ')
+                                *c = '\0';
+                if ((r = adfs_entry(im, dir, name, e, le32(&e[12]), e[16],
+                                    depth)) != 0)
+                        return r;
+        }
+        return 0;
+}
+
+/* Read directory node dir, of size bytes at ind (or for the old map, 0 to
+ * use the root's size)
+ */
+static int      adfs_dir(struct img *im, unsigned int dir, uint32_t ind,
+                         uint32_t size, unsigned int depth)
+{
+        uint8_t *b;
+        int r = EIO;
+
+        if (depth > IMG_DEPTH)
+                return ELOOP;
+        if (!size) {
+                uint8_t h[5];
+
+                if ((r = adfs_read(im, ind, h, sizeof(h))) != 0)
+                        return r;
+                size = !memcmp(&h[1], "Hugo", 4) ? ADFS_OLD_DIR : ADFS_NEW_DIR;
+        }
+        if (!(b = malloc(size)))
+                return ENOMEM;
+        if (adfs_read(im, ind, b, size) == 0) {
+                if (!memcmp(&b[1], "Hugo", 4) || !memcmp(&b[1], "Nick", 4))
+                        r = adfs_dir_fixed(im, dir, b, size, depth);
+                else if (!memcmp(&b[4], "SBPr", 4))
+                        r = adfs_dir_big(im, dir, b, size, depth);
+        }
+        free(b);
+        return r;
+}
+
+/* A new map disc, if there's a plausible disc record at dr_off */
+static int      adfs_new_map(struct img *im, uint64_t dr_off)
+{
+        uint8_t dr[DR_SIZE], *map;
+        uint64_t disc_size, map_off;
+        uint32_t spare, root_size;
+        int r;
+
+        if (img_read(im, dr, sizeof(dr), dr_off))
+                return EIO;
+        im->log2secsize = dr[DR_LOG2SECSIZE];
+        im->idlen = dr[DR_IDLEN];
+        im->log2bpmb = dr[DR_LOG2BPMB];
+        im->log2sharesize = dr[DR_SHARE_SIZE] & 0xf;
+        im->nzones = dr[DR_NZONES] | (dr[DR_NZONES_HI] << 8);
+        spare = le16(&dr[DR_ZONE_SPARE]);
+        if (im->log2secsize < 8 || im->log2secsize > 12 || im->idlen < 8 ||
+            im->idlen > 21 || im->log2bpmb > 12 || im->nzones == 0 ||
+            spare + 32 + DR_BITS >= (8U << im->log2secsize))
+                return EINVAL;
+        im->zone_size = (8U << im->log2secsize) - spare;
+        im->ids_per_zone = im->zone_size / (im->idlen + 1);
+        disc_size = le32(&dr[DR_DISC_SIZE]) |
+                ((uint64_t)le32(&dr[DR_DISC_SIZE_HI]) << 32);
+        /* The map is in the middle zone, so that's where object 2 (the
+         * map, and on floppies the root directory too) starts:
+         */
+        map_off = ((uint64_t)(im->nzones / 2) * im->zone_size -
+                   (im->nzones > 1 ? DR_BITS : 0)) << im->log2bpmb;
+        if (!(map = malloc((size_t)im->nzones << im->log2secsize)))
+                return ENOMEM;
+        r = img_read(im, map, (size_t)im->nzones << im->log2secsize, map_off);
+        if (!r)
+                r = adfs_scan_map(im, map, disc_size >> im->log2bpmb);
+        free(map);
+        if (r)
+                return r;
+
+        root_size = le32(&dr[DR_FORMAT]) ? le32(&dr[DR_ROOT_SIZE]) : 0;
+        if (root_size < ADFS_NEW_DIR || root_size > IMG_MAX_DIR)
+                root_size = ADFS_NEW_DIR;
+        im->kind = IMG_ADFS_NEW;
+        return adfs_dir(im, 0, le32(&dr[DR_ROOT]), root_size, 0);
+}
+
+static void     adfs_reset(struct img *im)
+{
+        for (unsigned int i = 1; i < im->n; i++) {
+                free(im->nodes[i].name);
+                free(im->nodes[i].host);
+        }
+        im->n = 1;
+        free(im->frags);
+        free(im->zone_frag);
+        im->frags = NULL;
+        im->zone_frag = NULL;
+        im->kind = IMG_NONE;
+}
+
+/* E format floppies have the map (so the disc record) at the start, and
+ * F format and hard discs in the middle, with a copy of the disc record in
+ * the boot block.  Old map discs have their root directory at &200 (S, M
+ * and L formats) or &400 (D).
+ */
+static int      img_adfs(struct img *im)
+{
+        static const uint64_t dr_at[] = { 4, ADFS_BOOT_DR };
+        static const uint32_t old_root[] = { 2, 4 };
+
+        for (unsigned int i = 0; i < 2; i++) {
+                if (adfs_new_map(im, dr_at[i]) == 0)
+                        return 0;
+                adfs_reset(im);
+        }
+        for (unsigned int i = 0; i < 2; i++) {
+                im->kind = IMG_ADFS_OLD;
+                if (adfs_dir(im, 0, old_root[i], 0, 0) == 0)
+                        return 0;
+                adfs_reset(im);
+        }
+        return EINVAL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Zip
+
+#define ZIP_EOCD        0x06054b50
+#define ZIP_CENTRAL     0x02014b50
+#define ZIP_LOCAL       0x04034b50
+#define ZIP_EOCD_SIZE   22
+#define ZIP_CENTRAL_SIZE 46
+#define ZIP_LOCAL_SIZE  30
+/* RISC OS zips (SparkFS, Info-ZIP) keep load/exec/attributes in an extra
+ * field:  "AC", size, "ARC0", load, exec, attributes
+ */
+#define ZIP_ACORN       0x4341
+
+static time_t   zip_time(uint32_t t, uint32_t d)
+{
+        struct tm tm;
+
+        memset(&tm, 0, sizeof(tm));
+        tm.tm_sec = (t & 31) * 2;
+        tm.tm_min = (t >> 5) & 63;
+        tm.tm_hour = t >> 11;
+        tm.tm_mday = d & 31;
+        tm.tm_mon = ((d >> 5) & 15) - 1;
+        tm.tm_year = (d >> 9) + 80;
+        tm.tm_isdst = -1;
+        return mktime(&tm);
+}
+
+/* Add a central directory entry, and any directories on its way */
+static int      zip_entry(struct img *im, const uint8_t *c, char *path,
+                          const uint8_t *extra, unsigned int xlen)
+{
+        unsigned int dir = 0;
+        char *p = path, *slash;
+        bool is_dir = path[0] && path[strlen(path) - 1] == '/';
+        time_t mtime = zip_time(le16(&c[12]), le16(&c[14]));
+        struct img_node *nd;
+        int n = 0;
+
+        while ((slash = strchr(p, '/')) != NULL) {
+                *slash = '\0';
+                if (p[0] && strcmp(p, ".")) {
+                        if ((n = img_child(im, dir, p)) < 0 &&
+                            (n = img_add(im, dir, p, p, 2)) < 0)
+                                return ENOMEM;
+                        if (im->nodes[n].type != 2)
+                                return 0;               // Clashes:  skip
+                        dir = n;
+                }
+                p = slash + 1;
+        }
+        char name[256];
+
+        if (is_dir) {
+                if (n > 0) {                            // Its stamp
+                        crf_name_attrs(im->nodes[n].name, mtime, name,
+                                       sizeof(name), &im->nodes[n].load,
+                                       &im->nodes[n].exec);
+                        im->nodes[n].attr = 0x11;
+                }
+                return 0;
+        }
+        if (!p[0] || img_child(im, dir, p) >= 0)
+                return 0;
+
+        uint32_t load, exec;
+        uint8_t attr = 0x11;                            // Read-only
+
+        crf_name_attrs(p, mtime, name, sizeof(name), &load, &exec);
+        while (xlen >= 4) {
+                unsigned int id = le16(extra), sz = le16(&extra[2]);
+
+                if (sz + 4 > xlen)
+                        break;
+                if (id == ZIP_ACORN && sz >= 16 && !memcmp(&extra[4], "ARC0", 4)) {
+                        snprintf(name, sizeof(name), "%s", p);
+                        load = le32(&extra[8]);
+                        exec = le32(&extra[12]);
+                        attr = extra[16] & 0x3b;
+                }
+                extra += sz + 4;
+                xlen -= sz + 4;
+        }
+        if ((n = img_add(im, dir, name, p, 1)) < 0)
+                return ENOMEM;
+        nd = &im->nodes[n];
+        nd->load = load;
+        nd->exec = exec;
+        nd->attr = attr;
+        nd->method = le16(&c[10]);
+        nd->crc = le32(&c[16]);
+        nd->csize = le32(&c[20]);
+        nd->length = le32(&c[24]);
+        nd->addr = le32(&c[42]);
+        return 0;
+}
+
+/* The central directory, found from the end record (after which there can
+ * be a comment of up to 64KB).  Zip64 isn't supported.
+ */
+static int      img_zip(struct img *im)
+{
+        uint32_t tlen = im->size < 65535 + ZIP_EOCD_SIZE ? im->size :
+                65535 + ZIP_EOCD_SIZE;
+        uint8_t *b = malloc(tlen), *e = NULL;
+        uint32_t count, cd_size, cd_off, pos = 0;
+        int r = EINVAL;
+
+        if (!b || tlen < ZIP_EOCD_SIZE ||
+            img_read(im, b, tlen, im->size - tlen)) {
+                free(b);
+                return EINVAL;
+        }
+        for (int i = tlen - ZIP_EOCD_SIZE; i >= 0 && !e; i--) {
+                if (le32(&b[i]) == ZIP_EOCD)
+                        e = &b[i];
+        }
+        if (!e) {
+                free(b);
+                return EINVAL;
+        }
+        count = le16(&e[10]);
+        cd_size = le32(&e[12]);
+        cd_off = le32(&e[16]);
+        free(b);
+        if (count == 0xffff || cd_off == 0xffffffff ||
+            (uint64_t)cd_off + cd_size > (uint64_t)im->size)
+                return EINVAL;
+        if (!(b = malloc(cd_size ? cd_size : 1)) ||
+            img_read(im, b, cd_size, cd_off)) {
+                free(b);
+                return EIO;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+                const uint8_t *c = &b[pos];
+                unsigned int nlen, xlen, clen;
+                char path[PATH_MAX];
+
+                if (pos + ZIP_CENTRAL_SIZE > cd_size || le32(c) != ZIP_CENTRAL)
+                        break;
+                nlen = le16(&c[28]);
+                xlen = le16(&c[30]);
+                clen = le16(&c[32]);
+                if (pos + ZIP_CENTRAL_SIZE + nlen + xlen + clen > cd_size ||
+                    nlen >= sizeof(path))
+                        break;
+                memcpy(path, &c[ZIP_CENTRAL_SIZE], nlen);
+                path[nlen] = '\0';
+                // Encrypted members are left out:
+                if (!(le16(&c[8]) & 1) &&
+                    zip_entry(im, c, path, &c[ZIP_CENTRAL_SIZE + nlen], xlen))
+                        break;
+                pos += ZIP_CENTRAL_SIZE + nlen + xlen + clen;
+                if (i == count - 1)
+                        r = 0;
+        }
+        if (count == 0)
+                r = 0;
+        free(b);
+        if (!r)
+                im->kind = IMG_ZIP;
+        return r;
+}
+
+/* Where zip member nd's data starts */
+static int      zip_data(struct img *im, struct img_node *nd, uint64_t *off)
+{
+        uint8_t h[ZIP_LOCAL_SIZE];
+        int r = img_read(im, h, sizeof(h), nd->addr);
+
+        if (r)
+                return r;
+        if (le32(h) != ZIP_LOCAL)
+                return EIO;
+        *off = (uint64_t)nd->addr + ZIP_LOCAL_SIZE + le16(&h[26]) +
+                le16(&h[28]);
+        return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The index
+
+static void     img_free(struct img *im)
+{
+        if (!im)
+                return;
+        for (unsigned int i = 0; i < IMG_XCACHE; i++) {
+                struct img_extent *x = &img_xcache[i];
+
+                if (x->id == im->id) {
+                        close(x->fd);
+                        x->id = 0;
+                }
+        }
+        adfs_reset(im);
+        if (im->n) {
+                free(im->nodes[0].name);
+                free(im->nodes[0].host);
+        }
+        free(im->nodes);
+        if (im->fd >= 0)
+                close(im->fd);
+        free(im);
+}
+
+static bool     img_is_zip(const char *path)
+{
+        const char *leaf = strrchr(path, '/');
+        const char *comma;
+        size_t len;
+
+        leaf = leaf ? leaf + 1 : path;
+        comma = strrchr(leaf, ',');
+        if (comma && !strcmp(comma, ",a91"))
+                return true;
+        len = comma ? (size_t)(comma - leaf) : strlen(leaf);
+        return len > 4 && !strncasecmp(&leaf[len - 4], ".zip", 4);
+}
+
+/* Read an image's catalogue.  One we don't understand is kept as
+ * IMG_NONE, so as not to try again until it changes.
+ */
+static struct img *img_index(const char *path, const struct stat *sb)
+{
+        struct img *im = calloc(1, sizeof(*im));
+        int r = EINVAL;
+
+        if (!im)
+                return NULL;
+        snprintf(im->path, sizeof(im->path), "%s", path);
+        im->dev = sb->st_dev;
+        im->ino = sb->st_ino;
+        im->mtime = sb->st_mtim;
+        im->size = sb->st_size;
+        im->id = img_next_id++;
+        im->fd = open(path, O_RDONLY);
+        if (im->fd >= 0 && img_add(im, 0, "", "", 2) == 0)
+                r = img_is_zip(path) ? img_zip(im) : img_adfs(im);
+        if (r) {
+                adfs_reset(im);
+#if DEBUG > 1
+                printf("+++ '%s' isn't an image we know (%d)\n", path, r);
+#endif
+        } else {
+#if DEBUG > 0
+                static const char *kinds[] = { "", "ADFS old map",
+                                               "ADFS new map", "zip" };
+
+                printf("+++ Indexed image '%s' (%s):  %u objects\n", path,
+                       kinds[im->kind], im->n - 1);
+#endif
+        }
+        return im;
+}
+
+/* Image path, indexed (again, if it's changed), or NULL */
+static struct img *img_get(const char *path, const struct stat *sb)
+{
+        unsigned int slot = 0;
+
+        for (unsigned int i = 0; i < IMG_CACHE; i++) {
+                struct img *im = img_cache[i];
+
+                if (!im || strcmp(im->path, path))
+                        continue;
+                if (im->dev == sb->st_dev && im->ino == sb->st_ino &&
+                    im->size == sb->st_size &&
+                    im->mtime.tv_sec == sb->st_mtim.tv_sec &&
+                    im->mtime.tv_nsec == sb->st_mtim.tv_nsec) {
+                        im->used = ++img_clock;
+                        return im;
+                }
+                img_free(im);
+                img_cache[i] = NULL;
+        }
+        for (unsigned int i = 0; i < IMG_CACHE; i++) {
+                if (!img_cache[i]) {
+                        slot = i;
+                        break;
+                }
+                if (img_cache[i]->used < img_cache[slot]->used)
+                        slot = i;
+        }
+        img_free(img_cache[slot]);
+        img_cache[slot] = img_index(path, sb);
+        if (img_cache[slot])
+                img_cache[slot]->used = ++img_clock;
+        return img_cache[slot];
+}
+
+bool            img_name(const char *leaf)
+{
+        static const char *const ext[] = { ".adf", ".adl", ".hdf", ".zip" };
+        const char *comma = strrchr(leaf, ',');
+        size_t len = strlen(leaf);
+
+        if (comma && !strcmp(comma, ",a91"))
+                return true;
+        for (int pass = 0; pass < 2; pass++) {
+                for (unsigned int i = 0; i < 4; i++) {
+                        if (len > 4 && !strncasecmp(&leaf[len - 4], ext[i], 4))
+                                return true;
+                }
+                if (!comma)
+                        break;
+                len = comma - leaf;             // Before a ",xxx" suffix
+        }
+        return false;
+}
+
+/* The image host path leads into (or is), with the path within it in
+ * *rest; or NULL, if there isn't one we understand
+ */
+static struct img *img_find(const char *path, const char **rest)
+{
+        char prefix[PATH_MAX];
+        size_t len = strlen(path), leaf = 0;
+
+        if (len >= sizeof(prefix))
+                return NULL;
+        for (size_t i = 0; i <= len; i++) {
+                struct stat sb;
+                struct img *im;
+
+                if (path[i] != '/' && path[i] != '\0')
+                        continue;
+                memcpy(prefix, path, i);
+                prefix[i] = '\0';
+                if (i > leaf && img_name(&prefix[leaf])) {
+                        if (stat(prefix, &sb) < 0)
+                                return NULL;
+                        if (S_ISREG(sb.st_mode)) {
+                                im = img_get(prefix, &sb);
+                                if (!im || im->kind == IMG_NONE)
+                                        return NULL;
+                                *rest = &path[i] + (path[i] ? 1 : 0);
+                                return im;
+                        }
+                }
+                leaf = i + 1;
+        }
+        return NULL;
+}
+
+/* Node of path within im, or -errno */
+static int      img_lookup(struct img *im, const char *rest)
+{
+        unsigned int node = 0;
+        char comp[256];
+
+        while (*rest) {
+                const char *slash = strchr(rest, '/');
+                size_t n = slash ? (size_t)(slash - rest) : strlen(rest);
+                int c;
+
+                if (n >= sizeof(comp))
+                        return -ENAMETOOLONG;
+                memcpy(comp, rest, n);
+                comp[n] = '\0';
+                rest += n;
+                if (*rest)
+                        rest++;
+                if (!comp[0] || !strcmp(comp, "."))
+                        continue;
+                if (im->nodes[node].type != 2)
+                        return -ENOTDIR;
+                if ((c = img_child(im, node, comp)) < 0)
+                        return -ENOENT;
+                node = c;
+        }
+        return node;
+}
+
+static void     img_entry(struct img *im, unsigned int node,
+                          struct cdir_entry *e)
+{
+        struct img_node *nd = &im->nodes[node];
+
+        memset(e, 0, sizeof(*e));
+        snprintf(e->name, sizeof(e->name), "%s", nd->name);
+        snprintf(e->host, sizeof(e->host), "%s", nd->host);
+        e->load = nd->load;
+        e->exec = nd->exec;
+        e->length = nd->type == 2 ? 0 : nd->length;
+        e->type = nd->type;
+        e->attr = nd->attr;
+}
+
+int             img_stat(const char *path, struct cdir_entry *e)
+{
+        const char *rest;
+        struct img *im = img_find(path, &rest);
+        int node;
+
+        if (!im)
+                return -1;
+        if ((node = img_lookup(im, rest)) < 0)
+                return -node;
+        img_entry(im, node, e);
+        return 0;
+}
+
+static int      img_cmp(const void *a, const void *b)
+{
+        const struct cdir_entry *x = a, *y = b;
+
+        return strcmp(x->name, y->name);
+}
+
+int             img_list(const char *path, struct cdir_entry **ents,
+                         unsigned int *n)
+{
+        const char *rest;
+        struct img *im = img_find(path, &rest);
+        unsigned int count = 0;
+        int node;
+
+        *ents = NULL;
+        *n = 0;
+        if (!im)
+                return -1;
+        if ((node = img_lookup(im, rest)) < 0)
+                return -node;
+        if (im->nodes[node].type != 2)
+                return ENOTDIR;
+        for (unsigned int i = 1; i < im->n; i++)
+                count += im->nodes[i].parent == (unsigned int)node;
+        if (count && !(*ents = malloc(count * sizeof(**ents))))
+                return ENOMEM;
+        for (unsigned int i = 1; i < im->n; i++) {
+                if (im->nodes[i].parent == (unsigned int)node)
+                        img_entry(im, i, &(*ents)[(*n)++]);
+        }
+        if (*n)
+                qsort(*ents, *n, sizeof(**ents), img_cmp);
+        return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Reading
+
+#define IMG_CHUNK       (64 * 1024)
+
+/* Put a fragmented ADFS file together */
+static int      adfs_copy(struct img *im, struct img_node *nd, int out,
+                          uint8_t *buf)
+{
+        struct img_ext *x;
+        int nx = adfs_extents(im, nd->addr, nd->length, &x), r = 0;
+        uint64_t pos = 0;
+
+        if (nx < 0)
+                return EIO;
+        for (int i = 0; i < nx && !r; i++) {
+                for (uint32_t done = 0; done < x[i].len && !r; ) {
+                        uint32_t n = x[i].len - done;
+
+                        if (n > IMG_CHUNK)
+                                n = IMG_CHUNK;
+                        r = img_read(im, buf, n, x[i].off + done);
+                        if (!r && pwrite(out, buf, n, pos) != (ssize_t)n)
+                                r = errno ? errno : EIO;
+                        done += n;
+                        pos += n;
+                }
+        }
+        free(x);
+        return r;
+}
+
+/* Inflate a zip member, checking its CRC */
+static int      zip_inflate(struct img *im, struct img_node *nd, int out,
+                            uint8_t *buf)
+{
+#ifdef CONFIG_ZLIB
+        uint8_t *obuf = buf + IMG_CHUNK;
+        uint64_t off, pos = 0;
+        uint32_t left = nd->csize;
+        uLong crc = crc32(0, NULL, 0);
+        z_stream zs;
+        int r, zr = Z_OK;
+
+        if ((r = zip_data(im, nd, &off)) != 0)
+                return r;
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+                return ENOMEM;
+        while (!r && zr != Z_STREAM_END) {
+                uint32_t n = left > IMG_CHUNK ? IMG_CHUNK : left;
+
+                if (n == 0 || (r = img_read(im, buf, n, off)) != 0)
+                        break;
+                off += n;
+                left -= n;
+                zs.next_in = buf;
+                zs.avail_in = n;
+                do {
+                        unsigned int got;
+
+                        zs.next_out = obuf;
+                        zs.avail_out = IMG_CHUNK;
+                        zr = inflate(&zs, Z_NO_FLUSH);
+                        if (zr == Z_BUF_ERROR) {        // Wants more input
+                                zr = Z_OK;
+                                break;
+                        }
+                        if (zr != Z_OK && zr != Z_STREAM_END) {
+                                r = EIO;
+                                break;
+                        }
+                        got = IMG_CHUNK - zs.avail_out;
+                        crc = crc32(crc, obuf, got);
+                        if (pwrite(out, obuf, got, pos) != (ssize_t)got)
+                                r = errno ? errno : EIO;
+                        pos += got;
+                } while (!r && zs.avail_out == 0 && zr != Z_STREAM_END);
+        }
+        inflateEnd(&zs);
+        if (!r && (zr != Z_STREAM_END || pos != nd->length || crc != nd->crc))
+                r = EIO;
+        return r;
+#else
+        (void)im;
+        (void)nd;
+        (void)out;
+        (void)buf;
+        return EOPNOTSUPP;
+#endif
+}
+
+/* Node of im, put together in memory, or from the cache of those */
+static int      img_extent(struct img *im, unsigned int node,
+                           struct img_file *f)
+{
+        struct img_node *nd = &im->nodes[node];
+        struct img_extent *x = NULL;
+        uint64_t total = 0;
+        uint8_t *buf;
+        int fd, r;
+
+        for (unsigned int i = 0; i < IMG_XCACHE; i++) {
+                if (img_xcache[i].id == im->id && img_xcache[i].node == node)
+                        x = &img_xcache[i];
+        }
+        if (!x) {
+                if ((fd = memfd_create("pipe-extent", MFD_CLOEXEC)) < 0)
+                        return errno;
+                if (!(buf = malloc(2 * IMG_CHUNK))) {
+                        close(fd);
+                        return ENOMEM;
+                }
+                r = im->kind == IMG_ZIP ? zip_inflate(im, nd, fd, buf) :
+                        adfs_copy(im, nd, fd, buf);
+                free(buf);
+                if (r) {
+                        close(fd);
+                        printf("--- Image '%s': can't read '%s' (%d)\n",
+                               im->path, nd->name, r);
+                        return r;
+                }
+                /* Make room, dropping the least recently used: */
+                for (;;) {
+                        struct img_extent *lru = NULL;
+
+                        total = 0;
+                        x = NULL;
+                        for (unsigned int i = 0; i < IMG_XCACHE; i++) {
+                                struct img_extent *c = &img_xcache[i];
+
+                                if (!c->id) {
+                                        x = c;
+                                        continue;
+                                }
+                                total += c->length;
+                                if (!lru || c->used < lru->used)
+                                        lru = c;
+                        }
+                        if (!lru || (x && total + nd->length <= IMG_XCACHE_BYTES))
+                                break;
+                        close(lru->fd);
+                        lru->id = 0;
+                }
+                x->id = im->id;
+                x->node = node;
+                x->fd = fd;
+                x->length = nd->length;
+#if DEBUG > 1
+                printf("+++ Image '%s': '%s' put together (%u bytes)\n",
+                       im->path, nd->name, nd->length);
+#endif
+        }
+        x->used = ++img_clock;
+        if ((f->fd = dup(x->fd)) < 0)
+                return errno;
+        f->base = 0;
+        return 0;
+}
+
+int             img_open(const char *path, struct img_file *f)
+{
+        const char *rest;
+        struct img *im = img_find(path, &rest);
+        struct img_node *nd;
+        struct img_ext *x = NULL;
+        uint64_t off = 0;
+        int node, nx, r;
+
+        if (!im)
+                return -1;
+        if ((node = img_lookup(im, rest)) < 0)
+                return -node;
+        if (node == 0)
+                return -1;                      // The image itself
+        nd = &im->nodes[node];
+        if (nd->type == 2)
+                return EISDIR;
+        f->length = nd->length;
+        f->load = nd->load;
+        f->exec = nd->exec;
+
+        if (im->kind == IMG_ZIP) {
+                if (nd->method == 8)
+                        return img_extent(im, node, f);
+                if (nd->method != 0)
+                        return EOPNOTSUPP;
+                if ((r = zip_data(im, nd, &off)) != 0)
+                        return r;
+        } else {
+                if ((nx = adfs_extents(im, nd->addr, nd->length, &x)) < 0)
+                        return EIO;
+                if (nx > 1) {
+                        free(x);
+                        return img_extent(im, node, f);
+                }
+                if (nx == 1)
+                        off = x[0].off;
+                free(x);
+        }
+        if ((f->fd = dup(im->fd)) < 0)
+                return errno;
+        f->base = off;
+        return 0;
+}
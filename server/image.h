@@ -0,0 +1,71 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <sys/types.h>
+
+struct cdir_entry;
+
+/* A file to read from:  length bytes of fd, from base.  The fd is the
+ * caller's to close.
+ */
+struct img_file {
+        int             fd;
+        off_t           base;
+        uint32_t        length;
+        uint32_t        load;
+        uint32_t        exec;
+};
+
+/* Whether a host leaf name is one we look into (.adf, .zip etc.) */
+extern bool     img_name(const char *leaf);
+
+/* Each of these returns -1 if host path doesn't lead into an image (it's
+ * an ordinary host path), else 0 or an errno.  The image itself is its
+ * root directory, except to img_open(), for which it's a file.
+ */
+extern int      img_stat(const char *path, struct cdir_entry *e);
+extern int      img_list(const char *path, struct cdir_entry **ents,
+                         unsigned int *n);
+extern int      img_open(const char *path, struct img_file *f);
+
+/* How many bytes of size at offset are in a file of length (the rest
+ * read as zeroes).  Ordinary host files are opened with length
+ * IMG_NO_LIMIT, and read to their end.
+ */
+#define IMG_NO_LIMIT    UINT32_MAX
+
+static inline uint32_t img_avail(uint32_t length, uint32_t offset,
+                                 uint32_t size)
+{
+        if (offset >= length)
+                return 0;
+        return length - offset < size ? length - offset : size;
+}
+
+#endif
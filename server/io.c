@@ -0,0 +1,445 @@
+/* I/O engine
+ *
+ * Optional io_uring backend for the server, so that file reads and tty
+ * reads/writes are all submitted to, and completed from, one ring.  This
+ * cuts the syscall count on bulk transfers, and lets a file read overlap
+ * with output to the tty.
+ *
+ * There's no dependency on liburing; the handful of syscalls are used
+ * directly.  If io_uring can't be set up (old kernel, seccomp, or disabled
+ * at build time) the server uses the poll() loop, and io_pread() degrades
+ * to a synchronous pread().
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <stdbool.h>
+
+#include "io.h"
+
+#ifdef CONFIG_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#ifndef DEBUG
+#define DEBUG 1
+#endif
+
+bool    io_use_uring = false;
+
+#ifdef CONFIG_IO_URING
+
+#define URING_ENTRIES   64
+
+/* Each submitted op carries one of these as user_data: */
+struct io_op {
+        io_done_t       done;
+        void            *ctx;
+        struct io_op    *next;
+};
+
+static struct {
+        int             fd;
+        unsigned int    features;
+
+        unsigned int    *sq_head;
+        unsigned int    *sq_tail;
+        unsigned int    *sq_mask;
+        unsigned int    *sq_array;
+        struct io_uring_sqe *sqes;
+
+        unsigned int    *cq_head;
+        unsigned int    *cq_tail;
+        unsigned int    *cq_mask;
+        struct io_uring_cqe *cqes;
+
+        unsigned int    to_submit;
+
+        struct io_op    ops[URING_ENTRIES];
+        struct io_op    *free_ops;
+} ring;
+
+static int      sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+        return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int      sys_io_uring_enter(int fd, unsigned int to_submit,
+                                   unsigned int min_complete, unsigned int flags,
+                                   void *arg, size_t argsz)
+{
+        return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                       flags, arg, argsz);
+}
+
+static int      uring_setup(void)
+{
+        struct io_uring_params p;
+        uint8_t *sq = MAP_FAILED, *cq = MAP_FAILED;
+        int err;
+
+        memset(&p, 0, sizeof(p));
+        ring.fd = sys_io_uring_setup(URING_ENTRIES, &p);
+        if (ring.fd < 0)
+                return -errno;
+
+        ring.features = p.features;
+
+        size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+        size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (cq_sz > sq_sz)
+                        sq_sz = cq_sz;
+                cq_sz = sq_sz;
+        }
+
+        sq = mmap(0, sq_sz, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+        if (sq == MAP_FAILED)
+                goto fail;
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                cq = sq;
+        } else {
+                cq = mmap(0, cq_sz, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+                if (cq == MAP_FAILED)
+                        goto fail;
+        }
+
+        ring.sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
+                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring.fd, IORING_OFF_SQES);
+        if (ring.sqes == MAP_FAILED)
+                goto fail;
+
+        ring.sq_head = (unsigned int *)(sq + p.sq_off.head);
+        ring.sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+        ring.sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+        ring.sq_array = (unsigned int *)(sq + p.sq_off.array);
+
+        ring.cq_head = (unsigned int *)(cq + p.cq_off.head);
+        ring.cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+        ring.cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+        ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+        ring.to_submit = 0;
+
+        // Chain up the op pool:
+        ring.free_ops = NULL;
+        for (int i = 0; i < URING_ENTRIES; i++) {
+                ring.ops[i].next = ring.free_ops;
+                ring.free_ops = &ring.ops[i];
+        }
+        return 0;
+
+fail:
+        err = -errno;
+        if (cq != MAP_FAILED && cq != sq)
+                munmap(cq, cq_sz);
+        if (sq != MAP_FAILED)
+                munmap(sq, sq_sz);
+        close(ring.fd);
+        ring.fd = -1;
+        return err;
+}
+
+/* Returns a zeroed SQE wired up to a callback, or NULL if the ring or the op
+ * pool is full.
+ */
+static struct io_uring_sqe *uring_get_sqe(io_done_t done, void *ctx)
+{
+        if (!ring.free_ops)
+                return NULL;
+
+        unsigned int tail = *ring.sq_tail;
+        unsigned int head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+        unsigned int mask = *ring.sq_mask;
+
+        if (tail - head >= URING_ENTRIES)
+                return NULL;
+
+        struct io_op *op = ring.free_ops;
+        ring.free_ops = op->next;
+        op->done = done;
+        op->ctx = ctx;
+
+        unsigned int idx = tail & mask;
+        struct io_uring_sqe *sqe = &ring.sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = (uint64_t)(uintptr_t)op;
+
+        ring.sq_array[idx] = idx;
+        __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ring.to_submit++;
+
+        return sqe;
+}
+
+static void     uring_reap(void)
+{
+        unsigned int head = *ring.cq_head;
+
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+                struct io_op *op = (struct io_op *)(uintptr_t)cqe->user_data;
+                int res = cqe->res;
+
+                head++;
+                __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+                // Free the op before the callback, which may submit more:
+                io_done_t done = op->done;
+                void *ctx = op->ctx;
+                op->next = ring.free_ops;
+                ring.free_ops = op;
+
+                if (done)
+                        done(ctx, res);
+        }
+}
+
+int             io_read(int fd, void *buf, size_t len, io_done_t done, void *ctx)
+{
+        struct io_uring_sqe *sqe = uring_get_sqe(done, ctx);
+        if (!sqe)
+                return -EBUSY;
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = len;
+        sqe->off = -1;          // Current position, for a tty
+        return 0;
+}
+
+int             io_write(int fd, const void *buf, size_t len,
+                         io_done_t done, void *ctx)
+{
+        struct io_uring_sqe *sqe = uring_get_sqe(done, ctx);
+        if (!sqe)
+                return -EBUSY;
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = len;
+        sqe->off = -1;
+        return 0;
+}
+
+int             io_poll(int fd, short events, io_done_t done, void *ctx)
+{
+        struct io_uring_sqe *sqe = uring_get_sqe(done, ctx);
+        if (!sqe)
+                return -EBUSY;
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = events;
+        return 0;
+}
+
+static bool     timeout_posted = false;
+static struct __kernel_timespec timeout_ts;
+
+static void     uring_timeout_done(void *ctx, int res)
+{
+        (void)ctx;
+        (void)res;
+        timeout_posted = false;
+}
+
+/* Submit anything queued, wait for at least one completion (or timeout, if
+ * timeout_ms >= 0) and run callbacks.
+ */
+int             io_wait(int timeout_ms)
+{
+        struct __kernel_timespec ts;
+        struct io_uring_getevents_arg arg;
+        unsigned int flags = IORING_ENTER_GETEVENTS;
+        void *argp = NULL;
+        size_t argsz = 0;
+
+        if (timeout_ms >= 0 && (ring.features & IORING_FEAT_EXT_ARG)) {
+                ts.tv_sec = timeout_ms / 1000;
+                ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+                memset(&arg, 0, sizeof(arg));
+                arg.ts = (uint64_t)(uintptr_t)&ts;
+                flags |= IORING_ENTER_EXT_ARG;
+                argp = &arg;
+                argsz = sizeof(arg);
+        } else if (timeout_ms >= 0 && !timeout_posted) {
+                /* Older kernels:  a timeout op completes to wake us.  Only
+                 * one is kept in flight, so a wakeup might come a little
+                 * early, which callers cope with.
+                 */
+                struct io_uring_sqe *sqe = uring_get_sqe(uring_timeout_done,
+                                                         NULL);
+                if (sqe) {
+                        timeout_ts.tv_sec = timeout_ms / 1000;
+                        timeout_ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+                        sqe->opcode = IORING_OP_TIMEOUT;
+                        sqe->fd = -1;
+                        sqe->addr = (uint64_t)(uintptr_t)&timeout_ts;
+                        sqe->len = 1;
+                        timeout_posted = true;
+                }
+        }
+
+        int r = sys_io_uring_enter(ring.fd, ring.to_submit, 1, flags,
+                                   argp, argsz);
+        if (r < 0 && errno != ETIME && errno != EINTR) {
+#if DEBUG > 0
+                printf("- io_uring_enter error %d\n", errno);
+#endif
+                return -errno;
+        }
+        if (r > 0)
+                ring.to_submit -= ((unsigned int)r > ring.to_submit) ?
+                        ring.to_submit : (unsigned int)r;
+
+        uring_reap();
+        return 0;
+}
+#else
+int             io_read(int fd, void *buf, size_t len, io_done_t done, void *ctx)
+{
+        (void)fd;
+        (void)buf;
+        (void)len;
+        (void)done;
+        (void)ctx;
+        return -ENOSYS;
+}
+
+int             io_write(int fd, const void *buf, size_t len,
+                         io_done_t done, void *ctx)
+{
+        (void)fd;
+        (void)buf;
+        (void)len;
+        (void)done;
+        (void)ctx;
+        return -ENOSYS;
+}
+
+int             io_poll(int fd, short events, io_done_t done, void *ctx)
+{
+        (void)fd;
+        (void)events;
+        (void)done;
+        (void)ctx;
+        return -ENOSYS;
+}
+
+int             io_wait(int timeout_ms)
+{
+        (void)timeout_ms;
+        return -ENOSYS;
+}
+#endif
+
+int             io_init(bool want_uring)
+{
+#ifdef CONFIG_IO_URING
+        if (want_uring) {
+                int r = uring_setup();
+                if (r == 0) {
+                        io_use_uring = true;
+                        printf("+++ Using io_uring\n");
+                        return 0;
+                }
+                printf("(io_uring unavailable (%d), using poll)\n", -r);
+        }
+#else
+        (void)want_uring;
+#endif
+        io_use_uring = false;
+        return 0;
+}
+
+void            io_pread(int fd, void *buf, size_t len, off_t offset,
+                         io_done_t done, void *ctx)
+{
+#ifdef CONFIG_IO_URING
+        if (io_use_uring) {
+                struct io_uring_sqe *sqe = uring_get_sqe(done, ctx);
+                if (sqe) {
+                        sqe->opcode = IORING_OP_READ;
+                        sqe->fd = fd;
+                        sqe->addr = (uint64_t)(uintptr_t)buf;
+                        sqe->len = len;
+                        sqe->off = offset;
+                        return;
+                }
+                // Else, ring's full; just do it synchronously.
+        }
+#endif
+        int r = pread(fd, buf, len, offset);
+        done(ctx, r < 0 ? -errno : r);
+}
+
+void            io_pwrite(int fd, const void *buf, size_t len, off_t offset,
+                          io_done_t done, void *ctx)
+{
+#ifdef CONFIG_IO_URING
+        if (io_use_uring) {
+                struct io_uring_sqe *sqe = uring_get_sqe(done, ctx);
+                if (sqe) {
+                        sqe->opcode = IORING_OP_WRITE;
+                        sqe->fd = fd;
+                        sqe->addr = (uint64_t)(uintptr_t)buf;
+                        sqe->len = len;
+                        sqe->off = offset;
+                        return;
+                }
+        }
+#endif
+        int r = pwrite(fd, buf, len, offset);
+        done(ctx, r < 0 ? -errno : r);
+}
+
+void            io_fsync(int fd, io_done_t done, void *ctx)
+{
+#ifdef CONFIG_IO_URING
+        if (io_use_uring) {
+                struct io_uring_sqe *sqe = uring_get_sqe(done, ctx);
+                if (sqe) {
+                        sqe->opcode = IORING_OP_FSYNC;
+                        sqe->fd = fd;
+                        return;
+                }
+        }
+#endif
+        int r = fsync(fd);
+        done(ctx, r < 0 ? -errno : 0);
+}
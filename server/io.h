@@ -0,0 +1,59 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef IO_H
+#define IO_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Completion callback: res is the syscall-style result (bytes, or -errno) */
+typedef void    (*io_done_t)(void *ctx, int res);
+
+extern bool     io_use_uring;
+
+extern int      io_init(bool want_uring);
+
+/* Positional file read.  With io_uring this is queued and completes from
+ * io_wait(); otherwise it's a plain pread() and done() is called before
+ * returning.
+ */
+extern void     io_pread(int fd, void *buf, size_t len, off_t offset,
+                         io_done_t done, void *ctx);
+
+/* Positional file write, and fsync, likewise */
+extern void     io_pwrite(int fd, const void *buf, size_t len, off_t offset,
+                          io_done_t done, void *ctx);
+extern void     io_fsync(int fd, io_done_t done, void *ctx);
+
+/* The following are only valid when io_use_uring is set: */
+extern int      io_read(int fd, void *buf, size_t len,
+                        io_done_t done, void *ctx);
+extern int      io_write(int fd, const void *buf, size_t len,
+                         io_done_t done, void *ctx);
+/* One-shot poll; done() gets the returned events mask */
+extern int      io_poll(int fd, short events, io_done_t done, void *ctx);
+extern int      io_wait(int timeout_ms);
+
+#endif
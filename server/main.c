@@ -36,191 +36,266 @@
 #include <termios.h>
 #include <string.h>
 #include <endian.h>
+#include <stdbool.h>
+#include <glob.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "channels.h"
+#include "device.h"
+#include "io.h"
+#include "stats.h"
+#include "capture.h"
+#include "usbfs.h"
 
+#ifndef DEBUG
 #define DEBUG 2
+#endif
 
-#define TTY_DEVICE      "/dev/ttyACM0"  // FIXME: cmdline option!
+#define DEFAULT_DEVICE  "/dev/ttyACM0"
+#define MAX_PATTERNS    16
+#define RESCAN_MS       1000
+#define CTL_INTERFACE   2       // ITF_NUM_CDC_1 in usb_descriptors.c
 
+/* Device paths, or glob patterns, given on the command line: */
+static char     *dev_patterns[MAX_PATTERNS];
+static int      num_dev_patterns = 0;
 
-/* Input state machine */
-typedef enum {
-        ST_IDLE=0,
-        ST_READING_HDR,
-        ST_READING_DATA
-} rx_state_t;
+static struct device *devices = NULL;
 
-static rx_state_t rxs = ST_IDLE;
-static uint8_t rx_buffer[4096];
-static unsigned int rx_pos = 0;
+static int      stats_fd = -1;
+static int      stats_period = 0;       // Seconds between summaries, or 0
+static uint64_t stats_last;
+static unsigned int next_cap_id = 0;
 
-static uint8_t tx_buffer[4096];
-static int tx_len = -1;
-static unsigned int tx_pos = 0;
 
-typedef struct {
-        uint8_t cid;
-        uint8_t sizel;
-        uint8_t sizeh;
-} pkt_header_t;
+////////////////////////////////////////////////////////////////////////////////
+// Infra for input/output & main service loop
 
+/* Whether to take the next request off a lane:  each is likely to
+ * generate a response, so hold off once enough are queued or in
+ * preparation.  Interactive requests have their own allowance, so that a
+ * bulk transfer doesn't hold them up.
+ */
+static bool     rx_can_consume(struct lane *l)
+{
+        struct device *d = l->dev;
 
-////////////////////////////////////////////////////////////////////////////////
-// Utils
+        if (l->rx_total == 0)
+                return true;    // Don't know what it is yet
+
+        pkt_header_t *pkt = (pkt_header_t *)&l->rx_buffer[l->rx_hdr];
 
-// scandir/opendir
+        if (cid_priority(pkt->cid) == TXQ_PRIO_HIGH)
+                return d->txq[TXQ_PRIO_HIGH].depth < TXQ_MAX;
+        return d->txq_depth + d->io_inflight < TXQ_MAX;
+}
 
-static void     pretty_hexdump(uint8_t *r, unsigned int len)
+/* Remove n bytes from the start of rx_buffer */
+static void     rx_discard(struct lane *l, unsigned int n)
 {
-        unsigned int left = len;
-        for (int i = 0; i < len; i += 16) {
-                unsigned int rowlen = left > 16 ? 16 : left;
-                printf("%03x: ", i);
-                for (int j = 0; j < rowlen; j++) {
-                        printf("%02x ", r[i+j]);
-                }
-                printf("  ");
-                for (int j = 0; j < rowlen; j++) {
-                        uint8_t c = r[i+j];
-                        printf("%c", c >= 32 ? c : '.');
-                }
-                printf("\n");
-                left -= 16;
-        }
+        memmove(&l->rx_buffer[0], &l->rx_buffer[n], l->rx_pos - n);
+        l->rx_pos -= n;
+        l->rx_total = 0;
 }
 
-void            send_packet(unsigned int cid, unsigned int len, uint8_t *data)
+/* Find the packet (or frame) at the start of rx_buffer, setting rx_total to
+ * its size and rx_hdr to where its header starts.  rx_total is left 0 if
+ * more data is needed.  Bad frames are discarded, as is anything but a
+ * frame while resyncing after one.  Once CRC framing's agreed, the only
+ * plain packets taken are hostinfo, since the Arc may have been reset and
+ * be renegotiating.
+ */
+static void     rx_check(struct lane *l)
 {
-        if (tx_len != -1) {
-                // FIXME, TX is rubbish, needs a queue
-                printf("Yarrrgh! TX busy!\n");
-        }
-        pkt_header_t *pkt = (pkt_header_t *)&tx_buffer[0];
-        pkt->cid = cid;
-        pkt->sizel = len & 0xff;
-        pkt->sizeh = len >> 8;
-        memcpy(&tx_buffer[3], data, len);
+        struct device *d = l->dev;
+        bool strict = d->caps & CAP_CRC;
+        uint8_t *b = l->rx_buffer;
+
+        while (l->rx_pos > 0) {
+                if (b[0] == FRAME_SYNC) {
+                        if (l->rx_pos < FRAME_HDR_SIZE)
+                                return;
+                        unsigned int total = FRAME_OVERHEAD + b[2] + (b[3] * 256);
+
+                        if (b[4] == (crc16(b, 4) & 0xff) &&
+                            total <= FRAME_OVERHEAD + PKT_MAX_PAYLOAD) {
+                                if (l->rx_pos < total)
+                                        return;
+                                uint16_t crc = crc16(b, total - 2);
+                                if (b[total - 2] == (crc & 0xff) &&
+                                    b[total - 1] == (crc >> 8)) {
+                                        l->rx_resync = false;
+                                        l->rx_hdr = 1;
+                                        l->rx_total = total;
+                                        return;
+                                }
+                        }
+                } else if (!l->rx_resync &&
+                           (!strict || b[0] == CID_HOSTINFO)) {
+                        if (l->rx_pos >= sizeof(pkt_header_t)) {
+                                l->rx_hdr = 0;
+                                l->rx_total = sizeof(pkt_header_t) +
+                                        b[1] + (b[2] * 256);
+                        }
+                        return;
+                }
 
-        tx_pos = 0;
-        tx_len = len + 3;
+                if (!l->rx_resync) {
+#if DEBUG > 0
+                        printf("--- %s: Bad frame, resyncing\n", l->path);
+#endif
+                        d->st_bad_frames++;
+                        l->rx_resync = true;
+                }
+                // Discard up to the next sync byte:
+                uint8_t *sync = memchr(&b[1], FRAME_SYNC, l->rx_pos - 1);
+                unsigned int skip = sync ? (unsigned int)(sync - b) : l->rx_pos;
 
-        // Main loop sorts it.
+                d->st_resync_bytes += skip;
+                rx_discard(l, skip);
+        }
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// Channel Hostinfo
-
-void            channel_hostinfo_rx(uint8_t *data, unsigned int len)
+/* Consume any complete packets in rx_buffer, dispatching each one.  Partial
+ * packets (or any beyond TXQ_MAX) are left at the bottom of the buffer for
+ * next time.
+ */
+static void     rx_consume(struct lane *l)
 {
-        if (data[0] == 0) {
+ packet_check:
+        if (l->rx_total == 0)
+                rx_check(l);
+        if (l->rx_total && rx_can_consume(l)) {
+                pkt_header_t *pkt = (pkt_header_t *)&l->rx_buffer[l->rx_hdr];
+                uint16_t data_len = pkt->sizel + (pkt->sizeh * 256);
+                unsigned int dend = l->rx_total;
+
+                if (l->rx_pos >= dend) {
+                        // We can access the entire packet.  Consume/process:
+                        process_packet(l->dev, pkt->cid, data_len,
+                                       &l->rx_buffer[l->rx_hdr ?
+                                                     FRAME_HDR_SIZE :
+                                                     sizeof(pkt_header_t)]);
+                }
+                // Reset read buffer
+                if (l->rx_pos == dend) {
+                        l->rx_pos = 0;
+                        l->rx_total = 0;
+                } else if (l->rx_pos > dend) {
+                        // We read some of the next request too.
+                        // Hacky, but shuffle that down to index 0...
+                        rx_discard(l, dend);
 #if DEBUG > 1
-                printf("+++ hostinfo request (%d)\n", data[0]);
+                        printf("Read %d, pkt %d, excess %d\n",
+                               l->rx_pos + dend, dend, l->rx_pos);
 #endif
-                // Format host info string
-                // FIXME: Do protocol version, capabilities etc.
-                struct {
-                        uint32_t proto_ver;
-                        char    hinfo[28];
-                        uint32_t pad;
-                } response;
-
-                response.proto_ver = htole32(CID_HOSTINFO_PROTO_VERSION);
-                memset(response.hinfo, 0, 28);
-                strncpy(response.hinfo, CID_HOSTINFO_STRING, 28);
-                response.pad = 0;
-
-                send_packet(CID_HOSTINFO, sizeof(response), (uint8_t *)&response);
-        } else {
-                printf("hostinfo: Odd byte 0: 0x%x\n", data[0]);
+                        goto packet_check;
+                }
         }
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// Core packet dispatch
+/* Whether there's room to read more:  packet lanes read a whole message at
+ * once, so need room for the largest.
+ */
+static bool     rx_room(struct lane *l)
+{
+        unsigned int space = sizeof(l->rx_buffer) - l->rx_pos;
 
-static void     process_packet(unsigned int cid, unsigned int len, uint8_t *data)
+        return l->kind == LANE_STREAM ? space > 0 :
+                space >= sizeof(l->ur_rx_buf);
+}
+
+/* Append data read from a lane.  On packet lanes that's one packet, maybe
+ * with a pad byte after it (see pipe_tx_start()), which is dropped.
+ */
+void            lane_rx_in(struct lane *l, const uint8_t *buf, unsigned int len)
 {
-#if DEBUG > 1
-        printf("+++ Packet CID%d, len %d\n", cid, len);
+        if (l->kind != LANE_STREAM && buf[0] == FRAME_SYNC &&
+            len >= FRAME_HDR_SIZE) {
+                unsigned int flen = FRAME_OVERHEAD + buf[2] + (buf[3] * 256);
+
+                if (len > flen)
+                        len = flen;
+        } else if (l->kind != LANE_STREAM && len >= sizeof(pkt_header_t)) {
+                const pkt_header_t *pkt = (const pkt_header_t *)buf;
+                unsigned int plen = sizeof(pkt_header_t) + pkt->sizel +
+                        (pkt->sizeh * 256);
+
+                if (len > plen)
+                        len = plen;
+        }
 #if DEBUG > 2
-        pretty_hexdump(data, len);
-#endif
+        printf("Received %d\n", len);
 #endif
-        switch (cid) {
-        case CID_IGNORE:
-                break;
-
-        case CID_HOSTINFO:
-                channel_hostinfo_rx(data, len);
-                break;
+        memcpy(&l->rx_buffer[l->rx_pos], buf, len);
+        l->rx_pos += len;
+}
 
-        case CID_RAWFILE:
-                channel_rawfile_rx(data, len);
-                break;
+/* After responses go out, there may be room for requests held back */
+static void     device_rx_consume(struct device *d)
+{
+        for (unsigned int i = 0; i < LANES; i++) {
+                if (d->lane[i].fd >= 0)
+                        rx_consume(&d->lane[i]);
         }
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// Infra for input/output & main service loop
-
-static void     process_input(int fd)
+static void     process_input(struct lane *l)
 {
         int r;
 
         do {
-                // Try a large read; O_NONBLOCK returns EAGAIN instead of blockin'
-                r = read(fd, &rx_buffer[rx_pos],
-                         sizeof(rx_buffer) - rx_pos);
+                if (l->kind == LANE_STREAM) {
+                        // Try a large read; O_NONBLOCK returns EAGAIN instead of blockin'
+                        r = read(l->fd, &l->rx_buffer[l->rx_pos],
+                                 sizeof(l->rx_buffer) - l->rx_pos);
+                } else if (rx_room(l)) {
+                        // A message at a time
+                        r = read(l->fd, l->ur_rx_buf, sizeof(l->ur_rx_buf));
+                } else {
+                        return;
+                }
                 if (r < 0) {
 #if DEBUG > 0
                         if (errno != EAGAIN)
                                 printf("- Read error %d\n", errno);
 #endif
+                        if (errno == EIO)
+                                l->dev->hup = true;
                         return;
                 }
+                if (l->kind == LANE_STREAM) {
 #if DEBUG > 2
-                printf("Received %d\n", r);
+                        printf("Received %d\n", r);
 #endif
-                rx_pos += r;
-
-        packet_check:
-                if (rx_pos > sizeof(pkt_header_t)) {
-                        pkt_header_t *pkt = (pkt_header_t *)rx_buffer;
-                        uint16_t data_len = pkt->sizel + (pkt->sizeh * 256);
-                        unsigned int dend = sizeof(pkt_header_t) + data_len;
-
-                        if (rx_pos >= dend) {
-                                // We can access the entire packet.  Consume/process:
-                                process_packet(pkt->cid, data_len,
-                                               &rx_buffer[sizeof(pkt_header_t)]);
-                        }
-                        // Reset read buffer
-                        if (rx_pos == dend) {
-                                rx_pos = 0;
-                        } else if (rx_pos > dend) {
-                                // We read some of the next request too.
-                                // Hacky, but shuffle that down to index 0...
-                                unsigned int excess = dend - rx_pos;
-                                memmove(&rx_buffer[0], &rx_buffer[dend], excess);
-                                // And, we reset everything:
-                                rx_pos = excess;
-#if DEBUG > 1
-                                printf("Read %d, pkt %d, excess %d\n",
-                                       rx_pos, dend, excess);
-#endif
-                                goto packet_check;
-                        }
+                        l->rx_pos += r;
+                } else {
+                        lane_rx_in(l, l->ur_rx_buf, r);
                 }
+                rx_consume(l);
         } while (r > 0);
 }
 
-static void     process_output(int fd)
+void            lane_tx_done(struct lane *l)
+{
+        struct tx_pkt *p = tx_dequeue(l);
+
+#if DEBUG > 1
+        printf("+++ TX of %d complete\n", p->len);
+#endif
+        stats_response_done(l->dev, &p->st);
+        free(p);
+}
+
+static void     process_output(struct lane *l)
 {
+        struct tx_pkt *p;
         int r;
 
-        do {
-                r = write(fd, &tx_buffer[tx_pos], tx_len - tx_pos);
+        while ((p = tx_next(l)) != NULL) {
+                r = write(l->fd, &p->data[l->tx_pos], p->len - l->tx_pos);
 
                 if (r < 0) {
 #if DEBUG > 0
@@ -232,15 +307,11 @@ static void     process_output(int fd)
 #if DEBUG > 2
                 printf("Wrote %d\n", r);
 #endif
-                tx_pos += r;
-
-                if (tx_pos == tx_len) {
-                        printf("+++ TX of %d complete\n", tx_len);
+                l->tx_pos += r;
 
-                        tx_len = -1;
-                        return;
-                }
-        } while (r > 0);
+                if (l->tx_pos == p->len)
+                        lane_tx_done(l);
+        }
 }
 
 static int      open_device(char *path)
@@ -254,66 +325,600 @@ static int      open_device(char *path)
         struct termios tos;
         if (tcgetattr(r, &tos) < 0) {
                 perror("Can't tcgetattr:");
+                close(r);
                 return -1;
         }
         cfmakeraw(&tos);
         if (tcsetattr(r, TCSAFLUSH, &tos)) {
                 perror("Can't tcsetattr:");
+                close(r);
                 return -1;
         }
 
-        int f = fcntl(r, F_GETFL);
-        fcntl(r, F_SETFL, f | O_NONBLOCK);
+        /* The poll loop wants non-blocking reads/writes.  io_uring
+         * wants a blocking fd, so that it waits (asynchronously) for
+         * data rather than completing immediately with EAGAIN.
+         */
+        if (!io_use_uring) {
+                int f = fcntl(r, F_GETFL);
+                fcntl(r, F_SETFL, f | O_NONBLOCK);
+        }
 
         return r;
 }
 
-static void     service_loop(int fd)
+/* vpodule's stand-in for the vendor interface */
+static int      open_socket(const char *path)
 {
-        channel_rawfile_init();
+        struct sockaddr_un sa = { .sun_family = AF_UNIX };
+        int r = socket(AF_UNIX, SOCK_SEQPACKET |
+                       (io_use_uring ? 0 : SOCK_NONBLOCK), 0);
 
-        while (1) {
-                struct pollfd pfd = {
-                        .fd = fd,
-                        .events = POLLIN | POLLHUP,
-                        .revents = 0
-                };
+        if (r < 0)
+                return r;
+        strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+        if (connect(r, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+                close(r);
+                return -1;
+        }
+        return r;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Device list management & hot-plug
+
+/* A device's data lane, or control lane, at path */
+static struct device *device_find(const char *path)
+{
+        for (struct device *d = devices; d; d = d->next) {
+                for (unsigned int i = 0; i < LANES; i++) {
+                        if (d->lane[i].fd >= 0 &&
+                            !strcmp(d->lane[i].path, path))
+                                return d;
+                }
+        }
+        return NULL;
+}
+
+static struct device *device_find_usb(const char *usb_dev)
+{
+        for (struct device *d = devices; d; d = d->next) {
+                if (d->usb_dev[0] && !strcmp(d->usb_dev, usb_dev))
+                        return d;
+        }
+        return NULL;
+}
 
-                int r;
-                r = poll(&pfd, 1, -1);
+/* For a USB CDC tty, find (in sysfs) the USB device it's part of, and its
+ * interface number.  Returns -1 if it isn't one (e.g. a pty).
+ */
+static int      tty_usb_info(const char *path, char *usb_dev, size_t len)
+{
+        char real[PATH_MAX], itf_dir[PATH_MAX], sys[PATH_MAX + 32];
+        int itf = -1;
 
-                if (pfd.revents & POLLHUP) {
-                        close(fd);
+        if (!realpath(path, real))
+                return -1;
+        const char *name = strrchr(real, '/');
+        snprintf(sys, sizeof(sys), "/sys/class/tty/%s/device",
+                 name ? name + 1 : real);
+        if (!realpath(sys, itf_dir))
+                return -1;
+
+        snprintf(sys, sizeof(sys), "%s/bInterfaceNumber", itf_dir);
+        FILE *f = fopen(sys, "r");
+        if (!f)
+                return -1;
+        if (fscanf(f, "%x", &itf) != 1)
+                itf = -1;
+        fclose(f);
+
+        // The interface's parent is the device:
+        char *slash = strrchr(itf_dir, '/');
+        if (!slash)
+                return -1;
+        *slash = '\0';
+        snprintf(usb_dev, len, "%s", itf_dir);
+        return itf;
+}
+
+static int      lane_open(struct device *d, unsigned int n, unsigned int kind,
+                          const char *path)
+{
+        struct lane *l = &d->lane[n];
+        int fd;
+
+        if (kind == LANE_USBFS)
+                fd = usbfs_open(l, path);
+        else if (kind == LANE_PACKET)
+                fd = open_socket(path);
+        else
+                fd = open_device((char *)path);
+
+        if (fd < 0) {
+                printf("- Can't open device %s: %s\n", path, strerror(errno));
+                return -1;
+        }
+        strncpy(l->path, path, sizeof(l->path) - 1);
+        l->fd = fd;
+        l->kind = kind;
+        printf("+++ Opened %s, fd %d%s\n", path, fd,
+               n == LANE_CTL ? " (control lane)" :
+               kind == LANE_USBFS ? " (vendor interface)" : "");
+        return 0;
+}
+
+static void     lane_close(struct lane *l)
+{
+        if (l->kind == LANE_USBFS)
+                usbfs_close(l);
+        else
+                close(l->fd);
+        l->fd = -1;
+}
+
+static void     device_add(unsigned int kind, const char *path,
+                           const char *ctl_path, const char *usb_dev)
+{
+        struct device *d = calloc(1, sizeof(*d));
+        if (!d)
+                return;
+        for (unsigned int i = 0; i < LANES; i++) {
+                d->lane[i].dev = d;
+                d->lane[i].fd = -1;
+        }
+        if (lane_open(d, LANE_DATA, kind, path) < 0) {
+                free(d);
+                return;
+        }
+        // Carry on without a control lane if it won't open:
+        if (ctl_path)
+                lane_open(d, LANE_CTL, LANE_STREAM, ctl_path);
+
+        strncpy(d->path, path, sizeof(d->path) - 1);
+        strncpy(d->usb_dev, usb_dev, sizeof(d->usb_dev) - 1);
+        d->cap_id = next_cap_id++ & 0x7f;
+        channel_rawfile_init(d);
+        channel_dir_init(d);
+        channel_block_init(d);
+        channel_fs_init(d);
+
+        d->next = devices;
+        devices = d;
+}
+
+static void     device_remove(struct device *d)
+{
+        printf("+++ Closing %s\n", d->path);
+        channel_rawfile_fini(d);
+        channel_dir_fini(d);
+        channel_block_fini(d);
+        channel_fs_fini(d);
+        channel_echo_fini(d);
+        for (unsigned int i = 0; i < LANES; i++) {
+                struct lane *l = &d->lane[i];
+                struct tx_pkt *p;
+
+                if (l->fd >= 0)
+                        lane_close(l);
+                while ((p = tx_dequeue(l)) != NULL)
+                        free(p);
+        }
+
+        for (struct device **p = &devices; *p; p = &(*p)->next) {
+                if (*p == d) {
+                        *p = d->next;
                         break;
-                } else if (pfd.revents & POLLIN) {
-                        /* FIXME: inhibits this if there's TX pending, as
-                         * it'll likely create more output...
-                         */
-                        if (tx_len == -1)
-                                process_input(fd);
                 }
+        }
+        free(d);
+}
 
-                if (tx_len != -1) {
-                        process_output(fd);
+/* A tty found by rescan:  the podule's second CDC interface is its control
+ * lane, so is attached to the device for the first rather than opened as a
+ * device of its own.  (It's ignored until the first has been found.)  The
+ * first is ignored if the podule's vendor interface is already open.
+ */
+static void     rescan_found(const char *path)
+{
+        char usb_dev[PATH_MAX];
+        int itf = tty_usb_info(path, usb_dev, sizeof(usb_dev));
+
+        if (itf < 0) {
+                device_add(LANE_STREAM, path, NULL, "");
+        } else if (itf == CTL_INTERFACE) {
+                struct device *d = device_find_usb(usb_dev);
+
+                if (d && d->lane[LANE_CTL].fd < 0)
+                        lane_open(d, LANE_CTL, LANE_STREAM, path);
+        } else if (!device_find_usb(usb_dev)) {
+                device_add(LANE_STREAM, path, NULL, usb_dev);
+        }
+}
+
+/* A podule's vendor interface, found by usbfs_scan() */
+static void     rescan_found_usbfs(const char *node, const char *usb_dev)
+{
+        if (!device_find_usb(usb_dev))
+                device_add(LANE_USBFS, node, NULL, usb_dev);
+}
+
+/* Look for devices matching the patterns that aren't already open.  Called
+ * periodically, so that podules plugged in later (or reset) are picked up.
+ * A "data,control" pair of paths gives a device's lanes explicitly.  "usb"
+ * finds podules' vendor interfaces, and a "usb:" or "unix:" prefix gives
+ * one as the data lane.
+ */
+static void     rescan_devices(void)
+{
+        for (int i = 0; i < num_dev_patterns; i++) {
+                char *pat = dev_patterns[i];
+                char *comma = strchr(pat, ',');
+                unsigned int kind = LANE_STREAM;
+                glob_t gt;
+
+                if (!strcmp(pat, "usb")) {
+                        usbfs_scan(rescan_found_usbfs);
+                        continue;
+                } else if (!strncmp(pat, "usb:", 4)) {
+                        kind = LANE_USBFS;
+                        pat += 4;
+                } else if (!strncmp(pat, "unix:", 5)) {
+                        kind = LANE_PACKET;
+                        pat += 5;
+                }
+
+                if (comma || kind != LANE_STREAM) {
+                        char data[PATH_MAX];
+
+                        snprintf(data, sizeof(data), "%.*s",
+                                 comma ? (int)(comma - pat) : PATH_MAX, pat);
+                        if (!device_find(data) && access(data, F_OK) == 0 &&
+                            (!comma || access(comma + 1, F_OK) == 0))
+                                device_add(kind, data,
+                                           comma ? comma + 1 : NULL, "");
+                        continue;
+                }
+
+                if (glob(dev_patterns[i], GLOB_NOCHECK, NULL, &gt) != 0)
+                        continue;
+
+                for (size_t j = 0; j < gt.gl_pathc; j++) {
+                        char *path = gt.gl_pathv[j];
+
+                        if (device_find(path))
+                                continue;
+                        // A pattern that matched nothing comes back verbatim:
+                        if (access(path, F_OK) != 0)
+                                continue;
+                        rescan_found(path);
                 }
+                globfree(&gt);
+        }
+}
+
+static void     reap_devices(void)
+{
+        struct device *d = devices;
+
+        while (d) {
+                struct device *n = d->next;
+                bool posted = false;
+
+                for (unsigned int i = 0; i < LANES; i++)
+                        posted |= d->lane[i].ur_rx_posted ||
+                                d->lane[i].ur_tx_posted;
+                if (d->hup && !posted && d->io_inflight == 0)
+                        device_remove(d);
+                d = n;
         }
 }
 
-int             main(void)
+/* Called from either loop after each wakeup; does things at most once per
+ * RESCAN_MS, so that a busy link doesn't starve hot-plug or the stats.
+ */
+static void     periodic(void)
+{
+        static uint64_t last_scan = 0;
+        uint64_t now = stats_now();
+
+        if (now - last_scan < (uint64_t)RESCAN_MS * 1000000)
+                return;
+        last_scan = now;
+
+        rescan_devices();
+        capture_flush();
+        for (struct device *d = devices; d; d = d->next)
+                channel_block_idle(d, now);
+
+        if (stats_period) {
+                if (now - stats_last >= (uint64_t)stats_period * 1000000000ULL) {
+                        stats_summary(stdout);
+                        stats_last = now;
+                }
+        }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// poll() engine
+
+static void     service_loop_poll(void)
 {
         while (1) {
-                int fd;
-                printf("Opening %s\n", TTY_DEVICE);
+                struct pollfd pfd[65];
+                struct lane *plane[64];
+                int n = 0;
+
+                for (struct device *d = devices; d; d = d->next) {
+                        for (unsigned int i = 0; i < LANES && n < 64; i++) {
+                                struct lane *l = &d->lane[i];
+
+                                if (l->fd < 0)
+                                        continue;
+                                pfd[n].fd = l->fd;
+                                pfd[n].events = POLLHUP;
+                                if (l->kind == LANE_USBFS) {
+                                        // Polls writable when URBs complete
+                                        usbfs_kick(l);
+                                        pfd[n].events |= POLLOUT;
+                                } else {
+                                        if (rx_can_consume(l) && rx_room(l))
+                                                pfd[n].events |= POLLIN;
+                                        if (tx_next(l))
+                                                pfd[n].events |= POLLOUT;
+                                }
+                                pfd[n].revents = 0;
+                                plane[n] = l;
+                                n++;
+                        }
+                }
 
-                fd = open_device(TTY_DEVICE);
+                // The stats socket, if any, goes last:
+                pfd[n].fd = stats_fd;
+                pfd[n].events = POLLIN;
+                pfd[n].revents = 0;
+
+                int r = poll(pfd, n + 1, RESCAN_MS);
+
+                if (r > 0 && (pfd[n].revents & POLLIN))
+                        stats_serve(stats_fd, devices);
+
+                for (int i = 0; r > 0 && i < n; i++) {
+                        struct lane *l = plane[i];
+
+                        if (pfd[i].revents & (POLLHUP | POLLERR)) {
+                                l->dev->hup = true;
+                                continue;
+                        } else if (l->kind == LANE_USBFS) {
+                                if (pfd[i].revents & POLLOUT) {
+                                        usbfs_reap(l);
+                                        device_rx_consume(l->dev);
+                                }
+                                continue;
+                        } else if (pfd[i].revents & POLLIN) {
+                                process_input(l);
+                        }
 
-                if (fd < 0) {
-                        perror("- Can't open device");
-                        sleep(1);
-                        continue;
+                        if (tx_next(l)) {
+                                process_output(l);
+                                // Room for requests held back?
+                                device_rx_consume(l->dev);
+                        }
                 }
-                printf("+++ Main loop, fd %d\n", fd);
-                service_loop(fd);
+
+                reap_devices();
+                periodic();
         }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// io_uring engine
+
+/* One read is kept posted on each tty, and output is written as a ring op
+ * too.  File reads issued by channels (via io_pread()) complete from the
+ * same io_wait(), so a disc read can be in flight while the previous
+ * response is still going out.
+ */
+static void     ur_rx_done(void *ctx, int res)
+{
+        struct lane *l = ctx;
+
+        l->ur_rx_posted = false;
+        if (res == -EINTR || res == -EAGAIN)
+                return;                 // Posted again by ur_service_lane()
+        if (res <= 0) {
+#if DEBUG > 0
+                if (res < 0)
+                        printf("- Read error %d\n", -res);
+#endif
+                l->dev->hup = true;
+                return;
+        }
+        lane_rx_in(l, l->ur_rx_buf, res);
+}
+
+static void     ur_tx_done(void *ctx, int res)
+{
+        struct lane *l = ctx;
+
+        l->ur_tx_posted = false;
+        /* A tty write done from io_uring's worker thread can be
+         * interrupted; it's just retried.
+         */
+        if (res == -EINTR || res == -EAGAIN)
+                return;
+        if (res < 0) {
+#if DEBUG > 0
+                printf("- Write error %d\n", -res);
+#endif
+                l->dev->hup = true;
+                return;
+        }
+#if DEBUG > 2
+        printf("Wrote %d\n", res);
+#endif
+        l->tx_pos += res;
+
+        if (l->tx_pos == l->tx_cur->len)
+                lane_tx_done(l);
+}
+
+/* usbfs lanes keep a poll posted (as ur_rx_posted), for URB completions */
+static void     ur_usbfs_done(void *ctx, int res)
+{
+        struct lane *l = ctx;
+
+        l->ur_rx_posted = false;
+        if (res < 0 || (res & (POLLHUP | POLLERR))) {
+                l->dev->hup = true;
+                return;
+        }
+        usbfs_reap(l);
+        device_rx_consume(l->dev);
+}
+
+static void     ur_service_lane(struct lane *l)
+{
+        rx_consume(l);
+
+        if (l->kind == LANE_USBFS) {
+                usbfs_kick(l);
+                if (!l->ur_rx_posted &&
+                    io_poll(l->fd, POLLOUT, ur_usbfs_done, l) == 0)
+                        l->ur_rx_posted = true;
+                return;
+        }
+
+        unsigned int space = sizeof(l->rx_buffer) - l->rx_pos;
+        if (!l->ur_rx_posted && rx_room(l)) {
+                if (space > sizeof(l->ur_rx_buf))
+                        space = sizeof(l->ur_rx_buf);
+                if (io_read(l->fd, l->ur_rx_buf, space, ur_rx_done, l) == 0)
+                        l->ur_rx_posted = true;
+        }
+
+        struct tx_pkt *p = l->ur_tx_posted ? NULL : tx_next(l);
+        if (p) {
+                if (io_write(l->fd, &p->data[l->tx_pos], p->len - l->tx_pos,
+                             ur_tx_done, l) == 0)
+                        l->ur_tx_posted = true;
+        }
+}
+
+static void     ur_service(struct device *d)
+{
+        if (d->hup)
+                return;
+
+        for (unsigned int i = 0; i < LANES; i++) {
+                if (d->lane[i].fd >= 0)
+                        ur_service_lane(&d->lane[i]);
+        }
+}
+
+static bool     ur_stats_posted = false;
+
+static void     ur_stats_done(void *ctx, int res)
+{
+        ur_stats_posted = false;
+        if (res > 0)
+                stats_serve(stats_fd, devices);
+}
+
+static void     service_loop_uring(void)
+{
+        while (1) {
+                for (struct device *d = devices; d; d = d->next)
+                        ur_service(d);
+
+                if (stats_fd >= 0 && !ur_stats_posted &&
+                    io_poll(stats_fd, POLLIN, ur_stats_done, NULL) == 0)
+                        ur_stats_posted = true;
+
+                if (io_wait(RESCAN_MS) < 0) {
+                        printf("- Fatal io_uring error\n");
+                        exit(1);
+                }
+
+                /* A hung-up device is only freed once its posted
+                 * ops have completed (with errors, quickly).
+                 */
+                reap_devices();
+
+                periodic();
+        }
+}
+
+static void     usage(char *prog)
+{
+        printf("Syntax: %s [-p] [-c capfile] [-s sockpath] [-S secs] "
+               "[device|pattern|data,control ...]\n"
+               "\t-p\tUse poll() loop, even if io_uring is available\n"
+               "\t-c\tRecord all packets to capfile, for replay\n"
+               "\t-s\tServe stats on a unix socket at sockpath\n"
+               "\t-S\tPrint a stats summary every secs seconds\n"
+               "Devices may be given as paths or glob patterns (e.g. "
+               "'/dev/ttyACM*'),\nand are re-scanned periodically for "
+               "hot-plug.  A podule's control lane (its second CDC "
+               "interface) is found\nautomatically, or can be given after "
+               "a comma.  'usb' finds podules' vendor\ninterfaces (via "
+               "usbfs), and 'usb:/dev/bus/usb/BBB/DDD' opens one.  "
+               "'unix:path' connects\nto vpodule -u.  Default: "
+               DEFAULT_DEVICE "\n",
+               prog);
+}
+
+int             main(int argc, char *argv[])
+{
+        bool want_uring = true;
+        int opt;
+
+        char *stats_path = NULL;
+        char *cap_path = NULL;
+
+        while ((opt = getopt(argc, argv, "pc:s:S:h")) != -1) {
+                switch (opt) {
+                case 'p':
+                        want_uring = false;
+                        break;
+                case 'c':
+                        cap_path = optarg;
+                        break;
+                case 's':
+                        stats_path = optarg;
+                        break;
+                case 'S':
+                        stats_period = atoi(optarg);
+                        break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+
+        for (int i = optind; i < argc && num_dev_patterns < MAX_PATTERNS; i++)
+                dev_patterns[num_dev_patterns++] = argv[i];
+        if (num_dev_patterns == 0)
+                dev_patterns[num_dev_patterns++] = DEFAULT_DEVICE;
+
+        io_init(want_uring);
+
+        if (stats_path) {
+                stats_fd = stats_listen(stats_path);
+                if (stats_fd < 0)
+                        return 1;
+        }
+        stats_last = stats_now();
+
+        if (cap_path && capture_open(cap_path) < 0)
+                return 1;
+
+        rescan_devices();
+
+        if (io_use_uring)
+                service_loop_uring();
+        else
+                service_loop_poll();
+
         return 0;
 }
@@ -0,0 +1,317 @@
+/* Replay a packet capture (from server -c) through the channels
+ *
+ * Requests recorded from the podule are fed to process_packet(), with
+ * original, compressed or no inter-packet timing; run from the same
+ * directory of files as the original server.  Responses are compared with
+ * the recorded ones, and server-side handling time is reported against
+ * the time the recorded link spent elsewhere (the Arc, USB).
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <endian.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "channels.h"
+#include "device.h"
+#include "capture.h"
+#include "io.h"
+#include "stats.h"
+
+#define NUM_DEVS        128
+
+/* A replayed response, not yet matched against a recorded one */
+struct pend {
+        struct pend     *next;
+        struct tx_pkt   *p;
+        uint64_t        t_rec_req;      // Recorded time of its request
+};
+
+/* Replay state for each device seen in the capture */
+struct rdev {
+        struct device   *d;
+        struct pend     *pending;
+        bool            idle;           // Recorded link had nothing pending
+        uint64_t        t_idle;         // ...since this recorded time
+};
+
+static struct rdev *rdevs[NUM_DEVS];
+
+static struct {
+        uint64_t        reqs;
+        uint64_t        resps;
+        uint64_t        mismatched;
+        uint64_t        unmatched;      // Replayed response but none recorded
+        uint64_t        missing;        // Recorded response but none replayed
+        uint64_t        matched;
+        uint64_t        rec_server_ns;  // Recorded request -> response
+        uint64_t        rec_link_ns;    // Recorded idle -> next request
+        uint64_t        rec_link_n;
+        uint64_t        rec_span_ns;
+        uint64_t        handle_ns;      // Replayed process_packet() time
+        uint64_t        handle_max_ns;
+} rs;
+
+static struct rdev *rdev_get(unsigned int id)
+{
+        if (!rdevs[id]) {
+                struct rdev *r = calloc(1, sizeof(*r));
+                struct device *d = calloc(1, sizeof(*d));
+                if (!r || !d) {
+                        printf("- Out of memory\n");
+                        exit(1);
+                }
+                snprintf(d->path, sizeof(d->path), "replay%u", id);
+                for (unsigned int i = 0; i < LANES; i++) {
+                        d->lane[i].dev = d;
+                        d->lane[i].fd = -1;
+                }
+                d->cap_id = id;
+                channel_rawfile_init(d);
+                channel_dir_init(d);
+                channel_block_init(d);
+                channel_fs_init(d);
+                r->d = d;
+                rdevs[id] = r;
+        }
+        return rdevs[id];
+}
+
+static void     wait_until(uint64_t t)
+{
+        struct timespec ts = { .tv_sec = t / 1000000000ULL,
+                               .tv_nsec = t % 1000000000ULL };
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                               NULL) == EINTR)
+                ;
+}
+
+static void     replay_rx(struct rdev *r, struct capture_rec *rec,
+                          uint8_t *data)
+{
+        struct device *d = r->d;
+
+        if (r->idle) {
+                rs.rec_link_ns += rec->t_ns - r->t_idle;
+                rs.rec_link_n++;
+        }
+        r->idle = false;
+        rs.reqs++;
+
+        uint64_t t = stats_now();
+        process_packet(d, rec->cid, rec->len, data);
+        t = stats_now() - t;
+        rs.handle_ns += t;
+        if (t > rs.handle_max_ns)
+                rs.handle_max_ns = t;
+
+        // File I/O is synchronous here, so any response is now queued:
+        struct tx_pkt *p;
+        struct pend **tail = &r->pending;
+        while (*tail)
+                tail = &(*tail)->next;
+        while ((p = tx_dequeue(&d->lane[LANE_DATA])) != NULL) {
+                stats_response_done(d, &p->st);
+                struct pend *pe = calloc(1, sizeof(*pe));
+                if (!pe) {
+                        free(p);
+                        continue;
+                }
+                pe->p = p;
+                pe->t_rec_req = rec->t_ns;
+                *tail = pe;
+                tail = &pe->next;
+        }
+
+        // No response expected, so the next request follows on from this:
+        if (!r->pending) {
+                r->idle = true;
+                r->t_idle = rec->t_ns;
+        }
+}
+
+/* Responses to tagged requests can be recorded in any order, so match by
+ * CID and tag; untagged ones just by CID.
+ */
+static void     replay_tx(struct rdev *r, struct capture_rec *rec,
+                          uint8_t *data)
+{
+        struct pend **pp;
+
+        rs.resps++;
+
+        for (pp = &r->pending; *pp; pp = &(*pp)->next) {
+                uint8_t *pd = &(*pp)->p->data[(*pp)->p->hdr];
+
+                if (pd[0] != rec->cid)
+                        continue;
+                if ((rec->cid & CID_F_TAGGED) && (rec->len < CID_TAG_SIZE ||
+                    memcmp(&pd[sizeof(pkt_header_t)], data, CID_TAG_SIZE)))
+                        continue;
+                break;
+        }
+
+        if (!*pp) {
+                rs.missing++;
+        } else {
+                struct pend *pe = *pp;
+                uint8_t *pd = &pe->p->data[pe->p->hdr];
+
+                rs.matched++;
+                rs.rec_server_ns += rec->t_ns - pe->t_rec_req;
+                if ((pd[1] | (pd[2] << 8)) != rec->len ||
+                    memcmp(&pd[sizeof(pkt_header_t)], data, rec->len) != 0)
+                        rs.mismatched++;
+                *pp = pe->next;
+                free(pe->p);
+                free(pe);
+        }
+
+        if (!r->pending) {
+                r->idle = true;
+                r->t_idle = rec->t_ns;
+        }
+}
+
+static void     usage(char *prog)
+{
+        printf("Syntax: %s [-f | -x factor] [-v] capfile\n"
+               "\t-f\tReplay as fast as possible\n"
+               "\t-x\tCompress recorded timing by factor (default 1)\n"
+               "\t-v\tDump server stats at the end\n"
+               "Run from the directory the original server was serving.\n",
+               prog);
+}
+
+int             main(int argc, char *argv[])
+{
+        double factor = 1.0;
+        bool verbose = false;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "fx:vh")) != -1) {
+                switch (opt) {
+                case 'f':
+                        factor = 0;
+                        break;
+                case 'x':
+                        factor = atof(optarg);
+                        if (factor <= 0) {
+                                usage(argv[0]);
+                                return 1;
+                        }
+                        break;
+                case 'v':
+                        verbose = true;
+                        break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+        if (optind != argc - 1) {
+                usage(argv[0]);
+                return 1;
+        }
+
+        FILE *f = fopen(argv[optind], "rb");
+        if (!f) {
+                perror("Can't open capture:");
+                return 1;
+        }
+        char magic[CAPTURE_MAGIC_LEN];
+        if (fread(magic, sizeof(magic), 1, f) != 1 ||
+            memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) {
+                printf("- %s isn't a capture file\n", argv[optind]);
+                return 1;
+        }
+
+        // Synchronous file I/O, so responses are deterministic
+        io_init(false);
+
+        struct capture_rec rec;
+        uint8_t data[65536];
+        uint64_t t_start = stats_now();
+
+        while (fread(&rec, sizeof(rec), 1, f) == 1) {
+                rec.t_ns = le64toh(rec.t_ns);
+                rec.len = le16toh(rec.len);
+                if (fread(data, 1, rec.len, f) != rec.len) {
+                        printf("- Truncated record\n");
+                        break;
+                }
+                rs.rec_span_ns = rec.t_ns;
+
+                struct rdev *r = rdev_get(rec.flags >> CAPTURE_F_DEV_SHIFT);
+
+                if (rec.flags & CAPTURE_F_TX) {
+                        replay_tx(r, &rec, data);
+                } else {
+                        if (factor > 0)
+                                wait_until(t_start + rec.t_ns / factor);
+                        replay_rx(r, &rec, data);
+                }
+        }
+        fclose(f);
+
+        uint64_t t_total = stats_now() - t_start;
+
+        for (int i = 0; i < NUM_DEVS; i++) {
+                for (struct pend *pe = rdevs[i] ? rdevs[i]->pending : NULL;
+                     pe; pe = pe->next)
+                        rs.unmatched++;
+        }
+
+        printf("+++ Replayed %" PRIu64 " requests (%" PRIu64
+               " recorded responses) in %.3fs\n", rs.reqs, rs.resps,
+               t_total / 1e9);
+        printf("    Recorded: span %.3fs, server %.3fs (avg %.1f us), "
+               "link/Arc %.3fs (avg %.1f us)\n",
+               rs.rec_span_ns / 1e9, rs.rec_server_ns / 1e9,
+               rs.matched ? rs.rec_server_ns / 1e3 / rs.matched : 0.0,
+               rs.rec_link_ns / 1e9,
+               rs.rec_link_n ? rs.rec_link_ns / 1e3 / rs.rec_link_n : 0.0);
+        printf("    Replayed: handling %.3fs (avg %.1f us, max %.1f us)\n",
+               rs.handle_ns / 1e9,
+               rs.reqs ? rs.handle_ns / 1e3 / rs.reqs : 0.0,
+               rs.handle_max_ns / 1e3);
+        if (rs.rec_link_ns)
+                printf("    Handling is %.1f%% of recorded link/Arc time\n",
+                       100.0 * rs.handle_ns / rs.rec_link_ns);
+        printf("    Responses: %" PRIu64 " differ, %" PRIu64
+               " not recorded, %" PRIu64 " not replayed\n",
+               rs.mismatched, rs.unmatched, rs.missing);
+
+        if (verbose)
+                stats_dump(stdout, NULL);
+
+        return rs.mismatched || rs.unmatched || rs.missing;
+}
@@ -0,0 +1,396 @@
+/* Server metrics
+ *
+ * Per-channel/per-opcode counters and latency histograms, so that a slow
+ * transfer can be pinned on the Arc, the USB link or the host's disc:
+ *
+ *  total   Request frame complete -> response fully written
+ *  service Request frame complete -> response queued (host/disc time)
+ *  write   Response queued -> fully written (TX backlog, link)
+ *  gap     Link idle -> next request frame complete (Arc + link inbound)
+ *
+ * Histograms are HDR-style:  log2 buckets, each split linearly into
+ * HIST_SUB sub-buckets, so values are held to ~12% precision over the
+ * whole range without any configuration.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "device.h"
+#include "stats.h"
+
+#define HIST_SUB_BITS   3
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS    ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+#define NUM_CIDS        128
+#define NUM_OPS         256
+
+struct hist {
+        uint64_t        count;
+        uint64_t        sum;
+        uint64_t        max;
+        uint32_t        b[HIST_BUCKETS];
+};
+
+struct op_stats {
+        uint64_t        reqs;
+        uint64_t        resps;
+        uint64_t        rx_bytes;
+        uint64_t        tx_bytes;
+        struct hist     total;
+        struct hist     service;
+        struct hist     write;
+        struct hist     gap;
+};
+
+/* Allocated on first use; most CIDs/ops are never seen */
+static struct op_stats **cid_ops[NUM_CIDS];
+
+static uint64_t t_start;
+
+/* For the periodic summary:  totals at the last summary, and latencies
+ * since then.
+ */
+static uint64_t sum_t_last;
+static uint64_t sum_rx_last;
+static uint64_t sum_tx_last;
+static uint64_t sum_reqs_last;
+static uint64_t all_reqs;
+static uint64_t all_rx;
+static uint64_t all_tx;
+static struct hist sum_total;
+
+uint64_t        stats_now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Histograms
+
+static unsigned int hist_bucket(uint64_t v)
+{
+        if (v < HIST_SUB)
+                return v;
+        unsigned int msb = 63 - __builtin_clzll(v);
+        unsigned int shift = msb - HIST_SUB_BITS;
+        return ((shift + 1) << HIST_SUB_BITS) | ((v >> shift) & (HIST_SUB - 1));
+}
+
+/* Highest value that lands in bucket i */
+static uint64_t hist_value(unsigned int i)
+{
+        if (i < HIST_SUB)
+                return i;
+        unsigned int shift = (i >> HIST_SUB_BITS) - 1;
+        return (((uint64_t)(HIST_SUB | (i & (HIST_SUB - 1))) + 1) << shift) - 1;
+}
+
+static void     hist_add(struct hist *h, uint64_t v)
+{
+        h->count++;
+        h->sum += v;
+        if (v > h->max)
+                h->max = v;
+        h->b[hist_bucket(v)]++;
+}
+
+static uint64_t hist_pct(struct hist *h, unsigned int pct)
+{
+        uint64_t want = (h->count * pct + 99) / 100;
+        uint64_t seen = 0;
+
+        if (want == 0)
+                want = 1;
+        for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+                seen += h->b[i];
+                if (seen >= want) {
+                        uint64_t v = hist_value(i);
+                        return v > h->max ? h->max : v;
+                }
+        }
+        return h->max;
+}
+
+static void     hist_print(FILE *f, const char *name, struct hist *h)
+{
+        if (h->count == 0)
+                return;
+        // Values are in ns, reported in us
+        fprintf(f, "    %-8s n %-8" PRIu64 " p50 %-8.1f p90 %-8.1f "
+                "p99 %-8.1f max %-8.1f mean %.1f us\n", name, h->count,
+                hist_pct(h, 50) / 1000.0, hist_pct(h, 90) / 1000.0,
+                hist_pct(h, 99) / 1000.0, h->max / 1000.0,
+                (double)h->sum / h->count / 1000.0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Collection
+
+static struct op_stats *op_get(unsigned int cid, unsigned int op)
+{
+        cid &= NUM_CIDS - 1;
+        op &= NUM_OPS - 1;
+
+        if (!cid_ops[cid]) {
+                cid_ops[cid] = calloc(NUM_OPS, sizeof(struct op_stats *));
+                if (!cid_ops[cid])
+                        return NULL;
+        }
+        if (!cid_ops[cid][op])
+                cid_ops[cid][op] = calloc(1, sizeof(struct op_stats));
+        return cid_ops[cid][op];
+}
+
+void            stats_request(struct device *d, unsigned int cid,
+                              unsigned int len, uint8_t *data)
+{
+        uint64_t t = stats_now();
+        unsigned int op = len ? data[0] : 0;
+        struct op_stats *os = op_get(cid, op);
+
+        if (!t_start)
+                t_start = sum_t_last = t;
+
+        d->st_rx_bytes += len + 3;
+        all_rx += len + 3;
+        all_reqs++;
+        if (os) {
+                os->reqs++;
+                os->rx_bytes += len + 3;
+                if (d->st_idle)
+                        hist_add(&os->gap, t - d->st_idle);
+        }
+
+        d->req.st.valid = true;
+        d->req.st.cid = cid;
+        d->req.st.op = op;
+        d->req.st.t_req = t;
+        /* If there's no response, the Arc's next request follows straight
+         * on from this one; if there is, st_idle moves on when it's sent.
+         */
+        d->st_idle = t;
+}
+
+void            stats_response_queued(struct device *d, struct stats_req *req,
+                                      struct stats_req *st, unsigned int len,
+                                      unsigned int depth)
+{
+        d->st_tx_bytes += len + 3;
+        all_tx += len + 3;
+        if (depth > d->st_tx_depth_max)
+                d->st_tx_depth_max = depth;
+
+        // Unsolicited, or a second response to the same request:
+        if (!req->valid) {
+                st->valid = false;
+                return;
+        }
+
+        struct op_stats *os = op_get(req->cid, req->op);
+        if (os) {
+                os->resps++;
+                os->tx_bytes += len + 3;
+        }
+        *st = *req;
+        st->t_queued = stats_now();
+        req->valid = false;
+}
+
+void            stats_response_done(struct device *d, struct stats_req *st)
+{
+        uint64_t t = stats_now();
+
+        d->st_idle = t;
+        if (!st->valid)
+                return;
+
+        struct op_stats *os = op_get(st->cid, st->op);
+        if (os) {
+                hist_add(&os->total, t - st->t_req);
+                hist_add(&os->service, st->t_queued - st->t_req);
+                hist_add(&os->write, t - st->t_queued);
+        }
+        hist_add(&sum_total, t - st->t_req);
+        st->valid = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Reporting
+
+void            stats_dump(FILE *f, struct device *devs)
+{
+        uint64_t t = stats_now();
+
+        fprintf(f, "uptime %.1fs, rx %" PRIu64 " B, tx %" PRIu64 " B, %"
+                PRIu64 " reqs\n", t_start ? (t - t_start) / 1e9 : 0.0,
+                all_rx, all_tx, all_reqs);
+
+        for (struct device *d = devs; d; d = d->next) {
+                struct lane *c = &d->lane[LANE_CTL];
+
+                fprintf(f, "device %s%s%s: rx %" PRIu64 " B, tx %" PRIu64
+                        " B, rx buffered %u, tx depth %u (max %u), "
+                        "io in flight %u, bad frames %" PRIu64 ", resync %"
+                        PRIu64 " B\n", d->path,
+                        c->fd >= 0 ? " + " : "", c->fd >= 0 ? c->path : "",
+                        d->st_rx_bytes, d->st_tx_bytes,
+                        d->lane[LANE_DATA].rx_pos + c->rx_pos, d->txq_depth,
+                        d->st_tx_depth_max, d->io_inflight, d->st_bad_frames,
+                        d->st_resync_bytes);
+        }
+
+        for (unsigned int c = 0; c < NUM_CIDS; c++) {
+                if (!cid_ops[c])
+                        continue;
+
+                uint64_t reqs = 0, resps = 0, rxb = 0, txb = 0;
+                for (unsigned int o = 0; o < NUM_OPS; o++) {
+                        struct op_stats *os = cid_ops[c][o];
+                        if (!os)
+                                continue;
+                        reqs += os->reqs;
+                        resps += os->resps;
+                        rxb += os->rx_bytes;
+                        txb += os->tx_bytes;
+                }
+                fprintf(f, "cid %u: %" PRIu64 " reqs, %" PRIu64 " resps, rx %"
+                        PRIu64 " B, tx %" PRIu64 " B\n", c, reqs, resps,
+                        rxb, txb);
+
+                for (unsigned int o = 0; o < NUM_OPS; o++) {
+                        struct op_stats *os = cid_ops[c][o];
+                        if (!os)
+                                continue;
+                        fprintf(f, "  op %u: %" PRIu64 " reqs, %" PRIu64
+                                " resps, rx %" PRIu64 " B, tx %" PRIu64 " B\n",
+                                o, os->reqs, os->resps, os->rx_bytes,
+                                os->tx_bytes);
+                        hist_print(f, "total", &os->total);
+                        hist_print(f, "service", &os->service);
+                        hist_print(f, "write", &os->write);
+                        hist_print(f, "gap", &os->gap);
+                }
+        }
+}
+
+void            stats_summary(FILE *f)
+{
+        uint64_t t = stats_now();
+
+        if (!t_start)
+                return;         // Nothing's happened yet
+
+        double secs = (t - sum_t_last) / 1e9;
+        if (secs <= 0)
+                return;
+        uint64_t drx = all_rx - sum_rx_last;
+        uint64_t dtx = all_tx - sum_tx_last;
+
+        fprintf(f, "+++ stats: %.1fs: rx %.1f KB/s, tx %.1f KB/s, %.0f req/s",
+                secs, drx / secs / 1024, dtx / secs / 1024,
+                (all_reqs - sum_reqs_last) / secs);
+        if (sum_total.count)
+                fprintf(f, ", total p50 %.1f p99 %.1f max %.1f us",
+                        hist_pct(&sum_total, 50) / 1000.0,
+                        hist_pct(&sum_total, 99) / 1000.0,
+                        sum_total.max / 1000.0);
+        fprintf(f, "\n");
+        fflush(f);
+
+        sum_t_last = t;
+        sum_rx_last = all_rx;
+        sum_tx_last = all_tx;
+        sum_reqs_last = all_reqs;
+        memset(&sum_total, 0, sizeof(sum_total));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Unix socket endpoint
+
+int             stats_listen(const char *path)
+{
+        struct sockaddr_un sa;
+        int fd;
+
+        if (strlen(path) >= sizeof(sa.sun_path)) {
+                printf("- Stats socket path too long\n");
+                return -1;
+        }
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+                perror("Can't create stats socket:");
+                return -1;
+        }
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        strcpy(sa.sun_path, path);
+        unlink(path);           // Stale, from a previous run
+
+        if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+            listen(fd, 4) < 0) {
+                perror("Can't bind stats socket:");
+                close(fd);
+                return -1;
+        }
+        printf("+++ Stats on %s\n", path);
+        return fd;
+}
+
+void            stats_serve(int lfd, struct device *devs)
+{
+        int fd;
+
+        while ((fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+                /* Blocking, but don't let a reader that's gone to sleep
+                 * stall the server.
+                 */
+                struct timeval tv = { .tv_sec = 1 };
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+                FILE *f = fdopen(fd, "w");
+                if (!f) {
+                        close(fd);
+                        continue;
+                }
+                stats_dump(f, devs);
+                fclose(f);
+        }
+}
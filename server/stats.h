@@ -0,0 +1,68 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+struct device;
+
+/* Timing of one request/response exchange, carried with the request's
+ * context and then with the response, until it's fully written.
+ */
+struct stats_req {
+        bool            valid;
+        uint8_t         cid;
+        uint8_t         op;
+        uint64_t        t_req;          // Request frame complete
+        uint64_t        t_queued;       // Response handed to send_packet()
+};
+
+extern uint64_t stats_now(void);
+
+/* Called from process_packet(), before dispatch; fills in d->req.st */
+extern void     stats_request(struct device *d, unsigned int cid,
+                              unsigned int len, uint8_t *data);
+/* Called from send_reply(); moves req into the queued packet's st.  depth
+ * is the TX queue depth including this packet.
+ */
+extern void     stats_response_queued(struct device *d, struct stats_req *req,
+                                      struct stats_req *st, unsigned int len,
+                                      unsigned int depth);
+/* Called once the response is fully written */
+extern void     stats_response_done(struct device *d, struct stats_req *st);
+
+extern void     stats_dump(FILE *f, struct device *devs);
+/* One line of rates since the last call, for the periodic summary */
+extern void     stats_summary(FILE *f);
+
+/* Unix-socket endpoint:  each connection gets a stats_dump() and is closed */
+extern int      stats_listen(const char *path);
+extern void     stats_serve(int lfd, struct device *devs);
+
+#endif
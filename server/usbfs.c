@@ -0,0 +1,248 @@
+/* Podule vendor-interface transport, via Linux usbfs
+ *
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glob.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+
+#include "channels.h"
+#include "device.h"
+#include "usbfs.h"
+
+#ifndef DEBUG
+#define DEBUG 2
+#endif
+
+/* These match usb_descriptors.c and pipe_packet.h: */
+#define USB_VID                 0xcafe
+#define VENDOR_INTERFACE        4
+#define VENDOR_EP_OUT           0x05
+#define VENDOR_EP_IN            0x85
+#define VENDOR_REQ_OPEN         1
+
+/* The firmware sends each packet as one transfer, ending in a short USB
+ * packet (it pads if need be), so one RX URB gets one packet.  The largest
+ * is 512+3, plus a pad byte.
+ */
+#define RX_URB_SIZE             576
+
+struct usbfs_lane {
+        struct usbdevfs_urb rx_urb;
+        struct usbdevfs_urb tx_urb;
+        bool            rx_posted;
+        bool            tx_posted;
+        uint8_t         rx_buf[RX_URB_SIZE];
+};
+
+static int      vendor_request(int fd, unsigned int open)
+{
+        struct usbdevfs_ctrltransfer ct = {
+                .bRequestType = 0x41,   // Host-to-device, vendor, interface
+                .bRequest = VENDOR_REQ_OPEN,
+                .wValue = open,
+                .wIndex = VENDOR_INTERFACE,
+                .wLength = 0,
+                .timeout = 1000,
+                .data = NULL,
+        };
+
+        return ioctl(fd, USBDEVFS_CONTROL, &ct);
+}
+
+int             usbfs_open(struct lane *l, const char *path)
+{
+        unsigned int itf = VENDOR_INTERFACE;
+        int fd = open(path, O_RDWR);
+
+        if (fd < 0)
+                return -1;
+        if (ioctl(fd, USBDEVFS_CLAIMINTERFACE, &itf) < 0) {
+                printf("- Can't claim interface %d of %s: %s\n",
+                       itf, path, strerror(errno));
+                close(fd);
+                return -1;
+        }
+        if (vendor_request(fd, 1) < 0) {
+                printf("- Vendor open request failed: %s\n", strerror(errno));
+                ioctl(fd, USBDEVFS_RELEASEINTERFACE, &itf);
+                close(fd);
+                return -1;
+        }
+        l->usb = calloc(1, sizeof(*l->usb));
+        if (!l->usb) {
+                ioctl(fd, USBDEVFS_RELEASEINTERFACE, &itf);
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+void            usbfs_close(struct lane *l)
+{
+        struct usbfs_lane *u = l->usb;
+        unsigned int itf = VENDOR_INTERFACE;
+
+        // URBs reference our buffers, so must be back before they're freed
+        if (u->rx_posted)
+                ioctl(l->fd, USBDEVFS_DISCARDURB, &u->rx_urb);
+        if (u->tx_posted)
+                ioctl(l->fd, USBDEVFS_DISCARDURB, &u->tx_urb);
+        while (u->rx_posted || u->tx_posted) {
+                struct usbdevfs_urb *urb;
+
+                if (ioctl(l->fd, USBDEVFS_REAPURB, &urb) < 0)
+                        break;
+                if (urb == &u->rx_urb)
+                        u->rx_posted = false;
+                else
+                        u->tx_posted = false;
+        }
+        // Hand the firmware back to its CDC interface (if still there)
+        vendor_request(l->fd, 0);
+        ioctl(l->fd, USBDEVFS_RELEASEINTERFACE, &itf);
+        close(l->fd);
+        free(u);
+        l->usb = NULL;
+}
+
+void            usbfs_kick(struct lane *l)
+{
+        struct usbfs_lane *u = l->usb;
+
+        if (!u->rx_posted &&
+            sizeof(l->rx_buffer) - l->rx_pos >= sizeof(u->rx_buf)) {
+                memset(&u->rx_urb, 0, sizeof(u->rx_urb));
+                u->rx_urb.type = USBDEVFS_URB_TYPE_BULK;
+                u->rx_urb.endpoint = VENDOR_EP_IN;
+                u->rx_urb.buffer = u->rx_buf;
+                u->rx_urb.buffer_length = sizeof(u->rx_buf);
+                if (ioctl(l->fd, USBDEVFS_SUBMITURB, &u->rx_urb) == 0)
+                        u->rx_posted = true;
+                else if (errno == ENODEV)
+                        l->dev->hup = true;
+        }
+
+        struct tx_pkt *p = u->tx_posted ? NULL : tx_next(l);
+        if (p) {
+                memset(&u->tx_urb, 0, sizeof(u->tx_urb));
+                u->tx_urb.type = USBDEVFS_URB_TYPE_BULK;
+                u->tx_urb.endpoint = VENDOR_EP_OUT;
+                // End the transfer even if it's a multiple of 64 bytes:
+                u->tx_urb.flags = USBDEVFS_URB_ZERO_PACKET;
+                u->tx_urb.buffer = p->data;
+                u->tx_urb.buffer_length = p->len;
+                if (ioctl(l->fd, USBDEVFS_SUBMITURB, &u->tx_urb) == 0)
+                        u->tx_posted = true;
+                else if (errno == ENODEV)
+                        l->dev->hup = true;
+        }
+}
+
+void            usbfs_reap(struct lane *l)
+{
+        struct usbfs_lane *u = l->usb;
+        struct usbdevfs_urb *urb;
+
+        while (ioctl(l->fd, USBDEVFS_REAPURBNDELAY, &urb) == 0) {
+                if (urb->status < 0) {
+#if DEBUG > 0
+                        printf("- URB error %d (EP %02x)\n",
+                               -urb->status, urb->endpoint);
+#endif
+                        if (urb->status == -ENODEV ||
+                            urb->status == -ESHUTDOWN)
+                                l->dev->hup = true;
+                }
+                if (urb == &u->rx_urb) {
+                        u->rx_posted = false;
+                        if (urb->status == 0)
+                                lane_rx_in(l, u->rx_buf, urb->actual_length);
+                } else {
+                        u->tx_posted = false;
+                        // On error, the packet's sent again
+                        if (urb->status == 0)
+                                lane_tx_done(l);
+                }
+        }
+        if (errno == ENODEV)
+                l->dev->hup = true;
+}
+
+static int      read_sysfs(const char *dir, const char *file, const char *fmt,
+                           unsigned int *val)
+{
+        char path[PATH_MAX + 32];
+        int r;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, file);
+        FILE *f = fopen(path, "r");
+        if (!f)
+                return -1;
+        r = fscanf(f, fmt, val) == 1 ? 0 : -1;
+        fclose(f);
+        return r;
+}
+
+void            usbfs_scan(usbfs_found_t found)
+{
+        char pattern[64];
+        glob_t gt;
+
+        // Interface directories are named <device>:<config>.<interface>
+        snprintf(pattern, sizeof(pattern), "/sys/bus/usb/devices/*:1.%d",
+                 VENDOR_INTERFACE);
+        if (glob(pattern, 0, NULL, &gt) != 0)
+                return;
+
+        for (size_t i = 0; i < gt.gl_pathc; i++) {
+                char usb_dev[PATH_MAX], node[64];
+                unsigned int class, vid, bus, dev;
+
+                if (read_sysfs(gt.gl_pathv[i], "bInterfaceClass", "%x",
+                               &class) < 0 || class != 0xff)
+                        continue;
+                if (!realpath(gt.gl_pathv[i], usb_dev))
+                        continue;
+                *strrchr(usb_dev, '/') = '\0';
+                if (read_sysfs(usb_dev, "idVendor", "%x", &vid) < 0 ||
+                    vid != USB_VID ||
+                    read_sysfs(usb_dev, "busnum", "%u", &bus) < 0 ||
+                    read_sysfs(usb_dev, "devnum", "%u", &dev) < 0)
+                        continue;
+                snprintf(node, sizeof(node), "/dev/bus/usb/%03u/%03u",
+                         bus, dev);
+                found(node, usb_dev);
+        }
+        globfree(&gt);
+}
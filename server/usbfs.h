@@ -0,0 +1,48 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2021 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef USBFS_H
+#define USBFS_H
+
+#include <stdbool.h>
+
+struct lane;
+
+/* Found by usbfs_scan():  the usbfs node, and the sysfs USB device */
+typedef void    (*usbfs_found_t)(const char *node, const char *usb_dev);
+
+/* Claim the podule's vendor interface on the usbfs node at path, and tell
+ * the firmware to use it.  Returns the fd, or -1.
+ */
+extern int      usbfs_open(struct lane *l, const char *path);
+extern void     usbfs_close(struct lane *l);
+/* Submit RX/TX transfers, if there's room/something to send */
+extern void     usbfs_kick(struct lane *l);
+/* Handle completed transfers (the fd polls POLLOUT when there are some) */
+extern void     usbfs_reap(struct lane *l);
+/* Find podules (in sysfs) whose vendor interface could be opened */
+extern void     usbfs_scan(usbfs_found_t found);
+
+#endif
@@ -32,10 +32,19 @@
 #define CFG_TUD_ENDPOINT0_SIZE          64
 #endif
 
-#define CFG_TUD_CDC                     1
+/* Interface 0 carries everything, or just bulk data once the host opens
+ * interface 1 (the control lane) too.  See pipe_packet.c.
+ */
+#define CFG_TUD_CDC                     2
 
 #define CFG_TUD_CDC_RX_BUFSIZE          1024
 #define CFG_TUD_CDC_TX_BUFSIZE          1024
 #define CFG_TUD_CDC_EP_BUFSIZE          1024
 
+/* Alternative to CDC interface 0, one packet per transfer: */
+#define CFG_TUD_VENDOR                  1
+
+#define CFG_TUD_VENDOR_RX_BUFSIZE       1024
+#define CFG_TUD_VENDOR_TX_BUFSIZE       1024
+
 #endif
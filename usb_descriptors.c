@@ -25,6 +25,7 @@
  */
 
 #include "tusb.h"
+#include "pipe_packet.h"
 
 /* A combination of interfaces must have a unique product id, since PC
  * will save device driver after the first plug.  Same VID/PID with
@@ -81,13 +82,20 @@ enum
 {
   ITF_NUM_CDC_0 = 0,
   ITF_NUM_CDC_0_DATA,
+  ITF_NUM_CDC_1,                // Control lane
+  ITF_NUM_CDC_1_DATA,
+  ITF_NUM_VENDOR,               // Bulk transport; server's usbfs.c knows this
   ITF_NUM_TOTAL
 };
 
-#define CONFIG_TOTAL_LEN    (TUD_CONFIG_DESC_LEN + CFG_TUD_CDC * TUD_CDC_DESC_LEN)
+#define CONFIG_TOTAL_LEN    (TUD_CONFIG_DESC_LEN + CFG_TUD_CDC * TUD_CDC_DESC_LEN + \
+                             CFG_TUD_VENDOR * TUD_VENDOR_DESC_LEN)
 
 #define EPNUM_CDC_0_NOTIF   0x81
 #define EPNUM_CDC_0_DATA    0x02
+#define EPNUM_CDC_1_NOTIF   0x83
+#define EPNUM_CDC_1_DATA    0x04
+#define EPNUM_VENDOR        0x05
 
 
 // CDC Descriptor Template (ME modified to change poll interval)
@@ -141,6 +149,12 @@ uint8_t const desc_fs_configuration[] =
   // EP data address (out, in) and size.
   MTUD_CDC_DESCRIPTOR(ITF_NUM_CDC_0, 4, EPNUM_CDC_0_NOTIF, 8, EPNUM_CDC_0_DATA,
                       0x80 | EPNUM_CDC_0_DATA, 64),
+  // 2nd CDC, the control lane:
+  MTUD_CDC_DESCRIPTOR(ITF_NUM_CDC_1, 5, EPNUM_CDC_1_NOTIF, 8, EPNUM_CDC_1_DATA,
+                      0x80 | EPNUM_CDC_1_DATA, 64),
+  // Vendor: Interface number, string index, EP out & in address, EP size
+  TUD_VENDOR_DESCRIPTOR(ITF_NUM_VENDOR, 6, EPNUM_VENDOR, 0x80 | EPNUM_VENDOR,
+                        64),
 };
 
 // Invoked when received GET CONFIGURATION DESCRIPTOR
@@ -165,6 +179,8 @@ char const* string_desc_arr [] =
   "ArcPipePodule ",              // 2: Product
   "0000",                        // 3: Serials, should use chip ID
   "TinyUSB CDC",                 // 4: CDC Interface
+  "ArcPipe control",             // 5: CDC Interface (control lane)
+  "ArcPipe bulk",                // 6: Vendor Interface
 };
 
 static uint16_t _desc_str[32];
@@ -207,3 +223,22 @@ uint16_t const* tud_descriptor_string_cb(uint8_t index, uint16_t langid)
 
   return _desc_str;
 }
+
+//--------------------------------------------------------------------+
+// Vendor interface control
+//--------------------------------------------------------------------+
+
+// The host opens/closes the vendor interface, as DTR does for CDC
+bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage,
+                                tusb_control_request_t const * request)
+{
+  if (stage != CONTROL_STAGE_SETUP) return true;
+
+  if (request->bmRequestType_bit.type == TUSB_REQ_TYPE_VENDOR &&
+      request->bRequest == PIPE_VENDOR_REQ_OPEN)
+  {
+    pipe_vendor_open(request->wValue != 0);
+    return tud_control_status(rhport, request);
+  }
+  return false;
+}